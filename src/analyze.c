@@ -26,23 +26,705 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
-#include <mysql.h>
+#include <arpa/inet.h>
 #include "ipta.h"
 
+/* Denied packets and their sources summed up per country or AS */
+struct analyze_geo {
+	unsigned int key;         /* Country as two letters, or AS number */
+	char *name;
+	long count;
+	long sources;
+};
+
+static int analyze_geo_compare(const void *a, const void *b)
+{
+	const struct analyze_geo *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+/* Adds to the entry for key in an open addressing table, FLAG_SET if it is new */
+static int analyze_geo_add(struct analyze_geo *table, int size, unsigned int key,
+			   char *name, long count, long sources)
+{
+	unsigned int i = (key * 2654435761U) & (size - 1);
+	int new;
+
+	while(table[i].count && table[i].key != key)
+		i = (i + 1) & (size - 1);
+	new = !table[i].count;
+	table[i].key = key;
+	table[i].name = name;
+	table[i].count += count;
+	table[i].sources += sources;
+	return new;
+}
+
+static void analyze_geo_print(char *title, struct analyze_geo *table, int size,
+			      int limit, int countries)
+{
+	char cc[3];
+	int i, n;
+
+	for(i = 0, n = 0; i < size; i++)
+		if(table[i].count)
+			table[n++] = table[i];
+	qsort(table, n, sizeof(struct analyze_geo), analyze_geo_compare);
+
+	printf("\n%s\n", title);
+	if(countries) {
+		printf(" Count   CC   Sources\n");
+		printf("------   --   -------\n");
+	} else {
+		printf(" Count   AS           Sources   Name\n");
+		printf("------   ----------   -------   ------------------------------\n");
+	}
+	for(i = 0; i < n && i < limit; i++) {
+		if(countries) {
+			cc[0] = table[i].key >> 8;
+			cc[1] = table[i].key & 0xff;
+			cc[2] = '\0';
+			printf("%6ld   %-2s   %7ld\n", table[i].count, table[i].key ? cc : "--",
+			       table[i].sources);
+		} else {
+			printf("%6ld   AS%-8u   %7ld   %-30.30s\n", table[i].count, table[i].key,
+			       table[i].sources, table[i].name);
+		}
+	}
+}
+
+/***********************************************************************
+ * analyze_geoip
+ *
+ * Denied traffic per country and per AS of the source. The logs
+ * table has no country, so the packets are counted per source address
+ * in the database and each address is then looked up in the --geoip
+ * index, which takes well under a microsecond.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+static int analyze_geoip(struct ipta_db *con, char *source, char *count_sql, char *query, char *filter,
+			 int analyze_limit)
+{
+	struct analyze_geo *countries = NULL, *as = NULL, *p;
+	struct ipta_db_result *result = NULL;
+	char **row;
+	struct ipta_geo geo;
+	int size = 1024, used = 0;
+	unsigned int key;
+	long count;
+	int retval = RETVAL_OK;
+
+	sprintf(query,
+		"SELECT src_ip, %s FROM %s WHERE action<>'ACCEPT' AND if_in<>'lo' "
+		"AND if_out<>'lo' AND %s GROUP BY src_ip;", count_sql, source, filter);
+	if(db_query(con, query)) {
+		fprintf(stderr, "! Query not accepted from database.\n");
+		fprintf(stderr, "! %s\n", db_error(con));
+		return RETVAL_ERROR;
+	}
+
+	// A table for each of the 26 * 26 country codes and one that
+	// grows for the AS numbers
+	countries = calloc(1024, sizeof(struct analyze_geo));
+	as = calloc(size, sizeof(struct analyze_geo));
+	if(!countries || !as) {
+		fprintf(stderr, "! Memory allocation failed.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	result = db_use_result(con);
+	while(result && (row = db_fetch_row(result))) {
+		count = atol(row[1]);
+		if(!row[0] || geoip_lookup4(strtoul(row[0], NULL, 10), &geo) != RETVAL_OK)
+			memset(&geo, 0, sizeof(geo));
+		key = geo.country[0] ? (geo.country[0] << 8) | geo.country[1] : 0;
+		analyze_geo_add(countries, 1024, key, NULL, count, 1);
+
+		if(2 * (used + 1) > size) {
+			p = calloc(2 * size, sizeof(struct analyze_geo));
+			if(!p) {
+				fprintf(stderr, "! Memory allocation failed.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			for(key = 0; key < (unsigned int)size; key++)
+				if(as[key].count)
+					analyze_geo_add(p, 2 * size, as[key].key, as[key].name,
+							as[key].count, as[key].sources);
+			free(as);
+			as = p;
+			size *= 2;
+		}
+		used += analyze_geo_add(as, size, geo.asn, geo.asn ? geo.name : "Not known", count, 1);
+	}
+
+	analyze_geo_print("Denied traffic per country", countries, 1024, analyze_limit, FLAG_SET);
+	analyze_geo_print("Denied traffic per AS", as, size, analyze_limit, FLAG_CLEAR);
+
+clean_exit:
+	if(result)
+		db_free_result(result);
+	free(countries);
+	free(as);
+	return retval;
+}
+
+/* The reports, in the order they are shown */
+#define ANALYZE_CULPRITS 0
+#define ANALYZE_ICMP 1
+#define ANALYZE_PORTS 2
+#define ANALYZE_INVALID 3
+#define ANALYZE_INTERFACES 4
+#define ANALYZE_PORT_ACTIONS 5
+#define ANALYZE_TAGS 6
+#define ANALYZE_REPORTS 7
+
+static void analyze_title(int report)
+{
+	switch(report) {
+	case ANALYZE_CULPRITS:
+		printf("\nShowing denied traffic grouped by IP, destination port, action taken and protocol.\n");
+		printf(" Count Source IP                 SPort Dest IP                   DPort Proto  Action\n");
+		printf("------ ------------------------- ----- ------------------------- ----- ------ ----------\n");
+		break;
+	case ANALYZE_ICMP:
+		printf("\nShowing ICMP traffic statistics\n");
+		printf(" Count Source IP                 Dest IP                   Action    \n");
+		printf("------ ------------------------- ------------------------- ----------\n");
+		break;
+	case ANALYZE_PORTS:
+		printf("\nMost denied ports\n");
+		printf(" Count   DPort   Proto    Action       \n");
+		printf("------   -----   ------   ----------   \n");
+		break;
+	case ANALYZE_INVALID:
+		printf("\nMost invalid packets comes from\n");
+		printf(" Count   Source IP                   SPort   Dest IP                     DPort   Proto    \n");
+		printf("------   -------------------------   -----   -------------------------   -----   ------   \n");
+		break;
+	case ANALYZE_INTERFACES:
+		printf("\nInterface statistics\n");
+		printf(" Count   IF In        Action       Proto\n");
+		printf("------   ----------   ----------   -----\n");
+		break;
+	case ANALYZE_PORT_ACTIONS:
+		printf("\nInvalid and denied packets per port and action taken\n");
+		printf(" Count   DPort   Action\n");
+		printf("------   -----   ----------\n");
+		break;
+	case ANALYZE_TAGS:
+		printf("\nTraffic from and to tagged address lists\n");
+		printf(" Count   List               Action       Sources\n");
+		printf("------   ----------------   ----------   -------\n");
+		break;
+	}
+}
+
+/***********************************************************************
+ * analyze_show
+ *
+ * Prints one row of a report. The row has the columns of the query
+ * for the report, as text, wherever it came from.
+ ***********************************************************************/
+static void analyze_show(int report, char **row, struct ipta_flags *flags,
+			 struct ipta_db_info *dnsdb)
+{
+	char src_ip_hostname[HOSTNAME_MAX_LEN];
+	char dst_ip_hostname[HOSTNAME_MAX_LEN];
+	int rdns_flg[2];
+	int dst = report == ANALYZE_ICMP ? 2 : 3;
+	int columns[ANALYZE_REPORTS] = { 7, 4, 4, 6, 4, 3, 4 };
+	int i;
+
+	// The compacted rows have no source port or destination address
+	for(i = 0; i < columns[report]; i++)
+		if(!row[i])
+			row[i] = "";
+
+	// rdns flag determines host or ip
+	rdns_flg[0] = rdns_flg[1] = FLAG_CLEAR;
+	if(flags->rdns && (report == ANALYZE_CULPRITS || report == ANALYZE_ICMP ||
+			   report == ANALYZE_INVALID)) {
+		rdns_flg[0] = rdns_flg[1] = FLAG_SET;
+		if(get_host_by_addr(row[1], src_ip_hostname, 25, dnsdb))
+			rdns_flg[0] = FLAG_CLEAR;
+		if(get_host_by_addr(row[dst], dst_ip_hostname, 25, dnsdb))
+			rdns_flg[1] = FLAG_CLEAR;
+	}
+
+	switch(report) {
+	case ANALYZE_CULPRITS:
+		printf("%6d %-25s %5d %-25s %5d %-6s %-10s\n", 
+		       atoi(row[0]), rdns_flg[0] ? src_ip_hostname : row[1],
+		       atoi(row[2]), rdns_flg[1] ? dst_ip_hostname : row[3], 
+		       atoi(row[4]), row[5], row[6]);
+		break;
+	case ANALYZE_ICMP:
+		printf("%6d %-25s %-25s %-10s\n", 
+		       atoi(row[0]), rdns_flg[0] ? src_ip_hostname : row[1], 
+		                     rdns_flg[1] ? dst_ip_hostname : row[2], row[3]);
+		break;
+	case ANALYZE_PORTS:
+		printf("%6d    %5d   %-6s   %-10s\n", 
+		       atoi(row[0]), atoi(row[1]), row[2], row[3]);
+		break;
+	case ANALYZE_INVALID:
+		printf("%6d   %-25s   %5d   %-25s   %5d   %-6s   \n", 
+		       atoi(row[0]), rdns_flg[0] ? src_ip_hostname : row[1], atoi(row[2]), 
+		       rdns_flg[1] ? dst_ip_hostname : row[3], atoi(row[4]), row[5]);
+		break;
+	case ANALYZE_INTERFACES:
+		printf("%6d   %-10s   %-10s   %-6s   \n", 
+		       atoi(row[0]), row[1], row[2], row[3]);
+		break;
+	case ANALYZE_PORT_ACTIONS:
+		printf("%6d   %5d   %-10s   \n",
+		       atoi(row[0]), atoi(row[1]), row[2]);
+		break;
+	case ANALYZE_TAGS:
+		printf("%6d   %-16.16s   %-10s   %7d\n",
+		       atoi(row[0]), row[1], row[2], atoi(row[3]));
+		break;
+	}
+}
+
+/***********************************************************************
+ * Reports over the column archive
+ *
+ * The same reports are made from an --archive. Every row is packed
+ * into 128 bits, the addresses, the ports and numbers for the action,
+ * protocol, in interface and tag. A report groups on some of these
+ * bits, so its groups are kept in a hash table keyed by the packed
+ * row with the other bits masked away.
+ ***********************************************************************/
+
+#define ANALYZE_SRC(k) ((unsigned int)(k))
+#define ANALYZE_DST(k) ((unsigned int)((k) >> 32))
+#define ANALYZE_SPT(k) ((unsigned int)((k) >> 64) & 0xffff)
+#define ANALYZE_DPT(k) ((unsigned int)((k) >> 80) & 0xffff)
+#define ANALYZE_ACTION(k) ((unsigned int)((k) >> 96) & 0xff)
+#define ANALYZE_PROTO(k) ((unsigned int)((k) >> 104) & 0xff)
+#define ANALYZE_IF_IN(k) ((unsigned int)((k) >> 112) & 0xff)
+#define ANALYZE_TAG(k) ((unsigned int)((k) >> 120) & 0xff)
+
+#define ANALYZE_NAMES 256
+
+typedef unsigned __int128 analyze_key;
+
+struct analyze_group {
+	analyze_key key;          /* The bits grouped on */
+	analyze_key first;        /* The first row, for the other columns */
+	long count;
+	long sources;
+};
+
+struct analyze_table {
+	struct analyze_group *group;
+	int size;
+	int used;
+};
+
+/* The strings of the archive get small numbers, the same in all blocks */
+struct analyze_names {
+	char *name[ANALYZE_NAMES];
+	int count;
+};
+
+static unsigned int analyze_name(struct analyze_names *n, char *name)
+{
+	int i;
+
+	for(i = 0; i < n->count; i++)
+		if(!strcmp(n->name[i], name))
+			return i;
+	// Very many different strings end up together in the last one
+	if(n->count == ANALYZE_NAMES - 1) {
+		if(!n->name[n->count])
+			n->name[n->count] = strdup("(other)");
+		return n->count;
+	}
+	n->name[n->count] = strdup(name);
+	return n->name[n->count] ? n->count++ : 0;
+}
+
+static analyze_key analyze_mask(int report)
+{
+	analyze_key src = 0xffffffffULL, dpt = (analyze_key)0xffff << 80;
+	analyze_key action = (analyze_key)0xff << 96, proto = (analyze_key)0xff << 104;
+	analyze_key if_in = (analyze_key)0xff << 112, tag = (analyze_key)0xff << 120;
+
+	switch(report) {
+	case ANALYZE_CULPRITS:
+	case ANALYZE_ICMP:
+		return src | dpt | action | proto;
+	case ANALYZE_PORTS:
+		return dpt | action | proto;
+	case ANALYZE_INVALID:
+		return src | dpt | proto;
+	case ANALYZE_INTERFACES:
+		return if_in | action | proto;
+	case ANALYZE_PORT_ACTIONS:
+		return dpt | action;
+	case ANALYZE_TAGS:
+		return tag | action;
+	default:
+		// The sources of each tag and action
+		return tag | action | src;
+	}
+}
+
+/* Counts a row in its group, *new is set if the group is new. NULL
+ * if there is no memory for more groups */
+static struct analyze_group *analyze_add(struct analyze_table *t, analyze_key key,
+					 analyze_key row, int *new)
+{
+	struct analyze_group *old, *g;
+	unsigned long long h;
+	int i, size;
+
+	if(2 * (t->used + 1) > t->size) {
+		old = t->group;
+		size = t->size;
+		g = calloc(size ? 2 * size : 1024, sizeof(struct analyze_group));
+		if(!g) {
+			fprintf(stderr, "! Memory allocation failed.\n");
+			return NULL;
+		}
+		t->group = g;
+		t->size = size ? 2 * size : 1024;
+		for(i = 0; i < size; i++) {
+			if(!old[i].count)
+				continue;
+			h = (unsigned long long)old[i].key ^ (unsigned long long)(old[i].key >> 64);
+			for(h *= 0x9e3779b97f4a7c15ULL; t->group[(h >> 20) & (t->size - 1)].count; h += 1 << 20)
+				;
+			t->group[(h >> 20) & (t->size - 1)] = old[i];
+		}
+		free(old);
+	}
+
+	h = (unsigned long long)key ^ (unsigned long long)(key >> 64);
+	for(h *= 0x9e3779b97f4a7c15ULL; ; h += 1 << 20) {
+		g = &t->group[(h >> 20) & (t->size - 1)];
+		if(!g->count) {
+			g->key = key;
+			g->first = row;
+			g->count = 1;
+			t->used++;
+			*new = FLAG_SET;
+			return g;
+		}
+		if(g->key == key) {
+			g->count++;
+			*new = FLAG_CLEAR;
+			return g;
+		}
+	}
+}
+
+static int analyze_group_compare(const void *a, const void *b)
+{
+	const struct analyze_group *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+/* Prints the largest groups of a report like the rows of the query */
+static void analyze_table_show(int report, struct analyze_table *t, struct analyze_names *names,
+			       int analyze_limit, struct ipta_flags *flags, struct ipta_db_info *dnsdb)
+{
+	char text[7][INET_ADDRSTRLEN + 8];
+	char *row[7];
+	struct analyze_group *g;
+	struct in_addr addr;
+	char *name[4];
+	int i, j, n;
+
+	for(i = 0, n = 0; i < t->size; i++)
+		if(t->group[i].count)
+			t->group[n++] = t->group[i];
+	qsort(t->group, n, sizeof(struct analyze_group), analyze_group_compare);
+
+	analyze_title(report);
+	for(i = 0; i < n && i < analyze_limit; i++) {
+		g = &t->group[i];
+		name[0] = names[0].name[ANALYZE_ACTION(g->first)];
+		name[1] = names[1].name[ANALYZE_PROTO(g->first)];
+		name[2] = names[2].name[ANALYZE_IF_IN(g->first)];
+		name[3] = names[3].name[ANALYZE_TAG(g->first)];
+		for(j = 0; j < 7; j++)
+			row[j] = text[j];
+		sprintf(text[0], "%ld", g->count);
+		addr.s_addr = htonl(ANALYZE_SRC(g->first));
+		inet_ntop(AF_INET, &addr, text[1], sizeof(text[1]));
+
+		switch(report) {
+		case ANALYZE_CULPRITS:
+		case ANALYZE_INVALID:
+			sprintf(text[2], "%u", ANALYZE_SPT(g->first));
+			addr.s_addr = htonl(ANALYZE_DST(g->first));
+			inet_ntop(AF_INET, &addr, text[3], sizeof(text[3]));
+			sprintf(text[4], "%u", ANALYZE_DPT(g->first));
+			row[5] = name[1];
+			row[6] = name[0];
+			break;
+		case ANALYZE_ICMP:
+			addr.s_addr = htonl(ANALYZE_DST(g->first));
+			inet_ntop(AF_INET, &addr, text[2], sizeof(text[2]));
+			row[3] = name[0];
+			break;
+		case ANALYZE_PORTS:
+		case ANALYZE_PORT_ACTIONS:
+			sprintf(text[1], "%u", ANALYZE_DPT(g->first));
+			row[2] = report == ANALYZE_PORTS ? name[1] : name[0];
+			row[3] = name[0];
+			break;
+		case ANALYZE_INTERFACES:
+			row[1] = name[2];
+			row[2] = name[0];
+			row[3] = name[1];
+			break;
+		case ANALYZE_TAGS:
+			row[1] = name[3];
+			row[2] = name[0];
+			sprintf(text[3], "%ld", g->sources);
+			break;
+		}
+		analyze_show(report, row, flags, dnsdb);
+	}
+}
+
+/***********************************************************************
+ * analyze_archive
+ *
+ * Makes the reports from the archive in dir. A block is skipped
+ * without reading it when its smallest and largest addresses and
+ * ports show that the filter can not select any of its rows. The
+ * conditions of each report are worked out for a whole block at a
+ * time from small tables over the dictionary codes.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+static int analyze_archive(char *dir, struct ipta_flags *flags, int analyze_limit,
+			   struct ipta_db_info *dnsdb)
+{
+	struct ipta_archive_reader r;
+	struct ipta_archive_header *h = &r.header;
+	struct analyze_table table[ANALYZE_REPORTS + 1];
+	struct analyze_names names[4];
+	struct analyze_group *g;
+	struct ipta_record rec;
+	struct in_addr addr;
+	unsigned char *cond = NULL, *is = NULL;
+	unsigned char *accept, *invalid, *icmp, *lo_in, *no_in, *lo_out, *tagged;
+	unsigned char *id[4];
+	unsigned long bound[4][2];
+	unsigned long rows = 0, skipped = 0;
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN], spt[8], dpt[8];
+	char *string_field[4] = { "src", "dst", "spt", "dpt" };
+	int string_column[4] = { ARCHIVE_ACTION, ARCHIVE_PROTO, ARCHIVE_IF_IN, ARCHIVE_TAG };
+	analyze_key key;
+	int mask, c, i, n, new;
+	int retval = RETVAL_OK;
+
+	memset(table, 0, sizeof(table));
+	memset(names, 0, sizeof(names));
+	memset(id, 0, sizeof(id));
+	if(archive_reader_open(&r, dir))
+		return RETVAL_ERROR;
+
+	// Tables over the dictionary codes of a block
+	cond = malloc(ARCHIVE_BLOCK_ROWS);
+	is = malloc(7 * ARCHIVE_BLOCK_ROWS);
+	for(c = 0; c < 4; c++)
+		id[c] = malloc(ARCHIVE_BLOCK_ROWS);
+	if(!cond || !is || !id[0] || !id[1] || !id[2] || !id[3]) {
+		fprintf(stderr, "! Memory allocation failed.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	accept = is;
+	invalid = is + ARCHIVE_BLOCK_ROWS;
+	icmp = is + 2 * ARCHIVE_BLOCK_ROWS;
+	lo_in = is + 3 * ARCHIVE_BLOCK_ROWS;
+	no_in = is + 4 * ARCHIVE_BLOCK_ROWS;
+	lo_out = is + 5 * ARCHIVE_BLOCK_ROWS;
+	tagged = is + 6 * ARCHIVE_BLOCK_ROWS;
+
+	for(c = 0; c < 4; c++)
+		filter_bounds(flags->filter, string_field[c], &bound[c][0], &bound[c][1]);
+
+	mask = (1 << ARCHIVE_SRC) | (1 << ARCHIVE_DST) | (1 << ARCHIVE_SPT) | (1 << ARCHIVE_DPT) |
+		(1 << ARCHIVE_ACTION) | (1 << ARCHIVE_PROTO) | (1 << ARCHIVE_IF_IN) |
+		(1 << ARCHIVE_IF_OUT) | (1 << ARCHIVE_TAG);
+	if(flags->filter)
+		mask |= (1 << ARCHIVE_TIME) | (1 << ARCHIVE_MAC);
+
+	while(archive_reader_next(&r)) {
+		if(h->src_max < bound[0][0] || h->src_min > bound[0][1] ||
+		   h->dst_max < bound[1][0] || h->dst_min > bound[1][1] ||
+		   h->spt_max < bound[2][0] || h->spt_min > bound[2][1] ||
+		   h->dpt_max < bound[3][0] || h->dpt_min > bound[3][1]) {
+			skipped++;
+			continue;
+		}
+		if(archive_reader_load(&r, mask))
+			continue;
+		n = h->rows;
+		rows += n;
+
+		// What the conditions of the queries say about each string
+		for(c = 0; c < 4; c++)
+			for(i = 0; i < r.dict_count[string_column[c] - ARCHIVE_ACTION]; i++)
+				id[c][i] = analyze_name(&names[c], r.dict[string_column[c] - ARCHIVE_ACTION][i]);
+		for(i = 0; i < r.dict_count[0]; i++) {
+			accept[i] = !strcmp(r.dict[0][i], "ACCEPT");
+			invalid[i] = !strcmp(r.dict[0][i], "INVALID");
+		}
+		for(i = 0; i < r.dict_count[1]; i++)
+			icmp[i] = !strcmp(r.dict[1][i], "ICMP");
+		for(i = 0; i < r.dict_count[2]; i++) {
+			lo_in[i] = !strcmp(r.dict[2][i], "lo");
+			no_in[i] = !r.dict[2][i][0];
+		}
+		for(i = 0; i < r.dict_count[3]; i++)
+			lo_out[i] = !strcmp(r.dict[3][i], "lo");
+		for(i = 0; i < r.dict_count[5]; i++)
+			tagged[i] = r.dict[5][i][0] != '\0';
+
+		// The filter needs the rows as text again
+		memset(cond, 1, n);
+		if(flags->filter) {
+			rec.host = "";
+			rec.src = src;
+			rec.dst = dst;
+			rec.src_port = spt;
+			rec.dst_port = dpt;
+			for(i = 0; i < n; i++) {
+				rec.timestamp = r.time[i];
+				rec.action = r.dict[0][r.code[0][i]];
+				rec.proto = r.dict[1][r.code[1][i]];
+				rec.if_in = r.dict[2][r.code[2][i]];
+				rec.if_out = r.dict[3][r.code[3][i]];
+				rec.mac = r.dict[4][r.code[4][i]];
+				rec.tag = r.dict[5][r.code[5][i]];
+				addr.s_addr = htonl(r.src[i]);
+				inet_ntop(AF_INET, &addr, src, sizeof(src));
+				addr.s_addr = htonl(r.dst[i]);
+				inet_ntop(AF_INET, &addr, dst, sizeof(dst));
+				sprintf(spt, "%u", r.spt[i]);
+				sprintf(dpt, "%u", r.dpt[i]);
+				cond[i] = filter_match(flags->filter, &rec);
+			}
+		}
+
+		// The conditions of the reports as bits, one pass per block:
+		// 1 not ACCEPT, 2 neither interface lo, 4 ICMP, 8 INVALID,
+		// 16 in interface neither lo nor empty, 32 tagged
+		for(i = 0; i < n; i++)
+			cond[i] = cond[i] * ((accept[r.code[0][i]] ^ 1) |
+					     (!lo_in[r.code[2][i]] & !lo_out[r.code[3][i]]) << 1 |
+					     icmp[r.code[1][i]] << 2 |
+					     invalid[r.code[0][i]] << 3 |
+					     (!lo_in[r.code[2][i]] & !no_in[r.code[2][i]]) << 4 |
+					     tagged[r.code[5][i]] << 5);
+
+		for(i = 0; i < n; i++) {
+			if(!cond[i])
+				continue;
+			key = (analyze_key)r.src[i] | (analyze_key)r.dst[i] << 32 |
+				(analyze_key)r.spt[i] << 64 | (analyze_key)r.dpt[i] << 80 |
+				(analyze_key)id[0][r.code[0][i]] << 96 |
+				(analyze_key)id[1][r.code[1][i]] << 104 |
+				(analyze_key)id[2][r.code[2][i]] << 112 |
+				(analyze_key)id[3][r.code[5][i]] << 120;
+			if((cond[i] & 3) == 3 &&
+			   (!analyze_add(&table[ANALYZE_CULPRITS], key & analyze_mask(ANALYZE_CULPRITS), key, &new) ||
+			    !analyze_add(&table[ANALYZE_PORTS], key & analyze_mask(ANALYZE_PORTS), key, &new)))
+				goto no_memory;
+			if((cond[i] & 6) == 6 &&
+			   !analyze_add(&table[ANALYZE_ICMP], key & analyze_mask(ANALYZE_ICMP), key, &new))
+				goto no_memory;
+			if((cond[i] & 10) == 10 &&
+			   !analyze_add(&table[ANALYZE_INVALID], key & analyze_mask(ANALYZE_INVALID), key, &new))
+				goto no_memory;
+			if((cond[i] & 1) &&
+			   !analyze_add(&table[ANALYZE_INTERFACES], key & analyze_mask(ANALYZE_INTERFACES), key, &new))
+				goto no_memory;
+			if((cond[i] & 17) == 17 &&
+			   !analyze_add(&table[ANALYZE_PORT_ACTIONS], key & analyze_mask(ANALYZE_PORT_ACTIONS), key, &new))
+				goto no_memory;
+			if(cond[i] & 32) {
+				g = analyze_add(&table[ANALYZE_TAGS], key & analyze_mask(ANALYZE_TAGS), key, &new);
+				if(!g || !analyze_add(&table[ANALYZE_REPORTS], key & analyze_mask(ANALYZE_REPORTS),
+						      key, &new))
+					goto no_memory;
+				// A source not seen before with the tag and action
+				if(new)
+					g->sources++;
+			}
+		}
+	}
+
+	fprintf(stderr, "* Read %lu rows in %lu blocks of the archive %s, %lu blocks skipped.\n",
+		rows, r.blocks - skipped, dir, skipped);
+	for(c = 0; c < ANALYZE_REPORTS; c++) {
+		if(c == ANALYZE_TAGS && !table[c].used)
+			continue;
+		analyze_table_show(c, &table[c], names, analyze_limit, flags, dnsdb);
+	}
+	if(flags->rdns)
+		dns_stats_print(stdout);
+	goto clean_exit;
+
+no_memory:
+	retval = RETVAL_ERROR;
+
+clean_exit:
+	archive_reader_close(&r);
+	for(c = 0; c <= ANALYZE_REPORTS; c++)
+		free(table[c].group);
+	for(c = 0; c < 4; c++) {
+		for(i = 0; i < ANALYZE_NAMES; i++)
+			free(names[c].name[i]);
+		free(id[c]);
+	}
+	free(cond);
+	free(is);
+	return retval;
+}
+
 int analyze(struct ipta_db_info *db, 
 	    struct ipta_flags *flags, 
 	    int analyze_limit, 
 	    struct ipta_db_info *dnsdb) 
 {
 	char *query = NULL;
-	MYSQL *con = NULL;
-	MYSQL_RES *result = NULL;
-	MYSQL_ROW row = 0;
-	char src_ip_hostname[HOSTNAME_MAX_LEN];
-	char dst_ip_hostname[HOSTNAME_MAX_LEN];
-	int rdns_flg[2];
+	struct ipta_db *con = NULL;
+	struct ipta_db_result *result = NULL;
+	char **row = 0;
+	char filter[FILTER_SQL_SIZE];
+	char source[1024];
+	char *count = "COUNT(*)";
+	int tagged, flows, compacted;
 	int retval = RETVAL_OK;
 	
+	// The archive is read directly, there is no database
+	if(flags->archive)
+		return analyze_archive(flags->archive->dir, flags, analyze_limit, dnsdb);
+
 	// Allocate memory for the query string
 	query = malloc(QUERY_STRING_SIZE);
 	if(!query) {
@@ -51,196 +733,238 @@ int analyze(struct ipta_db_info *db,
 		goto clean_exit;
 	}
 
+	// --filter is added to every query, TRUE when there is none
+	if(filter_sql(flags->filter, filter, sizeof(filter))) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
 	// Open the con to process queries
 	con = open_db(db);
 	if(!con) {
-		fprintf(stderr, "! Unable to initialize MySQL connection.\n");
+		fprintf(stderr, "! Unable to initialize database connection.\n");
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
   
+	// Only tables with the tag column from --create-table or
+	// --upgrade-table have the address lists
+	tagged = db_has_column(con, db->table, "tag");
+	if(tagged < 0) {
+		fprintf(stderr, "! Query not accepted from database.\n");
+		fprintf(stderr, "! %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	// A row merged by --flow-timeout counts its packets
+	flows = db_has_column(con, db->table, "packet_count");
+	if(flows < 0) {
+		fprintf(stderr, "! Query not accepted from database.\n");
+		fprintf(stderr, "! %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	// After --compact the older packets are counted per hour in
+	// another table, the queries then read both as one. The columns
+	// that are not kept there are NULL, which MAX() passes over.
+	sprintf(source, "%s%s", db->table, COMPACT_SUFFIX);
+	compacted = db_has_column(con, source, "packets") > 0;
+
+	// A filter on a column the hourly rows do not keep would leave
+	// them all out, so it is refused once there are any
+	if(compacted && (filter_uses(flags->filter, "dst") || filter_uses(flags->filter, "spt") ||
+			 filter_uses(flags->filter, "mac") || filter_uses(flags->filter, "tag"))) {
+		sprintf(query, "SELECT 1 FROM %s LIMIT 1;", source);
+		if(db_query(con, query) || !(result = db_store_result(con))) {
+			fprintf(stderr, "! Query not accepted from database.\n");
+			fprintf(stderr, "! %s\n", db_error(con));
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		if(db_fetch_row(result)) {
+			fprintf(stderr, "! Error, --filter on dst, spt, mac or tag can not select the "
+				"packets compacted into %s.\n", source);
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		db_free_result(result);
+		result = NULL;
+	}
+
+	if(compacted) {
+		sprintf(source,
+			"(SELECT if_in, if_out, src_ip, src_prt, dst_ip, dst_prt, proto, action, mac, " \
+			"%s AS tag, %s AS packets FROM %s UNION ALL SELECT if_in, if_out, src_ip, NULL, NULL, " \
+			"dst_prt, proto, action, '', '', packets FROM %s%s) AS logs",
+			tagged ? "tag" : "''", flows ? "packet_count" : "1", db->table,
+			db->table, COMPACT_SUFFIX);
+		count = "SUM(packets)";
+	} else {
+		sprintf(source, "%s", db->table);
+		if(flows)
+			count = "SUM(packet_count)";
+	}
+
 	// Query: Top culprits ordered by source ip, destination port, action taken and protocol
 	sprintf(query, 
-		"SELECT COUNT(*), INET_NTOA(src_ip), src_prt, INET_NTOA(dst_ip), dst_prt, proto, " \
-		"action FROM %s WHERE action<>'ACCEPT' AND if_in<>'lo' and if_out<>'lo' GROUP BY " \
-		"src_ip, dst_prt, action, proto ORDER BY COUNT(*) DESC LIMIT %d;", 
-		db->table, analyze_limit);
+		"SELECT %s, INET_NTOA(src_ip), MAX(src_prt), INET_NTOA(MAX(dst_ip)), dst_prt, proto, " \
+		"action FROM %s WHERE action<>'ACCEPT' AND if_in<>'lo' and if_out<>'lo' AND %s GROUP BY " \
+		"src_ip, dst_prt, action, proto ORDER BY %s DESC LIMIT %d;", 
+		count, source, filter, count, analyze_limit);
 	
-	if(mysql_query(con, query)) {
+	if(db_query(con, query)) {
 		fprintf(stderr, "! Query not accepted from database.\n");
-		fprintf(stderr, "  %s\n", mysql_error(con));
+		fprintf(stderr, "  %s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
-	result = mysql_store_result(con);
+	result = db_store_result(con);
 
-	printf("\nShowing denied traffic grouped by IP, destination port, action taken and protocol.\n");
-	printf(" Count Source IP                 SPort Dest IP                   DPort Proto  Action\n");
-	printf("------ ------------------------- ----- ------------------------- ----- ------ ----------\n");
-	rdns_flg[0] = rdns_flg[1] = FLAG_CLEAR;
-	while((row = mysql_fetch_row(result))) {
-		if(flags->rdns) {
-			rdns_flg[0] = rdns_flg[1] = FLAG_SET;
-			if(get_host_by_addr(row[1], src_ip_hostname, 25, dnsdb))
-				rdns_flg[0] = FLAG_CLEAR;
-			if(get_host_by_addr(row[3], dst_ip_hostname, 25, dnsdb))
-				rdns_flg[1] = FLAG_CLEAR;
-		}      
-		printf("%6d %-25s %5d %-25s %5d %-6s %-10s\n", 
-		       atoi(row[0]), rdns_flg[0] ? src_ip_hostname : row[1], // rdns flag determines host or ip
-		       atoi(row[2]), rdns_flg[1] ? dst_ip_hostname : row[3], 
-		       atoi(row[4]), row[5], row[6]);
-	}
-	mysql_free_result(result);
+	analyze_title(ANALYZE_CULPRITS);
+	while((row = db_fetch_row(result)))
+		analyze_show(ANALYZE_CULPRITS, row, flags, dnsdb);
+	db_free_result(result);
 	result = NULL;
 	
 	// Create a query for ICMP protocol use
 	sprintf(query, 
-		"SELECT COUNT(*), INET_NTOA(src_ip), INET_NTOA(dst_ip), action FROM %s WHERE proto='ICMP' " \
-		"AND if_in<>'lo' AND if_out<>'lo' GROUP BY src_ip, dst_prt, action, proto ORDER BY COUNT(*) " \
+		"SELECT %s, INET_NTOA(src_ip), INET_NTOA(MAX(dst_ip)), action FROM %s WHERE proto='ICMP' " \
+		"AND if_in<>'lo' AND if_out<>'lo' AND %s GROUP BY src_ip, dst_prt, action, proto ORDER BY %s " \
 		"DESC LIMIT %d;", 
-		db->table, analyze_limit);
+		count, source, filter, count, analyze_limit);
 	
-	if(mysql_query(con, query)) {
+	if(db_query(con, query)) {
 		fprintf(stderr, "! Query not accepted from database.\n");
-		fprintf(stderr, "! %s\n", mysql_error(con));
+		fprintf(stderr, "! %s\n", db_error(con));
 		return RETVAL_ERROR;
 	}
-	result = mysql_store_result(con);
+	result = db_store_result(con);
 
-	printf("\nShowing ICMP traffic statistics\n");
-	printf(" Count Source IP                 Dest IP                   Action    \n");
-	printf("------ ------------------------- ------------------------- ----------\n");
-	rdns_flg[0] = rdns_flg[1] = FLAG_CLEAR;
-	while((row = mysql_fetch_row(result))) {
-		if(flags->rdns) {
-			rdns_flg[0] = rdns_flg[1] = FLAG_SET;
-			if(get_host_by_addr(row[1], src_ip_hostname, 25, dnsdb))
-				rdns_flg[0] = FLAG_CLEAR;
-			if(get_host_by_addr(row[2], dst_ip_hostname, 25, dnsdb))
-				rdns_flg[1] = FLAG_CLEAR;
-		}      
-		
-		printf("%6d %-25s %-25s %-10s\n", 
-		       atoi(row[0]), rdns_flg[0] ? src_ip_hostname : row[1], 
-		                     rdns_flg[1] ? dst_ip_hostname : row[2], row[3]);
-	}
-	mysql_free_result(result);
+	analyze_title(ANALYZE_ICMP);
+	while((row = db_fetch_row(result)))
+		analyze_show(ANALYZE_ICMP, row, flags, dnsdb);
+	db_free_result(result);
 	result = NULL;
 	
 	// Query: Not accepted packets ordered by destination port, action, protocol
 	sprintf(query, 
-		"SELECT COUNT(*), dst_prt, proto, action FROM %s WHERE if_in<>'lo' AND if_out<>'lo' " \
-		"AND action<>'ACCEPT' GROUP BY dst_prt, action, proto ORDER BY COUNT(*) DESC LIMIT %d;", 
-		db->table, analyze_limit);
+		"SELECT %s, dst_prt, proto, action FROM %s WHERE if_in<>'lo' AND if_out<>'lo' " \
+		"AND action<>'ACCEPT' AND %s GROUP BY dst_prt, action, proto ORDER BY %s DESC LIMIT %d;", 
+		count, source, filter, count, analyze_limit);
 	
-	if(mysql_query(con, query)) {
+	if(db_query(con, query)) {
 		fprintf(stderr, "! Query not accepted from database.\n");
-		fprintf(stderr, "! %s\n", mysql_error(con));
+		fprintf(stderr, "! %s\n", db_error(con));
 		return RETVAL_ERROR;
 	}
-	result = mysql_store_result(con);
+	result = db_store_result(con);
 
-	printf("\nMost denied ports\n");
-	printf(" Count   DPort   Proto    Action       \n");
-	printf("------   -----   ------   ----------   \n");
-	while((row = mysql_fetch_row(result))) {
-		printf("%6d    %5d   %-6s   %-10s\n", 
-		       atoi(row[0]), atoi(row[1]), row[2], row[3]);
-	}
+	analyze_title(ANALYZE_PORTS);
+	while((row = db_fetch_row(result)))
+		analyze_show(ANALYZE_PORTS, row, flags, dnsdb);
 	
-	mysql_free_result(result);
+	db_free_result(result);
 	result = NULL;
 	
 	// Query: Shows invalid packets ordered by src ip, destination port, and protocol.
 	sprintf(query, 
-		"SELECT COUNT(*), INET_NTOA(src_ip), src_prt, INET_NTOA(dst_ip), dst_prt, proto FROM %s " \
-		"WHERE if_in<>'lo' AND if_out<>'lo' AND action='INVALID' GROUP BY src_ip, dst_prt, proto " \
-		"ORDER BY COUNT(*) DESC LIMIT %d;", 
-		db->table, analyze_limit);
+		"SELECT %s, INET_NTOA(src_ip), MAX(src_prt), INET_NTOA(MAX(dst_ip)), dst_prt, proto FROM %s " \
+		"WHERE if_in<>'lo' AND if_out<>'lo' AND action='INVALID' AND %s GROUP BY src_ip, dst_prt, proto " \
+		"ORDER BY %s DESC LIMIT %d;", 
+		count, source, filter, count, analyze_limit);
 	
-	if(mysql_query(con, query)) {
+	if(db_query(con, query)) {
 		fprintf(stderr, "! Query not accepted from database.\n");
-		fprintf(stderr, "! %s\n", mysql_error(con));
+		fprintf(stderr, "! %s\n", db_error(con));
 		return RETVAL_ERROR;
 	}
-	result = mysql_store_result(con);
+	result = db_store_result(con);
 	
-	printf("\nMost invalid packets comes from\n");
-	printf(" Count   Source IP                   SPort   Dest IP                     DPort   Proto    \n");
-	printf("------   -------------------------   -----   -------------------------   -----   ------   \n");
-	
-	rdns_flg[0] = rdns_flg[1] = FLAG_CLEAR;
-	while((row = mysql_fetch_row(result))) {
-		if(flags->rdns) {
-			rdns_flg[0] = rdns_flg[1] = FLAG_SET;
-			if(get_host_by_addr(row[1], src_ip_hostname, 25, dnsdb))
-				rdns_flg[0] = FLAG_CLEAR;
-			if(get_host_by_addr(row[3], dst_ip_hostname, 25, dnsdb))
-				rdns_flg[1] = FLAG_CLEAR;
-			
-		}
-		printf("%6d   %-25s   %5d   %-25s   %5d   %-6s   \n", 
-		       atoi(row[0]), rdns_flg[0] ? src_ip_hostname : row[1], atoi(row[2]), 
-		       rdns_flg[1] ? dst_ip_hostname : row[3], atoi(row[4]), row[5]);
-	}
-	mysql_free_result(result);
+	analyze_title(ANALYZE_INVALID);
+	while((row = db_fetch_row(result)))
+		analyze_show(ANALYZE_INVALID, row, flags, dnsdb);
+	db_free_result(result);
 	result = NULL;
 	
 	// Query: Not accepted packets ordered by interface, reason and protocol
 	sprintf(query, 
-		"SELECT COUNT(*),if_in,action,proto FROM %s WHERE action<>'ACCEPT' GROUP BY " \
-		"if_in,action,proto ORDER BY COUNT(*) DESC LIMIT %d;", 
-		db->table, analyze_limit);
+		"SELECT %s,if_in,action,proto FROM %s WHERE action<>'ACCEPT' AND %s GROUP BY " \
+		"if_in,action,proto ORDER BY %s DESC LIMIT %d;", 
+		count, source, filter, count, analyze_limit);
 	
-	if(mysql_query(con, query)) {
+	if(db_query(con, query)) {
 		fprintf(stderr, "! Query not accepted from database.\n");
-		fprintf(stderr, "! %s\n", mysql_error(con));
+		fprintf(stderr, "! %s\n", db_error(con));
 		return RETVAL_ERROR;
 	}
-	result = mysql_store_result(con);
+	result = db_store_result(con);
 	
-	printf("\nInterface statistics\n");
-	printf(" Count   IF In        Action       Proto\n");
-	printf("------   ----------   ----------   -----\n");
-	while((row = mysql_fetch_row(result))) {
-		printf("%6d   %-10s   %-10s   %-6s   \n", 
-		       atoi(row[0]), row[1], row[2], row[3]);
-	}
-	mysql_free_result(result);
+	analyze_title(ANALYZE_INTERFACES);
+	while((row = db_fetch_row(result)))
+		analyze_show(ANALYZE_INTERFACES, row, flags, dnsdb);
+	db_free_result(result);
 	result = NULL;
 
 	// Query: Destination ports with denied traffic and their actions
 	sprintf(query,
-		"SELECT COUNT(*), dst_prt, action FROM %s "\
-		"WHERE if_in<>'lo' and if_in<>'' and action<>'ACCEPT' "\
-		"GROUP BY dst_prt, action ORDER BY COUNT(*) DESC LIMIT %d;",
-		db->table, analyze_limit);
+		"SELECT %s, dst_prt, action FROM %s "\
+		"WHERE if_in<>'lo' and if_in<>'' and action<>'ACCEPT' AND %s "\
+		"GROUP BY dst_prt, action ORDER BY %s DESC LIMIT %d;",
+		count, source, filter, count, analyze_limit);
 
-	if(mysql_query(con, query)) {
+	if(db_query(con, query)) {
 		fprintf(stderr, "! Query not accepted from database.\n");
-		fprintf(stderr, "! %s\n", mysql_error(con));
+		fprintf(stderr, "! %s\n", db_error(con));
 		return RETVAL_ERROR;
 	}
-	result = mysql_store_result(con);
+	result = db_store_result(con);
 	
-	printf("\nInvalid and denied packets per port and action taken\n");
-	printf(" Count   DPort   Action\n");
-	printf("------   -----   ----------\n");
-	while((row = mysql_fetch_row(result))) {
-		printf("%6d   %5d   %-10s   \n",
-		       atoi(row[0]), atoi(row[1]), row[2]);
+	analyze_title(ANALYZE_PORT_ACTIONS);
+	while((row = db_fetch_row(result)))
+		analyze_show(ANALYZE_PORT_ACTIONS, row, flags, dnsdb);
+	db_free_result(result);
+	result = NULL;
+
+	// Query: Packets per address list
+	if(tagged) {
+		sprintf(query,
+			"SELECT %s, tag, action, COUNT(DISTINCT src_ip) FROM %s "	\
+			"WHERE tag<>'' AND %s GROUP BY tag, action ORDER BY %s DESC LIMIT %d;",
+			count, source, filter, count, analyze_limit);
+		if(db_query(con, query)) {
+			fprintf(stderr, "! Query not accepted from database.\n");
+			fprintf(stderr, "! %s\n", db_error(con));
+			result = NULL;
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		result = db_store_result(con);
+
+		analyze_title(ANALYZE_TAGS);
+		while((row = db_fetch_row(result)))
+			analyze_show(ANALYZE_TAGS, row, flags, dnsdb);
 	}
-	mysql_free_result(result);
+	if(result)
+		db_free_result(result);
 	result = NULL;
 
+	if(geoip_active() && analyze_geoip(con, source, count, query, filter, analyze_limit)) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	if(flags->rdns)
+		dns_stats_print(stdout);
+
 clean_exit:
 
 	free(query);
 	if(result)
-		mysql_free_result(result);
+		db_free_result(result);
 	if(con)
-		mysql_close(con);
+		db_close(con);
 
 	return retval;
 }
@@ -0,0 +1,692 @@
+/**********************************************************************
+ * archive.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Column archive
+ *
+ * Instead of the logs table the rows can be kept in a directory of
+ * segment files, one per day (UTC) named like 2026-10-19.ipta. A
+ * segment is a sequence of blocks that are only ever appended. A
+ * block holds up to ARCHIVE_BLOCK_ROWS rows stored column by column,
+ * each column compressed on its own with zlib so a report only
+ * inflates the columns it needs:
+ *
+ * 	time         zigzag varint deltas from the smallest time
+ * 	src, dst     IPv4 addresses as 32 bit numbers, 0 for IPv6
+ * 	spt, dpt     16 bit ports
+ * 	action, proto, in, out, mac, tag
+ * 	             16 bit codes into the dictionary of the block
+ * 	dictionary   for each of the six columns above a 32 bit count
+ * 	             and that many strings ending in a NUL
+ *
+ * The header of a block has the row count, the sizes and CRC-32 of
+ * the columns and the smallest and largest time, addresses and ports,
+ * so a scan can skip blocks a filter can not match without reading
+ * them. Numbers are stored in the byte order of the host.
+ *
+ * A block is written with a single write(). If ipta is killed half
+ * way through one, the broken block is cut off the next time the
+ * segment is opened for writing, and readers stop at it.
+ ***********************************************************************/
+
+#define ARCHIVE_MAGIC "IPC1"
+#define ARCHIVE_SUFFIX ".ipta"
+
+/* Longest strings of a row in the dictionary, with their NULs */
+#define ARCHIVE_ROW_STRINGS (sizeof(((struct ipta_row *)0)->action) +	\
+			     sizeof(((struct ipta_row *)0)->proto) +	\
+			     sizeof(((struct ipta_row *)0)->if_in) +	\
+			     sizeof(((struct ipta_row *)0)->if_out) +	\
+			     sizeof(((struct ipta_row *)0)->mac) +	\
+			     sizeof(((struct ipta_row *)0)->tag))
+
+/* Largest uncompressed size of each column */
+static size_t archive_raw_size(int column, int rows)
+{
+	switch(column) {
+	case ARCHIVE_TIME:
+		return 10 * rows;
+	case ARCHIVE_SRC:
+	case ARCHIVE_DST:
+		return 4 * rows;
+	case ARCHIVE_DICTIONARY:
+		return ARCHIVE_ROW_STRINGS * rows + 4 * ARCHIVE_STRINGS;
+	default:
+		return 2 * rows;
+	}
+}
+
+/* The string of a row for one of the dictionary columns */
+static char *archive_row_string(struct ipta_row *row, int string)
+{
+	switch(string) {
+	case 0: return row->action;
+	case 1: return row->proto;
+	case 2: return row->if_in;
+	case 3: return row->if_out;
+	case 4: return row->mac;
+	default: return row->tag;
+	}
+}
+
+static unsigned int archive_hash(char *s)
+{
+	unsigned int h = 2166136261U;
+
+	while(*s)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return h;
+}
+
+static unsigned char *archive_varint(unsigned char *p, unsigned long long v)
+{
+	while(v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/***********************************************************************
+ * archive_repair
+ *
+ * Walks the block headers of a segment and cuts off a block that was
+ * not completely written.
+ ***********************************************************************/
+static void archive_repair(int fd, char *path)
+{
+	struct ipta_archive_header h;
+	struct stat st;
+	off_t off = 0;
+
+	if(fstat(fd, &st))
+		return;
+	while(off + (off_t)sizeof(h) <= st.st_size) {
+		if(pread(fd, &h, sizeof(h), off) != sizeof(h) || memcmp(h.magic, ARCHIVE_MAGIC, 4) ||
+		   off + (off_t)sizeof(h) + h.size > st.st_size)
+			break;
+		off += sizeof(h) + h.size;
+	}
+	if(off != st.st_size) {
+		fprintf(stderr, "- Removed a broken block at the end of %s.\n", path);
+		if(ftruncate(fd, off))
+			fprintf(stderr, "! Error, unable to truncate %s.\n", path);
+	}
+}
+
+/* Opens the segment of the day for appending */
+static int archive_segment(struct ipta_archive *a, time_t t)
+{
+	char path[PATH_MAX];
+	char name[32];
+	long day = t / 86400;
+	struct tm tm;
+
+	if(a->fd >= 0 && a->day == day)
+		return RETVAL_OK;
+	if(a->fd >= 0)
+		close(a->fd);
+
+	gmtime_r(&t, &tm);
+	strftime(name, sizeof(name), "%Y-%m-%d" ARCHIVE_SUFFIX, &tm);
+	snprintf(path, sizeof(path), "%s/%s", a->dir, name);
+	a->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if(a->fd < 0) {
+		fprintf(stderr, "! Error, unable to open archive segment %s: %s\n",
+			path, strerror(errno));
+		return RETVAL_ERROR;
+	}
+	archive_repair(a->fd, path);
+	a->day = day;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * archive_open
+ *
+ * Sets up writing to the archive in dir, which is created if it does
+ * not exist.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int archive_open(struct ipta_archive *a, char *dir)
+{
+	struct stat st;
+
+	memset(a, 0, sizeof(struct ipta_archive));
+	a->fd = -1;
+	a->dir = dir;
+	if(mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "! Error, unable to create the archive directory %s: %s\n",
+			dir, strerror(errno));
+		return RETVAL_ERROR;
+	}
+	if(stat(dir, &st) || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "! Error, the archive %s is not a directory.\n", dir);
+		return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+void archive_close(struct ipta_archive *a)
+{
+	if(a->fd >= 0)
+		close(a->fd);
+	a->fd = -1;
+}
+
+/***********************************************************************
+ * archive_block
+ *
+ * Builds and appends one block of rows that all belong to the same
+ * segment.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+static int archive_block(struct ipta_archive *a, struct ipta_row *rows, int n, time_t *times)
+{
+	struct ipta_archive_header h;
+	unsigned char *raw[ARCHIVE_COLUMNS];
+	unsigned char *packed = NULL, *p;
+	unsigned int *src, *dst;
+	unsigned short *spt, *dpt, *code;
+	unsigned int *slot = NULL;
+	unsigned int slots, count, hash, v4, k;
+	size_t raw_size = 0, packed_size = 0;
+	unsigned char *buffer = NULL;
+	char *s, *d;
+	uLongf len;
+	struct iovec iov[2];
+	long long prev, delta;
+	ssize_t written;
+	int i, c;
+	int retval = RETVAL_OK;
+
+	for(c = 0; c < ARCHIVE_COLUMNS; c++) {
+		raw_size += archive_raw_size(c, n);
+		packed_size += compressBound(archive_raw_size(c, n));
+	}
+	for(slots = 2; slots < 2U * n; slots <<= 1)
+		;
+	buffer = malloc(raw_size);
+	packed = malloc(packed_size);
+	slot = malloc(slots * sizeof(unsigned int));
+	if(!buffer || !packed || !slot) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	for(c = 0, p = buffer; c < ARCHIVE_COLUMNS; c++) {
+		raw[c] = p;
+		p += archive_raw_size(c, n);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, ARCHIVE_MAGIC, 4);
+	h.rows = n;
+	h.time_min = h.time_max = times[0];
+	h.src_min = h.dst_min = 0xffffffffU;
+	h.spt_min = h.dpt_min = 0xffff;
+
+	src = (unsigned int *)raw[ARCHIVE_SRC];
+	dst = (unsigned int *)raw[ARCHIVE_DST];
+	spt = (unsigned short *)raw[ARCHIVE_SPT];
+	dpt = (unsigned short *)raw[ARCHIVE_DPT];
+	for(i = 0; i < n; i++) {
+		if(times[i] < h.time_min)
+			h.time_min = times[i];
+		if(times[i] > h.time_max)
+			h.time_max = times[i];
+		// Like INET_ATON in the table, only IPv4 is kept
+		src[i] = cidr_parse_v4(rows[i].src, &v4) == RETVAL_OK ? v4 : 0;
+		dst[i] = cidr_parse_v4(rows[i].dst, &v4) == RETVAL_OK ? v4 : 0;
+		spt[i] = rows[i].src_port;
+		dpt[i] = rows[i].dst_port;
+		if(src[i] < h.src_min) h.src_min = src[i];
+		if(src[i] > h.src_max) h.src_max = src[i];
+		if(dst[i] < h.dst_min) h.dst_min = dst[i];
+		if(dst[i] > h.dst_max) h.dst_max = dst[i];
+		if(spt[i] < h.spt_min) h.spt_min = spt[i];
+		if(spt[i] > h.spt_max) h.spt_max = spt[i];
+		if(dpt[i] < h.dpt_min) h.dpt_min = dpt[i];
+		if(dpt[i] > h.dpt_max) h.dpt_max = dpt[i];
+	}
+	h.raw[ARCHIVE_SRC] = h.raw[ARCHIVE_DST] = 4 * n;
+	h.raw[ARCHIVE_SPT] = h.raw[ARCHIVE_DPT] = 2 * n;
+
+	// Times are mostly in order, the deltas take a byte or two
+	p = raw[ARCHIVE_TIME];
+	prev = h.time_min;
+	for(i = 0; i < n; i++) {
+		delta = times[i] - prev;
+		p = archive_varint(p, ((unsigned long long)delta << 1) ^ (delta >> 63));
+		prev = times[i];
+	}
+	h.raw[ARCHIVE_TIME] = p - raw[ARCHIVE_TIME];
+
+	// The strings are replaced by their number in the dictionary,
+	// the slots hold the first row with the string plus one
+	d = (char *)raw[ARCHIVE_DICTIONARY];
+	for(c = 0; c < ARCHIVE_STRINGS; c++) {
+		code = (unsigned short *)raw[ARCHIVE_ACTION + c];
+		memset(slot, 0, slots * sizeof(unsigned int));
+		count = 0;
+		k = d - (char *)raw[ARCHIVE_DICTIONARY];
+		d += 4;
+		for(i = 0; i < n; i++) {
+			s = archive_row_string(&rows[i], c);
+			for(hash = archive_hash(s) & (slots - 1); slot[hash];
+			    hash = (hash + 1) & (slots - 1))
+				if(!strcmp(archive_row_string(&rows[slot[hash] - 1], c), s))
+					break;
+			if(!slot[hash]) {
+				slot[hash] = i + 1;
+				code[i] = count++;
+				d = stpcpy(d, s) + 1;
+			} else {
+				code[i] = code[slot[hash] - 1];
+			}
+		}
+		memcpy(raw[ARCHIVE_DICTIONARY] + k, &count, 4);
+		h.raw[ARCHIVE_ACTION + c] = 2 * n;
+	}
+	h.raw[ARCHIVE_DICTIONARY] = d - (char *)raw[ARCHIVE_DICTIONARY];
+
+	for(c = 0, p = packed; c < ARCHIVE_COLUMNS; c++) {
+		len = compressBound(h.raw[c]);
+		if(compress2(p, &len, raw[c], h.raw[c], Z_DEFAULT_COMPRESSION) != Z_OK) {
+			fprintf(stderr, "! Error, unable to compress an archive block.\n");
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		h.packed[c] = len;
+		h.crc[c] = crc32(0, p, len);
+		p += len;
+	}
+	h.size = p - packed;
+
+	if(archive_segment(a, times[0])) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = packed;
+	iov[1].iov_len = h.size;
+	written = writev(a->fd, iov, 2);
+	if(written != (ssize_t)(sizeof(h) + h.size)) {
+		fprintf(stderr, "! Error writing to the archive %s: %s\n", a->dir,
+			written < 0 ? strerror(errno) : "short write");
+		// Cut the partial block off so the next one is readable
+		close(a->fd);
+		a->fd = -1;
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	a->blocks++;
+	a->bytes += written;
+
+clean_exit:
+	free(buffer);
+	free(packed);
+	free(slot);
+	return retval;
+}
+
+/***********************************************************************
+ * archive_write
+ *
+ * Appends rows to the archive. They are split in blocks at the end of
+ * a day and every ARCHIVE_BLOCK_ROWS rows. Rows without a time get
+ * the current time, like NOW() in the table.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error, rows may have been written in part
+ ***********************************************************************/
+int archive_write(struct ipta_archive *a, struct ipta_row *rows, int count)
+{
+	time_t *times;
+	time_t now = time(NULL);
+	int first, i;
+	int retval = RETVAL_OK;
+
+	times = malloc(count * sizeof(time_t));
+	if(!times) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+	for(i = 0; i < count; i++)
+		times[i] = rows[i].timestamp ? rows[i].timestamp : now;
+
+	for(first = 0; first < count && !retval; first = i) {
+		for(i = first + 1; i < count && i - first < ARCHIVE_BLOCK_ROWS &&
+			    times[i] / 86400 == times[first] / 86400; i++)
+			;
+		retval = archive_block(a, rows + first, i - first, times + first);
+	}
+	free(times);
+	return retval;
+}
+
+/***********************************************************************
+ * Reading
+ *
+ * archive_reader_next() steps to the next block and only reads its
+ * header, archive_reader_load() then inflates the columns asked for.
+ * Blocks that do not matter can be passed by without inflating
+ * anything.
+ ***********************************************************************/
+
+static int archive_segment_name(const struct dirent *d)
+{
+	size_t len = strlen(d->d_name);
+
+	return len > strlen(ARCHIVE_SUFFIX) &&
+		!strcmp(d->d_name + len - strlen(ARCHIVE_SUFFIX), ARCHIVE_SUFFIX);
+}
+
+/***********************************************************************
+ * archive_reader_open
+ *
+ * Finds the segments of the archive in dir, in order of day.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int archive_reader_open(struct ipta_archive_reader *r, char *dir)
+{
+	int c;
+
+	memset(r, 0, sizeof(struct ipta_archive_reader));
+	r->dir = dir;
+	r->map = MAP_FAILED;
+	r->count = scandir(dir, &r->names, archive_segment_name, alphasort);
+	if(r->count < 0) {
+		fprintf(stderr, "! Error, unable to read the archive %s: %s\n", dir, strerror(errno));
+		r->count = 0;
+		return RETVAL_ERROR;
+	}
+	for(c = 0; c < ARCHIVE_COLUMNS; c++) {
+		r->raw[c] = malloc(archive_raw_size(c, ARCHIVE_BLOCK_ROWS));
+		if(!r->raw[c])
+			goto fail;
+	}
+	r->time = malloc(ARCHIVE_BLOCK_ROWS * sizeof(time_t));
+	if(!r->time)
+		goto fail;
+	for(c = 0; c < ARCHIVE_STRINGS; c++) {
+		r->dict[c] = malloc(ARCHIVE_BLOCK_ROWS * sizeof(char *));
+		if(!r->dict[c])
+			goto fail;
+	}
+	r->src = (unsigned int *)r->raw[ARCHIVE_SRC];
+	r->dst = (unsigned int *)r->raw[ARCHIVE_DST];
+	r->spt = (unsigned short *)r->raw[ARCHIVE_SPT];
+	r->dpt = (unsigned short *)r->raw[ARCHIVE_DPT];
+	for(c = 0; c < ARCHIVE_STRINGS; c++)
+		r->code[c] = (unsigned short *)r->raw[ARCHIVE_ACTION + c];
+	return RETVAL_OK;
+
+fail:
+	fprintf(stderr, "! Error, memory allocation failed.\n");
+	archive_reader_close(r);
+	return RETVAL_ERROR;
+}
+
+void archive_reader_close(struct ipta_archive_reader *r)
+{
+	int i;
+
+	if(r->map != MAP_FAILED)
+		munmap(r->map, r->size);
+	r->map = MAP_FAILED;
+	for(i = 0; i < r->count; i++)
+		free(r->names[i]);
+	free(r->names);
+	r->names = NULL;
+	r->count = 0;
+	for(i = 0; i < ARCHIVE_COLUMNS; i++) {
+		free(r->raw[i]);
+		r->raw[i] = NULL;
+	}
+	for(i = 0; i < ARCHIVE_STRINGS; i++) {
+		free(r->dict[i]);
+		r->dict[i] = NULL;
+	}
+	free(r->time);
+	r->time = NULL;
+}
+
+/* Maps the next segment, FLAG_CLEAR when there are no more */
+static int archive_reader_segment(struct ipta_archive_reader *r)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	if(r->map != MAP_FAILED)
+		munmap(r->map, r->size);
+	r->map = MAP_FAILED;
+
+	while(r->current < r->count) {
+		snprintf(path, sizeof(path), "%s/%s", r->dir, r->names[r->current++]->d_name);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if(fd < 0 || fstat(fd, &st)) {
+			fprintf(stderr, "- Unable to open archive segment %s, skipped.\n", path);
+			if(fd >= 0)
+				close(fd);
+			continue;
+		}
+		if(!st.st_size) {
+			close(fd);
+			continue;
+		}
+		r->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(r->map == MAP_FAILED) {
+			fprintf(stderr, "- Unable to map archive segment %s, skipped.\n", path);
+			continue;
+		}
+		madvise(r->map, st.st_size, MADV_SEQUENTIAL);
+		r->size = st.st_size;
+		r->offset = 0;
+		return FLAG_SET;
+	}
+	return FLAG_CLEAR;
+}
+
+/***********************************************************************
+ * archive_reader_next
+ *
+ * Steps to the next block, its header is in r->header.
+ *
+ * RETURNS
+ *
+ * 	FLAG_SET - there is a block
+ *
+ * 	FLAG_CLEAR - all blocks have been read
+ ***********************************************************************/
+int archive_reader_next(struct ipta_archive_reader *r)
+{
+	while(1) {
+		if(r->map == MAP_FAILED || r->offset >= r->size) {
+			if(!archive_reader_segment(r))
+				return FLAG_CLEAR;
+		}
+		if(r->offset + sizeof(struct ipta_archive_header) > r->size)
+			goto broken;
+		// The headers are not aligned in the file
+		memcpy(&r->header, r->map + r->offset, sizeof(struct ipta_archive_header));
+		if(memcmp(r->header.magic, ARCHIVE_MAGIC, 4) ||
+		   r->offset + sizeof(struct ipta_archive_header) + r->header.size > r->size ||
+		   r->header.rows > ARCHIVE_BLOCK_ROWS)
+			goto broken;
+		r->data = r->map + r->offset + sizeof(struct ipta_archive_header);
+		r->offset += sizeof(struct ipta_archive_header) + r->header.size;
+		r->loaded = r->decoded = r->checked = 0;
+		r->blocks++;
+		return FLAG_SET;
+
+	broken:
+		fprintf(stderr, "- Archive segment %s is broken at offset %lu, the rest is skipped.\n",
+			r->names[r->current - 1]->d_name, (unsigned long)r->offset);
+		r->offset = r->size;
+	}
+}
+
+/***********************************************************************
+ * archive_reader_load
+ *
+ * Inflates the columns of the current block that are set in mask,
+ * (1 << ARCHIVE_SRC) and so on. The dictionary comes along with any of
+ * the string columns.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the block is damaged
+ ***********************************************************************/
+int archive_reader_load(struct ipta_archive_reader *r, int mask)
+{
+	struct ipta_archive_header *h = &r->header;
+	const unsigned char *p = r->data;
+	unsigned char *q, *end;
+	unsigned long long v, packed = 0;
+	long long t;
+	uLongf len;
+	unsigned int count;
+	int c, i, shift;
+
+	if(mask & (((1 << ARCHIVE_STRINGS) - 1) << ARCHIVE_ACTION))
+		mask |= 1 << ARCHIVE_DICTIONARY;
+
+	// The columns fill the block exactly, the size of the block is
+	// known to be within the segment, so no column reads past the map
+	for(c = 0; c < ARCHIVE_COLUMNS; c++)
+		packed += h->packed[c];
+	if(packed != h->size)
+		goto damaged;
+
+	for(c = 0; c < ARCHIVE_COLUMNS; p += h->packed[c], c++) {
+		if(!(mask & (1 << c)) || (r->loaded & (1 << c)))
+			continue;
+		len = archive_raw_size(c, ARCHIVE_BLOCK_ROWS);
+		if(h->raw[c] > len || (c != ARCHIVE_TIME && c != ARCHIVE_DICTIONARY &&
+				       h->raw[c] != archive_raw_size(c, h->rows)) ||
+		   crc32(0, p, h->packed[c]) != h->crc[c] ||
+		   uncompress(r->raw[c], &len, p, h->packed[c]) != Z_OK || len != h->raw[c])
+			goto damaged;
+		r->loaded |= 1 << c;
+	}
+
+	if((mask & (1 << ARCHIVE_TIME)) && !(r->decoded & (1 << ARCHIVE_TIME))) {
+		q = r->raw[ARCHIVE_TIME];
+		end = q + h->raw[ARCHIVE_TIME];
+		t = h->time_min;
+		for(i = 0; i < (int)h->rows; i++) {
+			v = 0;
+			shift = 0;
+			do {
+				if(q >= end || shift > 63)
+					goto damaged;
+				v |= (unsigned long long)(*q & 0x7f) << shift;
+				shift += 7;
+			} while(*q++ & 0x80);
+			t += (long long)(v >> 1) ^ -(long long)(v & 1);
+			r->time[i] = t;
+		}
+		r->decoded |= 1 << ARCHIVE_TIME;
+	}
+
+	if((mask & (1 << ARCHIVE_DICTIONARY)) && !(r->decoded & (1 << ARCHIVE_DICTIONARY))) {
+		q = r->raw[ARCHIVE_DICTIONARY];
+		end = q + h->raw[ARCHIVE_DICTIONARY];
+		for(c = 0; c < ARCHIVE_STRINGS; c++) {
+			if(q + 4 > end)
+				goto damaged;
+			memcpy(&count, q, 4);
+			q += 4;
+			if(count > h->rows || (count == 0 && h->rows))
+				goto damaged;
+			for(i = 0; i < (int)count; i++) {
+				r->dict[c][i] = (char *)q;
+				q = memchr(q, '\0', end - q);
+				if(!q)
+					goto damaged;
+				q++;
+			}
+			r->dict_count[c] = count;
+		}
+		r->decoded |= 1 << ARCHIVE_DICTIONARY;
+	}
+
+	// A code outside the dictionary would read outside it later
+	for(c = 0; c < ARCHIVE_STRINGS; c++) {
+		if(!(mask & (1 << (ARCHIVE_ACTION + c))) || (r->checked & (1 << c)))
+			continue;
+		for(i = 0; i < (int)h->rows; i++)
+			if(r->code[c][i] >= r->dict_count[c])
+				goto damaged;
+		r->checked |= 1 << c;
+	}
+	return RETVAL_OK;
+
+damaged:
+	fprintf(stderr, "- A damaged block in archive segment %s was skipped.\n",
+		r->names[r->current - 1]->d_name);
+	r->damaged++;
+	return RETVAL_ERROR;
+}
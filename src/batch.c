@@ -0,0 +1,277 @@
+/**********************************************************************
+ * batch.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Batched inserts into the logs table
+ *
+ * Rows are collected in the batch and written in one go when the
+ * batch is flushed, the database backend decides how. Used by import
+ * and by the ingest mode so they write the table the same way.
+ *
+ * A row the database will not take, a value that does not fit in
+ * strict mode for example, must not cost the rest of the batch or
+ * stop a long import. When the database blames the rows the batch is
+ * split in halves that are tried on their own, down to the single
+ * rows to blame. Those are rejected, written to the --reject-file or
+ * to stderr, and the rest of the rows are written.
+ ***********************************************************************/
+
+static long long batch_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/***********************************************************************
+ * batch_init
+ *
+ * Sets up a batch of at most size rows to be written to table over
+ * con. The connection is owned by the caller. With --archive con is
+ * NULL and the caller sets batch->archive instead.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on memory allocation failure
+ ***********************************************************************/
+int batch_init(struct ipta_batch *batch, struct ipta_db *con, char *table, int size)
+{
+	memset(batch, 0, sizeof(struct ipta_batch));
+	batch->con = con;
+	batch->line_base = -1;
+	batch->table = table;
+	batch->size = size > 0 ? size : QUERY_ROW_COUNT;
+	batch->rows = calloc(batch->size, sizeof(struct ipta_row));
+	if(!batch->rows) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		batch_free(batch);
+		return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * batch_add
+ *
+ * Adds a parsed record to the batch, line is the line number in the
+ * source it came from.
+ *
+ * RETURNS
+ *
+ * 	FLAG_SET - the batch is full and should be flushed
+ *
+ * 	FLAG_CLEAR - there is room for more
+ ***********************************************************************/
+int batch_add(struct ipta_batch *batch, struct ipta_record *rec, long line)
+{
+	if(batch->count == 0)
+		batch->started = batch_now_ms();
+	parse_to_row(rec, &batch->rows[batch->count], line);
+	batch->count++;
+	return batch->count >= batch->size;
+}
+
+/* Like batch_add() for a row that is already made, see flow.c */
+int batch_add_row(struct ipta_batch *batch, struct ipta_row *row)
+{
+	if(batch->count == 0)
+		batch->started = batch_now_ms();
+	batch->rows[batch->count++] = *row;
+	return batch->count >= batch->size;
+}
+
+/* Milliseconds since the first row was added to the batch */
+int batch_age(struct ipta_batch *batch)
+{
+	if(!batch->count)
+		return 0;
+	return (int)(batch_now_ms() - batch->started);
+}
+
+/* The lines of the source before source_start, counted the first
+   time a row has to be rejected */
+static long batch_line_base(struct ipta_batch *batch)
+{
+	char buffer[65536];
+	FILE *file;
+	off_t left = batch->source_start;
+	size_t n, i;
+	long lines = 0;
+
+	if(batch->line_base >= 0 || !batch->source || left <= 0)
+		return batch->line_base > 0 ? batch->line_base : 0;
+
+	file = fopen(batch->source, "r");
+	if(!file)
+		return 0;
+	while(left > 0 && (n = fread(buffer, 1, left < (off_t)sizeof(buffer) ?
+				     (size_t)left : sizeof(buffer), file)) > 0) {
+		for(i = 0; i < n; i++)
+			lines += buffer[i] == '\n';
+		left -= n;
+	}
+	fclose(file);
+	batch->line_base = lines;
+	return lines;
+}
+
+/***********************************************************************
+ * batch_reject
+ *
+ * Writes a row the database did not take to the reject file, one tab
+ * separated line with the source, the line number and the reason
+ * followed by the fields of the row. Without a reject file it is
+ * only reported.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the reject file could not be written
+ ***********************************************************************/
+static int batch_reject(struct ipta_batch *batch, struct ipta_row *row, const char *error)
+{
+	char timestamp[32];
+	struct tm tm;
+	long line = row->line + batch_line_base(batch);
+
+	if(!batch->reject) {
+		fprintf(stderr, "! Rejected line %ld%s%s: %s\n", line,
+			batch->source ? " of " : "", batch->source ? batch->source : "", error);
+		batch->rejected++;
+		return RETVAL_OK;
+	}
+
+	localtime_r(&row->timestamp, &tm);
+	strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+	if(fprintf(batch->reject, "%s\t%ld\t%s\t%s\t%s\t%s\t%s\t%d\t%s\t%d\t%s\t%s\t%s\t%s\t%d\n",
+		   batch->source ? batch->source : "-", line, error, timestamp,
+		   row->if_in, row->if_out, row->src, row->src_port, row->dst,
+		   row->dst_port, row->proto, row->action, row->mac, row->tag,
+		   row->packets) < 0 || fflush(batch->reject)) {
+		fprintf(stderr, "! Error, unable to write to the reject file.\n");
+		return RETVAL_ERROR;
+	}
+	batch->rejected++;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * batch_insert
+ *
+ * Writes count rows, split in halves for as long as the database
+ * blames the rows, see above. *done counts the rows from the first
+ * that are written or rejected, they are taken in order.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - every row is written or rejected
+ *
+ * 	RETVAL_ERROR - the database failed for another reason
+ ***********************************************************************/
+static int batch_insert(struct ipta_batch *batch, struct ipta_row *rows, int count, int *done)
+{
+	int half;
+
+	if(!db_insert(batch->con, batch->table, rows, count)) {
+		batch->inserted += count;
+		*done += count;
+		return RETVAL_OK;
+	}
+	if(!db_row_error(batch->con))
+		return RETVAL_ERROR;
+
+	if(count == 1) {
+		if(batch_reject(batch, rows, db_error(batch->con)))
+			return RETVAL_ERROR;
+		(*done)++;
+		return RETVAL_OK;
+	}
+
+	half = count / 2;
+	if(batch_insert(batch, rows, half, done))
+		return RETVAL_ERROR;
+	return batch_insert(batch, rows + half, count - half, done);
+}
+
+/***********************************************************************
+ * batch_flush
+ *
+ * Writes the rows collected so far, or hands them to the queue
+ * function when there is one, and empties the batch.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success, also when the batch is empty
+ *
+ * 	RETVAL_ERROR - the database failed, the rows not written are
+ * 		left in the batch
+ ***********************************************************************/
+int batch_flush(struct ipta_batch *batch)
+{
+	int done = 0;
+
+	if(!batch->count)
+		return RETVAL_OK;
+
+	// Written by another thread, see ingest.c
+	if(batch->queue)
+		return batch->queue(batch);
+
+	if(batch->archive) {
+		if(archive_write(batch->archive, batch->rows, batch->count))
+			return RETVAL_ERROR;
+		batch->inserted += batch->count;
+		batch->count = 0;
+		return RETVAL_OK;
+	}
+
+	if(batch_insert(batch, batch->rows, batch->count, &done)) {
+		fprintf(stderr, "! Insert of %d rows failed, first at line %ld.\n"
+			"  Error: %s\n", batch->count - done, batch->rows[done].line,
+			db_error(batch->con));
+		memmove(batch->rows, batch->rows + done,
+			(batch->count - done) * sizeof(struct ipta_row));
+		batch->count -= done;
+		return RETVAL_ERROR;
+	}
+
+	batch->count = 0;
+	return RETVAL_OK;
+}
+
+void batch_free(struct ipta_batch *batch)
+{
+	free(batch->rows);
+	batch->rows = NULL;
+}
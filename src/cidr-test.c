@@ -0,0 +1,193 @@
+/***********************************************************************
+ * cidr-test.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * Tests for the address lists, not needed to compile the tools. The
+ * lists are written to temporary files. Needs no database.
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ipta.h"
+
+#define TEST_RANDOM_PREFIXES 20000
+#define TEST_RANDOM_LOOKUPS 20000
+
+static char *test_file(char *template, char *content)
+{
+	FILE *file;
+	int fd;
+
+	fd = mkstemp(template);
+	if(fd < 0)
+		return NULL;
+	file = fdopen(fd, "w");
+	fputs(content, file);
+	fclose(file);
+	return template;
+}
+
+static int test_lookup(struct ipta_cidr_set *set, char *address, char *expected)
+{
+	char *tag = cidr_lookup(set, address);
+
+	if((!tag && !expected) || (tag && expected && !strcmp(tag, expected)))
+		return 0;
+	fprintf(stderr, "! Error, %s is in %s, expected %s.\n", address,
+		tag ? tag : "no list", expected ? expected : "no list");
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	char own_name[] = "/tmp/ipta-cidr-own.XXXXXX";
+	char block_name[] = "/tmp/ipta-cidr-block.XXXXXX";
+	char top_name[] = "/tmp/ipta-cidr-top.XXXXXX";
+	char end_name[] = "/tmp/ipta-cidr-end.XXXXXX";
+	char random_name[] = "/tmp/ipta-cidr-random.XXXXXX";
+	struct ipta_cidr_set set;
+	unsigned int *net, *mask;
+	unsigned int a;
+	char address[32];
+	FILE *file;
+	int errors = 0;
+	int n, i, j, found, hits = 0;
+
+	printf("* Unit tests for the address lists of ipta.\n\n");
+
+	// Test I: Nested networks, the most specific one decides
+	fprintf(stderr, "* Test I: Look up nested networks.\n");
+	memset(&set, 0, sizeof(set));
+	if(!test_file(own_name, "# our networks\n10.0.0.0/8\n192.168.1.0/24 ; office\n"
+		      "2001:db8::/32\n") ||
+	   !test_file(block_name, "10.20.0.0/16\n10.20.30.40\n198.51.100.0/24\n"
+		      "2001:db8:bad::/48\nnot-a-network\n")) {
+		fprintf(stderr, "! Test error, unable to create a temporary file.\n");
+		return RETVAL_ERROR;
+	}
+	n = 0;
+	if(cidr_add_file(&set, own_name, "own") != RETVAL_OK ||
+	   cidr_add_file(&set, block_name, "block") != RETVAL_WARN ||
+	   cidr_build(&set)) {
+		fprintf(stderr, "! Error, the lists were not loaded.\n");
+		n++;
+	}
+	n += test_lookup(&set, "10.1.2.3", "own");
+	n += test_lookup(&set, "10.20.1.1", "block");
+	n += test_lookup(&set, "10.20.30.40", "block");
+	n += test_lookup(&set, "10.21.0.0", "own");
+	n += test_lookup(&set, "9.255.255.255", NULL);
+	n += test_lookup(&set, "11.0.0.0", NULL);
+	n += test_lookup(&set, "192.168.1.255", "own");
+	n += test_lookup(&set, "192.168.2.0", NULL);
+	n += test_lookup(&set, "198.51.100.77", "block");
+	n += test_lookup(&set, "2001:db8::1", "own");
+	n += test_lookup(&set, "2001:db8:bad::1", "block");
+	n += test_lookup(&set, "2001:db9::1", NULL);
+	n += test_lookup(&set, "", NULL);
+	cidr_free(&set);
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test II: A network ending at the last address inside the whole space
+	fprintf(stderr, "* Test II: Look up a network at the end of the space.\n");
+	memset(&set, 0, sizeof(set));
+	if(!test_file(top_name, "::/0 ; all\n") || !test_file(end_name, "ffff::/16\n")) {
+		fprintf(stderr, "! Test error, unable to create a temporary file.\n");
+		return RETVAL_ERROR;
+	}
+	n = 0;
+	if(cidr_add_file(&set, top_name, "all") != RETVAL_OK ||
+	   cidr_add_file(&set, end_name, "top") != RETVAL_OK ||
+	   cidr_build(&set)) {
+		fprintf(stderr, "! Error, the lists were not loaded.\n");
+		n++;
+	}
+	if(set.count6 != 2) {
+		fprintf(stderr, "! Error, %d ranges, expected 2.\n", set.count6);
+		n++;
+	}
+	n += test_lookup(&set, "::1", "all");
+	n += test_lookup(&set, "fffe:ffff::1", "all");
+	n += test_lookup(&set, "ffff::1", "top");
+	n += test_lookup(&set, "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", "top");
+	cidr_free(&set);
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test III: A large random list against a plain search
+	fprintf(stderr, "* Test III: Compare %d random networks with a linear search.\n",
+		TEST_RANDOM_PREFIXES);
+	srandom(42);
+	net = malloc(TEST_RANDOM_PREFIXES * sizeof(unsigned int));
+	mask = malloc(TEST_RANDOM_PREFIXES * sizeof(unsigned int));
+	file = fdopen(mkstemp(random_name), "w");
+	if(!net || !mask || !file) {
+		fprintf(stderr, "! Test error, unable to set up the test.\n");
+		return RETVAL_ERROR;
+	}
+	for(i = 0; i < TEST_RANDOM_PREFIXES; i++) {
+		// Within 10.0.0.0/8 so there are gaps between the networks
+		j = 20 + random() % 13;
+		mask[i] = j == 32 ? 0xffffffffU : ~(0xffffffffU >> j);
+		net[i] = (0x0a000000 | (random() & 0x00ffffff)) & mask[i];
+		fprintf(file, "%u.%u.%u.%u/%d\n", net[i] >> 24, (net[i] >> 16) & 255,
+			(net[i] >> 8) & 255, net[i] & 255, j);
+	}
+	fclose(file);
+	memset(&set, 0, sizeof(set));
+	n = 0;
+	if(cidr_add_file(&set, random_name, "random") != RETVAL_OK || cidr_build(&set)) {
+		fprintf(stderr, "! Error, the list was not loaded.\n");
+		n++;
+	}
+	for(i = 0; i < TEST_RANDOM_LOOKUPS && n < 10; i++) {
+		a = 0x0a000000 | (random() & 0x00ffffff);
+		found = 0;
+		for(j = 0; j < TEST_RANDOM_PREFIXES && !found; j++)
+			found = (a & mask[j]) == net[j];
+		snprintf(address, sizeof(address), "%u.%u.%u.%u", a >> 24, (a >> 16) & 255,
+			 (a >> 8) & 255, a & 255);
+		n += test_lookup(&set, address, found ? "random" : NULL);
+		hits += found;
+	}
+	if(!n)
+		fprintf(stderr, "  Success, %d ranges, %d of %d addresses found.\n",
+			set.count4, hits, i);
+	errors += n;
+	cidr_free(&set);
+	free(net);
+	free(mask);
+
+	unlink(own_name);
+	unlink(block_name);
+	unlink(top_name);
+	unlink(end_name);
+	unlink(random_name);
+
+	fprintf(stderr, "* %d errors.\n", errors);
+	return errors ? RETVAL_ERROR : RETVAL_OK;
+}
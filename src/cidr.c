@@ -0,0 +1,384 @@
+/**********************************************************************
+ * cidr.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Address lists
+ *
+ * Sets of networks loaded from files, our own networks to ignore or
+ * published block lists to tag packets with. A list may have a
+ * hundred thousand prefixes and is looked up for every packet, so the
+ * prefixes are flattened into sorted ranges that do not overlap and
+ * looked up with a binary search. Where prefixes nest, the most
+ * specific one decides the tag. IPv4 has its own arrays of 32 bit
+ * starts and ends so a search stays within a few cache lines and the
+ * loop compiles to conditional moves.
+ ***********************************************************************/
+
+typedef unsigned __int128 cidr_addr;
+
+/* A prefix as loaded, before the set is built */
+struct cidr_prefix {
+	cidr_addr start;
+	cidr_addr end;
+	int tag;
+	int order;                /* Loading order, the first of equals wins */
+};
+
+/* IPv4 is kept as ::ffff:a.b.c.d until the set is built */
+static const cidr_addr cidr_v4_base = (cidr_addr)0xffff << 32;
+
+/* The low bits of a prefix of length bits in a 128 bit address */
+static cidr_addr cidr_host_mask(int bits)
+{
+	return bits >= 128 ? 0 : ~(cidr_addr)0 >> bits;
+}
+
+static cidr_addr cidr_from_bytes(unsigned char *p)
+{
+	cidr_addr a = 0;
+	int i;
+
+	for(i = 0; i < 16; i++)
+		a = (a << 8) | p[i];
+	return a;
+}
+
+/* Parses a.b.c.d, much faster than inet_pton for the common case */
+int cidr_parse_v4(const char *s, unsigned int *addr)
+{
+	unsigned int a = 0, octet;
+	int i;
+
+	for(i = 0; i < 4; i++) {
+		if(!isdigit((unsigned char)*s))
+			return RETVAL_ERROR;
+		octet = 0;
+		while(isdigit((unsigned char)*s) && octet < 256)
+			octet = octet * 10 + (*s++ - '0');
+		if(octet > 255 || (i < 3 && *s++ != '.'))
+			return RETVAL_ERROR;
+		a = (a << 8) | octet;
+	}
+	if(*s)
+		return RETVAL_ERROR;
+	*addr = a;
+	return RETVAL_OK;
+}
+
+/* Parses address or address/bits into a range of the 128 bit space */
+static int cidr_parse(char *s, cidr_addr *start, cidr_addr *end)
+{
+	unsigned char bytes[16];
+	unsigned int v4;
+	char *slash, *e;
+	int bits, max;
+
+	slash = strchr(s, '/');
+	if(slash)
+		*slash = '\0';
+	if(cidr_parse_v4(s, &v4) == RETVAL_OK) {
+		*start = cidr_v4_base | v4;
+		max = 32;
+	} else if(inet_pton(AF_INET6, s, bytes) == 1) {
+		*start = cidr_from_bytes(bytes);
+		max = 128;
+	} else {
+		return RETVAL_ERROR;
+	}
+	bits = max;
+	if(slash) {
+		bits = strtol(slash + 1, &e, 10);
+		if(*e || e == slash + 1 || bits < 0 || bits > max)
+			return RETVAL_ERROR;
+	}
+	bits += 128 - max;
+	*start &= ~cidr_host_mask(bits);
+	*end = *start | cidr_host_mask(bits);
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * cidr_add_file
+ *
+ * Loads the prefixes in a file into the set, all with the same tag.
+ * There is one address or network per line, anything after it is
+ * ignored as are empty lines and lines starting with # or ;, so the
+ * common block list formats can be used as they are. The set must be
+ * built with cidr_build() before it is used.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_WARN - some lines were not understood and were skipped
+ *
+ * 	RETVAL_ERROR - the file could not be read
+ ***********************************************************************/
+int cidr_add_file(struct ipta_cidr_set *set, char *path, char *tag)
+{
+	struct cidr_prefix *prefix;
+	FILE *file;
+	char *line = NULL;
+	char *word;
+	size_t len = 0;
+	long lineno = 0, loaded = 0, bad = 0;
+	void *p;
+	int retval = RETVAL_OK;
+
+	if(set->ntags == CIDR_TAGS_MAX) {
+		fprintf(stderr, "! Error, at most %d address lists.\n", CIDR_TAGS_MAX);
+		return RETVAL_ERROR;
+	}
+	file = fopen(path, "r");
+	if(!file) {
+		fprintf(stderr, "! Error, unable to open the address list %s.\n", path);
+		return RETVAL_ERROR;
+	}
+	snprintf(set->tag[set->ntags], CIDR_TAG_LEN, "%s", tag);
+
+	while(getline(&line, &len, file) != -1) {
+		lineno++;
+		word = line + strspn(line, " \t");
+		word[strcspn(word, " \t\r\n;#,")] = '\0';
+		if(!*word)
+			continue;
+
+		if(set->prefixes == set->prefix_size) {
+			set->prefix_size = set->prefix_size ? set->prefix_size * 2 : 1024;
+			p = realloc(set->prefix, set->prefix_size * sizeof(struct cidr_prefix));
+			if(!p) {
+				fprintf(stderr, "! Error, memory allocation failed.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			set->prefix = p;
+		}
+		prefix = (struct cidr_prefix *)set->prefix + set->prefixes;
+		if(cidr_parse(word, &prefix->start, &prefix->end)) {
+			if(!bad++)
+				fprintf(stderr, "- %s:%ld: not an address or network, skipped.\n",
+					path, lineno);
+			retval = RETVAL_WARN;
+			continue;
+		}
+		prefix->tag = set->ntags;
+		prefix->order = set->prefixes++;
+		loaded++;
+	}
+	fprintf(stderr, "* Loaded %ld networks from %s", loaded, path);
+	if(bad)
+		fprintf(stderr, ", %ld lines skipped", bad);
+	fprintf(stderr, ".\n");
+	set->ntags++;
+
+clean_exit:
+	free(line);
+	fclose(file);
+	return retval;
+}
+
+static int cidr_compare(const void *a, const void *b)
+{
+	const struct cidr_prefix *x = a, *y = b;
+
+	// Start ascending, then the wider prefix first so it encloses
+	if(x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	if(x->end != y->end)
+		return x->end > y->end ? -1 : 1;
+	return x->order - y->order;
+}
+
+/* Appends a range, joined with the one before if they meet */
+static void cidr_emit(struct cidr_prefix *out, int *n, cidr_addr start, cidr_addr end, int tag)
+{
+	if(*n && out[*n - 1].tag == tag && out[*n - 1].end + 1 == start) {
+		out[*n - 1].end = end;
+		return;
+	}
+	out[*n].start = start;
+	out[*n].end = end;
+	out[*n].tag = tag;
+	(*n)++;
+}
+
+/***********************************************************************
+ * cidr_build
+ *
+ * Turns the loaded prefixes into the lookup arrays. Prefixes either
+ * nest or are apart, so with the enclosing prefix sorted first a
+ * stack gives the innermost prefix for every part of the space.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on memory allocation failure
+ ***********************************************************************/
+int cidr_build(struct ipta_cidr_set *set)
+{
+	struct cidr_prefix *in = set->prefix;
+	struct cidr_prefix *out = NULL;
+	struct cidr_prefix *stack[129];
+	cidr_addr cur = 0;
+	int depth = 0, n = 0, i, v4 = 0, v6 = 0;
+	int retval = RETVAL_OK;
+
+	qsort(in, set->prefixes, sizeof(struct cidr_prefix), cidr_compare);
+
+	// Every prefix ends at most one range and splits at most one
+	out = calloc(2 * set->prefixes + 1, sizeof(struct cidr_prefix));
+	if(!out) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+
+	for(i = 0; i <= set->prefixes; i++) {
+		// Close the prefixes that end before this one starts
+		while(depth && (i == set->prefixes || stack[depth - 1]->end < in[i].start)) {
+			depth--;
+			if(cur <= stack[depth]->end)
+				cidr_emit(out, &n, cur, stack[depth]->end, stack[depth]->tag);
+			// The end of the space, cur would wrap to 0
+			if(stack[depth]->end == ~(cidr_addr)0)
+				break;
+			cur = stack[depth]->end + 1;
+		}
+		if(i == set->prefixes)
+			break;
+		if(depth && stack[depth - 1]->start == in[i].start && stack[depth - 1]->end == in[i].end)
+			continue;
+		if(depth && cur < in[i].start)
+			cidr_emit(out, &n, cur, in[i].start - 1, stack[depth - 1]->tag);
+		stack[depth++] = &in[i];
+		cur = in[i].start;
+	}
+
+	for(i = 0; i < n; i++) {
+		if((out[i].start >> 32) == 0xffff && (out[i].end >> 32) == 0xffff)
+			v4++;
+		else
+			v6++;
+	}
+
+	set->start4 = malloc((v4 + 1) * sizeof(unsigned int));
+	set->end4 = malloc((v4 + 1) * sizeof(unsigned int));
+	set->tag4 = malloc((v4 + 1) * sizeof(unsigned char));
+	set->start6 = malloc((v6 + 1) * sizeof(unsigned __int128));
+	set->end6 = malloc((v6 + 1) * sizeof(unsigned __int128));
+	set->tag6 = malloc((v6 + 1) * sizeof(unsigned char));
+	if(!set->start4 || !set->end4 || !set->tag4 || !set->start6 || !set->end6 || !set->tag6) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	set->count4 = set->count6 = 0;
+	for(i = 0; i < n; i++) {
+		if((out[i].start >> 32) == 0xffff && (out[i].end >> 32) == 0xffff) {
+			set->start4[set->count4] = (unsigned int)out[i].start;
+			set->end4[set->count4] = (unsigned int)out[i].end;
+			set->tag4[set->count4++] = out[i].tag;
+		} else {
+			set->start6[set->count6] = out[i].start;
+			set->end6[set->count6] = out[i].end;
+			set->tag6[set->count6++] = out[i].tag;
+		}
+	}
+
+clean_exit:
+	free(out);
+	free(set->prefix);
+	set->prefix = NULL;
+	set->prefixes = set->prefix_size = 0;
+	return retval;
+}
+
+/***********************************************************************
+ * cidr_lookup
+ *
+ * Finds the address, as text from the log line, in the set.
+ *
+ * RETURNS
+ *
+ * 	The tag of the list the address is in, or NULL if it is in none
+ ***********************************************************************/
+char *cidr_lookup(struct ipta_cidr_set *set, char *address)
+{
+	unsigned char bytes[16];
+	const unsigned int *base4;
+	const unsigned __int128 *base6;
+	unsigned int v4;
+	cidr_addr v6;
+	int n, half, i;
+
+	if(cidr_parse_v4(address, &v4) == RETVAL_OK) {
+		if(!set->count4)
+			return NULL;
+		// The last start at or below the address, without branches
+		base4 = set->start4;
+		for(n = set->count4; n > 1; n -= half) {
+			half = n / 2;
+			base4 = base4[half] <= v4 ? base4 + half : base4;
+		}
+		i = base4 - set->start4;
+		if(set->start4[i] <= v4 && v4 <= set->end4[i])
+			return set->tag[set->tag4[i]];
+		return NULL;
+	}
+
+	if(!set->count6 || inet_pton(AF_INET6, address, bytes) != 1)
+		return NULL;
+	v6 = cidr_from_bytes(bytes);
+	base6 = set->start6;
+	for(n = set->count6; n > 1; n -= half) {
+		half = n / 2;
+		base6 = base6[half] <= v6 ? base6 + half : base6;
+	}
+	i = base6 - set->start6;
+	if(set->start6[i] <= v6 && v6 <= set->end6[i])
+		return set->tag[set->tag6[i]];
+	return NULL;
+}
+
+void cidr_free(struct ipta_cidr_set *set)
+{
+	free(set->prefix);
+	free(set->start4);
+	free(set->end4);
+	free(set->tag4);
+	free(set->start6);
+	free(set->end6);
+	free(set->tag6);
+	memset(set, 0, sizeof(struct ipta_cidr_set));
+}
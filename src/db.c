@@ -0,0 +1,249 @@
+/**********************************************************************
+ * db.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Storage backends
+ *
+ * The rest of ipta opens a connection with open_db() and then only
+ * uses the db_ functions below, which work like the MySQL client
+ * calls they replace. Each backend fills in a struct ipta_db_backend,
+ * db_mysql.c talks to a MySQL server and db_sqlite.c keeps everything
+ * in a local SQLite file.
+ ***********************************************************************/
+
+static struct ipta_db_backend *db_backends[] = {
+	&db_mysql_backend,
+	&db_sqlite_backend,
+	NULL
+};
+
+/* The backend called name, NULL if there is none */
+struct ipta_db_backend *db_backend(char *name)
+{
+	int i;
+
+	for(i = 0; db_backends[i]; i++)
+		if(!strcmp(db_backends[i]->name, name))
+			return db_backends[i];
+	return NULL;
+}
+
+/* Before any threads are started */
+int db_library_init(void)
+{
+	int i;
+
+	for(i = 0; db_backends[i]; i++)
+		if(db_backends[i]->library_init && db_backends[i]->library_init())
+			return RETVAL_ERROR;
+	return RETVAL_OK;
+}
+
+/* Threads that open connections of their own call these */
+void db_thread_init(void)
+{
+	int i;
+
+	for(i = 0; db_backends[i]; i++)
+		if(db_backends[i]->thread_init)
+			db_backends[i]->thread_init();
+}
+
+void db_thread_end(void)
+{
+	int i;
+
+	for(i = 0; db_backends[i]; i++)
+		if(db_backends[i]->thread_end)
+			db_backends[i]->thread_end();
+}
+
+/***********************************************************************
+ * open_db
+ *
+ * Opens a connection to the database described by db with the backend
+ * it names, MySQL if none.
+ *
+ * RETURNS
+ *
+ * 	The connection, which the caller closes with db_close()
+ *
+ * 	NULL on failure, after telling why
+ ***********************************************************************/
+struct ipta_db *open_db(struct ipta_db_info *db)
+{
+	struct ipta_db *con;
+
+	con = calloc(1, sizeof(struct ipta_db));
+	if(!con) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return NULL;
+	}
+	con->backend = db->backend ? db->backend : &db_mysql_backend;
+	if(con->backend->open(con, db)) {
+		db_close(con);
+		return NULL;
+	}
+	return con;
+}
+
+void db_close(struct ipta_db *con)
+{
+	if(!con)
+		return;
+	con->backend->close(con);
+	free(con);
+}
+
+/* Runs a statement, 0 on success like mysql_query() */
+int db_query(struct ipta_db *con, char *query)
+{
+	return con->backend->query(con, query);
+}
+
+static struct ipta_db_result *db_result(struct ipta_db *con, int stream)
+{
+	struct ipta_db_result *result;
+
+	result = calloc(1, sizeof(struct ipta_db_result));
+	if(!result)
+		return NULL;
+	result->con = con;
+	if(con->backend->result(con, result, stream)) {
+		free(result);
+		return NULL;
+	}
+	return result;
+}
+
+/* The rows of the last query, all read at once */
+struct ipta_db_result *db_store_result(struct ipta_db *con)
+{
+	return db_result(con, FLAG_CLEAR);
+}
+
+/* The rows of the last query, read as they are fetched. Nothing else
+ * can be done on the connection until all are fetched */
+struct ipta_db_result *db_use_result(struct ipta_db *con)
+{
+	return db_result(con, FLAG_SET);
+}
+
+/* The next row, NULL at the end. Valid until the next call */
+char **db_fetch_row(struct ipta_db_result *result)
+{
+	if(!result)
+		return NULL;
+	return result->con->backend->fetch_row(result);
+}
+
+int db_num_fields(struct ipta_db_result *result)
+{
+	return result ? result->fields : 0;
+}
+
+void db_free_result(struct ipta_db_result *result)
+{
+	if(!result)
+		return;
+	result->con->backend->free_result(result);
+	free(result);
+}
+
+const char *db_error(struct ipta_db *con)
+{
+	if(!con)
+		return "Not connected";
+	return con->backend->error(con);
+}
+
+/* Escapes from so it can be put between single quotes, to must have
+ * room for 2 * len + 1 characters. Returns the length written */
+unsigned long db_escape(struct ipta_db *con, char *to, char *from, unsigned long len)
+{
+	return con->backend->escape(con, to, from, len);
+}
+
+/***********************************************************************
+ * db_insert
+ *
+ * Writes count rows to the logs table in one go, all of them or none.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the rows were not accepted, see db_error()
+ ***********************************************************************/
+int db_insert(struct ipta_db *con, char *table, struct ipta_row *rows, int count)
+{
+	return con->backend->insert(con, table, rows, count);
+}
+
+/* FLAG_SET if the table has the column, -1 if that is not known */
+int db_has_column(struct ipta_db *con, char *table, char *column)
+{
+	return con->backend->has_column(con, table, column);
+}
+
+/* Starts a transaction, ended by db_commit() */
+int db_begin(struct ipta_db *con)
+{
+	return con->backend->begin(con);
+}
+
+/* Ends a transaction if one is open */
+int db_commit(struct ipta_db *con)
+{
+	return con->backend->commit(con);
+}
+
+/* FLAG_SET if the last insert failed because of what was in the rows */
+int db_row_error(struct ipta_db *con)
+{
+	return con->backend->row_error(con);
+}
+
+/***********************************************************************
+ * db_bulk
+ *
+ * Turned on before a large number of rows is loaded into table and
+ * off when done. The backend makes the load as fast as it can, for
+ * example by not updating the indexes until the end.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error, see db_error()
+ ***********************************************************************/
+int db_bulk(struct ipta_db *con, char *table, int on)
+{
+	return con->backend->bulk(con, table, on);
+}
@@ -25,82 +25,15 @@
 #include <stdio.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <time.h>
 //#include <my_global.h>
-//#include <mysql.h>
 #include "ipta.h"
 
 
 
-/***********************************************************************
- * dns_open_db
- *
- * DESCRIPTION
- *
- * This is a simple helper function that will open the con, select the
- * right database from the parameters given in the ipta_db_info
- * struct. Upon success it will return a MYSQL *con object. In failure
- * it will just return NULL.
- * 
- * PARAMETERS 
- *
- * struct ipta_db_info *db - a pointer to a struct containing
- *                           necessary information.
- *
- * RETURNS
- *
- * Upon Success: A MYSQL *con object pointer.
- *
- * Upon Failure: NULL
- *
- * OBSERVE! 
- *
- * The called must take care to destroy the con object themselves when
- * done with it because this function will do nothing of the kind.
- ***********************************************************************/
-MYSQL *open_db(struct ipta_db_info *db) 
-{ 
-	MYSQL *con = NULL; 
-	int retval = RETVAL_OK; 
-	char query_string[QUERY_STRING_SIZE];
-	
-	con = mysql_init(NULL);
-	if(con == NULL) {
-		fprintf(stderr, "! Error, unable to initiate MySQL.\n");
-		retval = RETVAL_ERROR;
-		goto clean_exit;
-	}
-	
-	// Attempt proper connection to database
-	if(mysql_real_connect(con, db->host, db->user, db->pass, 
-			      NULL, 0, NULL, 0) == NULL) {
-		fprintf(stderr, "! Unable to connect to database.\n");
-		fprintf(stderr, "  Error: %s\n", mysql_error(con));
-		retval = RETVAL_ERROR;
-		goto clean_exit;
-	}
-	
-	// Select the indicated database
-	sprintf(query_string, "USE %s;", db->name);
-	if(mysql_query(con, query_string)) {
-		fprintf(stderr, "! Database %s not found, or not possible to connect.\n", db->name);
-		fprintf(stderr, "  Error: %s\n", mysql_error(con));
-		goto clean_exit;
-	}
-
-	// If all is OK we end up here, NOT destroying the con object
-	return con;
-	
-clean_exit:
-	if(retval != RETVAL_OK) {
-		if(con) 
-			mysql_close(con);
-	}
-	return NULL;
-}
-
 int create_db(struct ipta_db_info *db)
 {
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	char *query = NULL;
 	int retval = RETVAL_OK;
 
@@ -116,6 +49,12 @@ int create_db(struct ipta_db_info *db)
 		goto clean_exit;
 	}
 
+	// An SQLite database is just the file, opening it created it
+	if(con->backend == &db_sqlite_backend) {
+		fprintf(stderr, "* Database file %s created.\n", db->name);
+		goto clean_exit;
+	}
+
 	query = malloc(QUERY_STRING_SIZE);
 	if(!query) {
 		fprintf(stderr, "! Allocation failed, must exit.\n");
@@ -124,25 +63,25 @@ int create_db(struct ipta_db_info *db)
 	}
 
 	sprintf(query, "CREATE DATABASE %s;", db->name);
-	if(mysql_query(con, query)) {
+	if(db_query(con, query)) {
 		fprintf(stderr, "! Error, unable to create database '%s'.\n"
-			"  Error: %s.\n", db->name, mysql_error(con));
+			"  Error: %s.\n", db->name, db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
 	
 	sprintf(query, "GRANT ALL PRIVILEGES ON %s.* TO '%s'@'localhost' IDENTIFIED BY %s;",
 		db->name, db->user, db->pass);
-	if(mysql_query(con, query)) {
+	if(db_query(con, query)) {
 		fprintf(stderr, "! Error, unable to grand privileges.\n"
-			"  Error: %s\n", mysql_error(con));
+			"  Error: %s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
 
 clean_exit:
 	if(con)
-		mysql_close(con);
+		db_close(con);
 	free(query);
 
 	return retval;
@@ -160,7 +99,7 @@ clean_exit:
 int create_table(struct ipta_db_info *db)
 {
 	char *query = NULL;
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	int retval = RETVAL_OK;
 
 	con = open_db(db);
@@ -182,22 +121,28 @@ int create_table(struct ipta_db_info *db)
 	// There is no sanity check really for this, MySQL will have to do that for us.
 	sprintf(query, 
 		"CREATE TABLE %s ("					\
-		"id int(11) PRIMARY KEY NOT NULL AUTO_INCREMENT,"	\
+		"id %s,"						\
 		"timestamp timestamp NOT NULL DEFAULT '1970-01-01 04:00:00'," \
 		"if_in varchar(10) DEFAULT NULL,"			\
 		"if_out varchar(10) DEFAULT NULL,"			\
-		"src_ip int(10) unsigned DEFAULT NULL,"			\
-		"src_prt int(10) unsigned DEFAULT NULL,"		\
-		"dst_ip int(10) unsigned DEFAULT NULL,"			\
-		"dst_prt int(10) unsigned DEFAULT NULL,"		\
+		"src_ip %s DEFAULT NULL,"				\
+		"src_prt %s DEFAULT NULL,"				\
+		"dst_ip %s DEFAULT NULL,"				\
+		"dst_prt %s DEFAULT NULL,"				\
 		"proto varchar(10) DEFAULT NULL,"			\
 		"action varchar(10) DEFAULT NULL,"			\
-        "mac varchar(41) DEFAULT NULL);",
-		db->table);
+        "mac varchar(41) DEFAULT NULL,"				\
+		"tag varchar(32) DEFAULT NULL,"				\
+		"packet_count %s NOT NULL DEFAULT 1,"			\
+		"last_seen timestamp NULL DEFAULT NULL);",
+		db->table, con->backend->serial_column,
+		con->backend->unsigned_column, con->backend->unsigned_column,
+		con->backend->unsigned_column, con->backend->unsigned_column,
+		con->backend->unsigned_column);
 	
-	if(mysql_query(con, query)) {
+	if(db_query(con, query)) {
 		fprintf(stderr, "! Query not accepted from database.\n");
-		fprintf(stderr, "! %s\n", mysql_error(con));
+		fprintf(stderr, "! %s\n", db_error(con));
 		
 		// Set error condition and then clean_exit
 		retval = RETVAL_ERROR;
@@ -211,7 +156,7 @@ int create_table(struct ipta_db_info *db)
 	// Clear things up and exit with return value previously set
 clean_exit:
 	if(con)
-		mysql_close(con);
+		db_close(con);
 	free(query);
 	
 	return retval;
@@ -219,6 +164,82 @@ clean_exit:
 
 
 
+/***********************************************************************
+ * upgrade_table
+ *
+ * Adds the columns newer versions of ipta use to a table created by
+ * an older one. The data in the table is kept.
+ ***********************************************************************/
+int upgrade_table(struct ipta_db_info *db)
+{
+	char query[QUERY_STRING_SIZE];
+	struct ipta_db *con = NULL;
+	int tagged, flows;
+	int retval = RETVAL_OK;
+
+	con = open_db(db);
+	if(!con) {
+		fprintf(stderr, "! Unable to open database connection, giving up!\n");
+		return RETVAL_ERROR;
+	}
+
+	// The address list a packet was tagged with, --tag-list
+	tagged = db_has_column(con, db->table, "tag");
+	if(tagged < 0) {
+		fprintf(stderr, "! Query not accepted from database.\n");
+		fprintf(stderr, "! %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	if(tagged) {
+		fprintf(stderr, "* Table '%s' already has the tag column.\n", db->table);
+	} else {
+		sprintf(query, "ALTER TABLE %s ADD COLUMN tag varchar(32) DEFAULT NULL;", db->table);
+		if(db_query(con, query)) {
+			fprintf(stderr, "! Query not accepted from database.\n");
+			fprintf(stderr, "! %s\n", db_error(con));
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		fprintf(stderr, "* Added the tag column to table '%s'.\n", db->table);
+	}
+
+	// The packets merged into a row by --flow-timeout, a row from
+	// before is one packet
+	flows = db_has_column(con, db->table, "packet_count");
+	if(flows < 0) {
+		fprintf(stderr, "! Query not accepted from database.\n");
+		fprintf(stderr, "! %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	if(flows) {
+		fprintf(stderr, "* Table '%s' already has the flow columns.\n", db->table);
+	} else {
+		sprintf(query, "ALTER TABLE %s ADD COLUMN packet_count %s NOT NULL DEFAULT 1;",
+			db->table, con->backend->unsigned_column);
+		if(db_query(con, query)) {
+			fprintf(stderr, "! Query not accepted from database.\n");
+			fprintf(stderr, "! %s\n", db_error(con));
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		sprintf(query, "ALTER TABLE %s ADD COLUMN last_seen timestamp NULL DEFAULT NULL;",
+			db->table);
+		if(db_query(con, query)) {
+			fprintf(stderr, "! Query not accepted from database.\n");
+			fprintf(stderr, "! %s\n", db_error(con));
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		fprintf(stderr, "* Added the flow columns to table '%s'.\n", db->table);
+	}
+
+clean_exit:
+	db_close(con);
+	return retval;
+}
+
 /**********************************************************************
  * delete_table
  *
@@ -229,14 +250,14 @@ clean_exit:
  *********************************************************************/
 int delete_table(struct ipta_db_info *db)
 {
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	char *query = NULL;
 	int retval = RETVAL_OK;
 	
 	// Connect to mysql database
 	con = open_db(db);
 	if(con == NULL) {
-		fprintf(stderr, "! ERROR: Unable to initialize MySQL connection.\n");
+		fprintf(stderr, "! ERROR: Unable to initialize database connection.\n");
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -249,8 +270,8 @@ int delete_table(struct ipta_db_info *db)
 	
 	// Empty the table before populating it with new data if flag set
 	sprintf(query, "DROP TABLE %s", db->table);
-	if(mysql_query(con, query)) {
-		fprintf(stderr, "%s\n", mysql_error(con));
+	if(db_query(con, query)) {
+		fprintf(stderr, "%s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -261,7 +282,7 @@ int delete_table(struct ipta_db_info *db)
 clean_exit:
 	free(query);
 	if(con)
-		mysql_close(con);
+		db_close(con);
 	return retval;
 }
 
@@ -277,11 +298,11 @@ clean_exit:
  *********************************************************************/
 int list_tables(struct ipta_db_info *db_info)
 {
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	char *query = NULL;
 	int retval = RETVAL_OK;
-	MYSQL_ROW row;
-	MYSQL_RES *result = NULL;
+	char **row;
+	struct ipta_db_result *result = NULL;
 	int i = 0;
 	int num_fields = 0;
 	int row_counter = 0;
@@ -289,7 +310,7 @@ int list_tables(struct ipta_db_info *db_info)
 	// Connect to mysql database
 	con = open_db(db_info);
 	if(con == NULL) {
-		fprintf(stderr, "ERROR: Unable to initialize MySQL connection.\n");
+		fprintf(stderr, "ERROR: Unable to initialize database connection.\n");
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -301,17 +322,17 @@ int list_tables(struct ipta_db_info *db_info)
 	}
 
 	// Empty the table before populating it with new data if flag set
-	sprintf(query, "SHOW TABLES");
-	if(mysql_query(con, query)) {
-		fprintf(stderr, "%s\n", mysql_error(con));
+	sprintf(query, "%s", con->backend->tables_query);
+	if(db_query(con, query)) {
+		fprintf(stderr, "%s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
   
-	result = mysql_store_result(con);
-	num_fields = mysql_num_fields(result);
+	result = db_store_result(con);
+	num_fields = db_num_fields(result);
 
-	while ((row = mysql_fetch_row(result))) { 
+	while ((row = db_fetch_row(result))) { 
 		row_counter++;
 		for(i = 0; i < num_fields; i++) { 
 			printf("  %3d: %s ", row_counter, row[i] ? row[i] : "NULL"); 
@@ -320,10 +341,10 @@ int list_tables(struct ipta_db_info *db_info)
 	}
 
 clean_exit:
-	mysql_free_result(result);
+	db_free_result(result);
 	free(query);
 	if(con)
-		mysql_close(con);
+		db_close(con);
 	
 	return retval;
 }
@@ -339,7 +360,7 @@ clean_exit:
  *********************************************************************/
 int clear_database(struct ipta_db_info *db_info)
 {
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	char *query = NULL;
 	int retval = 0;
 
@@ -353,22 +374,145 @@ int clear_database(struct ipta_db_info *db_info)
 	// Connect to mysql database
 	con = open_db(db_info);
 	if(con == NULL) {
-		fprintf(stderr, "ERROR: Unable to initialize MySQL connection.\n");
+		fprintf(stderr, "ERROR: Unable to initialize database connection.\n");
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
   
 	// Empty the table before populating it with new data if flag set
 	sprintf(query, "DELETE FROM %s;", db_info->table);
-	if(mysql_query(con, query)) {
-		fprintf(stderr, "%s\n", mysql_error(con));
+	if(db_query(con, query)) {
+		fprintf(stderr, "%s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
 
 clean_exit:
 	if(NULL != con)
-		mysql_close(con);
+		db_close(con);
+
+	return retval;
+}
+
 
+
+/**********************************************************************
+ * compact_table
+ *
+ * Rolls the rows older than hours into the table with the same name
+ * and COMPACT_SUFFIX, one row per hour, source address, destination
+ * port, protocol, action and in and out interface with the number of
+ * packets, and deletes them. This is done COMPACT_BATCH_IDS ids at a time, each
+ * in its own transaction, so the table is never locked for long. The
+ * cutoff is at a whole hour so an hour is only made once. analyze()
+ * reads both tables.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ *********************************************************************/
+int compact_table(struct ipta_db_info *db, int hours)
+{
+	char query[QUERY_STRING_SIZE];
+	char hourly[IPTA_DB_INFO_STRLEN + sizeof(COMPACT_SUFFIX)];
+	struct ipta_db *con = NULL;
+	struct ipta_db_result *result = NULL;
+	char **row;
+	long first, last, id;
+	unsigned long rows;
+	long cutoff;
+	int flows;
+	int retval = RETVAL_OK;
+
+	con = open_db(db);
+	if(!con) {
+		fprintf(stderr, "! Unable to open database connection, giving up!\n");
+		return RETVAL_ERROR;
+	}
+
+	snprintf(hourly, sizeof(hourly), "%s%s", db->table, COMPACT_SUFFIX);
+	sprintf(query,
+		"CREATE TABLE IF NOT EXISTS %s ("				\
+		"hour timestamp NOT NULL DEFAULT '1970-01-01 04:00:00',"	\
+		"src_ip %s DEFAULT NULL,"					\
+		"dst_prt %s DEFAULT NULL,"					\
+		"proto varchar(10) DEFAULT NULL,"				\
+		"action varchar(10) DEFAULT NULL,"				\
+		"if_in varchar(10) DEFAULT NULL,"				\
+		"if_out varchar(10) DEFAULT NULL,"				\
+		"packets %s NOT NULL);",
+		hourly, con->backend->unsigned_column, con->backend->unsigned_column,
+		con->backend->unsigned_column);
+	if(db_query(con, query)) {
+		fprintf(stderr, "! Query not accepted from database.\n");
+		fprintf(stderr, "! %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	// Rows merged by --flow-timeout count as their packets
+	flows = db_has_column(con, db->table, "packet_count");
+	if(flows < 0) {
+		fprintf(stderr, "! Query not accepted from database.\n");
+		fprintf(stderr, "! %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	cutoff = (long)time(NULL) - hours * 3600L;
+	cutoff -= cutoff % 3600;
+	sprintf(query, "SELECT MIN(id), MAX(id), COUNT(*) FROM %s WHERE timestamp < FROM_UNIXTIME(%ld);",
+		db->table, cutoff);
+	if(db_query(con, query) || !(result = db_store_result(con)) ||
+	   !(row = db_fetch_row(result))) {
+		fprintf(stderr, "! Query not accepted from database.\n");
+		fprintf(stderr, "! %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	first = row[0] ? atol(row[0]) : 1;
+	last = row[1] ? atol(row[1]) : 0;
+	rows = row[2] ? strtoul(row[2], NULL, 10) : 0;
+	db_free_result(result);
+	result = NULL;
+
+	for(id = first; id <= last; id += COMPACT_BATCH_IDS) {
+		// The aggregates and the delete are done together or not at all
+		if(db_begin(con)) {
+			fprintf(stderr, "! %s\n", db_error(con));
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		sprintf(query,
+			"INSERT INTO %s (hour, src_ip, dst_prt, proto, action, if_in, if_out, packets) " \
+			"SELECT FROM_UNIXTIME(UNIX_TIMESTAMP(timestamp) - UNIX_TIMESTAMP(timestamp) %% 3600), " \
+			"src_ip, dst_prt, proto, action, if_in, if_out, %s FROM %s "			\
+			"WHERE id >= %ld AND id < %ld AND timestamp < FROM_UNIXTIME(%ld) "		\
+			"GROUP BY 1, 2, 3, 4, 5, 6, 7;",
+			hourly, flows ? "SUM(packet_count)" : "COUNT(*)", db->table,
+			id, id + COMPACT_BATCH_IDS, cutoff);
+		if(!db_query(con, query)) {
+			sprintf(query,
+				"DELETE FROM %s WHERE id >= %ld AND id < %ld AND timestamp < FROM_UNIXTIME(%ld);",
+				db->table, id, id + COMPACT_BATCH_IDS, cutoff);
+			if(!db_query(con, query) && !db_commit(con))
+				continue;
+		}
+		// Closing the connection rolls the open transaction back
+		fprintf(stderr, "! Compacting ids %ld to %ld failed.\n", id, id + COMPACT_BATCH_IDS - 1);
+		fprintf(stderr, "! %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	fprintf(stderr, "* %lu rows older than %d hours compacted into table %s.\n",
+		rows, hours, hourly);
+
+clean_exit:
+	if(result)
+		db_free_result(result);
+	db_close(con);
 	return retval;
 }
@@ -0,0 +1,349 @@
+/**********************************************************************
+ * db_mysql.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * MySQL backend
+ *
+ * The database ipta has always used, on a server given by host, user
+ * and password. The rows of a batch are written with one multi-row
+ * INSERT that is built with the strings escaped, so a quote in a
+ * field can not break the statement.
+ ***********************************************************************/
+
+/* Room for the longest row we can build, escaped strings included */
+#define DB_MYSQL_ROW_SIZE (2 * sizeof(struct ipta_row) + 160)
+
+/* The state of a connection */
+struct db_mysql {
+	MYSQL *mysql;
+	char *query;              /* Built INSERT statements */
+	size_t query_size;
+};
+
+static int db_mysql_open(struct ipta_db *con, struct ipta_db_info *db)
+{
+	struct db_mysql *m;
+	char query[QUERY_STRING_SIZE];
+
+	m = con->state = calloc(1, sizeof(struct db_mysql));
+	if(!m) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+	m->mysql = mysql_init(NULL);
+	if(!m->mysql) {
+		fprintf(stderr, "! Error, unable to initiate MySQL.\n");
+		return RETVAL_ERROR;
+	}
+
+	// Attempt proper connection to database
+	if(mysql_real_connect(m->mysql, db->host, db->user, db->pass,
+			      NULL, 0, NULL, 0) == NULL) {
+		fprintf(stderr, "! Unable to connect to database.\n");
+		fprintf(stderr, "  Error: %s\n", mysql_error(m->mysql));
+		return RETVAL_ERROR;
+	}
+
+	// Select the indicated database
+	sprintf(query, "USE %s;", db->name);
+	if(mysql_query(m->mysql, query)) {
+		fprintf(stderr, "! Database %s not found, or not possible to connect.\n", db->name);
+		fprintf(stderr, "  Error: %s\n", mysql_error(m->mysql));
+		return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+static void db_mysql_close(struct ipta_db *con)
+{
+	struct db_mysql *m = con->state;
+
+	if(!m)
+		return;
+	if(m->mysql)
+		mysql_close(m->mysql);
+	free(m->query);
+	free(m);
+	con->state = NULL;
+}
+
+static int db_mysql_query(struct ipta_db *con, char *query)
+{
+	struct db_mysql *m = con->state;
+
+	return mysql_query(m->mysql, query);
+}
+
+static int db_mysql_result(struct ipta_db *con, struct ipta_db_result *result, int stream)
+{
+	struct db_mysql *m = con->state;
+	MYSQL_RES *res;
+
+	res = stream ? mysql_use_result(m->mysql) : mysql_store_result(m->mysql);
+	if(!res)
+		return RETVAL_ERROR;
+	result->state = res;
+	result->fields = mysql_num_fields(res);
+	return RETVAL_OK;
+}
+
+static char **db_mysql_fetch_row(struct ipta_db_result *result)
+{
+	return mysql_fetch_row(result->state);
+}
+
+static void db_mysql_free_result(struct ipta_db_result *result)
+{
+	mysql_free_result(result->state);
+}
+
+static const char *db_mysql_error(struct ipta_db *con)
+{
+	struct db_mysql *m = con->state;
+
+	return m && m->mysql ? mysql_error(m->mysql) : "Not connected";
+}
+
+static unsigned long db_mysql_escape(struct ipta_db *con, char *to, char *from, unsigned long len)
+{
+	struct db_mysql *m = con->state;
+
+	return mysql_real_escape_string(m->mysql, to, from, len);
+}
+
+/* Append an escaped string in quotes */
+static char *db_mysql_string(struct ipta_db *con, char *q, char *s)
+{
+	struct db_mysql *m = con->state;
+
+	*q++ = '\'';
+	q += mysql_real_escape_string(m->mysql, q, s, strlen(s));
+	*q++ = '\'';
+	return q;
+}
+
+/* Append a port, NULL when it is negative */
+static char *db_mysql_port(char *q, int port)
+{
+	if(port < 0)
+		return q + sprintf(q, "NULL");
+	return q + sprintf(q, "%d", port);
+}
+
+/***********************************************************************
+ * db_mysql_insert
+ *
+ * Builds one INSERT for all the rows and sends it.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+static int db_mysql_insert(struct ipta_db *con, char *table, struct ipta_row *rows, int count)
+{
+	struct db_mysql *m = con->state;
+	struct ipta_row *row;
+	size_t size = count * DB_MYSQL_ROW_SIZE + 256;
+	int tagged = FLAG_CLEAR, flows = FLAG_CLEAR;
+	char *q;
+	int i;
+
+	if(size > m->query_size) {
+		free(m->query);
+		m->query_size = 0;
+		m->query = malloc(size);
+		if(!m->query) {
+			fprintf(stderr, "! Error, memory allocation failed.\n");
+			return RETVAL_ERROR;
+		}
+		m->query_size = size;
+	}
+
+	// The tag and flow columns are only written when they are used,
+	// so tables from before --tag-list and --flow-timeout still work
+	for(i = 0; i < count; i++) {
+		if(rows[i].tag[0])
+			tagged = FLAG_SET;
+		if(rows[i].packets > 1)
+			flows = FLAG_SET;
+	}
+
+	q = m->query;
+	q += sprintf(q, "INSERT INTO %s (timestamp, if_in, if_out, src_ip, src_prt, "
+		     "dst_ip, dst_prt, proto, action, mac%s%s) VALUES ", table,
+		     tagged ? ", tag" : "", flows ? ", packet_count, last_seen" : "");
+
+	for(i = 0; i < count; i++) {
+		row = &rows[i];
+		if(i)
+			*q++ = ',';
+		if(row->timestamp)
+			q += sprintf(q, "\n (FROM_UNIXTIME(%ld), ", (long)row->timestamp);
+		else
+			q += sprintf(q, "\n (NOW(), ");
+		q = db_mysql_string(con, q, row->if_in);
+		*q++ = ',';
+		q = db_mysql_string(con, q, row->if_out);
+		q += sprintf(q, ", INET_ATON(");
+		q = db_mysql_string(con, q, row->src);
+		q += sprintf(q, "), ");
+		q = db_mysql_port(q, row->src_port);
+		q += sprintf(q, ", INET_ATON(");
+		q = db_mysql_string(con, q, row->dst);
+		q += sprintf(q, "), ");
+		q = db_mysql_port(q, row->dst_port);
+		q += sprintf(q, ", ");
+		q = db_mysql_string(con, q, row->proto);
+		*q++ = ',';
+		q = db_mysql_string(con, q, row->action);
+		*q++ = ',';
+		q = db_mysql_string(con, q, row->mac);
+		if(tagged) {
+			*q++ = ',';
+			q = db_mysql_string(con, q, row->tag);
+		}
+		if(flows)
+			q += sprintf(q, ", %d, FROM_UNIXTIME(%ld)", row->packets,
+				     (long)(row->last_seen ? row->last_seen : row->timestamp));
+		*q++ = ')';
+	}
+	*q++ = ';';
+	*q = '\0';
+
+	if(mysql_real_query(m->mysql, m->query, q - m->query))
+		return RETVAL_ERROR;
+	return RETVAL_OK;
+}
+
+static int db_mysql_has_column(struct ipta_db *con, char *table, char *column)
+{
+	struct db_mysql *m = con->state;
+	char query[QUERY_STRING_SIZE];
+	MYSQL_RES *result;
+	int found;
+
+	snprintf(query, sizeof(query), "SHOW COLUMNS FROM %s LIKE '%s';", table, column);
+	if(mysql_query(m->mysql, query) || !(result = mysql_store_result(m->mysql)))
+		return -1;
+	found = mysql_num_rows(result) ? FLAG_SET : FLAG_CLEAR;
+	mysql_free_result(result);
+	return found;
+}
+
+static int db_mysql_begin(struct ipta_db *con)
+{
+	struct db_mysql *m = con->state;
+
+	return mysql_query(m->mysql, "START TRANSACTION;") ? RETVAL_ERROR : RETVAL_OK;
+}
+
+static int db_mysql_commit(struct ipta_db *con)
+{
+	struct db_mysql *m = con->state;
+
+	return mysql_query(m->mysql, "COMMIT;") ? RETVAL_ERROR : RETVAL_OK;
+}
+
+/* The errors where a row of the INSERT is to blame and not the
+   connection, the table or a lock, so splitting it up can help */
+static int db_mysql_row_error(struct ipta_db *con)
+{
+	struct db_mysql *m = con->state;
+
+	switch(mysql_errno(m->mysql)) {
+	case 1048:                /* ER_BAD_NULL_ERROR */
+	case 1062:                /* ER_DUP_ENTRY */
+	case 1064:                /* ER_PARSE_ERROR */
+	case 1153:                /* ER_NET_PACKET_TOO_LARGE */
+	case 1264:                /* ER_WARN_DATA_OUT_OF_RANGE */
+	case 1265:                /* WARN_DATA_TRUNCATED */
+	case 1292:                /* ER_TRUNCATED_WRONG_VALUE */
+	case 1366:                /* ER_TRUNCATED_WRONG_VALUE_FOR_FIELD */
+	case 1406:                /* ER_DATA_TOO_LONG */
+	case 1411:                /* ER_WRONG_VALUE_FOR_TYPE */
+		return FLAG_SET;
+	}
+	return FLAG_CLEAR;
+}
+
+/* Indexes are rebuilt once at the end, rows are not checked */
+static int db_mysql_bulk(struct ipta_db *con, char *table, int on)
+{
+	struct db_mysql *m = con->state;
+	char query[QUERY_STRING_SIZE];
+
+	if(mysql_query(m->mysql, on ? "SET unique_checks=0;" : "SET unique_checks=1;") ||
+	   mysql_query(m->mysql, on ? "SET foreign_key_checks=0;" : "SET foreign_key_checks=1;"))
+		return RETVAL_ERROR;
+	snprintf(query, sizeof(query), "ALTER TABLE %s %s KEYS;", table, on ? "DISABLE" : "ENABLE");
+	return mysql_query(m->mysql, query) ? RETVAL_ERROR : RETVAL_OK;
+}
+
+/* Before any threads are started */
+static int db_mysql_library_init(void)
+{
+	return mysql_library_init(0, NULL, NULL) ? RETVAL_ERROR : RETVAL_OK;
+}
+
+static void db_mysql_thread_init(void)
+{
+	mysql_thread_init();
+}
+
+static void db_mysql_thread_end(void)
+{
+	mysql_thread_end();
+}
+
+struct ipta_db_backend db_mysql_backend = {
+	.name = "mysql",
+	.serial_column = "int(11) PRIMARY KEY NOT NULL AUTO_INCREMENT",
+	.unsigned_column = "int(10) unsigned",
+	.tables_query = "SHOW TABLES;",
+	.open = db_mysql_open,
+	.close = db_mysql_close,
+	.query = db_mysql_query,
+	.result = db_mysql_result,
+	.fetch_row = db_mysql_fetch_row,
+	.free_result = db_mysql_free_result,
+	.error = db_mysql_error,
+	.escape = db_mysql_escape,
+	.insert = db_mysql_insert,
+	.has_column = db_mysql_has_column,
+	.begin = db_mysql_begin,
+	.commit = db_mysql_commit,
+	.row_error = db_mysql_row_error,
+	.bulk = db_mysql_bulk,
+	.library_init = db_mysql_library_init,
+	.thread_init = db_mysql_thread_init,
+	.thread_end = db_mysql_thread_end
+};
@@ -0,0 +1,534 @@
+/**********************************************************************
+ * db_sqlite.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sqlite3.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * SQLite backend
+ *
+ * Keeps the database in a local file, --db-name names it, so ipta
+ * runs without a MySQL server. The file is opened in WAL mode so
+ * analyze and the DNS threads can read while an import writes. A
+ * batch is written with one prepared INSERT run once per row inside a
+ * single transaction.
+ *
+ * The MySQL functions the queries use are added as SQL functions:
+ * INET_ATON(), INET_NTOA(), NOW(), FROM_UNIXTIME() and
+ * UNIX_TIMESTAMP(). Times are kept as 'YYYY-MM-DD HH:MM:SS' in local
+ * time like MySQL shows them, so they compare and sort as text.
+ ***********************************************************************/
+
+/* Waiting for another writer, in ms */
+#define DB_SQLITE_BUSY_MS 10000
+
+/* The state of a connection */
+struct db_sqlite {
+	sqlite3 *sqlite;
+	sqlite3_stmt *stmt;       /* Rows of the last query not taken yet */
+	sqlite3_stmt *insert[4];  /* Prepared inserts, with tag 1 and flows 2 */
+	char insert_table[IPTA_DB_INFO_STRLEN];
+	char error[256];          /* Why the last insert failed */
+	int error_code;           /* And its result code */
+};
+
+/* The rows a query gave */
+struct db_sqlite_result {
+	sqlite3_stmt *stmt;
+	int stepped;              /* The first row is read already */
+	char **row;
+};
+
+static void db_sqlite_time(sqlite3_context *ctx, time_t t)
+{
+	char text[32];
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+	sqlite3_result_text(ctx, text, -1, SQLITE_TRANSIENT);
+}
+
+static void db_sqlite_inet_aton(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *text = (const char *)sqlite3_value_text(argv[0]);
+	struct in_addr addr;
+
+	if(!text || inet_pton(AF_INET, text, &addr) != 1) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	sqlite3_result_int64(ctx, ntohl(addr.s_addr));
+}
+
+static void db_sqlite_inet_ntoa(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	char text[INET_ADDRSTRLEN];
+	struct in_addr addr;
+
+	if(sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	addr.s_addr = htonl((unsigned int)sqlite3_value_int64(argv[0]));
+	inet_ntop(AF_INET, &addr, text, sizeof(text));
+	sqlite3_result_text(ctx, text, -1, SQLITE_TRANSIENT);
+}
+
+static void db_sqlite_now(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	db_sqlite_time(ctx, time(NULL));
+}
+
+static void db_sqlite_from_unixtime(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	if(sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	db_sqlite_time(ctx, (time_t)sqlite3_value_int64(argv[0]));
+}
+
+static void db_sqlite_unix_timestamp(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *text;
+	struct tm tm;
+
+	if(!argc) {
+		sqlite3_result_int64(ctx, time(NULL));
+		return;
+	}
+	text = (const char *)sqlite3_value_text(argv[0]);
+	memset(&tm, 0, sizeof(tm));
+	if(!text || sscanf(text, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+			   &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	tm.tm_isdst = -1;
+	sqlite3_result_int64(ctx, mktime(&tm));
+}
+
+static int db_sqlite_open(struct ipta_db *con, struct ipta_db_info *db)
+{
+	struct db_sqlite *lite;
+
+	lite = con->state = calloc(1, sizeof(struct db_sqlite));
+	if(!lite) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+	if(sqlite3_open_v2(db->name, &lite->sqlite,
+			   SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+		fprintf(stderr, "! Unable to open the database file %s.\n", db->name);
+		fprintf(stderr, "  Error: %s\n", sqlite3_errmsg(lite->sqlite));
+		return RETVAL_ERROR;
+	}
+	sqlite3_busy_timeout(lite->sqlite, DB_SQLITE_BUSY_MS);
+
+	if(sqlite3_exec(lite->sqlite, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;",
+			NULL, NULL, NULL) != SQLITE_OK ||
+	   sqlite3_create_function(lite->sqlite, "INET_ATON", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+				   NULL, db_sqlite_inet_aton, NULL, NULL) != SQLITE_OK ||
+	   sqlite3_create_function(lite->sqlite, "INET_NTOA", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+				   NULL, db_sqlite_inet_ntoa, NULL, NULL) != SQLITE_OK ||
+	   sqlite3_create_function(lite->sqlite, "NOW", 0, SQLITE_UTF8,
+				   NULL, db_sqlite_now, NULL, NULL) != SQLITE_OK ||
+	   sqlite3_create_function(lite->sqlite, "FROM_UNIXTIME", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+				   NULL, db_sqlite_from_unixtime, NULL, NULL) != SQLITE_OK ||
+	   sqlite3_create_function(lite->sqlite, "UNIX_TIMESTAMP", 0, SQLITE_UTF8,
+				   NULL, db_sqlite_unix_timestamp, NULL, NULL) != SQLITE_OK ||
+	   sqlite3_create_function(lite->sqlite, "UNIX_TIMESTAMP", 1, SQLITE_UTF8,
+				   NULL, db_sqlite_unix_timestamp, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "! Unable to set up the database file %s.\n", db->name);
+		fprintf(stderr, "  Error: %s\n", sqlite3_errmsg(lite->sqlite));
+		return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+static void db_sqlite_close(struct ipta_db *con)
+{
+	struct db_sqlite *lite = con->state;
+	int i;
+
+	if(!lite)
+		return;
+	sqlite3_finalize(lite->stmt);
+	for(i = 0; i < 4; i++)
+		sqlite3_finalize(lite->insert[i]);
+	sqlite3_close(lite->sqlite);
+	free(lite);
+	con->state = NULL;
+}
+
+/***********************************************************************
+ * db_sqlite_query
+ *
+ * Runs the statements in query. When one of them gives rows it stops
+ * there and leaves them for db_store_result() or db_use_result(),
+ * so a query works the same way as with mysql_query().
+ *
+ * RETURNS
+ *
+ * 	0 - on success
+ *
+ * 	1 - on error, see db_error()
+ ***********************************************************************/
+static int db_sqlite_query(struct ipta_db *con, char *query)
+{
+	struct db_sqlite *lite = con->state;
+	const char *tail = query;
+	sqlite3_stmt *stmt;
+	int step;
+
+	// Rows from before that were never asked for
+	lite->error[0] = '\0';
+	sqlite3_finalize(lite->stmt);
+	lite->stmt = NULL;
+
+	while(*tail) {
+		if(sqlite3_prepare_v2(lite->sqlite, tail, -1, &stmt, &tail) != SQLITE_OK)
+			return 1;
+		// Only white space or a comment was left
+		if(!stmt)
+			break;
+		step = sqlite3_step(stmt);
+		if(step == SQLITE_ROW) {
+			lite->stmt = stmt;
+			return 0;
+		}
+		sqlite3_finalize(stmt);
+		if(step != SQLITE_DONE)
+			return 1;
+	}
+	return 0;
+}
+
+/* All rows are read as they are fetched, stream does not matter */
+static int db_sqlite_result(struct ipta_db *con, struct ipta_db_result *result, int stream)
+{
+	struct db_sqlite *lite = con->state;
+	struct db_sqlite_result *res;
+
+	res = calloc(1, sizeof(struct db_sqlite_result));
+	if(!res)
+		return RETVAL_ERROR;
+	result->state = res;
+	res->stmt = lite->stmt;
+	lite->stmt = NULL;
+	if(!res->stmt)
+		return RETVAL_OK;
+	res->stepped = FLAG_SET;
+	result->fields = sqlite3_column_count(res->stmt);
+	res->row = calloc(result->fields, sizeof(char *));
+	if(!res->row) {
+		sqlite3_finalize(res->stmt);
+		free(res);
+		return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+static char **db_sqlite_fetch_row(struct ipta_db_result *result)
+{
+	struct db_sqlite_result *res = result->state;
+	int i;
+
+	if(!res->stmt)
+		return NULL;
+	if(!res->stepped && sqlite3_step(res->stmt) != SQLITE_ROW)
+		return NULL;
+	res->stepped = FLAG_CLEAR;
+	for(i = 0; i < result->fields; i++)
+		res->row[i] = (char *)sqlite3_column_text(res->stmt, i);
+	return res->row;
+}
+
+static void db_sqlite_free_result(struct ipta_db_result *result)
+{
+	struct db_sqlite_result *res = result->state;
+
+	sqlite3_finalize(res->stmt);
+	free(res->row);
+	free(res);
+}
+
+static const char *db_sqlite_error(struct ipta_db *con)
+{
+	struct db_sqlite *lite = con->state;
+
+	if(!lite)
+		return "Not connected";
+	return lite->error[0] ? lite->error : sqlite3_errmsg(lite->sqlite);
+}
+
+/* Keeps the message before a ROLLBACK replaces it */
+static int db_sqlite_rollback(struct ipta_db *con, int bulk)
+{
+	struct db_sqlite *lite = con->state;
+
+	snprintf(lite->error, sizeof(lite->error), "%s", sqlite3_errmsg(lite->sqlite));
+	lite->error_code = sqlite3_errcode(lite->sqlite);
+	sqlite3_exec(lite->sqlite, bulk ? "ROLLBACK TO batch; RELEASE batch;" : "ROLLBACK;",
+		     NULL, NULL, NULL);
+	return RETVAL_ERROR;
+}
+
+/* Quotes are doubled, a backslash means nothing to SQLite */
+static unsigned long db_sqlite_escape(struct ipta_db *con, char *to, char *from, unsigned long len)
+{
+	char *start = to;
+
+	while(len--) {
+		if(*from == '\'')
+			*to++ = '\'';
+		*to++ = *from++;
+	}
+	*to = '\0';
+	return to - start;
+}
+
+/* The prepared insert for table, with tag if kind has 1 and with the
+ * flow columns if it has 2. Each is made when first needed, so tables
+ * without these columns work as long as they are not used. */
+static sqlite3_stmt *db_sqlite_prepare(struct ipta_db *con, char *table, int kind)
+{
+	struct db_sqlite *lite = con->state;
+	char query[QUERY_STRING_SIZE];
+	int i;
+
+	if(strcmp(lite->insert_table, table)) {
+		for(i = 0; i < 4; i++) {
+			sqlite3_finalize(lite->insert[i]);
+			lite->insert[i] = NULL;
+		}
+		strncpy(lite->insert_table, table, IPTA_DB_INFO_STRLEN - 1);
+	}
+	if(lite->insert[kind])
+		return lite->insert[kind];
+
+	snprintf(query, sizeof(query),
+		 "INSERT INTO %s (timestamp, if_in, if_out, src_ip, src_prt, dst_ip, "
+		 "dst_prt, proto, action, mac%s%s) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?%s%s);",
+		 table, kind & 1 ? ", tag" : "", kind & 2 ? ", packet_count, last_seen" : "",
+		 kind & 1 ? ", ?" : "", kind & 2 ? ", ?, ?" : "");
+	if(sqlite3_prepare_v2(lite->sqlite, query, -1, &lite->insert[kind], NULL) != SQLITE_OK)
+		lite->insert[kind] = NULL;
+	return lite->insert[kind];
+}
+
+static void db_sqlite_bind_address(sqlite3_stmt *stmt, int n, char *text)
+{
+	struct in_addr addr;
+
+	// Like INET_ATON(), anything but IPv4 is NULL
+	if(inet_pton(AF_INET, text, &addr) == 1)
+		sqlite3_bind_int64(stmt, n, ntohl(addr.s_addr));
+	else
+		sqlite3_bind_null(stmt, n);
+}
+
+static void db_sqlite_bind_port(sqlite3_stmt *stmt, int n, int port)
+{
+	if(port < 0)
+		sqlite3_bind_null(stmt, n);
+	else
+		sqlite3_bind_int(stmt, n, port);
+}
+
+/***********************************************************************
+ * db_sqlite_insert
+ *
+ * Runs the prepared INSERT for every row, all in one transaction so
+ * the file is only synced once per batch. Inside a transaction of
+ * db_bulk() or db_begin() the batch is a savepoint of it instead.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error, nothing is written
+ ***********************************************************************/
+static int db_sqlite_insert(struct ipta_db *con, char *table, struct ipta_row *rows, int count)
+{
+	struct db_sqlite *lite = con->state;
+	struct ipta_row *row;
+	sqlite3_stmt *stmt;
+	char timestamp[32], last_seen[32];
+	struct tm tm;
+	time_t t;
+	int bulk, i;
+
+	lite->error[0] = '\0';
+	lite->error_code = SQLITE_OK;
+
+	// Inside a transaction the batch is a savepoint of it
+	bulk = !sqlite3_get_autocommit(lite->sqlite);
+	if(sqlite3_exec(lite->sqlite, bulk ? "SAVEPOINT batch;" : "BEGIN IMMEDIATE;",
+			NULL, NULL, NULL) != SQLITE_OK)
+		return RETVAL_ERROR;
+
+	for(i = 0; i < count; i++) {
+		row = &rows[i];
+		stmt = db_sqlite_prepare(con, table, (row->tag[0] ? 1 : 0) | (row->packets > 1 ? 2 : 0));
+		if(!stmt)
+			return db_sqlite_rollback(con, bulk);
+		t = row->timestamp ? row->timestamp : time(NULL);
+		localtime_r(&t, &tm);
+		strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+		sqlite3_bind_text(stmt, 1, timestamp, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, row->if_in, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, row->if_out, -1, SQLITE_STATIC);
+		db_sqlite_bind_address(stmt, 4, row->src);
+		db_sqlite_bind_port(stmt, 5, row->src_port);
+		db_sqlite_bind_address(stmt, 6, row->dst);
+		db_sqlite_bind_port(stmt, 7, row->dst_port);
+		sqlite3_bind_text(stmt, 8, row->proto, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 9, row->action, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 10, row->mac, -1, SQLITE_STATIC);
+		if(row->tag[0])
+			sqlite3_bind_text(stmt, 11, row->tag, -1, SQLITE_STATIC);
+		if(row->packets > 1) {
+			t = row->last_seen ? row->last_seen : t;
+			localtime_r(&t, &tm);
+			strftime(last_seen, sizeof(last_seen), "%Y-%m-%d %H:%M:%S", &tm);
+			sqlite3_bind_int(stmt, row->tag[0] ? 12 : 11, row->packets);
+			sqlite3_bind_text(stmt, row->tag[0] ? 13 : 12, last_seen, -1, SQLITE_STATIC);
+		}
+
+		if(sqlite3_step(stmt) != SQLITE_DONE) {
+			sqlite3_reset(stmt);
+			return db_sqlite_rollback(con, bulk);
+		}
+		sqlite3_reset(stmt);
+	}
+
+	if(sqlite3_exec(lite->sqlite, bulk ? "RELEASE batch;" : "COMMIT;",
+			NULL, NULL, NULL) != SQLITE_OK)
+		return db_sqlite_rollback(con, bulk);
+	return RETVAL_OK;
+}
+
+static int db_sqlite_has_column(struct ipta_db *con, char *table, char *column)
+{
+	struct db_sqlite *lite = con->state;
+	sqlite3_stmt *stmt;
+	int step;
+
+	if(sqlite3_prepare_v2(lite->sqlite, "SELECT 1 FROM pragma_table_info(?) WHERE name = ?;",
+			      -1, &stmt, NULL) != SQLITE_OK)
+		return -1;
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+	step = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if(step != SQLITE_ROW && step != SQLITE_DONE)
+		return -1;
+	return step == SQLITE_ROW ? FLAG_SET : FLAG_CLEAR;
+}
+
+/* Deferred, the file is not locked until the first row is written */
+static int db_sqlite_begin(struct ipta_db *con)
+{
+	struct db_sqlite *lite = con->state;
+
+	if(!sqlite3_get_autocommit(lite->sqlite))
+		return RETVAL_OK;
+	return sqlite3_exec(lite->sqlite, "BEGIN;", NULL, NULL, NULL) == SQLITE_OK ?
+		RETVAL_OK : RETVAL_ERROR;
+}
+
+/* Every write is its own transaction unless one was started */
+static int db_sqlite_commit(struct ipta_db *con)
+{
+	struct db_sqlite *lite = con->state;
+
+	if(sqlite3_get_autocommit(lite->sqlite))
+		return RETVAL_OK;
+	return sqlite3_exec(lite->sqlite, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK ?
+		RETVAL_OK : RETVAL_ERROR;
+}
+
+/* A constraint or a value that does not fit, not the file or a lock */
+static int db_sqlite_row_error(struct ipta_db *con)
+{
+	struct db_sqlite *lite = con->state;
+
+	switch(lite->error_code & 0xff) {
+	case SQLITE_CONSTRAINT:
+	case SQLITE_MISMATCH:
+	case SQLITE_TOOBIG:
+	case SQLITE_RANGE:
+		return FLAG_SET;
+	}
+	return FLAG_CLEAR;
+}
+
+/* The whole load is one transaction that is not synced until the end */
+static int db_sqlite_bulk(struct ipta_db *con, char *table, int on)
+{
+	struct db_sqlite *lite = con->state;
+
+	return sqlite3_exec(lite->sqlite, on ? "PRAGMA synchronous=OFF; BEGIN IMMEDIATE;" :
+			    "COMMIT; PRAGMA synchronous=NORMAL;", NULL, NULL, NULL) == SQLITE_OK ?
+		RETVAL_OK : RETVAL_ERROR;
+}
+
+/* Before any threads are started */
+static int db_sqlite_library_init(void)
+{
+	return sqlite3_initialize() == SQLITE_OK ? RETVAL_OK : RETVAL_ERROR;
+}
+
+struct ipta_db_backend db_sqlite_backend = {
+	.name = "sqlite",
+	.serial_column = "INTEGER PRIMARY KEY AUTOINCREMENT",
+	.unsigned_column = "INTEGER",
+	.tables_query = "SELECT name FROM sqlite_master WHERE type = 'table' "
+			"AND name NOT LIKE 'sqlite_%' ORDER BY name;",
+	.open = db_sqlite_open,
+	.close = db_sqlite_close,
+	.query = db_sqlite_query,
+	.result = db_sqlite_result,
+	.fetch_row = db_sqlite_fetch_row,
+	.free_result = db_sqlite_free_result,
+	.error = db_sqlite_error,
+	.escape = db_sqlite_escape,
+	.insert = db_sqlite_insert,
+	.has_column = db_sqlite_has_column,
+	.begin = db_sqlite_begin,
+	.commit = db_sqlite_commit,
+	.row_error = db_sqlite_row_error,
+	.bulk = db_sqlite_bulk,
+	.library_init = db_sqlite_library_init
+};
@@ -0,0 +1,341 @@
+/**********************************************************************
+ * detect.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Scan and flood detection
+ *
+ * Every source address seen gets a slot in a table of fixed size, so
+ * a flood from many addresses can not make us grow. A slot counts the
+ * packets, the different destination ports and the different
+ * destination hosts of the source. The window is split in two halves,
+ * the counts of the current and the previous half are kept and
+ * together they cover the last window. When a new half starts the
+ * current counts become the previous ones.
+ *
+ * The different ports and hosts are counted with small HyperLogLog
+ * sketches, 64 registers of a byte each. The two halves are merged by
+ * taking the largest of each register, which is what a sketch of the
+ * whole window would have held.
+ *
+ * The table is open addressing with a short probe sequence. A new
+ * source takes a free slot, or one not seen for a whole window, or
+ * else the one seen longest ago, so a flood of new addresses pushes
+ * out the quiet ones and never the busy ones.
+ ***********************************************************************/
+
+#define DETECT_PROBES 8
+
+#define DETECT_EVENT_PORTS 0
+#define DETECT_EVENT_HOSTS 1
+#define DETECT_EVENT_RATE 2
+
+/* A 64 bit mix, the finalizer of splitmix64 */
+static uint64_t detect_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static uint64_t detect_hash(const unsigned char *data, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		h = (h ^ data[i]) * 1099511628211ULL;
+	return detect_mix(h);
+}
+
+/* Adds a hashed value to a sketch */
+static void detect_hll_add(unsigned char *registers, uint64_t h)
+{
+	unsigned char rank;
+	uint64_t w = h >> 6;
+
+	rank = w ? __builtin_clzll(w) - 5 : 59;
+	if(registers[h & (DETECT_HLL - 1)] < rank)
+		registers[h & (DETECT_HLL - 1)] = rank;
+}
+
+/* The number of different values in the union of two sketches */
+static unsigned int detect_hll_count(unsigned char *a, unsigned char *b)
+{
+	double sum = 0, estimate;
+	int zeros = 0, i;
+	unsigned char r;
+
+	for(i = 0; i < DETECT_HLL; i++) {
+		r = a[i] > b[i] ? a[i] : b[i];
+		if(!r)
+			zeros++;
+		sum += 1.0 / (1ULL << r);
+	}
+	estimate = 0.709 * DETECT_HLL * DETECT_HLL / sum;
+	// Small counts are far more exact from the empty registers
+	if(estimate <= 2.5 * DETECT_HLL && zeros)
+		estimate = DETECT_HLL * log((double)DETECT_HLL / zeros);
+	return (unsigned int)(estimate + 0.5);
+}
+
+/***********************************************************************
+ * detect_init
+ *
+ * Allocates the table of sources. The thresholds and window in detect
+ * should already be set, a threshold of 0 turns that check off.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int detect_init(struct ipta_detect *detect, char *logfile)
+{
+	detect->table = calloc(DETECT_SOURCES, sizeof(struct ipta_detect_source));
+	if(!detect->table) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+	if(detect->window < 2)
+		detect->window = 2;
+	detect->half = detect->window / 2;
+
+	// Events are appended, the way fail2ban and friends expect a log
+	if(logfile) {
+		detect->log = fopen(logfile, "a");
+		if(!detect->log) {
+			fprintf(stderr, "! Error, unable to open %s for the events.\n", logfile);
+			free(detect->table);
+			detect->table = NULL;
+			return RETVAL_ERROR;
+		}
+		setvbuf(detect->log, NULL, _IOLBF, 0);
+	}
+	return RETVAL_OK;
+}
+
+void detect_free(struct ipta_detect *detect)
+{
+	if(detect->table && (detect->events || detect->evicted))
+		fprintf(stderr, "* Detector: %lu events, %lu sources pushed out of the full table.\n",
+			detect->events, detect->evicted);
+	if(detect->log)
+		fclose(detect->log);
+	free(detect->table);
+	detect->table = NULL;
+	detect->log = NULL;
+}
+
+/* The slot of a source, a new or reused one if it is not in the table */
+static struct ipta_detect_source *detect_find(struct ipta_detect *detect, unsigned char *addr,
+					      long epoch)
+{
+	struct ipta_detect_source *s, *victim, *free_slot = NULL, *oldest = NULL;
+	uint64_t h = detect_hash(addr, 16);
+	int i;
+
+	for(i = 0; i < DETECT_PROBES; i++) {
+		s = &detect->table[(h + i) & (DETECT_SOURCES - 1)];
+		if(s->used && !memcmp(s->addr, addr, 16))
+			return s;
+		if(!s->used || s->epoch < epoch - 1) {
+			if(!free_slot)
+				free_slot = s;
+		} else if(!oldest || s->last < oldest->last) {
+			oldest = s;
+		}
+	}
+
+	victim = free_slot;
+	if(!victim) {
+		victim = oldest;
+		detect->evicted++;
+	}
+	memset(victim, 0, sizeof(struct ipta_detect_source));
+	memcpy(victim->addr, addr, 16);
+	victim->used = FLAG_SET;
+	victim->epoch = epoch;
+	for(i = 0; i < 3; i++)
+		victim->reported[i] = -2;
+	return victim;
+}
+
+/* Moves on to the half window of epoch */
+static void detect_advance(struct ipta_detect_source *s, long epoch)
+{
+	if(s->epoch == epoch)
+		return;
+	if(s->epoch == epoch - 1) {
+		s->packets[1] = s->packets[0];
+		memcpy(s->ports[1], s->ports[0], DETECT_HLL);
+		memcpy(s->hosts[1], s->hosts[0], DETECT_HLL);
+	} else {
+		s->packets[1] = 0;
+		memset(s->ports[1], 0, DETECT_HLL);
+		memset(s->hosts[1], 0, DETECT_HLL);
+		s->top_count = 0;
+	}
+	s->packets[0] = 0;
+	memset(s->ports[0], 0, DETECT_HLL);
+	memset(s->hosts[0], 0, DETECT_HLL);
+	s->epoch = epoch;
+}
+
+/* FLAG_SET if an event of this kind was not reported within the window */
+static int detect_due(struct ipta_detect_source *s, int kind, long epoch)
+{
+	if(s->reported[kind] >= epoch - 1)
+		return FLAG_CLEAR;
+	s->reported[kind] = epoch;
+	return FLAG_SET;
+}
+
+/***********************************************************************
+ * detect_packet
+ *
+ * Counts a packet for its source and checks the thresholds. At most
+ * one event is raised per packet, and the same kind of event is
+ * raised at most once per window for a source.
+ *
+ * RETURNS
+ *
+ * 	FLAG_SET - event holds the text of an event, without time
+ *
+ * 	FLAG_CLEAR - nothing to report
+ ***********************************************************************/
+int detect_packet(struct ipta_detect *detect, struct ipta_record *rec, char *event, size_t len)
+{
+	struct ipta_detect_source *s;
+	unsigned char addr[16];
+	unsigned int v4, count, span;
+	time_t now = rec->timestamp ? rec->timestamp : time(NULL);
+	long epoch = now / detect->half;
+	int port = atoi(rec->dst_port);
+
+	// IPv4 is kept as ::ffff:a.b.c.d so both fit the same key
+	if(cidr_parse_v4(rec->src, &v4) == RETVAL_OK) {
+		memset(addr, 0, 10);
+		addr[10] = addr[11] = 0xff;
+		v4 = htonl(v4);
+		memcpy(addr + 12, &v4, 4);
+	} else if(inet_pton(AF_INET6, rec->src, addr) != 1) {
+		return FLAG_CLEAR;
+	}
+
+	s = detect_find(detect, addr, epoch);
+	// Merged logs are not quite in order, late packets count as now
+	if(epoch < s->epoch)
+		epoch = s->epoch;
+	detect_advance(s, epoch);
+	if(now != s->last)
+		s->second = 0;
+	if(now > s->last)
+		s->last = now;
+	s->second++;
+	s->packets[0]++;
+	if(rec->dst_port[0])
+		detect_hll_add(s->ports[0], detect_mix(port + 1));
+	detect_hll_add(s->hosts[0], detect_hash((unsigned char *)rec->dst, strlen(rec->dst)));
+
+	// The port most of the packets go to, the majority vote of
+	// Boyer and Moore needs only a candidate and a counter
+	if(s->top_count && s->top_port == port) {
+		s->top_count++;
+	} else if(!s->top_count) {
+		s->top_port = port;
+		s->top_count = 1;
+	} else {
+		s->top_count--;
+	}
+
+	if(detect->ports) {
+		count = detect_hll_count(s->ports[0], s->ports[1]);
+		if(count >= (unsigned int)detect->ports && detect_due(s, DETECT_EVENT_PORTS, epoch)) {
+			snprintf(event, len, "SRC %s scanned %u ports in %ds", rec->src, count,
+				 detect->window);
+			detect->events++;
+			return FLAG_SET;
+		}
+	}
+
+	if(detect->hosts) {
+		count = detect_hll_count(s->hosts[0], s->hosts[1]);
+		if(count >= (unsigned int)detect->hosts && detect_due(s, DETECT_EVENT_HOSTS, epoch)) {
+			snprintf(event, len, "SRC %s scanned %u hosts in %ds", rec->src, count,
+				 detect->window);
+			detect->events++;
+			return FLAG_SET;
+		}
+	}
+
+	// The rate of this second, or over the window for a flood that
+	// is spread out over the seconds
+	if(detect->rate) {
+		span = s->last - epoch * detect->half + 1 + (s->packets[1] ? detect->half : 0);
+		count = (s->packets[0] + s->packets[1]) / span;
+		if(s->second > count)
+			count = s->second;
+		if(count >= (unsigned int)detect->rate && detect_due(s, DETECT_EVENT_RATE, epoch)) {
+			if(2 * s->top_count >= s->packets[0] + s->packets[1])
+				snprintf(event, len, "SRC %s %u pkts/s to DPT %d", rec->src, count,
+					 s->top_port);
+			else
+				snprintf(event, len, "SRC %s %u pkts/s", rec->src, count);
+			detect->events++;
+			return FLAG_SET;
+		}
+	}
+
+	return FLAG_CLEAR;
+}
+
+/***********************************************************************
+ * detect_log
+ *
+ * Writes an event to the --detect-log file with the date and time, one
+ * line per event.
+ ***********************************************************************/
+void detect_log(struct ipta_detect *detect, char *event)
+{
+	char date[32];
+	time_t t = time(NULL);
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(detect->log, "%s ipta: %s\n", date, event);
+}
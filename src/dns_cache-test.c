@@ -32,7 +32,6 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <mysql.h>
 #include "ipta.h"
 
 #define TEST_I 1
@@ -49,11 +48,17 @@ int main(int argc, char *argv[])
 	
 	printf("* Unit tests for the DNS cache subsystem of ipta.\n\n");
 	
-	// Populate the db struct with something that should work
+	// Populate the db struct with something that should work, a
+	// file name runs the tests against SQLite instead of MySQL
+	memset(&db, 0, sizeof(db));
+	if(argc > 1) {
+		db.backend = &db_sqlite_backend;
+		unlink(argv[1]);
+	}
 	strcpy(db.host, "localhost");
 	strcpy(db.user, "ipta");
 	strcpy(db.pass, "ipta");
-	strcpy(db.name, "ipta");
+	strcpy(db.name, argc > 1 ? argv[1] : "ipta");
 	strcpy(db.table, "dns");
 	
 	// Test I: Attemtp to create a table
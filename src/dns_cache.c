@@ -30,14 +30,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <mysql.h>
+#include <time.h>
 #include "ipta.h"
 
 int dns_dump_cache(struct ipta_db_info *db)
 {
-	MYSQL *con = NULL;
-	MYSQL_RES *result = NULL;
-	MYSQL_ROW row = 0;
+	struct ipta_db *con = NULL;
+	struct ipta_db_result *result = NULL;
+	char **row = 0;
 	int retval = RETVAL_OK;
 	char *query = NULL;
 
@@ -56,25 +56,25 @@ int dns_dump_cache(struct ipta_db_info *db)
 	sprintf(query,
 		"SELECT INET_NTOA(ip),host FROM %s ORDER BY ip;",
 		db->table);
-	if(mysql_query(con, query)) {
-		fprintf(stderr, "! Error: %s\n", mysql_error(con));
+	if(db_query(con, query)) {
+		fprintf(stderr, "! Error: %s\n", db_error(con));
 		goto clean_exit;
 	}
-	result = mysql_store_result(con);
+	result = db_store_result(con);
 
 	// Produce output for the results, row by row
-	while((row = mysql_fetch_row(result))) 
+	while((row = db_fetch_row(result))) 
 		// Filter out those that are just ip numbers and do not reverse
 		if(strcmp(row[0], row[1]))
 			printf("%20s    %-50s\n", row[0], row[1]);
-	mysql_free_result(result);
+	db_free_result(result);
 	result = NULL;
 
 clean_exit:
 	if(con)
-		mysql_close(con);
+		db_close(con);
 	if(result)
-		mysql_free_result(result);
+		db_free_result(result);
 	if(query)
 		free(query);
 
@@ -91,7 +91,7 @@ clean_exit:
 int dns_cache_create_table(struct ipta_db_info *db) 
 {
 	char *query_string = NULL;
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	int retval = RETVAL_OK;
 	
 	query_string = calloc(1, QUERY_STRING_SIZE);
@@ -110,16 +110,16 @@ int dns_cache_create_table(struct ipta_db_info *db)
 	// Create the query needed to create the database table
 	sprintf(query_string, 
 		"CREATE TABLE %s ("		      \
-		"ip INT(10) UNSIGNED PRIMARY KEY NOT NULL,"	\
+		"ip %s PRIMARY KEY NOT NULL,"	\
 		"host VARCHAR(256) DEFAULT NULL,"		\
 		"ttl TIMESTAMP);",
-		db->table);
+		db->table, con->backend->unsigned_column);
 	
 	// Attempt to create the table
-	if(mysql_query(con, query_string)) {
+	if(db_query(con, query_string)) {
 		fprintf(stderr, 
 			"! Unable to create table.\n"	\
-			"  Error: %s\n", mysql_error(con));
+			"  Error: %s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -134,7 +134,7 @@ int dns_cache_create_table(struct ipta_db_info *db)
 clean_exit:
 	free(query_string);
 	if(con) 
-		mysql_close(con);
+		db_close(con);
 
 	return retval;
 }
@@ -149,7 +149,7 @@ clean_exit:
 int dns_cache_add(struct ipta_db_info *db, char *ip_address, char *hostname) 
 {
 	char *query_string = NULL;
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	int retval = 0;
 	
 	query_string = calloc(1,QUERY_STRING_SIZE);
@@ -161,8 +161,8 @@ int dns_cache_add(struct ipta_db_info *db, char *ip_address, char *hostname)
 	/* Initialize databse object */
 	con = open_db(db);
 	if(con == NULL) {
-		printf("! Unable to initialize MySQL connection.\n");
-		printf("  Error message: %s\n", mysql_error(con));
+		printf("! Unable to initialize database connection.\n");
+		printf("  Error message: %s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -173,10 +173,10 @@ int dns_cache_add(struct ipta_db_info *db, char *ip_address, char *hostname)
 		"INET_ATON('%s'), '%s', now());",
 		db->table, ip_address, hostname);
 	
-	if(mysql_query(con, query_string)) {
+	if(db_query(con, query_string)) {
 		fprintf(stderr, 
 			"! Unable to perform insertion in to table.\n"	\
-			"  Error: %s\n", mysql_error(con));
+			"  Error: %s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -184,7 +184,7 @@ int dns_cache_add(struct ipta_db_info *db, char *ip_address, char *hostname)
 clean_exit:
 	free(query_string);
 	if(con)
-		mysql_close(con);
+		db_close(con);
 	return retval;
 }
 
@@ -212,10 +212,10 @@ int dns_cache_get(struct ipta_db_info *db, char *ip_address,
 		  char *hostname, char *ttl) 
 {
 	char *query_string = NULL;
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	int retval = RETVAL_OK;
-	MYSQL_RES *result = NULL;
-	MYSQL_ROW row = 0;
+	struct ipta_db_result *result = NULL;
+	char **row = 0;
 	
 	// Allocate memory
 	query_string = malloc(QUERY_STRING_SIZE);
@@ -228,8 +228,8 @@ int dns_cache_get(struct ipta_db_info *db, char *ip_address,
 	// Initialize databse object
 	con = open_db(db);
 	if(con == NULL) {
-		printf("! Unable to initialize MySQL connection.\n");
-		printf("  Error message: %s\n", mysql_error(con));
+		printf("! Unable to initialize database connection.\n");
+		printf("  Error message: %s\n", db_error(con));
 		retval = 20;
 		goto clean_exit;
 	}
@@ -238,18 +238,18 @@ int dns_cache_get(struct ipta_db_info *db, char *ip_address,
 	sprintf(query_string,
 		"SELECT host FROM %s "			\
 		"WHERE ip=INET_ATON('%s') "		\
-		"AND ttl > NOW() - INTERVAL '%s' HOUR;",
-		db->table, ip_address, ttl);
-	if(mysql_query(con, query_string)) {
+		"AND ttl > FROM_UNIXTIME(%ld);",
+		db->table, ip_address, (long)time(NULL) - atol(ttl) * 3600L);
+	if(db_query(con, query_string)) {
 		fprintf(stderr, 
 			"! Querying database failed.\n"
-			"  Error: %s\n", mysql_error(con));
+			"  Error: %s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
 	
-	result = mysql_store_result(con);
-	row = mysql_fetch_row(result);
+	result = db_store_result(con);
+	row = db_fetch_row(result);
 	if(row)  {
 		strcpy(hostname, row[0]);
 		retval = RETVAL_OK;
@@ -262,9 +262,9 @@ clean_exit:
 	if(query_string)
 		free(query_string);
 	if(result)
-		mysql_free_result(result);
+		db_free_result(result);
 	if(con)
-		mysql_close(con);
+		db_close(con);
 	
 	return retval;
 	
@@ -293,14 +293,14 @@ clean_exit:
  ***********************************************************************/
 int dns_cache_prune(struct ipta_db_info *db, int ttl) 
 { 
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	int retval = RETVAL_OK;
 	char *query = NULL;
 	
 	con = open_db(db);
 	if(!con) {
 		fprintf(stderr, "! Unable to open database.\n" \
-			"  Error: %s", mysql_error(con));
+			"  Error: %s", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -314,11 +314,11 @@ int dns_cache_prune(struct ipta_db_info *db, int ttl)
 
 	sprintf(query, 
 		"DELETE FROM %s "			\
-		"WHERE ttl < NOW() - INTERVAL '%d' HOUR;",
-		db->table, ttl);
+		"WHERE ttl < FROM_UNIXTIME(%ld);",
+		db->table, (long)time(NULL) - ttl * 3600L);
 
-	if(mysql_query(con, query)) {
-		fprintf(stderr, "! Error: %s\n", mysql_error(con));
+	if(db_query(con, query)) {
+		fprintf(stderr, "! Error: %s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -328,7 +328,7 @@ int dns_cache_prune(struct ipta_db_info *db, int ttl)
 clean_exit:
 	free(query);
 	if(con)
-		mysql_close(con);
+		db_close(con);
 
 	return retval;
 }
@@ -339,14 +339,14 @@ clean_exit:
  **********************************************************************/
 int dns_cache_delete_table(struct ipta_db_info *db) 
 {
-	MYSQL *con = NULL;
+	struct ipta_db *con = NULL;
 	int retval = RETVAL_OK;
 	char *query = NULL;
 	
 	con = open_db(db);
 	if(!con) {
 		fprintf(stderr, "! Unable to open database.\n" \
-			"  Error: %s", mysql_error(con));
+			"  Error: %s", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -362,8 +362,8 @@ int dns_cache_delete_table(struct ipta_db_info *db)
 		"DELETE * FROM %s;",
 		db->table);
 
-	if(mysql_query(con, query)) {
-		fprintf(stderr, "! Error: %s\n", mysql_error(con));
+	if(db_query(con, query)) {
+		fprintf(stderr, "! Error: %s\n", db_error(con));
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
@@ -373,7 +373,7 @@ int dns_cache_delete_table(struct ipta_db_info *db)
 clean_exit:
 	free(query);
 	if(con)
-		mysql_close(con);
+		db_close(con);
 
 	return retval;
 }
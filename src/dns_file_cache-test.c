@@ -0,0 +1,131 @@
+/***********************************************************************
+ * dns_file_cache-test.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * Test framework for the file backed dns cache, not needed to compile
+ * the tools, just the test for the dns cache file. Needs no database.
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "ipta.h"
+
+int main(int argc, char *argv[])
+{
+	char filename[] = "/tmp/ipta-dns-file-test.XXXXXX";
+	char hostname[HOSTNAME_MAX_LEN];
+	char ip_address[32];
+	int fd;
+	int i, found;
+	int errors = 0;
+
+	printf("* Unit tests for the DNS cache file of ipta.\n\n");
+
+	fd = mkstemp(filename);
+	if(fd < 0) {
+		fprintf(stderr, "! Test error, unable to create a temporary file.\n");
+		return RETVAL_ERROR;
+	}
+	close(fd);
+	unlink(filename);
+
+	// Test I: Create a new cache file
+	fprintf(stderr, "* Test I: Create cache file.\n");
+	if(dns_file_cache_open(filename, 24) != RETVAL_OK) {
+		fprintf(stderr, "! Test error, unable to create the cache file.\n");
+		return RETVAL_ERROR;
+	}
+	fprintf(stderr, "  Success.\n");
+
+	// Test II: Insert and look up a record
+	fprintf(stderr, "* Test II: Insert and look up a record.\n");
+	dns_file_cache_add("10.0.0.1", "fake-hostname.tld");
+	if(dns_file_cache_get("10.0.0.1", hostname, 30) == RETVAL_OK &&
+	   !strcmp(hostname, "fake-hostname.tld")) {
+		fprintf(stderr, "  Success.\n");
+	} else {
+		fprintf(stderr, "! Error, record not found.\n");
+		errors++;
+	}
+
+	// Test III: A missing record is a miss
+	fprintf(stderr, "* Test III: Look up a non-existent record.\n");
+	if(dns_file_cache_get("10.42.0.1", hostname, 30) == RETVAL_WARN) {
+		fprintf(stderr, "  Success.\n");
+	} else {
+		fprintf(stderr, "! Error, found a record that was never added.\n");
+		errors++;
+	}
+
+	// Test IV: Long names are trimmed from the front
+	fprintf(stderr, "* Test IV: Long names are trimmed.\n");
+	dns_file_cache_add("10.0.0.2", "a-very-long-host-name.in.a.deep.sub.domain.example.org");
+	if(dns_file_cache_get("10.0.0.2", hostname, 20) == RETVAL_OK &&
+	   strlen(hostname) == 20 && hostname[0] == '*') {
+		fprintf(stderr, "  Success, got %s\n", hostname);
+	} else {
+		fprintf(stderr, "! Error, got %s\n", hostname);
+		errors++;
+	}
+
+	// Test V: Fill well beyond the size and make sure recent
+	// records are still found
+	fprintf(stderr, "* Test V: Insert %d records.\n", 2 * DNS_FILE_SLOTS);
+	for(i = 0; i < 2 * DNS_FILE_SLOTS; i++) {
+		sprintf(ip_address, "10.%d.%d.%d", (i >> 16) & 255, (i >> 8) & 255, i & 255);
+		dns_file_cache_add(ip_address, ip_address);
+	}
+	found = 0;
+	for(i = 2 * DNS_FILE_SLOTS - 1000; i < 2 * DNS_FILE_SLOTS; i++) {
+		sprintf(ip_address, "10.%d.%d.%d", (i >> 16) & 255, (i >> 8) & 255, i & 255);
+		if(dns_file_cache_get(ip_address, hostname, 30) == RETVAL_OK &&
+		   !strcmp(hostname, ip_address))
+			found++;
+	}
+	if(found >= 900) {
+		fprintf(stderr, "  Success, %d of the last 1000 found.\n", found);
+	} else {
+		fprintf(stderr, "! Error, only %d of the last 1000 found.\n", found);
+		errors++;
+	}
+
+	// Test VI: Records survive closing and opening the file
+	fprintf(stderr, "* Test VI: Reopen the cache file.\n");
+	dns_file_cache_add("10.0.0.1", "fake-hostname.tld");
+	dns_file_cache_close();
+	if(dns_file_cache_open(filename, 24) == RETVAL_OK &&
+	   dns_file_cache_get("10.0.0.1", hostname, 30) == RETVAL_OK &&
+	   !strcmp(hostname, "fake-hostname.tld")) {
+		fprintf(stderr, "  Success.\n");
+	} else {
+		fprintf(stderr, "! Error, record lost after reopen.\n");
+		errors++;
+	}
+
+	dns_file_cache_close();
+	unlink(filename);
+
+	fprintf(stderr, "* %d errors.\n", errors);
+	return errors ? RETVAL_ERROR : RETVAL_OK;
+}
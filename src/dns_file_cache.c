@@ -0,0 +1,466 @@
+/**********************************************************************
+ * dns_file_cache.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * File backed DNS cache
+ *
+ * For hosts without a database the name cache can live in a plain
+ * file instead of the dns table. The file is a fixed size hash table
+ * that is mmap()ed, so a lookup is a few memory reads and the cache
+ * survives restarts.
+ *
+ * Layout: a header followed by DNS_FILE_SLOTS slots. Each slot holds
+ * an IPv4 address, the time the entry expires and the host name. An
+ * address is stored in one of the DNS_FILE_PROBE slots following its
+ * hash position.
+ *
+ * Readers do not lock. Every slot has a sequence number that is odd
+ * while the slot is being written, a reader copies the slot and
+ * retries if the sequence was odd or changed meanwhile. Writers
+ * serialize with flock() so several ipta processes can share the
+ * file.
+ ***********************************************************************/
+
+#define DNS_FILE_MAGIC 0x49444e53      /* "IDNS" */
+#define DNS_FILE_VERSION 1
+
+struct dns_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t name_len;
+	char pad[48];
+};
+
+struct dns_file_slot {
+	uint32_t seq;
+	uint32_t ip;                     /* Network byte order, 0 is empty */
+	int64_t expires;                 /* Unix time */
+	char name[DNS_FILE_NAME_LEN];
+};
+
+struct dns_file_cache {
+	int fd;
+	size_t size;
+	int ttl;
+	struct dns_file_header *header;
+	struct dns_file_slot *slot;
+	pthread_mutex_t lock;            /* Writers within this process */
+};
+
+static struct dns_file_cache *cache = NULL;
+
+static uint32_t dns_file_hash(uint32_t ip)
+{
+	// Mix all bits, the low bytes of an address in network order
+	// are the network part and vary very little.
+	ip ^= ip >> 16;
+	ip *= 0x85ebca6bU;
+	ip ^= ip >> 13;
+	ip *= 0xc2b2ae35U;
+	ip ^= ip >> 16;
+	return ip % DNS_FILE_SLOTS;
+}
+
+/***********************************************************************
+ * dns_file_cache_open
+ *
+ * Opens, or creates, the cache file and maps it. Entries added later
+ * are valid for ttl hours.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int dns_file_cache_open(char *filename, int ttl)
+{
+	struct stat st;
+	struct dns_file_header header;
+	size_t size = sizeof(struct dns_file_header) +
+		DNS_FILE_SLOTS * sizeof(struct dns_file_slot);
+	int fd = -1;
+
+	if(cache)
+		return RETVAL_OK;
+
+	fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if(fd < 0) {
+		fprintf(stderr, "! Error, unable to open DNS cache file %s.\n", filename);
+		return RETVAL_ERROR;
+	}
+
+	// A new file gets its header written under the lock so two
+	// processes starting at once do not both initialize it.
+	flock(fd, LOCK_EX);
+	if(fstat(fd, &st) || (st.st_size == 0 && ftruncate(fd, size))) {
+		fprintf(stderr, "! Error, unable to size DNS cache file %s.\n", filename);
+		goto error_exit;
+	}
+	if(st.st_size == 0) {
+		memset(&header, 0, sizeof(header));
+		header.magic = DNS_FILE_MAGIC;
+		header.version = DNS_FILE_VERSION;
+		header.slots = DNS_FILE_SLOTS;
+		header.name_len = DNS_FILE_NAME_LEN;
+		if(pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+			fprintf(stderr, "! Error, unable to write DNS cache file %s.\n", filename);
+			goto error_exit;
+		}
+	} else if(st.st_size != size) {
+		fprintf(stderr, "! Error, %s is not an ipta DNS cache file.\n", filename);
+		goto error_exit;
+	}
+	flock(fd, LOCK_UN);
+
+	cache = calloc(1, sizeof(struct dns_file_cache));
+	if(!cache) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		goto error_exit;
+	}
+
+	cache->header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(cache->header == MAP_FAILED) {
+		fprintf(stderr, "! Error, unable to map DNS cache file %s.\n", filename);
+		free(cache);
+		cache = NULL;
+		goto error_exit;
+	}
+
+	if(cache->header->magic != DNS_FILE_MAGIC ||
+	   cache->header->version != DNS_FILE_VERSION ||
+	   cache->header->slots != DNS_FILE_SLOTS ||
+	   cache->header->name_len != DNS_FILE_NAME_LEN) {
+		fprintf(stderr, "! Error, %s is not an ipta DNS cache file.\n", filename);
+		munmap(cache->header, size);
+		free(cache);
+		cache = NULL;
+		goto error_exit;
+	}
+
+	cache->fd = fd;
+	cache->size = size;
+	cache->ttl = ttl;
+	cache->slot = (struct dns_file_slot *)(cache->header + 1);
+	pthread_mutex_init(&cache->lock, NULL);
+
+	return RETVAL_OK;
+
+error_exit:
+	flock(fd, LOCK_UN);
+	close(fd);
+	return RETVAL_ERROR;
+}
+
+/* Returns FLAG_SET if a cache file is in use */
+int dns_file_cache_active(void)
+{
+	return cache ? FLAG_SET : FLAG_CLEAR;
+}
+
+void dns_file_cache_close(void)
+{
+	if(!cache)
+		return;
+
+	munmap(cache->header, cache->size);
+	close(cache->fd);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+	cache = NULL;
+}
+
+/* Take a consistent copy of a slot */
+static void dns_file_read_slot(struct dns_file_slot *slot, struct dns_file_slot *copy)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		memcpy(copy, slot, sizeof(struct dns_file_slot));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while((seq & 1) || seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+	copy->name[DNS_FILE_NAME_LEN - 1] = '\0';
+}
+
+/***********************************************************************
+ * dns_file_cache_get
+ *
+ * Looks up an address in the cache file. The name is trimmed to
+ * maxlen the same way get_host_by_addr() does, but hostname must
+ * have room for DNS_FILE_NAME_LEN characters.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - name found and written to hostname
+ *
+ * 	RETVAL_WARN - not in the cache or expired, hostname is empty
+ ***********************************************************************/
+int dns_file_cache_get(char *ip_address, char *hostname, int maxlen)
+{
+	struct dns_file_slot copy;
+	struct in_addr addr;
+	time_t now = time(NULL);
+	uint32_t i, idx;
+
+	hostname[0] = '\0';
+	if(!cache || inet_pton(AF_INET, ip_address, &addr) != 1 || addr.s_addr == 0)
+		return RETVAL_WARN;
+
+	for(i = 0; i < DNS_FILE_PROBE; i++) {
+		idx = (dns_file_hash(addr.s_addr) + i) % DNS_FILE_SLOTS;
+		dns_file_read_slot(&cache->slot[idx], &copy);
+		if(copy.ip != addr.s_addr)
+			continue;
+		if(copy.expires < now)
+			return RETVAL_WARN;
+		strcpy(hostname, copy.name);
+		dns_host_trim(hostname, maxlen);
+		return RETVAL_OK;
+	}
+
+	return RETVAL_WARN;
+}
+
+/* Write an entry with a known expiry time, used by add and import */
+static int dns_file_cache_put(uint32_t ip, char *hostname, time_t expires)
+{
+	struct dns_file_slot *slot = NULL;
+	struct dns_file_slot *victim = NULL;
+	struct dns_file_slot *free_slot = NULL;
+	struct dns_file_slot *oldest = NULL;
+	time_t now = time(NULL);
+	uint32_t i, idx;
+	size_t len;
+
+	if(!cache || ip == 0)
+		return RETVAL_ERROR;
+
+	pthread_mutex_lock(&cache->lock);
+	flock(cache->fd, LOCK_EX);
+
+	// Same address, else a free or expired slot, else the one
+	// closest to expiry is replaced.
+	for(i = 0; i < DNS_FILE_PROBE; i++) {
+		idx = (dns_file_hash(ip) + i) % DNS_FILE_SLOTS;
+		slot = &cache->slot[idx];
+		if(slot->ip == ip) {
+			victim = slot;
+			break;
+		}
+		if(slot->ip == 0 || slot->expires < now) {
+			if(!free_slot)
+				free_slot = slot;
+			continue;
+		}
+		if(!oldest || slot->expires < oldest->expires)
+			oldest = slot;
+	}
+	if(!victim)
+		victim = free_slot ? free_slot : oldest;
+
+	__atomic_add_fetch(&victim->seq, 1, __ATOMIC_ACQ_REL);
+	victim->ip = ip;
+	victim->expires = expires;
+
+	// Keep the end of long names, like dns_host_trim() does
+	len = strlen(hostname);
+	if(len > DNS_FILE_NAME_LEN - 1)
+		hostname += len - (DNS_FILE_NAME_LEN - 1);
+	strncpy(victim->name, hostname, DNS_FILE_NAME_LEN - 1);
+	victim->name[DNS_FILE_NAME_LEN - 1] = '\0';
+	__atomic_add_fetch(&victim->seq, 1, __ATOMIC_RELEASE);
+
+	flock(cache->fd, LOCK_UN);
+	pthread_mutex_unlock(&cache->lock);
+
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * dns_file_cache_add
+ *
+ * Adds or replaces a record. As with the dns table an address
+ * without a name is stored with the address as its name.
+ ***********************************************************************/
+int dns_file_cache_add(char *ip_address, char *hostname)
+{
+	struct in_addr addr;
+
+	if(!cache || inet_pton(AF_INET, ip_address, &addr) != 1)
+		return RETVAL_ERROR;
+
+	return dns_file_cache_put(addr.s_addr, hostname,
+				  time(NULL) + (time_t)cache->ttl * 3600);
+}
+
+/***********************************************************************
+ * dns_file_cache_import
+ *
+ * Copies the entries of the dns table that are younger than the ttl
+ * into the cache file, keeping their age.
+ ***********************************************************************/
+int dns_file_cache_import(struct ipta_db_info *db)
+{
+	struct ipta_db *con = NULL;
+	struct ipta_db_result *result = NULL;
+	char **row;
+	char query[QUERY_STRING_SIZE];
+	int count = 0;
+	int retval = RETVAL_OK;
+
+	if(!cache) {
+		fprintf(stderr, "! Error, no DNS cache file given.\n");
+		return RETVAL_ERROR;
+	}
+
+	con = open_db(db);
+	if(!con)
+		return RETVAL_ERROR;
+
+	sprintf(query,
+		"SELECT ip, host, UNIX_TIMESTAMP(ttl) FROM %s "	\
+		"WHERE ttl > FROM_UNIXTIME(%ld);",
+		db->table, (long)time(NULL) - cache->ttl * 3600L);
+	if(db_query(con, query)) {
+		fprintf(stderr, "! Error: %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	result = db_use_result(con);
+	while(result && (row = db_fetch_row(result))) {
+		if(!row[0] || !row[1] || !row[2])
+			continue;
+		dns_file_cache_put(htonl(strtoul(row[0], NULL, 10)), row[1],
+				   strtol(row[2], NULL, 10) + (time_t)cache->ttl * 3600);
+		count++;
+	}
+
+	fprintf(stderr, "* %d entries copied from table %s to the DNS cache file.\n",
+		count, db->table);
+
+clean_exit:
+	if(result)
+		db_free_result(result);
+	db_close(con);
+	return retval;
+}
+
+/***********************************************************************
+ * dns_file_cache_export
+ *
+ * Writes all valid entries of the cache file to the dns table, in
+ * batches of multi-row REPLACE statements.
+ ***********************************************************************/
+int dns_file_cache_export(struct ipta_db_info *db)
+{
+	struct dns_file_slot copy;
+	struct in_addr addr;
+	struct ipta_db *con = NULL;
+	char *query = NULL;
+	char escaped[2 * DNS_FILE_NAME_LEN + 1];
+	char ip_address[INET_ADDRSTRLEN];
+	time_t now = time(NULL);
+	size_t qlen = 0;
+	int rows = 0, count = 0;
+	uint32_t i;
+	int retval = RETVAL_OK;
+
+	if(!cache) {
+		fprintf(stderr, "! Error, no DNS cache file given.\n");
+		return RETVAL_ERROR;
+	}
+
+	query = malloc(QUERY_STRING_SIZE);
+	if(!query) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+
+	con = open_db(db);
+	if(!con) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	for(i = 0; i <= DNS_FILE_SLOTS; i++) {
+		if(i < DNS_FILE_SLOTS) {
+			dns_file_read_slot(&cache->slot[i], &copy);
+			if(copy.ip == 0 || copy.expires < now)
+				continue;
+
+			addr.s_addr = copy.ip;
+			inet_ntop(AF_INET, &addr, ip_address, sizeof(ip_address));
+			db_escape(con, escaped, copy.name, strlen(copy.name));
+
+			if(rows == 0)
+				qlen = sprintf(query, "REPLACE INTO %s (ip, host, ttl) VALUES ",
+					       db->table);
+			qlen += sprintf(query + qlen,
+					"%s(INET_ATON('%s'), '%s', FROM_UNIXTIME(%lld))",
+					rows ? "," : "", ip_address, escaped,
+					(long long)copy.expires - (long long)cache->ttl * 3600);
+			rows++;
+			count++;
+		}
+
+		// Flush full batches and whatever is left at the end
+		if(rows && (i == DNS_FILE_SLOTS || rows == QUERY_ROW_COUNT)) {
+			strcat(query, ";");
+			if(db_query(con, query)) {
+				fprintf(stderr, "! Unable to insert into %s.\n"
+					"  Error: %s\n", db->table, db_error(con));
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			rows = 0;
+		}
+	}
+
+	fprintf(stderr, "* %d entries copied from the DNS cache file to table %s.\n",
+		count, db->table);
+
+clean_exit:
+	if(con)
+		db_close(con);
+	free(query);
+	return retval;
+}
@@ -0,0 +1,519 @@
+/**********************************************************************
+ * dns_prewarm.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ipta.h"
+
+#define PREWARM_BATCH_ROWS 100
+
+/* A growing array of IPv4 addresses in network byte order */
+struct ip_list {
+	unsigned int *ip;
+	int count;
+	int size;
+};
+
+struct prewarm_job {
+	struct ip_list *todo;
+	struct ipta_db_info *dns;
+	int next;                 /* Next index in todo to resolve */
+	int done;
+	int named;
+	int failed;
+	int retval;
+	int running;              /* Threads still working */
+	long long interval_ns;    /* Time between two lookups, 0 for no limit */
+	long long next_slot_ns;   /* When the next lookup may start */
+	pthread_mutex_t lock;
+};
+
+static int ip_list_add(struct ip_list *list, unsigned int ip)
+{
+	unsigned int *p = NULL;
+
+	if(list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 4096;
+		p = realloc(list->ip, list->size * sizeof(unsigned int));
+		if(!p)
+			return RETVAL_ERROR;
+		list->ip = p;
+	}
+	list->ip[list->count++] = ip;
+	return RETVAL_OK;
+}
+
+static int ip_compare(const void *a, const void *b)
+{
+	unsigned int x = ntohl(*(const unsigned int *)a);
+	unsigned int y = ntohl(*(const unsigned int *)b);
+
+	return (x > y) - (x < y);
+}
+
+/* Sort the list and drop the duplicates */
+static void ip_list_unique(struct ip_list *list)
+{
+	int i, n = 0;
+
+	if(list->count == 0)
+		return;
+
+	qsort(list->ip, list->count, sizeof(unsigned int), ip_compare);
+	for(i = 1; i < list->count; i++)
+		if(list->ip[i] != list->ip[n])
+			list->ip[++n] = list->ip[i];
+	list->count = n + 1;
+}
+
+/* Remove every address in fresh from list, both must be unique sorted */
+static void ip_list_subtract(struct ip_list *list, struct ip_list *fresh)
+{
+	int i, j = 0, n = 0;
+
+	for(i = 0; i < list->count; i++) {
+		while(j < fresh->count && ip_compare(&fresh->ip[j], &list->ip[i]) < 0)
+			j++;
+		if(j < fresh->count && fresh->ip[j] == list->ip[i])
+			continue;
+		list->ip[n++] = list->ip[i];
+	}
+	list->count = n;
+}
+
+/* Run a query returning a single integer column of addresses as
+ * INET_ATON() values and add them to the list */
+static int ip_list_from_query(struct ip_list *list, struct ipta_db *con, char *query)
+{
+	struct ipta_db_result *result = NULL;
+	char **row;
+
+	if(db_query(con, query)) {
+		fprintf(stderr, "! Query not accepted from database.\n"
+			"  Error: %s\n", db_error(con));
+		return RETVAL_ERROR;
+	}
+
+	// Stream the result, there may be millions of rows
+	result = db_use_result(con);
+	if(!result) {
+		fprintf(stderr, "! Error: %s\n", db_error(con));
+		return RETVAL_ERROR;
+	}
+
+	while((row = db_fetch_row(result))) {
+		if(!row[0])
+			continue;
+		if(ip_list_add(list, htonl(strtoul(row[0], NULL, 10)))) {
+			db_free_result(result);
+			fprintf(stderr, "! Error, memory allocation failed.\n");
+			return RETVAL_ERROR;
+		}
+	}
+	db_free_result(result);
+
+	return RETVAL_OK;
+}
+
+/* Pick out the SRC= and DST= addresses of every ipta line in a file */
+static int ip_list_from_file(struct ip_list *list, char *filename)
+{
+	FILE *logfile = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	char *p = NULL;
+	char *fields[] = { " SRC=", " DST=" };
+	char ip_address[INET_ADDRSTRLEN];
+	struct in_addr addr;
+	int i, n;
+	int retval = RETVAL_OK;
+
+	logfile = fopen(filename, "r");
+	if(!logfile) {
+		fprintf(stderr, "! Error, unable to open log file %s.\n", filename);
+		return RETVAL_ERROR;
+	}
+
+	while(getline(&line, &len, logfile) != -1) {
+		if(!strstr(line, IPTA_LINE_PREFIX))
+			continue;
+		for(i = 0; i < 2; i++) {
+			p = strstr(line, fields[i]);
+			if(!p)
+				continue;
+			p += strlen(fields[i]);
+			for(n = 0; n < INET_ADDRSTRLEN - 1 && p[n] && p[n] != ' '; n++)
+				ip_address[n] = p[n];
+			ip_address[n] = '\0';
+			if(inet_pton(AF_INET, ip_address, &addr) != 1)
+				continue;
+			if(ip_list_add(list, addr.s_addr)) {
+				fprintf(stderr, "! Error, memory allocation failed.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+		}
+	}
+
+clean_exit:
+	free(line);
+	fclose(logfile);
+	return retval;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Send the collected rows to the dns table in one statement */
+static int prewarm_flush(struct ipta_db *con, struct ipta_db_info *dns, char *query, int rows)
+{
+	long long start;
+	int i;
+
+	if(!rows)
+		return RETVAL_OK;
+
+	strcat(query, ";");
+	start = dns_stats_now();
+	if(db_query(con, query)) {
+		fprintf(stderr, "\n! Unable to insert into %s.\n"
+			"  Error: %s\n", dns->table, db_error(con));
+		for(i = 0; i < rows; i++)
+			dns_stats_count(DNS_STAT_CACHE_WRITE_FAIL);
+		return RETVAL_ERROR;
+	}
+	dns_stats_time(DNS_TIME_CACHE_ADD, start);
+	for(i = 0; i < rows; i++)
+		dns_stats_count(DNS_STAT_CACHE_WRITE);
+	return RETVAL_OK;
+}
+
+/* Flush a batch and count its rows as cached, or as not written */
+static int prewarm_done(struct prewarm_job *job, struct ipta_db *con, char *query,
+			int rows, int named)
+{
+	int retval;
+
+	retval = prewarm_flush(con, job->dns, query, rows);
+	pthread_mutex_lock(&job->lock);
+	if(retval) {
+		job->retval = RETVAL_ERROR;
+	} else {
+		job->named += named;
+		job->failed += rows - named;
+	}
+	pthread_mutex_unlock(&job->lock);
+	return retval;
+}
+
+static void *prewarm_thread(void *arg)
+{
+	struct prewarm_job *job = arg;
+	struct sockaddr_in ip4addr;
+	char host[NI_MAXHOST];
+	char escaped[2 * NI_MAXHOST + 1];
+	char ip_address[INET_ADDRSTRLEN];
+	char *query = NULL;
+	struct ipta_db *con = NULL;
+	long long slot, start;
+	struct timespec delay;
+	size_t qlen = 0;
+	int rows = 0, named = 0;
+	int idx, dns_reply;
+
+	db_thread_init();
+
+	// open_db() tells why it failed
+	query = malloc(QUERY_STRING_SIZE);
+	if(!query)
+		fprintf(stderr, "\n! Error, memory allocation failed.\n");
+	else
+		con = open_db(job->dns);
+	if(!query || !con) {
+		pthread_mutex_lock(&job->lock);
+		job->retval = RETVAL_ERROR;
+		pthread_mutex_unlock(&job->lock);
+		goto clean_exit;
+	}
+
+	while(1) {
+		// Take the next address and a time slot for it
+		pthread_mutex_lock(&job->lock);
+		idx = job->next;
+		if(idx < job->todo->count)
+			job->next++;
+		slot = now_ns();
+		if(job->interval_ns) {
+			if(job->next_slot_ns > slot)
+				slot = job->next_slot_ns;
+			job->next_slot_ns = slot + job->interval_ns;
+		}
+		pthread_mutex_unlock(&job->lock);
+
+		if(idx >= job->todo->count)
+			break;
+
+		// Rate limit, wait for our slot
+		slot -= now_ns();
+		if(slot > 0) {
+			delay.tv_sec = slot / 1000000000LL;
+			delay.tv_nsec = slot % 1000000000LL;
+			nanosleep(&delay, NULL);
+		}
+
+		memset(&ip4addr, 0, sizeof(struct sockaddr_in));
+		ip4addr.sin_family = AF_INET;
+		ip4addr.sin_addr.s_addr = job->todo->ip[idx];
+		inet_ntop(AF_INET, &ip4addr.sin_addr, ip_address, sizeof(ip_address));
+
+		start = dns_stats_now();
+		dns_reply = getnameinfo((struct sockaddr *) &ip4addr, sizeof(struct sockaddr_in),
+					host, NI_MAXHOST, NULL, 0, NI_NAMEREQD);
+		dns_stats_time(DNS_TIME_RESOLVE, start);
+		if(dns_reply == 0)
+			dns_stats_count(DNS_STAT_RESOLVE_OK);
+		else if(dns_reply == EAI_AGAIN)
+			dns_stats_count(DNS_STAT_RESOLVE_TIMEOUT);
+		else
+			dns_stats_count(DNS_STAT_RESOLVE_FAIL);
+
+		// Unresolvable addresses are cached with the address as
+		// the name, the same way get_host_by_addr() does it.
+		if(dns_reply)
+			strcpy(host, ip_address);
+		host[HOSTNAME_MAX_LEN - 1] = '\0';
+		db_escape(con, escaped, host, strlen(host));
+
+		if(rows == 0)
+			qlen = sprintf(query, "REPLACE INTO %s (ip, host, ttl) VALUES ",
+				       job->dns->table);
+		qlen += sprintf(query + qlen, "%s(INET_ATON('%s'), '%s', NOW())",
+				rows ? "," : "", ip_address, escaped);
+		rows++;
+		if(!dns_reply)
+			named++;
+
+		pthread_mutex_lock(&job->lock);
+		job->done++;
+		pthread_mutex_unlock(&job->lock);
+
+		if(rows == PREWARM_BATCH_ROWS ||
+		   qlen > QUERY_STRING_SIZE - 3 * HOSTNAME_MAX_LEN) {
+			// Stop this thread if the table can not be written,
+			// the next batch would most likely fail the same way
+			if(prewarm_done(job, con, query, rows, named))
+				break;
+			rows = 0;
+			named = 0;
+		}
+	}
+
+	if(rows)
+		prewarm_done(job, con, query, rows, named);
+
+clean_exit:
+	if(con)
+		db_close(con);
+	free(query);
+	pthread_mutex_lock(&job->lock);
+	job->running--;
+	pthread_mutex_unlock(&job->lock);
+	db_thread_end();
+	return NULL;
+}
+
+/***********************************************************************
+ * dns_cache_prewarm
+ *
+ * Fill the dns cache table ahead of time so a later --rdns analyze
+ * finds every name in the cache. The addresses are taken from the
+ * logs table, or from a log file if filename is not NULL. Addresses
+ * that already have an entry younger than ttl hours are skipped, the
+ * rest is resolved by a number of threads with at most rate lookups
+ * per second in total, and written to the dns table in batches.
+ *
+ * PARAMETERS
+ *
+ * 	struct ipta_db_info *db - the logs table
+ *
+ * 	struct ipta_db_info *dns - the dns cache table
+ *
+ * 	char *filename - log file to take addresses from, or NULL
+ *
+ * 	int ttl - hours a cached entry is considered fresh
+ *
+ * 	int threads - number of concurrent lookups
+ *
+ * 	int rate - maximum lookups per second, 0 for no limit
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int dns_cache_prewarm(struct ipta_db_info *db, struct ipta_db_info *dns,
+		      char *filename, int ttl, int threads, int rate)
+{
+	struct ip_list todo = { NULL, 0, 0 };
+	struct ip_list fresh = { NULL, 0, 0 };
+	struct prewarm_job job;
+	pthread_t tid[DNS_RESOLVER_MAX_THREADS];
+	struct ipta_db *con = NULL;
+	char *query = NULL;
+	time_t starttime = time(NULL);
+	int total = 0;
+	int i, running, started = 0;
+	int retval = RETVAL_OK;
+
+	if(threads < 1)
+		threads = 1;
+	if(threads > DNS_RESOLVER_MAX_THREADS)
+		threads = DNS_RESOLVER_MAX_THREADS;
+
+	query = malloc(QUERY_STRING_SIZE);
+	if(!query) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	// Collect the candidates
+	if(filename) {
+		retval = ip_list_from_file(&todo, filename);
+		if(retval)
+			goto clean_exit;
+	} else {
+		con = open_db(db);
+		if(!con) {
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		sprintf(query,
+			"SELECT src_ip FROM %s UNION SELECT dst_ip FROM %s;",
+			db->table, db->table);
+		retval = ip_list_from_query(&todo, con, query);
+		db_close(con);
+		con = NULL;
+		if(retval)
+			goto clean_exit;
+	}
+	ip_list_unique(&todo);
+	total = todo.count;
+
+	// Drop the ones that are still fresh in the cache
+	con = open_db(dns);
+	if(!con) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	sprintf(query,
+		"SELECT ip FROM %s WHERE ttl > FROM_UNIXTIME(%ld);",
+		dns->table, (long)time(NULL) - ttl * 3600L);
+	retval = ip_list_from_query(&fresh, con, query);
+	db_close(con);
+	con = NULL;
+	if(retval)
+		goto clean_exit;
+	ip_list_unique(&fresh);
+	ip_list_subtract(&todo, &fresh);
+
+	fprintf(stderr, "* %d addresses found, %d already cached, %d to resolve.\n",
+		total, total - todo.count, todo.count);
+	if(todo.count == 0)
+		goto clean_exit;
+
+	if(db_library_init()) {
+		fprintf(stderr, "! Error, unable to initialize the database library.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.todo = &todo;
+	job.dns = dns;
+	job.interval_ns = rate > 0 ? 1000000000LL / rate : 0;
+	job.running = threads;
+	pthread_mutex_init(&job.lock, NULL);
+
+	for(i = 0; i < threads; i++) {
+		if(pthread_create(&tid[i], NULL, prewarm_thread, &job)) {
+			pthread_mutex_lock(&job.lock);
+			job.running -= threads - i;
+			pthread_mutex_unlock(&job.lock);
+			break;
+		}
+		started++;
+	}
+	if(!started) {
+		fprintf(stderr, "! Error, unable to start resolver threads.\n");
+		pthread_mutex_destroy(&job.lock);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	// Show progress while the threads work
+	while(1) {
+		pthread_mutex_lock(&job.lock);
+		i = job.done;
+		running = job.running;
+		pthread_mutex_unlock(&job.lock);
+		fprintf(stderr, "- Resolved %d of %d addresses in %d seconds  \r",
+			i, todo.count, (int)(time(NULL) - starttime));
+		if(i >= todo.count || running == 0)
+			break;
+		sleep(1);
+	}
+
+	for(i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	fprintf(stderr, "\n* Done, %d names and %d addresses without name cached in %d seconds.\n",
+		job.named, job.failed, (int)(time(NULL) - starttime));
+	if(job.retval) {
+		fprintf(stderr, "! Error, %d of %d addresses were not cached.\n",
+			todo.count - job.named - job.failed, todo.count);
+		retval = RETVAL_ERROR;
+	}
+
+clean_exit:
+	free(todo.ip);
+	free(fresh.ip);
+	free(query);
+	return retval;
+}
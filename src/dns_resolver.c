@@ -0,0 +1,319 @@
+/**********************************************************************
+ * dns_resolver.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Background reverse DNS resolver
+ *
+ * The follow mode must never wait for a PTR lookup, a single slow
+ * name server would otherwise freeze the live display. Instead the
+ * follow loop asks dns_resolver_lookup() which only looks in a small
+ * in-memory table. If the name is known it is returned right away,
+ * if not the IP address is returned and the address is queued for
+ * one of the resolver threads. The threads use get_host_by_addr()
+ * so the database cache is used and updated as before, and when the
+ * answer arrives it is stored in the table so the next packet from
+ * the same address is shown with its name. An answer is used for
+ * RESOLVER_TTL seconds, an address without a name is tried again
+ * after RESOLVER_NEGATIVE_TTL, then it is looked up again.
+ ***********************************************************************/
+
+#define RESOLVER_TABLE_SIZE 4096      /* Must be a power of two */
+#define RESOLVER_QUEUE_SIZE 1024
+#define RESOLVER_MAX_PROBE 16
+#define RESOLVER_TTL 3600
+#define RESOLVER_NEGATIVE_TTL 300
+
+#define SLOT_EMPTY 0
+#define SLOT_PENDING 1
+#define SLOT_DONE 2
+#define SLOT_NEW 3                    /* Taken, not queued yet */
+
+struct resolver_slot {
+	unsigned int ip;
+	int state;
+	time_t expires;               /* When done, the name is used until then */
+	char name[HOSTNAME_MAX_LEN];
+};
+
+struct resolver {
+	struct resolver_slot *table;
+	unsigned int queue[RESOLVER_QUEUE_SIZE];
+	int queue_head;
+	int queue_len;
+	int running;
+	int nthreads;
+	pthread_t threads[DNS_RESOLVER_MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	struct ipta_db_info *db;
+};
+
+static struct resolver *res = NULL;
+
+static unsigned int resolver_hash(unsigned int ip)
+{
+	// Fibonacci hashing spreads consecutive addresses nicely
+	return (ip * 2654435769U) >> 20;
+}
+
+/* Find the slot for an address, or a free one to use for it. Returns
+ * NULL if the probe sequence is full. Caller must hold the lock. */
+static struct resolver_slot *resolver_slot(unsigned int ip, int create)
+{
+	struct resolver_slot *slot = NULL;
+	struct resolver_slot *victim = NULL;
+	unsigned int i, idx;
+
+	for(i = 0; i < RESOLVER_MAX_PROBE; i++) {
+		idx = (resolver_hash(ip) + i) & (RESOLVER_TABLE_SIZE - 1);
+		slot = &res->table[idx];
+		if(slot->state != SLOT_EMPTY && slot->ip == ip)
+			return slot;
+		if(slot->state == SLOT_EMPTY) {
+			if(!create)
+				return NULL;
+			slot->ip = ip;
+			slot->state = SLOT_NEW;
+			return slot;
+		}
+		if(!victim && slot->state != SLOT_PENDING)
+			victim = slot;
+	}
+
+	if(!create || !victim)
+		return NULL;
+
+	// Neighbourhood is full, take over the first slot that has no
+	// lookup in flight. It is never made empty, an empty slot would
+	// end the probe for the addresses stored after it.
+	victim->ip = ip;
+	victim->state = SLOT_NEW;
+	return victim;
+}
+
+static void *resolver_thread(void *arg)
+{
+	struct resolver_slot *slot = NULL;
+	struct in_addr addr;
+	char ip_address[INET_ADDRSTRLEN];
+	char hostname[HOSTNAME_MAX_LEN];
+	unsigned int ip;
+	int found;
+
+	db_thread_init();
+
+	pthread_mutex_lock(&res->lock);
+	while(res->running) {
+		if(res->queue_len == 0) {
+			pthread_cond_wait(&res->wakeup, &res->lock);
+			continue;
+		}
+
+		ip = res->queue[res->queue_head];
+		res->queue_head = (res->queue_head + 1) % RESOLVER_QUEUE_SIZE;
+		res->queue_len--;
+		pthread_mutex_unlock(&res->lock);
+
+		// The slow part, done without holding the lock
+		addr.s_addr = ip;
+		inet_ntop(AF_INET, &addr, ip_address, sizeof(ip_address));
+		found = !get_host_by_addr(ip_address, hostname, HOSTNAME_MAX_LEN - 1, res->db);
+		if(!found)
+			strcpy(hostname, ip_address);
+
+		pthread_mutex_lock(&res->lock);
+		slot = resolver_slot(ip, 0);
+		if(slot) {
+			strcpy(slot->name, hostname);
+			slot->expires = time(NULL) + (found ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+			slot->state = SLOT_DONE;
+		}
+	}
+	pthread_mutex_unlock(&res->lock);
+
+	db_thread_end();
+	return NULL;
+}
+
+/***********************************************************************
+ * dns_resolver_start
+ *
+ * Starts the resolver threads. The database info is used by the
+ * threads for the dns cache table and must stay valid until
+ * dns_resolver_stop() has returned.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int dns_resolver_start(struct ipta_db_info *db, int threads)
+{
+	int i;
+
+	if(res)
+		return RETVAL_OK;
+
+	if(threads < 1)
+		threads = 1;
+	if(threads > DNS_RESOLVER_MAX_THREADS)
+		threads = DNS_RESOLVER_MAX_THREADS;
+
+	// Must be done before any thread touches the client library
+	if(db_library_init()) {
+		fprintf(stderr, "! Error, unable to initialize the database library.\n");
+		return RETVAL_ERROR;
+	}
+
+	res = calloc(1, sizeof(struct resolver));
+	if(!res) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+
+	res->table = calloc(RESOLVER_TABLE_SIZE, sizeof(struct resolver_slot));
+	if(!res->table) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		free(res);
+		res = NULL;
+		return RETVAL_ERROR;
+	}
+
+	res->db = db;
+	res->running = 1;
+	pthread_mutex_init(&res->lock, NULL);
+	pthread_cond_init(&res->wakeup, NULL);
+
+	for(i = 0; i < threads; i++) {
+		if(pthread_create(&res->threads[i], NULL, resolver_thread, NULL)) {
+			fprintf(stderr, "! Warning, only %d resolver threads started.\n", i);
+			break;
+		}
+	}
+	res->nthreads = i;
+
+	if(res->nthreads == 0) {
+		dns_resolver_stop();
+		return RETVAL_ERROR;
+	}
+
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * dns_resolver_lookup
+ *
+ * Never blocks on the network. Writes the host name to hostname if it
+ * is already known, otherwise the IP address itself is written and
+ * the address is handed to the background resolver.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - the name was known and written to hostname
+ *
+ * 	RETVAL_NONAME - the address was written, name may come later
+ ***********************************************************************/
+int dns_resolver_lookup(char *ip_address, char *hostname, int maxlen)
+{
+	struct resolver_slot *slot = NULL;
+	struct in_addr addr;
+	int retval = RETVAL_NONAME;
+
+	strncpy(hostname, ip_address, maxlen);
+	hostname[maxlen] = '\0';
+
+	if(!res || inet_pton(AF_INET, ip_address, &addr) != 1)
+		return RETVAL_NONAME;
+
+	pthread_mutex_lock(&res->lock);
+	slot = resolver_slot(addr.s_addr, 1);
+	if(slot && slot->state == SLOT_DONE && slot->expires < time(NULL))
+		slot->state = SLOT_NEW;
+	if(slot) {
+		switch(slot->state) {
+		case SLOT_DONE:
+			strncpy(hostname, slot->name, HOSTNAME_MAX_LEN - 1);
+			hostname[HOSTNAME_MAX_LEN - 1] = '\0';
+			dns_host_trim(hostname, maxlen);
+			retval = RETVAL_OK;
+			break;
+		case SLOT_NEW:
+			// Queue it, if the queue is full we just try again
+			// the next time the address shows up.
+			if(res->queue_len < RESOLVER_QUEUE_SIZE) {
+				res->queue[(res->queue_head + res->queue_len) % RESOLVER_QUEUE_SIZE] =
+					addr.s_addr;
+				res->queue_len++;
+				slot->state = SLOT_PENDING;
+				pthread_cond_signal(&res->wakeup);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	pthread_mutex_unlock(&res->lock);
+
+	return retval;
+}
+
+/***********************************************************************
+ * dns_resolver_stop
+ *
+ * Stops the resolver threads and frees the name table. Lookups that
+ * are still in progress are allowed to finish first.
+ ***********************************************************************/
+void dns_resolver_stop(void)
+{
+	int i;
+
+	if(!res)
+		return;
+
+	pthread_mutex_lock(&res->lock);
+	res->running = 0;
+	pthread_cond_broadcast(&res->wakeup);
+	pthread_mutex_unlock(&res->lock);
+
+	for(i = 0; i < res->nthreads; i++)
+		pthread_join(res->threads[i], NULL);
+
+	pthread_mutex_destroy(&res->lock);
+	pthread_cond_destroy(&res->wakeup);
+	free(res->table);
+	free(res);
+	res = NULL;
+}
@@ -0,0 +1,227 @@
+/**********************************************************************
+ * dns_stats.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * DNS cache instrumentation
+ *
+ * Counters for what happens to every reverse lookup and latency
+ * histograms for the cache and the resolver. The histograms have
+ * power of two buckets in microseconds, bucket n counts the calls
+ * that took less than 2^n us. Updates are atomic since the lookups
+ * are done from the resolver threads.
+ ***********************************************************************/
+
+#define DNS_STATS_BUCKETS 24     /* Up to 2^23 us, about 8 seconds */
+
+static unsigned long dns_counter[DNS_STAT_COUNT];
+static unsigned long dns_histogram[DNS_TIME_COUNT][DNS_STATS_BUCKETS];
+static unsigned long long dns_total_us[DNS_TIME_COUNT];
+
+static const char *dns_counter_name[DNS_STAT_COUNT] = {
+	"Cache hits",
+	"Cache negative hits",
+	"Cache misses",
+	"Resolver names found",
+	"Resolver failures",
+	"Resolver timeouts",
+	"Cache writes",
+	"Cache write failures"
+};
+
+static const char *dns_time_name[DNS_TIME_COUNT] = {
+	"Cache lookup",
+	"Resolver lookup",
+	"Cache write"
+};
+
+/* Microseconds on a monotonic clock */
+long long dns_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void dns_stats_count(int counter)
+{
+	if(counter >= 0 && counter < DNS_STAT_COUNT)
+		__atomic_add_fetch(&dns_counter[counter], 1, __ATOMIC_RELAXED);
+}
+
+/* Add the time since start, as given by dns_stats_now(), to a histogram */
+void dns_stats_time(int histogram, long long start)
+{
+	long long us = dns_stats_now() - start;
+	int bucket = 0;
+
+	if(histogram < 0 || histogram >= DNS_TIME_COUNT)
+		return;
+
+	while(bucket < DNS_STATS_BUCKETS - 1 && us >= (1LL << bucket))
+		bucket++;
+
+	__atomic_add_fetch(&dns_histogram[histogram][bucket], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dns_total_us[histogram], us, __ATOMIC_RELAXED);
+}
+
+/* Approximate percentile from a histogram, upper bucket bound in us */
+static long long dns_stats_percentile(unsigned long *hist, unsigned long total, int percent)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for(i = 0; i < DNS_STATS_BUCKETS; i++) {
+		sum += hist[i];
+		if(sum * 100 >= total * percent)
+			return 1LL << i;
+	}
+	return 1LL << (DNS_STATS_BUCKETS - 1);
+}
+
+/***********************************************************************
+ * dns_stats_print
+ *
+ * Prints the counters and a summary of the latency histograms of this
+ * process to the given stream.
+ ***********************************************************************/
+void dns_stats_print(FILE *out)
+{
+	unsigned long hist[DNS_STATS_BUCKETS];
+	unsigned long lookups, misses, total;
+	int i, j;
+
+	misses = __atomic_load_n(&dns_counter[DNS_STAT_CACHE_MISS], __ATOMIC_RELAXED);
+	lookups = __atomic_load_n(&dns_counter[DNS_STAT_CACHE_HIT], __ATOMIC_RELAXED) +
+		__atomic_load_n(&dns_counter[DNS_STAT_CACHE_NEGATIVE], __ATOMIC_RELAXED) +
+		misses;
+
+	fprintf(out, "\nDNS cache statistics\n");
+	fprintf(out, "Counter                      Count\n");
+	fprintf(out, "------------------------- ----------\n");
+	for(i = 0; i < DNS_STAT_COUNT; i++)
+		fprintf(out, "%-25s %10lu\n", dns_counter_name[i],
+			__atomic_load_n(&dns_counter[i], __ATOMIC_RELAXED));
+	if(lookups)
+		fprintf(out, "%-25s %9.1f%%\n", "Hit rate",
+			100.0 * (lookups - misses) / lookups);
+
+	fprintf(out, "\nLatency             Calls    Avg us    p50 us    p90 us    p99 us\n");
+	fprintf(out, "--------------- --------- --------- --------- --------- ---------\n");
+	for(i = 0; i < DNS_TIME_COUNT; i++) {
+		total = 0;
+		for(j = 0; j < DNS_STATS_BUCKETS; j++) {
+			hist[j] = __atomic_load_n(&dns_histogram[i][j], __ATOMIC_RELAXED);
+			total += hist[j];
+		}
+		if(!total) {
+			fprintf(out, "%-15s %9d\n", dns_time_name[i], 0);
+			continue;
+		}
+		fprintf(out, "%-15s %9lu %9llu %9lld %9lld %9lld\n", dns_time_name[i], total,
+			__atomic_load_n(&dns_total_us[i], __ATOMIC_RELAXED) / total,
+			dns_stats_percentile(hist, total, 50),
+			dns_stats_percentile(hist, total, 90),
+			dns_stats_percentile(hist, total, 99));
+	}
+}
+
+/***********************************************************************
+ * dns_stats_report
+ *
+ * The --dns-stats action. Shows the counters of this run and the size
+ * and age distribution of the dns table.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int dns_stats_report(struct ipta_db_info *db)
+{
+	struct ipta_db *con = NULL;
+	struct ipta_db_result *result = NULL;
+	char **row;
+	char query[QUERY_STRING_SIZE];
+	long hour = 3600L, day = 24 * 3600L;
+	long now = (long)time(NULL);
+	const char *age_name[] = { "< 1 hour", "< 1 day", "< 7 days", "< 14 days",
+				   "< 30 days", ">= 30 days" };
+	int i;
+	int retval = RETVAL_OK;
+
+	dns_stats_print(stdout);
+
+	con = open_db(db);
+	if(!con)
+		return RETVAL_ERROR;
+
+	// The ages are worked out here, the SQL is then the same for
+	// all backends
+	sprintf(query,
+		"SELECT COUNT(*), SUM(host = INET_NTOA(ip)),"			\
+		" SUM(ttl >= FROM_UNIXTIME(%ld)),"				\
+		" SUM(ttl < FROM_UNIXTIME(%ld) AND ttl >= FROM_UNIXTIME(%ld)),"	\
+		" SUM(ttl < FROM_UNIXTIME(%ld) AND ttl >= FROM_UNIXTIME(%ld)),"	\
+		" SUM(ttl < FROM_UNIXTIME(%ld) AND ttl >= FROM_UNIXTIME(%ld)),"	\
+		" SUM(ttl < FROM_UNIXTIME(%ld) AND ttl >= FROM_UNIXTIME(%ld)),"	\
+		" SUM(ttl < FROM_UNIXTIME(%ld)) FROM %s;",
+		now - hour, now - hour, now - day, now - day, now - 7 * day,
+		now - 7 * day, now - 14 * day, now - 14 * day, now - 30 * day,
+		now - 30 * day, db->table);
+	if(db_query(con, query)) {
+		fprintf(stderr, "! Query not accepted from database.\n"
+			"  Error: %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	result = db_store_result(con);
+	row = result ? db_fetch_row(result) : NULL;
+	if(!row) {
+		fprintf(stderr, "! Error: %s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	printf("\nDNS table %s\n", db->table);
+	printf("Entries                   %10ld\n", row[0] ? atol(row[0]) : 0L);
+	printf("Without name              %10ld\n", row[1] ? atol(row[1]) : 0L);
+	printf("\nAge                          Count\n");
+	printf("------------------------- ----------\n");
+	for(i = 0; i < 6; i++)
+		printf("%-25s %10ld\n", age_name[i], row[i + 2] ? atol(row[i + 2]) : 0L);
+
+clean_exit:
+	if(result)
+		db_free_result(result);
+	db_close(con);
+	return retval;
+}
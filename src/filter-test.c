@@ -0,0 +1,181 @@
+/***********************************************************************
+ * filter-test.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * Tests for the --filter expressions, not needed to compile the tools.
+ * Needs no database.
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ipta.h"
+
+static struct ipta_record test_record(char *action, char *src, char *dst, char *proto,
+				      char *dpt)
+{
+	struct ipta_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.host = "fw1";
+	rec.action = action;
+	rec.if_in = "eth0";
+	rec.if_out = "";
+	rec.mac = "";
+	rec.src = src;
+	rec.dst = dst;
+	rec.proto = proto;
+	rec.src_port = "40000";
+	rec.dst_port = dpt;
+	return rec;
+}
+
+/* Compiles expr and checks what it says about rec */
+static int test_match(char *expr, struct ipta_record *rec, int expected)
+{
+	struct ipta_filter f;
+	int match;
+
+	if(filter_compile(&f, expr)) {
+		fprintf(stderr, "! Error, \"%s\" did not compile.\n", expr);
+		return 1;
+	}
+	match = filter_match(&f, rec);
+	filter_free(&f);
+	if(match != expected) {
+		fprintf(stderr, "! Error, \"%s\" gave %d, expected %d.\n", expr, match, expected);
+		return 1;
+	}
+	return 0;
+}
+
+static int test_sql(char *expr, char *expected)
+{
+	struct ipta_filter f;
+	char sql[FILTER_SQL_SIZE];
+	int errors = 0;
+
+	if(filter_compile(&f, expr)) {
+		fprintf(stderr, "! Error, \"%s\" did not compile.\n", expr);
+		return 1;
+	}
+	if(filter_sql(&f, sql, sizeof(sql)) || strcmp(sql, expected)) {
+		fprintf(stderr, "! Error, \"%s\" gave SQL\n  %s\n  expected\n  %s\n",
+			expr, sql, expected);
+		errors++;
+	}
+	filter_free(&f);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ipta_record drop = test_record("DROP", "192.0.2.1", "10.1.2.3", "TCP", "22");
+	struct ipta_record accept = test_record("ACCEPT", "10.0.0.5", "10.1.2.3", "UDP", "53");
+	struct ipta_record v6 = test_record("REJECT", "2001:db8::7", "2001:db8:1::1", "TCP", "3389");
+	struct ipta_filter f;
+	char *bad[] = { "", "action", "action ==", "src == 10.0.0.300", "src ~ 10.0.0.0/33",
+			"dpt < http", "proto < 10", "nosuchfield == 1", "dpt in {22, 23",
+			"(action == DROP", "action == DROP extra", "dpt == 70000",
+			"action == DR*P", NULL };
+	int errors = 0;
+	int n, i;
+
+	printf("* Unit tests for the filter expressions of ipta.\n\n");
+
+	// Test I: Comparisons of every kind of field
+	fprintf(stderr, "* Test I: Compare fields.\n");
+	n = 0;
+	n += test_match("action == DROP", &drop, FLAG_SET);
+	n += test_match("action = drop", &drop, FLAG_SET);
+	n += test_match("action != ACCEPT", &accept, FLAG_CLEAR);
+	n += test_match("proto ~ T*", &drop, FLAG_SET);
+	n += test_match("dpt < 1024", &drop, FLAG_SET);
+	n += test_match("dpt >= 1024", &drop, FLAG_CLEAR);
+	n += test_match("dpt in {22, 23, 3389}", &v6, FLAG_SET);
+	n += test_match("dpt in {1-21, 24-1023}", &drop, FLAG_CLEAR);
+	n += test_match("src ~ 10.0.0.0/8", &accept, FLAG_SET);
+	n += test_match("src !~ 10.0.0.0/8", &drop, FLAG_SET);
+	n += test_match("src == 192.0.2.1", &drop, FLAG_SET);
+	n += test_match("src ~ 192.0.2.0/25", &drop, FLAG_SET);
+	n += test_match("src ~ 192.0.2.128/25", &drop, FLAG_CLEAR);
+	n += test_match("src ~ 2001:db8::/32", &v6, FLAG_SET);
+	n += test_match("src ~ 2001:db8::/32", &drop, FLAG_CLEAR);
+	n += test_match("dst in {10.1.0.0/16, 2001:db8:1::/48}", &v6, FLAG_SET);
+	n += test_match("host == fw1 && in == eth0", &drop, FLAG_SET);
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test II: And, or, not and grouping
+	fprintf(stderr, "* Test II: Combine comparisons.\n");
+	n = 0;
+	n += test_match("action!=ACCEPT && dpt in {22,23,3389} && src !~ 10.0.0.0/8", &drop, FLAG_SET);
+	n += test_match("action!=ACCEPT && dpt in {22,23,3389} && src !~ 10.0.0.0/8", &accept, FLAG_CLEAR);
+	n += test_match("action == ACCEPT || dpt == 22", &drop, FLAG_SET);
+	n += test_match("!(action == ACCEPT || dpt == 22)", &drop, FLAG_CLEAR);
+	n += test_match("not proto == UDP and dpt > 1000", &v6, FLAG_SET);
+	n += test_match("action == DROP || action == ACCEPT && proto == TCP", &accept, FLAG_CLEAR);
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test III: Errors are found when compiling
+	fprintf(stderr, "* Test III: Refuse bad expressions.\n");
+	n = 0;
+	for(i = 0; bad[i]; i++) {
+		if(!filter_compile(&f, bad[i])) {
+			fprintf(stderr, "! Error, \"%s\" compiled.\n", bad[i]);
+			filter_free(&f);
+			n++;
+		}
+	}
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test IV: The same filters as SQL
+	fprintf(stderr, "* Test IV: Translate to SQL.\n");
+	n = 0;
+	n += test_sql("action != ACCEPT", "(action IS NULL OR NOT (action = 'ACCEPT'))");
+	n += test_sql("!(dpt == 22)", "NOT COALESCE((dst_prt BETWEEN 22 AND 22), FALSE)");
+	n += test_sql("dpt in {22, 1000-2000} && src ~ 10.0.0.0/8",
+		      "((dst_prt BETWEEN 22 AND 22 OR dst_prt BETWEEN 1000 AND 2000) AND "
+		      "(src_ip BETWEEN 167772160 AND 184549375))");
+	n += test_sql("in ~ eth* || dpt < 1024",
+		      "((if_in LIKE 'eth%' ESCAPE '!') OR dst_prt < 1024)");
+	if(!filter_compile(&f, "host == fw1")) {
+		char sql[FILTER_SQL_SIZE];
+
+		if(!filter_sql(&f, sql, sizeof(sql))) {
+			fprintf(stderr, "! Error, host was translated to SQL.\n");
+			n++;
+		}
+		filter_free(&f);
+	}
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	fprintf(stderr, "* %d errors.\n", errors);
+	return errors ? RETVAL_ERROR : RETVAL_OK;
+}
@@ -0,0 +1,859 @@
+/**********************************************************************
+ * filter.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#define _GNU_SOURCE               /* FNM_CASEFOLD */
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Filter expressions
+ *
+ * A small language to select packets, for example
+ *
+ * 	action != ACCEPT && dpt in {22, 23, 3389} && src !~ 10.0.0.0/8
+ *
+ * Comparisons are joined with && (and), || (or) and ! (not) and may
+ * be grouped with parentheses. The fields are action, in, out, src,
+ * dst, proto, spt, dpt, mac, host, tag, and with --geoip cc and asn,
+ * the country and AS (like AS3301) of the source. The operators are
+ *
+ * 	== !=          equal, for addresses a prefix may be given
+ * 	~ !~           address in network, or wildcard match of a string
+ * 	< <= > >=      ports only
+ * 	in {a, b}      any of the values, ports may be ranges like 1-1023
+ *
+ * The expression is compiled once into a tree of nodes with the
+ * values already converted, so matching a packet is a walk over the
+ * fields of the parsed record and never touches the text again. The
+ * same tree is turned into a WHERE clause for the database.
+ ***********************************************************************/
+
+#define FILTER_AND 1
+#define FILTER_OR 2
+#define FILTER_NOT 3
+#define FILTER_CMP 4
+
+#define FILTER_EQ 1
+#define FILTER_NE 2
+#define FILTER_LT 3
+#define FILTER_LE 4
+#define FILTER_GT 5
+#define FILTER_GE 6
+#define FILTER_MATCH 7
+#define FILTER_NOMATCH 8
+#define FILTER_IN 9
+
+#define FILTER_STRING 0
+#define FILTER_PORT 1
+#define FILTER_ADDRESS 2
+
+#define FILTER_TOKEN_LEN 64
+
+static const struct {
+	char *name;
+	int type;
+	char *column;             /* NULL if not in the logs table */
+} filter_fields[] = {
+	{ "action", FILTER_STRING, "action" },
+	{ "in", FILTER_STRING, "if_in" },
+	{ "out", FILTER_STRING, "if_out" },
+	{ "src", FILTER_ADDRESS, "src_ip" },
+	{ "dst", FILTER_ADDRESS, "dst_ip" },
+	{ "proto", FILTER_STRING, "proto" },
+	{ "spt", FILTER_PORT, "src_prt" },
+	{ "dpt", FILTER_PORT, "dst_prt" },
+	{ "mac", FILTER_STRING, "mac" },
+	{ "host", FILTER_STRING, NULL },
+	{ "tag", FILTER_STRING, "tag" },
+	{ "cc", FILTER_STRING, NULL },
+	{ "asn", FILTER_STRING, NULL },
+	{ NULL, 0, NULL }
+};
+
+/* The compiler state, the text is consumed from pos */
+struct filter_parser {
+	struct ipta_filter *filter;
+	char *expr;
+	char *pos;
+	char token[FILTER_TOKEN_LEN];
+	int quoted;
+};
+
+static int filter_or(struct filter_parser *p);
+
+static void filter_error(struct filter_parser *p, char *message)
+{
+	fprintf(stderr, "! Error in filter: %s\n  %s\n  %*s^\n",
+		message, p->expr, (int)(p->pos - p->expr), "");
+}
+
+static void filter_space(struct filter_parser *p)
+{
+	while(isspace((unsigned char)*p->pos))
+		p->pos++;
+}
+
+/* Takes the operator or punctuation s if it is next */
+static int filter_accept(struct filter_parser *p, char *s)
+{
+	filter_space(p);
+	if(strncmp(p->pos, s, strlen(s)))
+		return FLAG_CLEAR;
+	p->pos += strlen(s);
+	return FLAG_SET;
+}
+
+static int filter_word_char(int c)
+{
+	return isalnum(c) || strchr("._:/-*?[]", c);
+}
+
+/* Takes the next word or quoted string into p->token */
+static int filter_word(struct filter_parser *p)
+{
+	char *start;
+	size_t n;
+
+	filter_space(p);
+	p->quoted = FLAG_CLEAR;
+	if(*p->pos == '"') {
+		start = ++p->pos;
+		while(*p->pos && *p->pos != '"')
+			p->pos++;
+		if(!*p->pos) {
+			filter_error(p, "missing end quote");
+			return RETVAL_ERROR;
+		}
+		n = p->pos++ - start;
+		p->quoted = FLAG_SET;
+	} else {
+		start = p->pos;
+		while(*p->pos && filter_word_char((unsigned char)*p->pos))
+			p->pos++;
+		n = p->pos - start;
+		if(!n) {
+			filter_error(p, "expected a word");
+			return RETVAL_ERROR;
+		}
+	}
+	if(n >= FILTER_TOKEN_LEN) {
+		filter_error(p, "word too long");
+		return RETVAL_ERROR;
+	}
+	memcpy(p->token, start, n);
+	p->token[n] = '\0';
+	return RETVAL_OK;
+}
+
+/* Takes the keyword if it is next and not the start of a longer word */
+static int filter_keyword(struct filter_parser *p, char *s)
+{
+	size_t n = strlen(s);
+
+	filter_space(p);
+	if(strncasecmp(p->pos, s, n) || filter_word_char((unsigned char)p->pos[n]))
+		return FLAG_CLEAR;
+	p->pos += n;
+	return FLAG_SET;
+}
+
+static int filter_node(struct filter_parser *p, int op, int left, int right)
+{
+	struct ipta_filter *f = p->filter;
+	struct ipta_filter_node *node = &f->node[f->nodes];
+
+	memset(node, 0, sizeof(struct ipta_filter_node));
+	node->op = op;
+	node->left = left;
+	node->right = right;
+	return f->nodes++;
+}
+
+/* Converts p->token to a value of the field's type */
+static int filter_value(struct filter_parser *p, int type, int cmp)
+{
+	struct ipta_filter *f = p->filter;
+	struct ipta_filter_value *v = &f->value[f->values];
+	char *slash, *end;
+	long low, high;
+
+	memset(v, 0, sizeof(struct ipta_filter_value));
+	switch(type) {
+	case FILTER_PORT:
+		low = strtol(p->token, &end, 10);
+		high = low;
+		if(*end == '-' && end > p->token)
+			high = strtol(end + 1, &end, 10);
+		if(*end || end == p->token || low < 0 || high > 65535 || low > high) {
+			filter_error(p, "expected a port or a range of ports");
+			return RETVAL_ERROR;
+		}
+		v->low = low;
+		v->high = high;
+		break;
+	case FILTER_ADDRESS:
+		slash = strchr(p->token, '/');
+		if(slash)
+			*slash = '\0';
+		if(inet_pton(AF_INET, p->token, v->addr) == 1) {
+			v->family = AF_INET;
+			v->bits = 32;
+		} else if(inet_pton(AF_INET6, p->token, v->addr) == 1) {
+			v->family = AF_INET6;
+			v->bits = 128;
+		} else {
+			filter_error(p, "expected an address or a network");
+			return RETVAL_ERROR;
+		}
+		if(slash) {
+			v->bits = strtol(slash + 1, &end, 10);
+			if(*end || end == slash + 1 || v->bits < 0 ||
+			   v->bits > (v->family == AF_INET ? 32 : 128)) {
+				filter_error(p, "bad network prefix length");
+				return RETVAL_ERROR;
+			}
+		}
+		break;
+	default:
+		if(strchr(p->token, '\'') || strchr(p->token, '\\')) {
+			filter_error(p, "quotes and backslashes can not be matched");
+			return RETVAL_ERROR;
+		}
+		if(cmp != FILTER_MATCH && cmp != FILTER_NOMATCH && !p->quoted &&
+		   strpbrk(p->token, "*?[")) {
+			filter_error(p, "wildcards need the ~ operator");
+			return RETVAL_ERROR;
+		}
+		v->text = strdup(p->token);
+		if(!v->text) {
+			fprintf(stderr, "! Error, memory allocation failed.\n");
+			return RETVAL_ERROR;
+		}
+		break;
+	}
+	f->values++;
+	return RETVAL_OK;
+}
+
+/* field op value, or field in { values } */
+static int filter_compare(struct filter_parser *p)
+{
+	struct ipta_filter_node *node;
+	int field, cmp, type, n;
+
+	if(filter_word(p))
+		return -1;
+	for(field = 0; filter_fields[field].name; field++)
+		if(!strcasecmp(p->token, filter_fields[field].name))
+			break;
+	if(!filter_fields[field].name || p->quoted) {
+		filter_error(p, "unknown field, use action, in, out, src, dst, proto, spt, dpt, mac, host, tag, cc or asn");
+		return -1;
+	}
+	type = filter_fields[field].type;
+
+	// Longest operators first
+	if(filter_accept(p, "==") || filter_accept(p, "="))
+		cmp = FILTER_EQ;
+	else if(filter_accept(p, "!="))
+		cmp = FILTER_NE;
+	else if(filter_accept(p, "!~"))
+		cmp = FILTER_NOMATCH;
+	else if(filter_accept(p, "~"))
+		cmp = FILTER_MATCH;
+	else if(filter_accept(p, "<="))
+		cmp = FILTER_LE;
+	else if(filter_accept(p, ">="))
+		cmp = FILTER_GE;
+	else if(filter_accept(p, "<"))
+		cmp = FILTER_LT;
+	else if(filter_accept(p, ">"))
+		cmp = FILTER_GT;
+	else if(filter_keyword(p, "in"))
+		cmp = FILTER_IN;
+	else {
+		filter_error(p, "expected an operator");
+		return -1;
+	}
+	if(cmp >= FILTER_LT && cmp <= FILTER_GE && type != FILTER_PORT) {
+		filter_error(p, "only ports can be compared with < and >");
+		return -1;
+	}
+
+	n = filter_node(p, FILTER_CMP, -1, -1);
+	node = &p->filter->node[n];
+	node->field = field;
+	node->cmp = cmp;
+	node->first = p->filter->values;
+
+	if(cmp == FILTER_IN) {
+		if(!filter_accept(p, "{")) {
+			filter_error(p, "expected { after in");
+			return -1;
+		}
+		do {
+			if(filter_word(p) || filter_value(p, type, cmp))
+				return -1;
+		} while(filter_accept(p, ","));
+		if(!filter_accept(p, "}")) {
+			filter_error(p, "expected , or }");
+			return -1;
+		}
+	} else {
+		if(filter_word(p) || filter_value(p, type, cmp))
+			return -1;
+	}
+	node->count = p->filter->values - node->first;
+	return n;
+}
+
+static int filter_unary(struct filter_parser *p)
+{
+	int n;
+
+	if(filter_keyword(p, "not") || (filter_accept(p, "!"))) {
+		n = filter_unary(p);
+		return n < 0 ? -1 : filter_node(p, FILTER_NOT, n, -1);
+	}
+	if(filter_accept(p, "(")) {
+		n = filter_or(p);
+		if(n < 0)
+			return -1;
+		if(!filter_accept(p, ")")) {
+			filter_error(p, "expected )");
+			return -1;
+		}
+		return n;
+	}
+	return filter_compare(p);
+}
+
+static int filter_and(struct filter_parser *p)
+{
+	int left, right;
+
+	left = filter_unary(p);
+	while(left >= 0 && (filter_accept(p, "&&") || filter_keyword(p, "and"))) {
+		right = filter_unary(p);
+		left = right < 0 ? -1 : filter_node(p, FILTER_AND, left, right);
+	}
+	return left;
+}
+
+static int filter_or(struct filter_parser *p)
+{
+	int left, right;
+
+	left = filter_and(p);
+	while(left >= 0 && (filter_accept(p, "||") || filter_keyword(p, "or"))) {
+		right = filter_and(p);
+		left = right < 0 ? -1 : filter_node(p, FILTER_OR, left, right);
+	}
+	return left;
+}
+
+/***********************************************************************
+ * filter_compile
+ *
+ * Compiles the expression into f. Errors are shown on stderr with a
+ * mark where the expression went wrong.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on a syntax error or memory allocation failure
+ ***********************************************************************/
+int filter_compile(struct ipta_filter *f, char *expr)
+{
+	struct filter_parser p;
+	size_t size = strlen(expr) + 1;
+
+	// Every node and every value takes at least one character
+	memset(f, 0, sizeof(struct ipta_filter));
+	f->node = calloc(size, sizeof(struct ipta_filter_node));
+	f->value = calloc(size, sizeof(struct ipta_filter_value));
+	if(!f->node || !f->value) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		filter_free(f);
+		return RETVAL_ERROR;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.filter = f;
+	p.expr = p.pos = expr;
+	f->root = filter_or(&p);
+	if(f->root >= 0) {
+		filter_space(&p);
+		if(*p.pos) {
+			filter_error(&p, "expected && or ||");
+			f->root = -1;
+		}
+	}
+	if(f->root < 0) {
+		filter_free(f);
+		return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+/* A prefix match of two addresses of the same family */
+static int filter_prefix(unsigned char *addr, struct ipta_filter_value *v)
+{
+	int bytes = v->bits / 8, bits = v->bits % 8;
+
+	if(memcmp(addr, v->addr, bytes))
+		return FLAG_CLEAR;
+	if(!bits)
+		return FLAG_SET;
+	return !((addr[bytes] ^ v->addr[bytes]) & (0xff00 >> bits));
+}
+
+/* Does the field match any of the values of the node */
+static int filter_values(struct ipta_filter *f, struct ipta_filter_node *node, char *field)
+{
+	struct ipta_filter_value *v = &f->value[node->first];
+	unsigned char addr[16];
+	int family, port, i;
+
+	switch(filter_fields[node->field].type) {
+	case FILTER_PORT:
+		port = atoi(field);
+		switch(node->cmp) {
+		case FILTER_LT:
+			return port < v->low;
+		case FILTER_LE:
+			return port <= v->high;
+		case FILTER_GT:
+			return port > v->high;
+		case FILTER_GE:
+			return port >= v->low;
+		}
+		for(i = 0; i < node->count; i++)
+			if(port >= v[i].low && port <= v[i].high)
+				return FLAG_SET;
+		return FLAG_CLEAR;
+
+	case FILTER_ADDRESS:
+		family = strchr(field, ':') ? AF_INET6 : AF_INET;
+		if(inet_pton(family, field, addr) != 1)
+			return FLAG_CLEAR;
+		for(i = 0; i < node->count; i++)
+			if(v[i].family == family && filter_prefix(addr, &v[i]))
+				return FLAG_SET;
+		return FLAG_CLEAR;
+
+	default:
+		for(i = 0; i < node->count; i++) {
+			if(node->cmp == FILTER_MATCH || node->cmp == FILTER_NOMATCH) {
+				if(!fnmatch(v[i].text, field, FNM_CASEFOLD))
+					return FLAG_SET;
+			} else if(!strcasecmp(v[i].text, field)) {
+				return FLAG_SET;
+			}
+		}
+		return FLAG_CLEAR;
+	}
+}
+
+/* The text of a field, buffer holds the ones that are looked up */
+static char *filter_field(struct ipta_record *rec, int field, char *buffer, size_t len)
+{
+	struct ipta_geo geo;
+
+	switch(field) {
+	case 0: return rec->action;
+	case 1: return rec->if_in;
+	case 2: return rec->if_out;
+	case 3: return rec->src;
+	case 4: return rec->dst;
+	case 5: return rec->proto;
+	case 6: return rec->src_port;
+	case 7: return rec->dst_port;
+	case 8: return rec->mac;
+	case 9: return rec->host;
+	case 10: return rec->tag;
+	}
+
+	buffer[0] = '\0';
+	if(geoip_lookup(rec->src, &geo) == RETVAL_OK) {
+		if(field == 11)
+			snprintf(buffer, len, "%s", geo.country);
+		else if(geo.asn)
+			snprintf(buffer, len, "AS%u", geo.asn);
+	}
+	return buffer;
+}
+
+static int filter_eval(struct ipta_filter *f, int n, struct ipta_record *rec)
+{
+	struct ipta_filter_node *node = &f->node[n];
+	char buffer[16];
+	int match;
+
+	switch(node->op) {
+	case FILTER_AND:
+		return filter_eval(f, node->left, rec) && filter_eval(f, node->right, rec);
+	case FILTER_OR:
+		return filter_eval(f, node->left, rec) || filter_eval(f, node->right, rec);
+	case FILTER_NOT:
+		return !filter_eval(f, node->left, rec);
+	}
+	match = filter_values(f, node, filter_field(rec, node->field, buffer, sizeof(buffer)));
+	return (node->cmp == FILTER_NE || node->cmp == FILTER_NOMATCH) ? !match : match;
+}
+
+/***********************************************************************
+ * filter_match
+ *
+ * Tests a parsed record against the filter. A NULL filter lets
+ * everything through.
+ *
+ * RETURNS
+ *
+ * 	FLAG_SET - the packet is selected
+ *
+ * 	FLAG_CLEAR - the packet is filtered away
+ ***********************************************************************/
+int filter_match(struct ipta_filter *f, struct ipta_record *rec)
+{
+	if(!f)
+		return FLAG_SET;
+	return filter_eval(f, f->root, rec);
+}
+
+/* The range one comparison allows, or the whole range of the field */
+static void filter_bounds_node(struct ipta_filter *f, int n, int field, unsigned long max,
+			       unsigned long *low, unsigned long *high)
+{
+	struct ipta_filter_node *node = &f->node[n];
+	struct ipta_filter_value *v;
+	unsigned long l, h, a, mask;
+	int i;
+
+	*low = 0;
+	*high = max;
+	switch(node->op) {
+	case FILTER_AND:
+		filter_bounds_node(f, node->left, field, max, low, high);
+		filter_bounds_node(f, node->right, field, max, &l, &h);
+		if(l > *low)
+			*low = l;
+		if(h < *high)
+			*high = h;
+		return;
+	case FILTER_OR:
+		filter_bounds_node(f, node->left, field, max, low, high);
+		filter_bounds_node(f, node->right, field, max, &l, &h);
+		if(l < *low)
+			*low = l;
+		if(h > *high)
+			*high = h;
+		return;
+	case FILTER_NOT:
+		return;
+	}
+	if(node->field != field || node->cmp == FILTER_NE || node->cmp == FILTER_NOMATCH)
+		return;
+
+	v = &f->value[node->first];
+	if(filter_fields[field].type == FILTER_PORT) {
+		switch(node->cmp) {
+		case FILTER_LT:
+			*high = v->low > 0 ? v->low - 1 : 0;
+			if(!v->low)
+				*low = 1;
+			return;
+		case FILTER_LE:
+			*high = v->high;
+			return;
+		case FILTER_GT:
+			*low = v->high + 1;
+			return;
+		case FILTER_GE:
+			*low = v->low;
+			return;
+		}
+	}
+
+	*low = max;
+	*high = 0;
+	for(i = 0; i < node->count; i++) {
+		if(filter_fields[field].type == FILTER_PORT) {
+			l = v[i].low;
+			h = v[i].high;
+		} else {
+			// An IPv6 network could match anything stored as 0
+			if(v[i].family != AF_INET) {
+				*low = 0;
+				*high = max;
+				return;
+			}
+			a = ((unsigned long)v[i].addr[0] << 24) | (v[i].addr[1] << 16) |
+				(v[i].addr[2] << 8) | v[i].addr[3];
+			mask = v[i].bits == 32 ? 0 : 0xffffffffUL >> v[i].bits;
+			l = a & ~mask & 0xffffffffUL;
+			h = l | mask;
+		}
+		if(l < *low)
+			*low = l;
+		if(h > *high)
+			*high = h;
+	}
+}
+
+/***********************************************************************
+ * filter_bounds
+ *
+ * The smallest and largest value the port or address field name can
+ * have in a packet the filter selects, addresses as IPv4 numbers. Used
+ * to skip blocks of the archive that hold no such packets. low is
+ * larger than high when no packet can be selected.
+ ***********************************************************************/
+void filter_bounds(struct ipta_filter *f, char *name, unsigned long *low, unsigned long *high)
+{
+	unsigned long max;
+	int field;
+
+	for(field = 0; filter_fields[field].name; field++)
+		if(!strcmp(filter_fields[field].name, name))
+			break;
+	max = filter_fields[field].type == FILTER_PORT ? 65535 : 0xffffffffUL;
+	*low = 0;
+	*high = max;
+	if(f && filter_fields[field].name)
+		filter_bounds_node(f, f->root, field, max, low, high);
+}
+
+/***********************************************************************
+ * filter_uses
+ *
+ * Tells if the filter compares the field name anywhere, for the
+ * callers that read rows where the field is not kept.
+ *
+ * RETURNS
+ *
+ * 	FLAG_SET - the field is in the filter
+ *
+ * 	FLAG_CLEAR - it is not, or there is no filter
+ ***********************************************************************/
+int filter_uses(struct ipta_filter *f, char *name)
+{
+	int i;
+
+	if(!f)
+		return FLAG_CLEAR;
+	for(i = 0; i < f->nodes; i++)
+		if(f->node[i].op == FILTER_CMP && !strcmp(filter_fields[f->node[i].field].name, name))
+			return FLAG_SET;
+	return FLAG_CLEAR;
+}
+
+/***********************************************************************
+ * filter_packet
+ *
+ * Everything that decides if a parsed packet is used, in the order
+ * of cost: the --ignore-list sources are dropped, the packet is
+ * tagged with the --tag-list its source or destination is in, and
+ * then --filter is tested, so it can select on the tag.
+ *
+ * RETURNS
+ *
+ * 	FLAG_SET - the packet is used
+ *
+ * 	FLAG_CLEAR - the packet is dropped
+ ***********************************************************************/
+int filter_packet(struct ipta_flags *flags, struct ipta_record *rec)
+{
+	char *tag;
+
+	if(flags->ignore && cidr_lookup(flags->ignore, rec->src))
+		return FLAG_CLEAR;
+	if(flags->tags) {
+		tag = cidr_lookup(flags->tags, rec->src);
+		if(!tag)
+			tag = cidr_lookup(flags->tags, rec->dst);
+		if(tag)
+			rec->tag = tag;
+	}
+	return filter_match(flags->filter, rec);
+}
+
+/* Appends to the clause, returns the room left or -1 if it is full */
+static int filter_append(char *sql, size_t len, char *format, ...)
+	__attribute__ ((format(printf, 3, 4)));
+
+static int filter_append(char *sql, size_t len, char *format, ...)
+{
+	va_list ap;
+	size_t used = strlen(sql);
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(sql + used, len - used, format, ap);
+	va_end(ap);
+	return (n < 0 || (size_t)n >= len - used) ? RETVAL_ERROR : RETVAL_OK;
+}
+
+/* One value as SQL, for the IN lists and the = comparisons */
+static int filter_sql_value(struct ipta_filter_node *node, struct ipta_filter_value *v,
+			    char *sql, size_t len)
+{
+	char *column = filter_fields[node->field].column;
+	char pattern[2 * FILTER_TOKEN_LEN];
+	unsigned long low, high;
+	char *s, *d;
+
+	switch(filter_fields[node->field].type) {
+	case FILTER_PORT:
+		return filter_append(sql, len, "%s BETWEEN %d AND %d", column, v->low, v->high);
+
+	case FILTER_ADDRESS:
+		// The table only has room for IPv4 addresses
+		if(v->family != AF_INET)
+			return filter_append(sql, len, "FALSE");
+		low = ((unsigned long)v->addr[0] << 24) | (v->addr[1] << 16) |
+			(v->addr[2] << 8) | v->addr[3];
+		high = v->bits == 32 ? 0 : 0xffffffffUL >> v->bits;
+		low &= ~high & 0xffffffffUL;
+		return filter_append(sql, len, "%s BETWEEN %lu AND %lu", column, low, low | high);
+
+	default:
+		if(node->cmp != FILTER_MATCH && node->cmp != FILTER_NOMATCH)
+			return filter_append(sql, len, "%s = '%s'", column, v->text);
+		// Wildcards to LIKE, with the LIKE characters themselves
+		// escaped. Not with a backslash, SQLite has no default escape
+		for(s = v->text, d = pattern; *s; s++) {
+			if(*s == '%' || *s == '_' || *s == '!')
+				*d++ = '!';
+			*d++ = *s == '*' ? '%' : *s == '?' ? '_' : *s;
+		}
+		*d = '\0';
+		return filter_append(sql, len, "%s LIKE '%s' ESCAPE '!'", column, pattern);
+	}
+}
+
+static int filter_sql_node(struct ipta_filter *f, int n, char *sql, size_t len)
+{
+	struct ipta_filter_node *node = &f->node[n];
+	struct ipta_filter_value *v;
+	int i;
+
+	switch(node->op) {
+	case FILTER_AND:
+	case FILTER_OR:
+		return filter_append(sql, len, "(") ||
+			filter_sql_node(f, node->left, sql, len) ||
+			filter_append(sql, len, node->op == FILTER_AND ? " AND " : " OR ") ||
+			filter_sql_node(f, node->right, sql, len) ||
+			filter_append(sql, len, ")");
+	case FILTER_NOT:
+		// A comparison with NULL is unknown, which is false here
+		// like in filter_match() but would stay unknown after NOT
+		return filter_append(sql, len, "NOT COALESCE(") ||
+			filter_sql_node(f, node->left, sql, len) ||
+			filter_append(sql, len, ", FALSE)");
+	}
+
+	if(!filter_fields[node->field].column) {
+		fprintf(stderr, "! Error, %s is not stored in the database and can not be filtered on.\n",
+			filter_fields[node->field].name);
+		return RETVAL_ERROR;
+	}
+
+	v = &f->value[node->first];
+	switch(node->cmp) {
+	case FILTER_LT:
+		return filter_append(sql, len, "%s < %d", filter_fields[node->field].column, v->low);
+	case FILTER_LE:
+		return filter_append(sql, len, "%s <= %d", filter_fields[node->field].column, v->high);
+	case FILTER_GT:
+		return filter_append(sql, len, "%s > %d", filter_fields[node->field].column, v->high);
+	case FILTER_GE:
+		return filter_append(sql, len, "%s >= %d", filter_fields[node->field].column, v->low);
+	}
+
+	// A NULL column is not equal to the values either
+	if(node->cmp == FILTER_NE || node->cmp == FILTER_NOMATCH) {
+		if(filter_append(sql, len, "(%s IS NULL OR NOT (", filter_fields[node->field].column))
+			return RETVAL_ERROR;
+	} else if(filter_append(sql, len, "(")) {
+		return RETVAL_ERROR;
+	}
+	for(i = 0; i < node->count; i++) {
+		if((i && filter_append(sql, len, " OR ")) ||
+		   filter_sql_value(node, &v[i], sql, len))
+			return RETVAL_ERROR;
+	}
+	return filter_append(sql, len, (node->cmp == FILTER_NE || node->cmp == FILTER_NOMATCH) ?
+			     "))" : ")");
+}
+
+/***********************************************************************
+ * filter_sql
+ *
+ * Writes the filter as an SQL condition on the logs table into sql,
+ * to be used in a WHERE clause. A NULL filter gives TRUE.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the filter uses a field that is not in the table,
+ * 		or the condition does not fit in len
+ ***********************************************************************/
+int filter_sql(struct ipta_filter *f, char *sql, size_t len)
+{
+	if(!len)
+		return RETVAL_ERROR;
+	sql[0] = '\0';
+	if(!f)
+		return filter_append(sql, len, "TRUE");
+	if(filter_sql_node(f, f->root, sql, len)) {
+		fprintf(stderr, "! Error, unable to use the filter with the database.\n");
+		return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+void filter_free(struct ipta_filter *f)
+{
+	int i;
+
+	if(f->value)
+		for(i = 0; i < f->values; i++)
+			free(f->value[i].text);
+	free(f->value);
+	free(f->node);
+	f->value = NULL;
+	f->node = NULL;
+	f->nodes = f->values = 0;
+}
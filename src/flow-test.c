@@ -0,0 +1,191 @@
+/**********************************************************************
+ * flow-test.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ipta.h"
+
+#define TEST_RANDOM_PACKETS 200000
+
+static struct ipta_record *test_record(time_t t, char *src, int spt, char *dst, int dpt)
+{
+	static struct ipta_record rec;
+	static char spt_text[8], dpt_text[8], src_text[48], dst_text[48];
+
+	snprintf(src_text, sizeof(src_text), "%s", src);
+	snprintf(dst_text, sizeof(dst_text), "%s", dst);
+	snprintf(spt_text, sizeof(spt_text), "%d", spt);
+	snprintf(dpt_text, sizeof(dpt_text), "%d", dpt);
+	rec.timestamp = t;
+	rec.host = "";
+	rec.action = "DROP";
+	rec.if_in = "eth0";
+	rec.if_out = "";
+	rec.mac = "";
+	rec.src = src_text;
+	rec.dst = dst_text;
+	rec.proto = "TCP";
+	rec.src_port = spt_text;
+	rec.dst_port = dpt_text;
+	rec.tag = "";
+	return &rec;
+}
+
+/* The packets in the rows of the batch */
+static long test_packets(struct ipta_batch *batch)
+{
+	long packets = 0;
+	int i;
+
+	for(i = 0; i < batch->count; i++)
+		packets += batch->rows[i].packets;
+	return packets;
+}
+
+static int test_check(char *what, long value, long expected)
+{
+	if(value == expected)
+		return 0;
+	fprintf(stderr, "! Error, %s is %ld, expected %ld.\n", what, value, expected);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ipta_flows flows;
+	struct ipta_batch batch;
+	struct ipta_row *row;
+	char src[32];
+	time_t t = 1700000000;
+	int errors = 0;
+	int n, i;
+
+	printf("* Unit tests for the flow aggregation of ipta.\n\n");
+
+	// No database, the batch is large enough to never be written
+	if(batch_init(&batch, NULL, "logs", FLOW_MAX + 1000)) {
+		fprintf(stderr, "! Test error, unable to set up the batch.\n");
+		return RETVAL_ERROR;
+	}
+
+	// Test I: Retries of the same SYN become one row
+	fprintf(stderr, "* Test I: Merge repeated packets.\n");
+	memset(&flows, 0, sizeof(flows));
+	flows.timeout = 10;
+	n = flow_init(&flows);
+	for(i = 0; i < 5; i++)
+		n |= flow_add(&flows, test_record(t + 3 * i, "10.0.0.1", 5000, "10.0.0.2", 22), i + 1, &batch);
+	n |= flow_add(&flows, test_record(t + 1, "10.0.0.1", 5001, "10.0.0.2", 22), 6, &batch);
+	n += test_check("rows before the end", batch.count, 0);
+	n |= flow_flush(&flows, &batch);
+	n += test_check("rows", batch.count, 2);
+	row = batch.rows[0].src_port == 5000 ? &batch.rows[0] : &batch.rows[1];
+	n += test_check("packets of the flow", row->packets, 5);
+	n += test_check("first seen", row->timestamp, t);
+	n += test_check("last seen", row->last_seen, t + 12);
+	n += test_check("line", row->line, 1);
+	flow_free(&flows);
+	batch.count = 0;
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test II: A flow quiet for longer than the timeout is written
+	// when the clock passes it and the next packet starts a new one
+	fprintf(stderr, "* Test II: Idle and active timeouts.\n");
+	memset(&flows, 0, sizeof(flows));
+	flows.timeout = 10;
+	n = flow_init(&flows);
+	n |= flow_add(&flows, test_record(t, "10.0.0.1", 5000, "10.0.0.2", 22), 1, &batch);
+	n |= flow_add(&flows, test_record(t + 9, "10.0.0.1", 5000, "10.0.0.2", 22), 2, &batch);
+	n += test_check("oldest line held", flow_oldest(&flows), 1);
+	n |= flow_add(&flows, test_record(t + 20, "10.0.0.1", 5000, "10.0.0.2", 22), 3, &batch);
+	n += test_check("rows written after 11 quiet seconds", batch.count, 1);
+	n += test_check("oldest line held", flow_oldest(&flows), 3);
+	n |= flow_tick(&flows, t + 30, &batch);
+	n += test_check("rows written by the clock", batch.count, 2);
+	n += test_check("oldest line held", flow_oldest(&flows), 0);
+	batch.count = 0;
+
+	// A packet every 5 seconds is never quiet, the active timeout
+	// still writes it every FLOW_ACTIVE_TIMEOUT seconds
+	for(i = 0; i < 140; i++)
+		n |= flow_add(&flows, test_record(t + 100 + 5 * i, "10.0.0.3", 1, "10.0.0.2", 80), i, &batch);
+	n |= flow_flush(&flows, &batch);
+	n += test_check("rows of a busy flow", batch.count, 3);
+	n += test_check("packets of a busy flow", test_packets(&batch), 140);
+	flow_free(&flows);
+	batch.count = 0;
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test III: More flows than fit, the ones expiring first go
+	fprintf(stderr, "* Test III: Fill the table with %d flows.\n", FLOW_MAX + 100);
+	memset(&flows, 0, sizeof(flows));
+	flows.timeout = 60;
+	n = flow_init(&flows);
+	for(i = 0; i < FLOW_MAX + 100; i++) {
+		snprintf(src, sizeof(src), "10.%d.%d.%d", i >> 16, (i >> 8) & 255, i & 255);
+		n |= flow_add(&flows, test_record(t, src, 1024, "10.0.0.2", 22), i, &batch);
+	}
+	n += test_check("flows written early", flows.evicted, 100);
+	n += test_check("rows written early", batch.count, 100);
+	n |= flow_flush(&flows, &batch);
+	n += test_check("rows", batch.count, FLOW_MAX + 100);
+	n += test_check("flows left", flows.count, 0);
+	flow_free(&flows);
+	batch.count = 0;
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test IV: Random packets, every one is in some row and no row
+	// covers more than the active timeout
+	fprintf(stderr, "* Test IV: %d random packets.\n", TEST_RANDOM_PACKETS);
+	memset(&flows, 0, sizeof(flows));
+	flows.timeout = 30;
+	n = flow_init(&flows);
+	srandom(42);
+	for(i = 0; i < TEST_RANDOM_PACKETS; i++) {
+		t += random() % 100 == 0;
+		snprintf(src, sizeof(src), "10.0.%ld.%ld", random() % 4, random() % 25);
+		n |= flow_add(&flows, test_record(t, src, 1024 + random() % 2, "10.0.0.2", 22), i, &batch);
+	}
+	n |= flow_flush(&flows, &batch);
+	for(i = 0; i < batch.count; i++)
+		if(batch.rows[i].last_seen - batch.rows[i].timestamp >= FLOW_ACTIVE_TIMEOUT)
+			n += test_check("length of a flow", batch.rows[i].last_seen - batch.rows[i].timestamp,
+					FLOW_ACTIVE_TIMEOUT - 1);
+	n += test_check("packets in the rows", test_packets(&batch), flows.packets);
+	if(!n)
+		fprintf(stderr, "  Success, %lu packets in %d rows.\n", flows.packets, batch.count);
+	flow_free(&flows);
+	errors += n;
+
+	batch_free(&batch);
+	fprintf(stderr, "* %d errors.\n", errors);
+	return errors ? RETVAL_ERROR : RETVAL_OK;
+}
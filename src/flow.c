@@ -0,0 +1,362 @@
+/**********************************************************************
+ * flow.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Flow aggregation
+ *
+ * A blocked connection attempt is retried, so the same packet is
+ * often logged several times within seconds, and a scan or flood is
+ * mostly such repeats. With --flow-timeout the packets with the same
+ * addresses, ports, protocol, action and interfaces are merged into
+ * one row that counts them, the way conntrack keeps a connection.
+ * The row is written when no packet of the flow has been seen for
+ * the timeout, or FLOW_ACTIVE_TIMEOUT after its first packet.
+ *
+ * At most FLOW_MAX flows are kept. They are found through a hash
+ * table with chains and each is also in a timer wheel, a list per
+ * second of FLOW_WHEEL seconds, by the time it expires. Moving the
+ * clock forward only looks at the lists of the seconds passed. The
+ * clock is the time of the packets, so an import of an old log
+ * merges the same way as the live log did, and the wall clock when
+ * the log is quiet. A full table writes the flow expiring first.
+ ***********************************************************************/
+
+#define FLOW_NONE -1
+
+static unsigned int flow_hash(struct ipta_row *row)
+{
+	uint64_t h = 14695981039346656037ULL;
+	char *field[6] = { row->src, row->dst, row->proto, row->action, row->if_in, row->if_out };
+	char *p;
+	int i;
+
+	for(i = 0; i < 6; i++) {
+		for(p = field[i]; *p; p++)
+			h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+		h = (h ^ 0xff) * 1099511628211ULL;
+	}
+	h = (h ^ (unsigned int)row->src_port) * 1099511628211ULL;
+	h = (h ^ (unsigned int)row->dst_port) * 1099511628211ULL;
+	return (unsigned int)(h ^ (h >> 32));
+}
+
+static int flow_same(struct ipta_row *a, struct ipta_row *b)
+{
+	return a->src_port == b->src_port && a->dst_port == b->dst_port &&
+		!strcmp(a->src, b->src) && !strcmp(a->dst, b->dst) &&
+		!strcmp(a->proto, b->proto) && !strcmp(a->action, b->action) &&
+		!strcmp(a->if_in, b->if_in) && !strcmp(a->if_out, b->if_out);
+}
+
+static void flow_timer_add(struct ipta_flows *f, int i)
+{
+	int slot = f->flow[i].expires & (FLOW_WHEEL - 1);
+
+	f->flow[i].timer_prev = FLOW_NONE;
+	f->flow[i].timer_next = f->wheel[slot];
+	if(f->wheel[slot] != FLOW_NONE)
+		f->flow[f->wheel[slot]].timer_prev = i;
+	f->wheel[slot] = i;
+}
+
+static void flow_timer_remove(struct ipta_flows *f, int i)
+{
+	struct ipta_flow *e = &f->flow[i];
+
+	if(e->timer_prev != FLOW_NONE)
+		f->flow[e->timer_prev].timer_next = e->timer_next;
+	else
+		f->wheel[e->expires & (FLOW_WHEEL - 1)] = e->timer_next;
+	if(e->timer_next != FLOW_NONE)
+		f->flow[e->timer_next].timer_prev = e->timer_prev;
+}
+
+/* When the flow is written, always within the wheel */
+static void flow_expires(struct ipta_flows *f, struct ipta_flow *e)
+{
+	e->expires = e->row.last_seen + f->timeout;
+	if(e->expires > e->row.timestamp + FLOW_ACTIVE_TIMEOUT)
+		e->expires = e->row.timestamp + FLOW_ACTIVE_TIMEOUT;
+	if(e->expires <= f->now)
+		e->expires = f->now + 1;
+}
+
+/***********************************************************************
+ * flow_emit
+ *
+ * Takes flow i out of the table and adds its row to the batch, which
+ * is written when full.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the batch could not be written
+ ***********************************************************************/
+static int flow_emit(struct ipta_flows *f, int i, struct ipta_batch *batch)
+{
+	struct ipta_flow *e = &f->flow[i];
+	int *p;
+
+	for(p = &f->bucket[e->hash & (FLOW_MAX - 1)]; *p != i; p = &f->flow[*p].next)
+		;
+	*p = e->next;
+	flow_timer_remove(f, i);
+	if(e->age_prev != FLOW_NONE)
+		f->flow[e->age_prev].age_next = e->age_next;
+	else
+		f->oldest = e->age_next;
+	if(e->age_next != FLOW_NONE)
+		f->flow[e->age_next].age_prev = e->age_prev;
+	else
+		f->newest = e->age_prev;
+	e->next = f->free;
+	f->free = i;
+	f->count--;
+	f->rows++;
+
+	if(batch_add_row(batch, &e->row))
+		return batch_flush(batch);
+	return RETVAL_OK;
+}
+
+/* Writes the flows of a wheel slot that have expired by now */
+static int flow_expire_slot(struct ipta_flows *f, int slot, time_t now,
+			    struct ipta_batch *batch)
+{
+	int i, next;
+
+	for(i = f->wheel[slot]; i != FLOW_NONE; i = next) {
+		next = f->flow[i].timer_next;
+		if(f->flow[i].expires <= now && flow_emit(f, i, batch))
+			return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * flow_init
+ *
+ * Allocates the table. The timeout is set by the caller, at most
+ * FLOW_ACTIVE_TIMEOUT seconds.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on memory allocation failure
+ ***********************************************************************/
+int flow_init(struct ipta_flows *f)
+{
+	int i;
+
+	f->flow = calloc(FLOW_MAX, sizeof(struct ipta_flow));
+	f->bucket = malloc(FLOW_MAX * sizeof(int));
+	if(!f->flow || !f->bucket) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		flow_free(f);
+		return RETVAL_ERROR;
+	}
+	if(f->timeout > FLOW_ACTIVE_TIMEOUT)
+		f->timeout = FLOW_ACTIVE_TIMEOUT;
+
+	for(i = 0; i < FLOW_MAX; i++) {
+		f->bucket[i] = FLOW_NONE;
+		f->flow[i].next = i + 1 < FLOW_MAX ? i + 1 : FLOW_NONE;
+	}
+	for(i = 0; i < FLOW_WHEEL; i++)
+		f->wheel[i] = FLOW_NONE;
+	f->oldest = f->newest = FLOW_NONE;
+	f->free = 0;
+	f->count = 0;
+	f->now = 0;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * flow_tick
+ *
+ * Moves the clock forward to now and writes the flows that have
+ * expired to the batch. Called for every packet with its time and
+ * with the wall clock when no packets come.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the batch could not be written
+ ***********************************************************************/
+int flow_tick(struct ipta_flows *f, time_t now, struct ipta_batch *batch)
+{
+	time_t t;
+
+	if(now <= f->now)
+		return RETVAL_OK;
+
+	if(!f->count) {
+		f->now = now;
+		return RETVAL_OK;
+	}
+
+	if(now - f->now >= FLOW_WHEEL) {
+		for(t = 0; t < FLOW_WHEEL; t++)
+			if(flow_expire_slot(f, t, now, batch))
+				return RETVAL_ERROR;
+	} else {
+		for(t = f->now + 1; t <= now; t++)
+			if(flow_expire_slot(f, t & (FLOW_WHEEL - 1), now, batch))
+				return RETVAL_ERROR;
+	}
+	f->now = now;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * flow_add
+ *
+ * Counts a packet in its flow, or starts a new flow. Flows that have
+ * expired by the time of the packet are written to the batch first.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the batch could not be written
+ ***********************************************************************/
+int flow_add(struct ipta_flows *f, struct ipta_record *rec, long line, struct ipta_batch *batch)
+{
+	struct ipta_row row;
+	struct ipta_flow *e;
+	unsigned int hash;
+	time_t t;
+	int i;
+
+	parse_to_row(rec, &row, line);
+	if(!row.timestamp)
+		row.timestamp = row.last_seen = time(NULL);
+	if(flow_tick(f, row.timestamp, batch))
+		return RETVAL_ERROR;
+	f->packets++;
+
+	hash = flow_hash(&row);
+	for(i = f->bucket[hash & (FLOW_MAX - 1)]; i != FLOW_NONE; i = f->flow[i].next) {
+		e = &f->flow[i];
+		if(e->hash != hash || !flow_same(&e->row, &row))
+			continue;
+		// Logs from several hosts may be a little out of order
+		t = row.timestamp;
+		if(t < e->row.timestamp)
+			e->row.timestamp = t;
+		if(t > e->row.last_seen)
+			e->row.last_seen = t;
+		e->row.packets++;
+		flow_timer_remove(f, i);
+		flow_expires(f, e);
+		flow_timer_add(f, i);
+		return RETVAL_OK;
+	}
+
+	// Full, the flow that would expire first goes now
+	if(f->free == FLOW_NONE) {
+		for(t = f->now + 1; f->wheel[t & (FLOW_WHEEL - 1)] == FLOW_NONE; t++)
+			;
+		if(flow_emit(f, f->wheel[t & (FLOW_WHEEL - 1)], batch))
+			return RETVAL_ERROR;
+		f->evicted++;
+	}
+
+	i = f->free;
+	e = &f->flow[i];
+	f->free = e->next;
+	e->row = row;
+	e->hash = hash;
+	e->next = f->bucket[hash & (FLOW_MAX - 1)];
+	f->bucket[hash & (FLOW_MAX - 1)] = i;
+	flow_expires(f, e);
+	flow_timer_add(f, i);
+	e->age_prev = f->newest;
+	e->age_next = FLOW_NONE;
+	if(f->newest != FLOW_NONE)
+		f->flow[f->newest].age_next = i;
+	else
+		f->oldest = i;
+	f->newest = i;
+	f->count++;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * flow_flush
+ *
+ * Writes all flows to the batch, at the end of the input.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the batch could not be written
+ ***********************************************************************/
+int flow_flush(struct ipta_flows *f, struct ipta_batch *batch)
+{
+	int t;
+
+	for(t = 0; t < FLOW_WHEEL; t++)
+		while(f->wheel[t] != FLOW_NONE)
+			if(flow_emit(f, f->wheel[t], batch))
+				return RETVAL_ERROR;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * flow_oldest
+ *
+ * The line of the first packet of the oldest flow still held. Every
+ * packet before it has been written to the batch.
+ *
+ * RETURNS
+ *
+ * 	The line number given to flow_add(), 0 if no flow is held
+ ***********************************************************************/
+long flow_oldest(struct ipta_flows *f)
+{
+	return f->oldest == FLOW_NONE ? 0 : f->flow[f->oldest].row.line;
+}
+
+void flow_free(struct ipta_flows *f)
+{
+	if(f->flow && f->packets)
+		fprintf(stderr, "* Flows: %lu packets written as %lu rows, %lu flows written early.\n",
+			f->packets, f->rows, f->evicted);
+	free(f->flow);
+	free(f->bucket);
+	f->flow = NULL;
+	f->bucket = NULL;
+}
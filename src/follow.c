@@ -26,17 +26,172 @@
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
 #include "ipta.h"
 
+static volatile sig_atomic_t dns_stats_requested = 0;
+
+/* SIGUSR1 asks for the DNS statistics, printed from the main loop */
+static void follow_sigusr1(int sig)
+{
+	dns_stats_requested = 1;
+}
+
 /***********************************************************************
- * The follow function will follow the file given as argument and
- * interprete it and print each logged packet line by line without
+ * Reordering
+ *
+ * When several logs are followed the lines do not arrive in time
+ * order, one firewall may be a second behind another. Packets are
+ * then held for a short while in a heap sorted on the time stamp of
+ * the log line and shown when they have waited out the reorder
+ * window, so the merged output is in time order.
+ ***********************************************************************/
+
+struct follow_pending {
+	long long due;            /* ms when it has waited long enough */
+	time_t timestamp;
+	unsigned long packet;     /* Packet number, also keeps the order stable */
+	int source;
+	char *line;               /* Copy of the line, rec points into it */
+	struct ipta_record rec;
+};
+
+struct follow_reorder {
+	struct follow_pending *heap;
+	int count;
+};
+
+static long long follow_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int follow_before(struct follow_pending *a, struct follow_pending *b)
+{
+	if(a->timestamp != b->timestamp)
+		return a->timestamp < b->timestamp;
+	return a->packet < b->packet;
+}
+
+static void follow_push(struct follow_reorder *r, struct follow_pending *p)
+{
+	struct follow_pending tmp;
+	int i = r->count++;
+
+	r->heap[i] = *p;
+	while(i > 0 && follow_before(&r->heap[i], &r->heap[(i - 1) / 2])) {
+		tmp = r->heap[i];
+		r->heap[i] = r->heap[(i - 1) / 2];
+		r->heap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+static void follow_pop(struct follow_reorder *r, struct follow_pending *p)
+{
+	struct follow_pending tmp;
+	int i = 0, child;
+
+	*p = r->heap[0];
+	r->heap[0] = r->heap[--r->count];
+	while((child = 2 * i + 1) < r->count) {
+		if(child + 1 < r->count && follow_before(&r->heap[child + 1], &r->heap[child]))
+			child++;
+		if(!follow_before(&r->heap[child], &r->heap[i]))
+			break;
+		tmp = r->heap[i];
+		r->heap[i] = r->heap[child];
+		r->heap[child] = tmp;
+		i = child;
+	}
+}
+
+/***********************************************************************
+ * follow_show
+ *
+ * Shows one packet unless it is filtered out. The host is the name of
+ * the firewall, only given when several logs are followed.
+ ***********************************************************************/
+static void follow_show(struct ipta_output *out, struct ipta_record *rec, char *host,
+			struct ipta_flags *flags, unsigned long packet)
+{
+	char src_hostname[HOSTNAME_MAX_LEN];
+	char dst_hostname[HOSTNAME_MAX_LEN];
+	char event[256];
+	int hostname_len = 30;
+
+	if(flags->no_lo && (!strcmp(rec->if_in, "lo") || !strcmp(rec->if_out, "lo")))
+		return;
+
+	// The detector sees accepted packets too, a flood is a flood
+	if(flags->detect && detect_packet(flags->detect, rec, event, sizeof(event))) {
+		if(flags->detect->log)
+			detect_log(flags->detect, event);
+		else
+			output_event(out, event);
+	}
+	if(flags->no_accept && !strcmp("ACCEPT", rec->action))
+		return;
+
+	// Names come from the background resolver, if it does not know
+	// the name yet we show the address and the name will show up on
+	// the next packet.
+	if(flags->rdns) {
+		dns_resolver_lookup(rec->src, src_hostname, hostname_len);
+		dns_resolver_lookup(rec->dst, dst_hostname, hostname_len);
+	}
+
+	output_packet(out, rec, host,
+		      flags->rdns ? src_hostname : NULL,
+		      flags->rdns ? dst_hostname : NULL,
+		      packet);
+}
+
+/* The host logged in the line, or the directory of the file */
+static char *follow_host(struct ipta_multitail *mt, struct ipta_record *rec, int source)
+{
+	if(mt->count < 2 && !mt->receivers)
+		return NULL;
+	if(rec->host[0])
+		return rec->host;
+	if(source >= mt->count)
+		return mt->receiver[source - mt->count].spec;
+	return mt->label[source];
+}
+
+/* Show the held packets that are due, or all of them if all is set */
+static void follow_release(struct follow_reorder *r, struct ipta_output *out,
+			   struct ipta_multitail *mt, struct ipta_flags *flags, int all)
+{
+	struct follow_pending p;
+	long long now = follow_now_ms();
+
+	while(r->count && (all || r->heap[0].due <= now)) {
+		follow_pop(r, &p);
+		follow_show(out, &p.rec, follow_host(mt, &p.rec, p.source), flags, p.packet);
+		free(p.line);
+	}
+}
+
+/***********************************************************************
+ * The follow function will follow the files given as argument and
+ * interprete them and print each logged packet line by line without
  * storing anything in the database. It's just a realtime look at what
  * is logged in a nicely formatted way.
  *
  * PARAMETERS
  *
- * 	char *filename - path/filename of the file to follow
+ * 	char **files - the files to follow, globs are expanded
+ *
+ * 	int nfiles - the number of names in files
+ *
+ * 	char **listen - syslog sockets to receive from, udp:port or
+ * 		unix:path
+ *
+ * 	int nlisten - the number of sockets in listen
  *
  * 	struct ipta_flags *flags - a struct containing various flags
  * 		that may affect this mode
@@ -49,200 +204,139 @@
  *
  **********************************************************************/
 
-int follow(char *filename, 
+int follow(char **files, int nfiles, char **listen, int nlisten,
 	   struct ipta_flags   *flags, 
 	   struct ipta_db_info *dnsdb) {
-	FILE *logfile;
-	int flag_rdns = FLAG_CLEAR;
-	char *line;
-	size_t len = HOSTNAME_MAX_LEN;
+	struct ipta_multitail mt;
+	struct follow_reorder reorder;
+	struct follow_pending pending;
+	struct ipta_output out;
+	struct ipta_record rec;
+	char *line = NULL;
+	size_t len = 0;
 	ssize_t read;
-	char prefix[]=IPTA_LINE_PREFIX;
-	char *log_action;
-	char *log_ifin;
-	char *log_ifout;
-	char *log_mac;
-	char *log_src;
-	char *log_dst;
-	char *log_proto;
-	char *log_src_port;
-	char *log_dst_port;
-	char *dummy;
-	char *token;
-	char nullstring[] = "";
-	int line_count = 0;
-	int packet_count = 0;
-	char src_hostname[HOSTNAME_MAX_LEN];
-	char dst_hostname[HOSTNAME_MAX_LEN];
-	int hostname_len = 30;
+	int source;
+	int wait;
+	int reorder_flag = FLAG_CLEAR;
+	unsigned long packet_count = 0;
+	int i;
 	int retval = RETVAL_OK;
-	time_t t = 0;
-	struct tm tm;
-	
 
-	line = calloc(256, 1);
+	memset(&reorder, 0, sizeof(reorder));
+	memset(&mt, 0, sizeof(mt));
+	mt.inotify_fd = mt.epoll_fd = -1;
 
-	logfile = fopen(filename, "r");
-	if(!logfile) {
-		fprintf(stderr, "! ERROR: Unable to open the file %s.\n", filename);
+	if(output_init(&out, STDOUT_FILENO, flags))
+		return RETVAL_ERROR;
+
+	// Start at the end of the files unless we have a flag to show the history as well
+	retval = multitail_open(&mt, files, nfiles, flags->scan);
+	if(retval) {
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
-	
-	// Seek to the end of the file unless we have a flag to show the history as well
-	if(flags->scan == 0) {
-		retval = fseek(logfile, 0L, SEEK_END);
-		if(0 != retval) {
-			fprintf(stderr, "! Error seeking to end of log file. Exiting.\n");
+	for(i = 0; i < nlisten; i++) {
+		if(multitail_listen(&mt, listen[i])) {
 			retval = RETVAL_ERROR;
 			goto clean_exit;
 		}
 	}
 
-	
-	// Set the flag if we want RDNS
-	if(flags->rdns)
-		flag_rdns = FLAG_SET;
+	if(!mt.count && !mt.receivers) {
+		fprintf(stderr, "! Error, no log files or syslog sockets given.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	// Merged logs are put in time order, a single log already is
+	if((mt.count > 1 || mt.receivers) && flags->reorder_ms) {
+		reorder.heap = calloc(FOLLOW_REORDER_MAX, sizeof(struct follow_pending));
+		if(!reorder.heap) {
+			fprintf(stderr, "! Error, memory allocation failed.\n");
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		reorder_flag = FLAG_SET;
+	}
+
+	signal(SIGUSR1, follow_sigusr1);
 
+	// Lookups are done in the background so a slow name server
+	// never stalls the display
+	if(flags->rdns) {
+		if(dns_resolver_start(dnsdb, flags->dns_threads)) {
+			fprintf(stderr, "! Error, unable to start the DNS resolver.\n");
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+	}
 
 	// Actually this goes on until CTRL-C is pressed, so we will actually never return from this 
 	// function once we started the following.
   	while (1) {
-		read = getline(&line, &len, logfile);
+		read = multitail_getline(&mt, &line, &len, &source);
+
+		if(dns_stats_requested) {
+			dns_stats_requested = 0;
+			output_flush(&out);
+			dns_stats_print(stderr);
+		}
 
 		if(read == -1) {
 			if(flags->scan)
 				break;
-			sleep(1);
+			// Show what we have and sleep until a log is written
+			// to or a held packet is due
+			follow_release(&reorder, &out, &mt, flags, FLAG_CLEAR);
+			if(output_flush(&out))
+				break;
+			wait = -1;
+			if(reorder.count) {
+				wait = reorder.heap[0].due - follow_now_ms();
+				if(wait < 0)
+					wait = 0;
+			}
+			multitail_wait(&mt, wait);
 			continue;
-		} else {
-			// We only want lines that contains the prefix
-			if(strstr(line, prefix)) {
-				dummy = strtok(line, " ");
-	
-				// Wind until marker found
-				do {
-					dummy = strtok(NULL, " ");
-				} while (strcmp(dummy, "IPT:"));
-	
-				log_action = strtok(NULL, " ");
+		}
 
-				packet_count++;
-	
-				// Clear records for next run
-				log_ifin = log_ifout = log_mac = log_src = log_dst = 
-					log_proto = log_src_port = log_dst_port = nullstring;
-		
-				// In here we process the known prefixes and the data * from each field in the log
-				// string. Fields that are * not known are just ignored silently. Anything that is
-				// changed or added here needs to reflect the database
-	
-				while ((token = strtok(NULL, " "))) {
-					if(!strncmp("ACTION=", token, 7)) {
-						log_action = token + strlen("ACTION=");
-						continue;
-					}
-					if(!strncmp("IN=", token, 3)) {
-						log_ifin = token + strlen("IN=");
-						continue;
-					}
-					if(!strncmp("OUT=", token, 4)) {
-						log_ifout = token + strlen("OUT=");
-						continue;
-					}
-					if(!strncmp("MAC=", token, 4)) {
-						log_mac = token + strlen("MAC=");
-						continue;
-					}
-					if(!strncmp("SRC=", token, 4)) {
-						log_src = token + strlen("SRC=");
-						if(flag_rdns) {
-							retval = get_host_by_addr(log_src, src_hostname, hostname_len, dnsdb);
-							if(retval != 0) 
-								strcpy(src_hostname, log_src);
-						}
-						continue;
-					}
-					if(!strncmp("DST=", token, 4)) {
-						log_dst = token + strlen("DST=");
-						if(flag_rdns) {
-							retval = get_host_by_addr(log_dst, dst_hostname, hostname_len, dnsdb);
-							if(retval != 0) 
-								strcpy(src_hostname, log_dst);
-						}
-						continue;
-					}
-					if(!strncmp("PROTO=", token, 6)) {
-						log_proto = token + strlen("PROTO=");
-						continue;
-					}
-					if(!strncmp("SPT=", token, 4)) {
-						log_src_port = token + strlen("SPT=");
-						continue;
-					}
-					if(!strncmp("DPT=", token, 4)) {
-						log_dst_port = token + strlen("DPT=");
-						continue;
-					}
-				}
-
-				if(!(flags->no_lo && (!strcmp(log_ifin, "lo") || !strcmp(log_ifout, "lo")))) {
-					if(!(flags->no_accept && !strcmp("ACCEPT", log_action))) {
-						
-						// Time to print the line in a nice formatted way
-						t = time(NULL);
-						tm = *localtime(&t);
-						if(line_count == 0) {
-							printf("\n");
-							if(flags->no_counter == FLAG_SET) {
-								if(flags->no_follow_header != FLAG_SET) {
-printf("Time     IF       Source                          Port Destination                     Port Proto      Action    \n");
-printf("-------- -------- ------------------------------ ----- ------------------------------ ----- ---------- ----------\n");
-								}
-
-							}
-							else {
-								if(flags->no_follow_header != FLAG_SET) {
-printf("Time     Count    IF       Source                          Port Destination                     Port Proto      Action    \n");
-printf("-------- -------- -------- ------------------------------ ----- ------------------------------ ----- ---------- ----------\n");
-								}
-							}
-						}
-	
-						line_count++;
-	
-						if(line_count >= 20)
-							line_count = 0;
-						if(flags->no_counter == FLAG_SET) {
-							printf("%02d:%02d:%02d %-8s %-30s %5d %-30s %5d %-10s %-10s\n",
-							       tm.tm_hour, tm.tm_min, tm.tm_sec,
-							       strcmp("", log_ifin) ? log_ifin : log_ifout,
-							       flag_rdns ? src_hostname : log_src,
-							       atoi(log_src_port),
-							       flag_rdns ? dst_hostname : log_dst,
-							       atoi(log_dst_port),
-							       log_proto,
-							       log_action);
-						} else {
-							printf("%02d:%02d:%02d %8d %-8s %-30s %5d %-30s %5d %-10s %-10s\n",
-							       tm.tm_hour, tm.tm_min, tm.tm_sec,
-							       packet_count,
-							       strcmp("", log_ifin) ? log_ifin : log_ifout,
-							       flag_rdns ? src_hostname : log_src,
-							       atoi(log_src_port),
-							       flag_rdns ? dst_hostname : log_dst,
-							       atoi(log_dst_port),
-							       log_proto,
-							       log_action);
-						}
-					}
-				}
+		if(reorder_flag) {
+			// The copy is parsed so the record stays valid while held
+			if(!strstr(line, IPTA_LINE_PREFIX))
+				continue;
+			if(reorder.count == FOLLOW_REORDER_MAX)
+				follow_release(&reorder, &out, &mt, flags, FLAG_SET);
+			memset(&pending, 0, sizeof(pending));
+			pending.line = strdup(line);
+			if(!pending.line || parse_line(pending.line, &pending.rec) != RETVAL_OK ||
+			   !filter_packet(flags, &pending.rec)) {
+				free(pending.line);
+				continue;
 			}
+			pending.packet = ++packet_count;
+			pending.source = source;
+			pending.timestamp = pending.rec.timestamp ? pending.rec.timestamp : time(NULL);
+			pending.due = follow_now_ms() + flags->reorder_ms;
+			follow_push(&reorder, &pending);
+			follow_release(&reorder, &out, &mt, flags, FLAG_CLEAR);
+		} else if(parse_line(line, &rec) == RETVAL_OK && filter_packet(flags, &rec)) {
+			packet_count++;
+			follow_show(&out, &rec, follow_host(&mt, &rec, source), flags, packet_count);
 		}
+
+		if(output_due(&out) && output_flush(&out))
+			break;
 	}
+	follow_release(&reorder, &out, &mt, flags, FLAG_SET);
+	output_flush(&out);
 	
 clean_exit:
-	fclose(logfile);
+	dns_resolver_stop();
+	if(flags->rdns)
+		dns_stats_print(stderr);
+	multitail_close(&mt);
+	output_free(&out);
+	free(reorder.heap);
 	free(line);
 
 	return retval;
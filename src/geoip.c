@@ -0,0 +1,597 @@
+/**********************************************************************
+ * geoip.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Country and AS number of an address
+ *
+ * The free address range dumps (ip-to-asn, db-ip lite and the like)
+ * are CSV or TSV files with one range per line. They are compiled
+ * once with --geoip-compile into an index file that is mmap()ed and
+ * searched in place, so a lookup allocates nothing and costs a few
+ * cache misses.
+ *
+ * Layout: a header, then the IPv4 ranges in Eytzinger order, the
+ * order of a breadth first walk of a balanced search tree. The search
+ * goes from an element to element 2k or 2k + 1, so the next elements
+ * are next to each other in memory and can be prefetched, which a
+ * plain binary search over a sorted array can not do. The end
+ * addresses are kept in an array of their own, that is all the
+ * search touches. The IPv6 ranges are sorted and binary searched,
+ * then comes the table of AS names.
+ ***********************************************************************/
+
+#define GEOIP_MAGIC "IPTAGEO1"
+#define GEOIP_FIELDS 6
+
+struct geoip_header {
+	char magic[8];
+	uint32_t count4;
+	uint32_t count6;
+	uint64_t ends4;           /* File offsets of the sections */
+	uint64_t ranges4;
+	uint64_t ranges6;
+	uint64_t names;
+	uint64_t names_size;
+};
+
+struct geoip_range4 {
+	uint32_t start;
+	uint32_t asn;
+	uint32_t name;            /* Offset in the name table */
+	char country[2];
+	char pad[2];
+};
+
+struct geoip_range6 {
+	uint64_t start[2];        /* High and low half */
+	uint64_t end[2];
+	uint32_t asn;
+	uint32_t name;
+	char country[2];
+	char pad[6];
+};
+
+/* A range as read from the CSV, before the index is written */
+struct geoip_source {
+	unsigned __int128 start;
+	unsigned __int128 end;
+	uint32_t asn;
+	uint32_t name;
+	char country[2];
+	int v6;
+};
+
+struct geoip_index {
+	void *map;
+	size_t size;
+	struct geoip_header *header;
+	uint32_t *ends4;          /* 1-based, element 0 is not used */
+	struct geoip_range4 *ranges4;
+	struct geoip_range6 *ranges6;
+	char *names;
+};
+
+static struct geoip_index *geoip = NULL;
+
+static unsigned __int128 geoip_from_bytes(unsigned char *p)
+{
+	unsigned __int128 a = 0;
+	int i;
+
+	for(i = 0; i < 16; i++)
+		a = (a << 8) | p[i];
+	return a;
+}
+
+/* An address as text, or an IPv4 address as a number */
+static int geoip_parse_address(char *s, unsigned __int128 *a, int *v6)
+{
+	unsigned char bytes[16];
+	unsigned int v4;
+	char *end;
+
+	if(cidr_parse_v4(s, &v4) == RETVAL_OK) {
+		*a = v4;
+		*v6 = FLAG_CLEAR;
+	} else if(inet_pton(AF_INET6, s, bytes) == 1) {
+		*a = geoip_from_bytes(bytes);
+		*v6 = FLAG_SET;
+	} else {
+		*a = strtoul(s, &end, 10);
+		if(*end || end == s || *a > 0xffffffffUL)
+			return RETVAL_ERROR;
+		*v6 = FLAG_CLEAR;
+	}
+	return RETVAL_OK;
+}
+
+/* Splits a CSV or TSV line in place, quotes are removed */
+static int geoip_split(char *line, char **field)
+{
+	char *p = line;
+	int n = 0;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	while(n < GEOIP_FIELDS) {
+		if(*p == '"') {
+			field[n++] = ++p;
+			p = strchr(p, '"');
+			if(!p)
+				break;
+			*p++ = '\0';
+		} else {
+			field[n++] = p;
+			p += strcspn(p, ",\t");
+		}
+		if(*p != ',' && *p != '\t')
+			break;
+		*p++ = '\0';
+	}
+	return n;
+}
+
+static int geoip_asn(char *s, uint32_t *asn)
+{
+	char *end;
+
+	if(!strncasecmp(s, "AS", 2))
+		s += 2;
+	*asn = strtoul(s, &end, 10);
+	return *end || end == s ? RETVAL_ERROR : RETVAL_OK;
+}
+
+static int geoip_country(char *s)
+{
+	return strlen(s) == 2 && isalpha((unsigned char)s[0]) && isalpha((unsigned char)s[1]);
+}
+
+static int geoip_compare(const void *a, const void *b)
+{
+	const struct geoip_source *x = a, *y = b;
+
+	if(x->v6 != y->v6)
+		return x->v6 - y->v6;
+	if(x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return 0;
+}
+
+/* Lays out the sorted ends in Eytzinger order */
+static uint32_t geoip_eytzinger(struct geoip_source *sorted, uint32_t i, uint32_t k, uint32_t n,
+				uint32_t *ends, struct geoip_range4 *ranges)
+{
+	if(k > n)
+		return i;
+	i = geoip_eytzinger(sorted, i, 2 * k, n, ends, ranges);
+	ends[k] = (uint32_t)sorted[i].end;
+	ranges[k].start = (uint32_t)sorted[i].start;
+	ranges[k].asn = sorted[i].asn;
+	ranges[k].name = sorted[i].name;
+	memcpy(ranges[k].country, sorted[i].country, 2);
+	return geoip_eytzinger(sorted, i + 1, 2 * k + 1, n, ends, ranges);
+}
+
+/* Adds an AS name to the name table, the same name is stored once */
+static uint32_t geoip_name(char **names, size_t *size, size_t *used, uint32_t *hash,
+			   size_t hash_size, char *name)
+{
+	uint32_t h = 2166136261U;
+	size_t len = strlen(name) + 1;
+	char *p;
+	char *s;
+
+	if(!*name)
+		return 0;
+	for(s = name; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	for(h %= hash_size; hash[h]; h = (h + 1) % hash_size)
+		if(!strcmp(*names + hash[h], name))
+			return hash[h];
+
+	if(*used + len > *size) {
+		*size = 2 * (*size + len);
+		p = realloc(*names, *size);
+		if(!p)
+			return 0;
+		*names = p;
+	}
+	memcpy(*names + *used, name, len);
+	hash[h] = *used;
+	*used += len;
+	return hash[h];
+}
+
+/***********************************************************************
+ * geoip_compile
+ *
+ * Reads the range files and writes the index to filename. A line has
+ * the first and last address of a range, then an AS number and AS
+ * name, an AS number, country and AS name, or a country. The files
+ * may be mixed, for example one for IPv4 and one for IPv6, but the
+ * ranges must not overlap; a range that does is skipped.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int geoip_compile(char *filename, char **csv, int ncsv)
+{
+	struct geoip_header header;
+	struct geoip_source *src = NULL;
+	struct geoip_source *r;
+	struct geoip_range4 *ranges4 = NULL;
+	struct geoip_range6 *ranges6 = NULL;
+	uint32_t *ends4 = NULL;
+	uint32_t *hash = NULL;
+	size_t hash_size = 1 << 20;
+	size_t count = 0, size = 0, n, i;
+	char *names = NULL;
+	size_t names_size = 0, names_used = 1;
+	char *field[GEOIP_FIELDS] = { NULL };
+	char tmpname[PATH_MAX];
+	char *line = NULL;
+	size_t len = 0;
+	long bad = 0, overlap = 0;
+	int nfields, v6, f;
+	FILE *in = NULL, *out = NULL;
+	void *p;
+	int retval = RETVAL_OK;
+
+	hash = calloc(hash_size, sizeof(uint32_t));
+	names = calloc(1, 1);
+	names_size = 1;
+	if(!hash || !names) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	for(f = 0; f < ncsv; f++) {
+		in = fopen(csv[f], "r");
+		if(!in) {
+			fprintf(stderr, "! Error, unable to open %s.\n", csv[f]);
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		while(getline(&line, &len, in) != -1) {
+			if(line[0] == '#')
+				continue;
+			nfields = geoip_split(line, field);
+			if(nfields < 3)
+				continue;
+			if(count == size) {
+				size = size ? 2 * size : 65536;
+				p = realloc(src, size * sizeof(struct geoip_source));
+				if(!p) {
+					fprintf(stderr, "! Error, memory allocation failed.\n");
+					retval = RETVAL_ERROR;
+					goto clean_exit;
+				}
+				src = p;
+			}
+			r = &src[count];
+			memset(r, 0, sizeof(struct geoip_source));
+			if(geoip_parse_address(field[0], &r->start, &r->v6) ||
+			   geoip_parse_address(field[1], &r->end, &v6) || v6 != r->v6 ||
+			   r->end < r->start) {
+				bad++;
+				continue;
+			}
+			if(geoip_asn(field[2], &r->asn) == RETVAL_OK) {
+				// asn, country, name or asn, name
+				if(nfields >= 5 && geoip_country(field[3])) {
+					memcpy(r->country, field[3], 2);
+					r->name = geoip_name(&names, &names_size, &names_used,
+							     hash, hash_size, field[4]);
+				} else if(nfields >= 4) {
+					r->name = geoip_name(&names, &names_size, &names_used,
+							     hash, hash_size, field[3]);
+				}
+			} else if(geoip_country(field[2])) {
+				memcpy(r->country, field[2], 2);
+			} else {
+				bad++;
+				continue;
+			}
+			r->country[0] = toupper((unsigned char)r->country[0]);
+			r->country[1] = toupper((unsigned char)r->country[1]);
+			count++;
+		}
+		fclose(in);
+		in = NULL;
+	}
+
+	qsort(src, count, sizeof(struct geoip_source), geoip_compare);
+	for(i = 1, n = count ? 1 : 0; i < count; i++) {
+		if(src[i].v6 == src[n - 1].v6 && src[i].start <= src[n - 1].end) {
+			overlap++;
+			continue;
+		}
+		src[n++] = src[i];
+	}
+	count = n;
+	for(n = 0; n < count && !src[n].v6; n++)
+		;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, GEOIP_MAGIC, 8);
+	header.count4 = n;
+	header.count6 = count - n;
+	header.ends4 = sizeof(header);
+	header.ranges4 = (header.ends4 + (n + 1) * sizeof(uint32_t) + 15) & ~15ULL;
+	header.ranges6 = (header.ranges4 + (n + 1) * sizeof(struct geoip_range4) + 15) & ~15ULL;
+	header.names = header.ranges6 + header.count6 * sizeof(struct geoip_range6);
+	header.names_size = names_used;
+
+	ends4 = calloc(n + 1, sizeof(uint32_t));
+	ranges4 = calloc(n + 1, sizeof(struct geoip_range4));
+	ranges6 = calloc(header.count6 + 1, sizeof(struct geoip_range6));
+	if(!ends4 || !ranges4 || !ranges6) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	geoip_eytzinger(src, 0, 1, n, ends4, ranges4);
+	for(i = n; i < count; i++) {
+		r = &src[i];
+		ranges6[i - n].start[0] = r->start >> 64;
+		ranges6[i - n].start[1] = (uint64_t)r->start;
+		ranges6[i - n].end[0] = r->end >> 64;
+		ranges6[i - n].end[1] = (uint64_t)r->end;
+		ranges6[i - n].asn = r->asn;
+		ranges6[i - n].name = r->name;
+		memcpy(ranges6[i - n].country, r->country, 2);
+	}
+
+	// Written next to the old index and renamed, so a running ipta
+	// keeps the index it has mapped
+	snprintf(tmpname, sizeof(tmpname), "%s.new", filename);
+	out = fopen(tmpname, "w");
+	if(!out) {
+		fprintf(stderr, "! Error, unable to create %s.\n", tmpname);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	if(fwrite(&header, sizeof(header), 1, out) != 1 ||
+	   fwrite(ends4, sizeof(uint32_t), n + 1, out) != n + 1 ||
+	   fseeko(out, header.ranges4, SEEK_SET) ||
+	   fwrite(ranges4, sizeof(struct geoip_range4), n + 1, out) != n + 1 ||
+	   fseeko(out, header.ranges6, SEEK_SET) ||
+	   fwrite(ranges6, sizeof(struct geoip_range6), header.count6, out) != header.count6 ||
+	   fwrite(names, 1, names_used, out) != names_used ||
+	   fclose(out)) {
+		out = NULL;
+		fprintf(stderr, "! Error writing %s.\n", tmpname);
+		unlink(tmpname);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	out = NULL;
+	if(rename(tmpname, filename)) {
+		fprintf(stderr, "! Error, unable to replace %s.\n", filename);
+		unlink(tmpname);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	fprintf(stderr, "* Wrote %s with %u IPv4 and %u IPv6 ranges.\n",
+		filename, header.count4, header.count6);
+	if(bad)
+		fprintf(stderr, "- %ld lines were not understood and skipped.\n", bad);
+	if(overlap)
+		fprintf(stderr, "- %ld overlapping ranges were skipped.\n", overlap);
+
+clean_exit:
+	if(in)
+		fclose(in);
+	if(out)
+		fclose(out);
+	free(line);
+	free(src);
+	free(hash);
+	free(names);
+	free(ends4);
+	free(ranges4);
+	free(ranges6);
+	return retval;
+}
+
+/***********************************************************************
+ * geoip_open
+ *
+ * Maps an index written by geoip_compile().
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int geoip_open(char *filename)
+{
+	struct geoip_header *h;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "! Error, unable to open the GeoIP index %s.\n", filename);
+		if(fd >= 0)
+			close(fd);
+		return RETVAL_ERROR;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "! Error, unable to map the GeoIP index %s.\n", filename);
+		return RETVAL_ERROR;
+	}
+	h = map;
+	if((size_t)st.st_size < sizeof(struct geoip_header) || memcmp(h->magic, GEOIP_MAGIC, 8) ||
+	   h->names + h->names_size != (uint64_t)st.st_size) {
+		fprintf(stderr, "! Error, %s is not a GeoIP index, make it with --geoip-compile.\n",
+			filename);
+		munmap(map, st.st_size);
+		return RETVAL_ERROR;
+	}
+
+	geoip_close();
+	geoip = calloc(1, sizeof(struct geoip_index));
+	if(!geoip) {
+		munmap(map, st.st_size);
+		return RETVAL_ERROR;
+	}
+	geoip->map = map;
+	geoip->size = st.st_size;
+	geoip->header = h;
+	geoip->ends4 = (uint32_t *)((char *)map + h->ends4);
+	geoip->ranges4 = (struct geoip_range4 *)((char *)map + h->ranges4);
+	geoip->ranges6 = (struct geoip_range6 *)((char *)map + h->ranges6);
+	geoip->names = (char *)map + h->names;
+	return RETVAL_OK;
+}
+
+int geoip_active(void)
+{
+	return geoip != NULL;
+}
+
+void geoip_close(void)
+{
+	if(!geoip)
+		return;
+	munmap(geoip->map, geoip->size);
+	free(geoip);
+	geoip = NULL;
+}
+
+/***********************************************************************
+ * geoip_lookup4
+ *
+ * Looks up an IPv4 address given as a number, as stored in the logs
+ * table. The first range that ends at or after the address is found
+ * with a branch free descent of the Eytzinger array, then its start
+ * is checked.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - geo is filled in
+ *
+ * 	RETVAL_WARN - the address is in no range
+ ***********************************************************************/
+int geoip_lookup4(unsigned int address, struct ipta_geo *geo)
+{
+	const uint32_t *ends;
+	uint32_t n, k = 1;
+	struct geoip_range4 *r;
+
+	if(!geoip || !geoip->header->count4)
+		return RETVAL_WARN;
+	ends = geoip->ends4;
+	n = geoip->header->count4;
+	while(k <= n) {
+		__builtin_prefetch(ends + 16 * k);
+		k = 2 * k + (ends[k] < address);
+	}
+	k >>= __builtin_ffs(~k);
+	if(!k)
+		return RETVAL_WARN;
+
+	r = &geoip->ranges4[k];
+	if(r->start > address)
+		return RETVAL_WARN;
+	geo->country[0] = r->country[0];
+	geo->country[1] = r->country[1];
+	geo->country[2] = '\0';
+	geo->asn = r->asn;
+	geo->name = geoip->names + r->name;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * geoip_lookup
+ *
+ * Looks up an address as text from a log line, IPv4 or IPv6.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - geo is filled in
+ *
+ * 	RETVAL_WARN - the address is in no range, or not an address
+ ***********************************************************************/
+int geoip_lookup(char *address, struct ipta_geo *geo)
+{
+	unsigned char bytes[16];
+	unsigned __int128 a, s, e;
+	struct geoip_range6 *r;
+	unsigned int v4;
+	int low, high, mid;
+
+	if(!geoip)
+		return RETVAL_WARN;
+	if(cidr_parse_v4(address, &v4) == RETVAL_OK)
+		return geoip_lookup4(v4, geo);
+	if(inet_pton(AF_INET6, address, bytes) != 1)
+		return RETVAL_WARN;
+
+	a = geoip_from_bytes(bytes);
+	low = 0;
+	high = (int)geoip->header->count6 - 1;
+	while(low <= high) {
+		mid = (low + high) / 2;
+		r = &geoip->ranges6[mid];
+		s = ((unsigned __int128)r->start[0] << 64) | r->start[1];
+		e = ((unsigned __int128)r->end[0] << 64) | r->end[1];
+		if(a < s) {
+			high = mid - 1;
+		} else if(a > e) {
+			low = mid + 1;
+		} else {
+			geo->country[0] = r->country[0];
+			geo->country[1] = r->country[1];
+			geo->country[2] = '\0';
+			geo->asn = r->asn;
+			geo->name = geoip->names + r->name;
+			return RETVAL_OK;
+		}
+	}
+	return RETVAL_WARN;
+}
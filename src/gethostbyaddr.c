@@ -44,7 +44,7 @@
 char *dns_host_trim(char *s, int maxlen) 
 {
 	if(strlen(s) > maxlen) {
-		memmove(s, s + (strlen(s)-maxlen),maxlen);
+		memmove(s, s + (strlen(s)-maxlen), maxlen + 1);
 		s[0] = '*';
 	}
 	return s;
@@ -72,14 +72,25 @@ int get_host_by_addr(char *ip_address, char *hostname, int maxlen,
 	char service[NI_MAXSERV];     // Holding service
 	int retval = RETVAL_OK;
 	int dns_reply = 0;
+	long long start;
 
-	// Check if the answer is in the cache
-	retval = dns_cache_get(db, ip_address, hostname, "300"); // Fixme: Should be controlled by user
+	// Check if the answer is in the cache, the cache file is used
+	// instead of the database when one is given.
+	start = dns_stats_now();
+	if(dns_file_cache_active())
+		retval = dns_file_cache_get(ip_address, hostname, maxlen);
+	else
+		retval = dns_cache_get(db, ip_address, hostname, "300"); // Fixme: Should be controlled by user
+	dns_stats_time(DNS_TIME_CACHE_GET, start);
 	if(!retval) {
-		// Found the cache, return this answer
+		// Found the cache, return this answer. An address cached as
+		// its own name is a negative answer.
+		dns_stats_count(strcmp(hostname, ip_address) ?
+				DNS_STAT_CACHE_HIT : DNS_STAT_CACHE_NEGATIVE);
 		dns_host_trim(hostname, maxlen);
 		return RETVAL_OK;
 	}
+	dns_stats_count(DNS_STAT_CACHE_MISS);
 	
 	// Not found in cache, try to look it up
 	memset(&ip4addr, 0, sizeof(struct sockaddr_in));
@@ -92,14 +103,28 @@ int get_host_by_addr(char *ip_address, char *hostname, int maxlen,
 	inet_pton(AF_INET, ip_address, &ip4addr.sin_addr);
 	
 	// Call the DNS subsystem
+	start = dns_stats_now();
 	dns_reply = getnameinfo((struct sockaddr *) &ip4addr, sizeof(struct sockaddr_in), 
-				host, NI_MAXHOST, service, NI_MAXSERV, NI_NUMERICSERV);
+				host, NI_MAXHOST, service, NI_MAXSERV, NI_NUMERICSERV | NI_NAMEREQD);
+	dns_stats_time(DNS_TIME_RESOLVE, start);
+	if(dns_reply == 0)
+		dns_stats_count(DNS_STAT_RESOLVE_OK);
+	else if(dns_reply == EAI_AGAIN)
+		dns_stats_count(DNS_STAT_RESOLVE_TIMEOUT);
+	else
+		dns_stats_count(DNS_STAT_RESOLVE_FAIL);
 	
 	// If we got a name then we copy the name to maxlen characters into the
 	// hostname pointer provided by the call.
 	if (dns_reply == 0) {
 		// Record found, put it in the cache, or if exists update it
-		retval = dns_cache_add(db, ip_address, host);
+		start = dns_stats_now();
+		if(dns_file_cache_active())
+			retval = dns_file_cache_add(ip_address, host);
+		else
+			retval = dns_cache_add(db, ip_address, host);
+		dns_stats_time(DNS_TIME_CACHE_ADD, start);
+		dns_stats_count(retval ? DNS_STAT_CACHE_WRITE_FAIL : DNS_STAT_CACHE_WRITE);
 		if(retval)
 			fprintf(stderr, "! Warning, failed to add new hostname to cache.\n");
 		
@@ -115,7 +140,13 @@ int get_host_by_addr(char *ip_address, char *hostname, int maxlen,
 		strncpy(hostname, ip_address, maxlen);
 
 		// But... also put it in the cache with ip address for host name
-		retval = dns_cache_add(db, ip_address, ip_address);
+		start = dns_stats_now();
+		if(dns_file_cache_active())
+			retval = dns_file_cache_add(ip_address, ip_address);
+		else
+			retval = dns_cache_add(db, ip_address, ip_address);
+		dns_stats_time(DNS_TIME_CACHE_ADD, start);
+		dns_stats_count(retval ? DNS_STAT_CACHE_WRITE_FAIL : DNS_STAT_CACHE_WRITE);
 		if(retval)
 			fprintf(stderr, "! Warning, failed to add new hostname to cache.\n");
 
@@ -22,278 +22,578 @@
  * long as you do not violate any terms and condition in the LICENCE.
  **********************************************************************/
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <mysql.h>
 #include <time.h>
+#include <zlib.h>
 
 #include "ipta.h"
 
-int import_syslog(struct ipta_db_info *db_info, char *filename)
+/***********************************************************************
+ * Importing log files
+ *
+ * --import takes any number of files and directories. The files are
+ * read by import_threads threads that each write over a connection of
+ * their own, committing every commit_rows rows. The work is a list of
+ * parts: a plain log larger than IMPORT_CHUNK_SIZE is cut into parts
+ * of that many bytes, a part owns the lines that start in it. A gzip
+ * file can not be cut and is one part, so is a pcap of NFLOG packets.
+ * The parts that can not be cut are put first, largest first, so a big
+ * one is not started last while the other threads run dry. A thread
+ * takes the next part when it is done with one, until there are none
+ * left.
+ *
+ * A file that fails does not stop the others, the failures are
+ * listed when all files are done.
+ ***********************************************************************/
+
+struct import_file {
+	char *name;
+	off_t size;
+	int gz;                   /* Read through zlib, can not be cut */
+	int pcap;                 /* NFLOG capture, see import_nflog() */
+	long lines;
+	long packets;
+	unsigned long rejected;   /* Rows the database did not take */
+	const char *error;        /* Why it failed, NULL if it did not */
+};
+
+struct import_part {
+	struct import_file *file;
+	off_t start;
+	off_t end;                /* -1 for the end of the file */
+};
+
+struct import_job {
+	struct ipta_db_info *db;
+	struct ipta_flags *flags;
+	struct import_part *part;
+	int parts;
+	int next;                 /* First part not taken by a thread */
+	pthread_mutex_t lock;
+	unsigned long inserted;
+	unsigned long rejected;
+	long lines;               /* For the progress line */
+	int threads;
+	time_t start;
+	time_t shown;
+	int failed;               /* A write outside of a file failed */
+};
+
+/* The gzip magic, zlib reads other files as they are as well */
+static int import_is_gz(char *filename)
+{
+	unsigned char magic[2];
+	FILE *file;
+	int found = FLAG_CLEAR;
+
+	file = fopen(filename, "r");
+	if(!file)
+		return FLAG_CLEAR;
+	if(fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+	   magic[0] == 0x1f && magic[1] == 0x8b)
+		found = FLAG_SET;
+	fclose(file);
+	return found;
+}
+
+/* Like getline() but through zlib */
+static ssize_t import_getline(gzFile gz, char **line, size_t *len)
 {
-	FILE *logfile = NULL;
+	size_t used = 0;
+	char *p;
+
+	if(!*line) {
+		*len = IMPORT_LINE_LEN;
+		*line = malloc(*len);
+		if(!*line)
+			return -1;
+	}
+	while(gzgets(gz, *line + used, *len - used)) {
+		used += strlen(*line + used);
+		if(used < *len - 1 || (*line)[used - 1] == '\n')
+			return used;
+		// The line did not fit, make room for the rest of it
+		p = realloc(*line, *len * 2);
+		if(!p)
+			return -1;
+		*line = p;
+		*len *= 2;
+	}
+	return used ? (ssize_t)used : -1;
+}
+
+/***********************************************************************
+ * import_add_file
+ *
+ * Adds a file to the list, or all files in a directory in name order.
+ * Hidden files and subdirectories are left out.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on memory allocation failure
+ ***********************************************************************/
+static int import_add_file(struct import_file **file, int *count, int *size, char *name)
+{
+	struct import_file *p;
+	struct dirent **entry = NULL;
+	struct stat st;
+	char path[PATH_MAX];
+	int n, i;
+	int retval = RETVAL_OK;
+
+	if(!stat(name, &st) && S_ISDIR(st.st_mode)) {
+		n = scandir(name, &entry, NULL, alphasort);
+		if(n < 0) {
+			fprintf(stderr, "! Error, unable to read the directory %s.\n", name);
+			return RETVAL_OK;
+		}
+		for(i = 0; i < n; i++) {
+			snprintf(path, sizeof(path), "%s/%s", name, entry[i]->d_name);
+			if(entry[i]->d_name[0] != '.' && !stat(path, &st) && S_ISREG(st.st_mode) &&
+			   !retval)
+				retval = import_add_file(file, count, size, path);
+			free(entry[i]);
+		}
+		free(entry);
+		return retval;
+	}
+
+	if(*count == *size) {
+		*size = *size ? 2 * *size : 64;
+		p = realloc(*file, *size * sizeof(struct import_file));
+		if(!p) {
+			fprintf(stderr, "! Error, memory allocation failed.\n");
+			return RETVAL_ERROR;
+		}
+		*file = p;
+	}
+	p = &(*file)[(*count)++];
+	memset(p, 0, sizeof(struct import_file));
+	p->name = strdup(name);
+	if(!p->name) {
+		(*count)--;
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+	if(stat(name, &st)) {
+		// Reported as a failure of this file at the end
+		p->error = "unable to open";
+		return RETVAL_OK;
+	}
+	p->size = st.st_size;
+	p->pcap = nflog_is_pcap(name);
+	p->gz = !p->pcap && import_is_gz(name);
+	return RETVAL_OK;
+}
+
+/* The parts that can not be cut first and largest first */
+static int import_part_order(const void *a, const void *b)
+{
+	const struct import_part *pa = a, *pb = b;
+	int cut_a = !pa->file->gz && !pa->file->pcap;
+	int cut_b = !pb->file->gz && !pb->file->pcap;
+
+	if(cut_a != cut_b)
+		return cut_a - cut_b;
+	if(!cut_a && pa->file->size != pb->file->size)
+		return pa->file->size < pb->file->size ? 1 : -1;
+	if(pa->file != pb->file)
+		return pa->file < pb->file ? -1 : 1;
+	return pa->start < pb->start ? -1 : pa->start > pb->start;
+}
+
+static void import_progress(struct import_job *job, long lines)
+{
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&job->lock);
+	job->lines += lines;
+	if(now != job->shown) {
+		job->shown = now;
+		fprintf(stderr, "- Processed %ld lines in %d seconds  \r",
+			job->lines, (int)(now - job->start));
+	}
+	pthread_mutex_unlock(&job->lock);
+}
+
+/***********************************************************************
+ * import_commit
+ *
+ * With --commit-rows the rows go into transactions of that many rows.
+ * Ends the transaction when it is full, or at once with force, and
+ * starts the next one. *committed is the count of rows of the batch
+ * that are committed.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+static int import_commit(struct import_job *job, struct ipta_batch *batch,
+			 unsigned long *committed, int force)
+{
+	int rows = job->flags->commit_rows;
+
+	// Without a transaction every INSERT is committed by itself
+	if(!batch->con || !rows) {
+		*committed = batch->inserted;
+		if(!batch->con || !force)
+			return RETVAL_OK;
+	} else if(!force && batch->inserted - *committed < (unsigned long)rows) {
+		return RETVAL_OK;
+	}
+	if(db_commit(batch->con) || (rows && db_begin(batch->con))) {
+		fprintf(stderr, "! Error, commit failed: %s\n", db_error(batch->con));
+		return RETVAL_ERROR;
+	}
+	*committed = batch->inserted;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * import_part
+ *
+ * Reads the lines of one part into the batch and writes them.
+ *
+ * RETURNS
+ *
+ * 	NULL - on success
+ *
+ * 	Why the part failed
+ ***********************************************************************/
+static const char *import_part(struct import_job *job, struct import_part *part,
+			       struct ipta_batch *batch, unsigned long *committed)
+{
+	struct ipta_flags *flags = job->flags;
+	struct ipta_record rec;
+	gzFile gz;
 	char *line = NULL;
 	size_t len = 0;
 	ssize_t read;
-//  char *month_string = NULL;
-//  char *day_string = NULL;
-//  char *hour_string = NULL;
-//  char *minute_string = NULL;
-//  char *second_string= NULL;
-	/* int month, day, hour, minute,second = 0; */
-	/* char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul",  */
-	/* 		     "Aug", "Sep", "Oct", "Nov", "Dec" }; */
-	//  char **saveptr = NULL;
-//  int i;
-//  char *dummyptr = NULL;
-	int lines = 0;
-	int row_counter = 0;
-	time_t starttime = 0;
-	//  int worktime = 0;
-	//  char *host = NULL;
-	char *module = NULL;
-	//  char *host_time = NULL;
-	char prefix[]="IPT: ";
-	char *token = NULL;
-	char *log_action = NULL;
-	//  char *log_prefix = NULL;
-	char *log_ifin = NULL;
-	char *log_ifout = NULL;
-	char *log_mac = NULL;
-	char *log_src = NULL;
-	char *log_dst = NULL;
-	//  char *log_len = NULL;
-	char *log_proto = NULL;
-	char *log_src_port = NULL;
-	char *log_dst_port = NULL;
-	char nullstring[] = "";
-	MYSQL *con = NULL;
-	char *query_string = NULL;
-	//  int ptime = 0;
-	int retval = 0;
-	
-	starttime = time(NULL);
-	query_string = malloc(QUERY_STRING_SIZE);
-	
-	if(!query_string) {
-		fprintf(stderr, "! Failed to allocate memory. Fatal error, exiting.");
-		retval = 20;
-		goto clean_exit;
+	off_t offset = part->start;
+	long lines = 0, packets = 0, shown = 0;
+	unsigned long rejected = batch->rejected;
+	const char *error = NULL;
+	int err;
+
+	gz = gzopen(part->file->name, "r");
+	if(!gz) {
+		fprintf(stderr, "! Error, unable to open syslog file %s.\n", part->file->name);
+		return "unable to open";
 	}
-	
-	// Connect to mysql database
-	con = mysql_init(NULL);
-	if(con == NULL) {
-		fprintf(stderr, "! Unable to initialize MySQL connection.\n");
-		fprintf(stderr, "! Error message: %s\n", mysql_error(con));
-		retval = 20;
-		goto clean_exit;
+	gzbuffer(gz, IMPORT_BUFFER_SIZE);
+
+	// The line that ends in this part belongs to the one before,
+	// unless the part before ended right after a newline
+	if(part->start > 0) {
+		if(gzseek(gz, part->start - 1, SEEK_SET) < 0 ||
+		   (read = import_getline(gz, &line, &len)) < 0) {
+			error = "unable to read";
+			goto clean_exit;
+		}
+		offset += read - 1;
 	}
-	
-	if(mysql_real_connect(con, db_info->host, db_info->user, db_info->pass, 
-			      NULL, 0, NULL, 0) == NULL) {
-		fprintf(stderr, "! %s\n", mysql_error(con));
-		retval = 20;
-		goto clean_exit;
+
+	// Rejected rows are told by their line in the file
+	batch->source = part->file->name;
+	batch->source_start = offset;
+	batch->line_base = -1;
+
+	while((part->end < 0 || offset < part->end) &&
+	      (read = import_getline(gz, &line, &len)) != -1) {
+		offset += read;
+		lines++;
+		if(parse_line(line, &rec) != RETVAL_OK || !filter_packet(flags, &rec))
+			continue;
+		packets++;
+
+		// Merged with the packets before, the flows write their
+		// rows to the batch themselves
+		if(flags->flows) {
+			if(flow_add(flags->flows, &rec, lines, batch) ||
+			   import_commit(job, batch, committed, FLAG_CLEAR)) {
+				error = "database error";
+				goto clean_exit;
+			}
+			continue;
+		}
+
+		if(batch_add(batch, &rec, lines)) {
+			if(batch_flush(batch) ||
+			   import_commit(job, batch, committed, FLAG_CLEAR)) {
+				error = "database error";
+				goto clean_exit;
+			}
+			import_progress(job, lines - shown);
+			shown = lines;
+		}
 	}
-	
-	// Select the database to use
-	sprintf(query_string, "USE %s;", db_info->name);
-	if(mysql_query(con, query_string)) {
-		fprintf(stderr, "! Database %s not found, or not possible to connect. \n", 
-			db_info->name);
-		printf("! %s\n", mysql_error(con));
-		retval = 20;
+
+	// A gzip file that ends too soon is damaged
+	gzerror(gz, &err);
+	if(err != Z_OK) {
+		fprintf(stderr, "! Error reading %s: %s\n", part->file->name, gzerror(gz, &err));
+		error = "damaged";
 		goto clean_exit;
 	}
-	
-	// Open log file and prepare for data
-	logfile = fopen(filename, "r");
-	if ( logfile == NULL ) {
-		fprintf(stderr, "! Error, unable to open syslog file %s.\n", filename);
-		retval = 20;
+
+	if(batch_flush(batch) || import_commit(job, batch, committed, FLAG_SET)) {
+		error = "database error";
 		goto clean_exit;
 	}
-  
-	lines = 0;
-	row_counter = 0;
-	
-	while (( read = getline(&line, &len, logfile)) != -1) {
-		lines++;
-		if(strstr(line, prefix)) {
-
-			// This entire part here is in order to future be able to add fields for time stamps to
-			// the database and thereby be able to analyze happenings over time or find some times
-			// more frequent than others and so on.
-
-			/*
-			month_string = strtok(line, " ");
-			day_string = strtok(NULL, " ");
-			hour_string = strtok(NULL, ":");
-			minute_string = strtok(NULL, ":");
-			second_string = strtok(NULL, " ");
-			
-			// Create a ISO date
-			for ( i = 0; i < 12; i++) {
-				if (!strcmp(month_string, months[i]))
-					break;
-			}
-			
-			month = i + 1;
-			errno = 0;
-			
-			day = strtol(day_string, &dummyptr, 10);
-			hour = strtol(hour_string, &dummyptr, 10);
-			minute = strtol(minute_string, &dummyptr, 10);
-			second = strtol(second_string, &dummyptr, 10);
-			if(errno != 0) {
-				fprintf(stderr, "! Error parsing day.\n");
-				retval = 20;
-				goto clean_exit;
-			}
-			
-			host = strtok(NULL, " ");
-			module = strtok(NULL, ": [");
-			host_time = strtok(NULL, "] ");
-			log_prefix = strtok(NULL, " "); 
-			*/
-			
-			// Wind the "tape" until "IPT:" is found
-			module = strtok(line, " ");
-			do {
-				module = strtok(NULL, " ");
-			} while (strcmp(module, "IPT:"));
-			
-			// Next one will be our action here
-			log_action = strtok(NULL, " ");
-			
-			// Clear records for next run
-			log_ifin = log_ifout = log_mac = log_src = log_dst = 
-				log_proto = log_src_port = log_dst_port = nullstring;
-			
-			
-			// In here we process the known prefixes and
-			// the data * from each field in the log
-                        // string. Fields that are * not known are
-                        // just ignored silently. Anything that is
-                        // changed or added here needs to reflect the database
-			
-			while ((token = strtok(NULL, " "))) {
-				if(!strncmp("ACTION=", token, 7)) {
-					log_action = token + strlen("ACTION=");
-					continue;
-				}
-				if(!strncmp("IN=", token, 3)) {
-					log_ifin = token + strlen("IN=");
-					continue;
-				}
-				if(!strncmp("OUT=", token, 4)) {
-					log_ifout = token + strlen("OUT=");
-					continue;
-				}
-				if(!strncmp("MAC=", token, 4)) {
-					log_mac = token + strlen("MAC=");                    
-					continue;
-				}
-				if(!strncmp("SRC=", token, 4)) {
-					log_src = token + strlen("SRC=");
-					continue;
-				}
-				if(!strncmp("DST=", token, 4)) {
-					log_dst = token + strlen("DST=");
-					continue;
-				}
-				if(!strncmp("PROTO=", token, 6)) {
-					log_proto = token + strlen("PROTO=");
-					continue;
-				}
-				if(!strncmp("SPT=", token, 4)) {
-					log_src_port = token + strlen("SPT=");
-					continue;
-				}
-				if(!strncmp("DPT=", token, 4)) {
-					log_dst_port = token + strlen("DPT=");
-					continue;
+
+clean_exit:
+	if(error && part->start > 0)
+		fprintf(stderr, "! Import of %s failed in the part from byte %lld.\n",
+			part->file->name, (long long)part->start);
+	import_progress(job, lines - shown);
+	pthread_mutex_lock(&job->lock);
+	part->file->lines += lines;
+	part->file->packets += packets;
+	part->file->rejected += batch->rejected - rejected;
+	pthread_mutex_unlock(&job->lock);
+	free(line);
+	gzclose(gz);
+	return error;
+}
+
+static void *import_thread(void *arg)
+{
+	struct import_job *job = arg;
+	struct import_part *part;
+	struct ipta_batch batch;
+	struct ipta_db *con = NULL;
+	struct ipta_nflog_count count;
+	unsigned long committed = 0;
+	const char *error;
+
+	if(batch_init(&batch, NULL, job->db->table,
+		      job->flags->archive ? ARCHIVE_BLOCK_ROWS : IMPORT_BATCH_ROWS)) {
+		pthread_mutex_lock(&job->lock);
+		job->failed = FLAG_SET;
+		pthread_mutex_unlock(&job->lock);
+		return NULL;
+	}
+	batch.archive = job->flags->archive;
+	batch.reject = job->flags->reject;
+
+	while(1) {
+		pthread_mutex_lock(&job->lock);
+		part = job->next < job->parts ? &job->part[job->next++] : NULL;
+		pthread_mutex_unlock(&job->lock);
+		if(!part)
+			break;
+
+		if(part->file->pcap) {
+			// Its own progress would be mixed up with the other threads
+			memset(&count, 0, sizeof(count));
+			error = import_nflog(job->db, part->file->name, job->flags, &count,
+					     job->threads > 1) ? "import failed" : NULL;
+			import_progress(job, count.records);
+			pthread_mutex_lock(&job->lock);
+			part->file->lines += count.records;
+			part->file->packets += count.packets;
+			part->file->rejected += count.rejected;
+			job->inserted += count.inserted;
+			job->rejected += count.rejected;
+			pthread_mutex_unlock(&job->lock);
+		} else {
+			// The connection is made when it is first needed and
+			// again after a part failed
+			if(!con && !batch.archive) {
+				con = open_db(job->db);
+				if(con && job->flags->commit_rows && db_begin(con)) {
+					fprintf(stderr, "! Error: %s\n", db_error(con));
+					db_close(con);
+					con = NULL;
 				}
+				batch.con = con;
 			}
-			
-			// If row counter is 0 then we should prepare the insert string
-			// with the headers needed.
-			if(row_counter == 0) {
-				sprintf(query_string, "INSERT INTO %s ( if_in, if_out, src_ip, src_prt, dst_ip, " \
-					"dst_prt, proto, action, mac) VALUES ",
-					db_info->table);
-			} else {
-				// Not the first line, then add the comma to previous line and
-				// prepp for adding a new line.
-				sprintf(query_string, "%s,\n", query_string);
-			}
-			
-			// This adds the values to the query string
-			sprintf(query_string, 
-				"%s\n ( '%s', '%s', INET_ATON('%s'), '%s', INET_ATON('%s'), " \
-				"'%s', '%s', '%s', '%s' )", 
-				query_string, log_ifin, log_ifout, log_src, log_src_port, log_dst, log_dst_port, 
-				log_proto, log_action, log_mac);
-			row_counter++;
-			
-			// Every 100 lines we terminate the query string and then call
-			// the MySQL to insert the rows collected. When done we must
-			// reset the row_counter to 0 again.
-			
-			if(row_counter == QUERY_ROW_COUNT) {
-				sprintf(query_string, "%s;", query_string);
-				fprintf(stderr, "- Processed %d lines in %d seconds, %d bytes in query  \r", 
-					lines, (int)time(NULL)-(int)starttime, (int)strlen(query_string) );
-				
-				if(mysql_query(con, query_string)) {
-					printf("\n%s\n", mysql_error(con));
-					retval = RETVAL_ERROR;
-					goto clean_exit;
-				}
-				
-				row_counter = 0;
+			if(!con && !batch.archive)
+				error = "no database connection";
+			else
+				error = import_part(job, part, &batch, &committed);
+			if(error) {
+				// What was not committed goes with the connection
+				batch.count = 0;
+				batch.inserted = committed;
+				if(con)
+					db_close(con);
+				con = NULL;
+				batch.con = NULL;
 			}
 		}
-		free(line);
-		line = NULL;
+
+		if(error) {
+			pthread_mutex_lock(&job->lock);
+			if(!part->file->error)
+				part->file->error = error;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	// With --flow-timeout there is one thread, it writes what is left
+	batch.source = NULL;
+	if(job->flags->flows && (con || batch.archive)) {
+		if(flow_flush(job->flags->flows, &batch) || batch_flush(&batch) ||
+		   import_commit(job, &batch, &committed, FLAG_SET)) {
+			pthread_mutex_lock(&job->lock);
+			job->failed = FLAG_SET;
+			pthread_mutex_unlock(&job->lock);
+		}
 	}
-	
-	// insert any remaining rows not previously inserted
-	if(row_counter != 0) {
-		sprintf(query_string, "%s;", query_string);
-		if(mysql_query(con, query_string)) {
-			fprintf(stderr, "%s\n", mysql_error(con));
+
+	pthread_mutex_lock(&job->lock);
+	job->inserted += batch.inserted;
+	job->rejected += batch.rejected;
+	pthread_mutex_unlock(&job->lock);
+	batch_free(&batch);
+	if(con)
+		db_close(con);
+	return NULL;
+}
+
+/***********************************************************************
+ * import_syslog
+ *
+ * Reads the log files and inserts every iptables line in them into the
+ * logs table, IMPORT_BATCH_ROWS rows per INSERT and commit_rows rows
+ * per transaction. The parsing and the batching are shared with the
+ * ingest mode. Lines that do not pass --filter are left out. A pcap
+ * file of NFLOG packets is handed over to import_nflog(). The archive
+ * and --flow-timeout are written by one thread, in the order of the
+ * files.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - if any file failed, the others are still imported
+ ***********************************************************************/
+int import_syslog(struct ipta_db_info *db_info, char **files, int nfiles,
+		  struct ipta_flags *flags)
+{
+	struct import_file *file = NULL;
+	struct import_job job;
+	pthread_t tid[IMPORT_THREADS_MAX];
+	int count = 0, size = 0, threads, failed = 0;
+	off_t start;
+	int i, n;
+	int retval = RETVAL_OK;
+
+	memset(&job, 0, sizeof(job));
+	pthread_mutex_init(&job.lock, NULL);
+	job.db = db_info;
+	job.flags = flags;
+	job.start = time(NULL);
+
+	for(i = 0; i < nfiles; i++) {
+		if(import_add_file(&file, &count, &size, files[i])) {
 			retval = RETVAL_ERROR;
 			goto clean_exit;
 		}
-	}    
-	
-	sprintf(query_string, "COMMIT;");
-	if(mysql_query(con, query_string)) {
-		fprintf(stderr, "%s\n", mysql_error(con));
+	}
+	if(!count) {
+		fprintf(stderr, "! Error, there are no files to import.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	for(i = n = 0; i < count; i++)
+		n += file[i].gz || file[i].pcap || file[i].error ? 1 :
+			file[i].size / IMPORT_CHUNK_SIZE + 1;
+	job.part = calloc(n, sizeof(struct import_part));
+	if(!job.part) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	for(i = 0; i < count; i++) {
+		if(file[i].error)
+			continue;
+		start = 0;
+		do {
+			job.part[job.parts].file = &file[i];
+			job.part[job.parts].start = start;
+			start += IMPORT_CHUNK_SIZE;
+			// The last part reads to the end, also lines added
+			// since the file was looked at
+			job.part[job.parts].end = file[i].gz || file[i].pcap ||
+				start >= file[i].size ? -1 : start;
+			job.parts++;
+		} while(job.part[job.parts - 1].end >= 0);
+	}
+	qsort(job.part, job.parts, sizeof(struct import_part), import_part_order);
+
+	// The flows and the archive are not shared between threads
+	threads = flags->import_threads;
+	if(flags->flows || flags->archive)
+		threads = 1;
+	if(threads > job.parts)
+		threads = job.parts;
+	if(threads < 1)
+		threads = 1;
+	job.threads = threads;
+
+	for(i = 0; i < threads; i++) {
+		if(pthread_create(&tid[i], NULL, import_thread, &job)) {
+			fprintf(stderr, "! Error, unable to start an import thread.\n");
+			break;
+		}
+	}
+	if(!i) {
 		retval = RETVAL_ERROR;
 		goto clean_exit;
 	}
-	
-	//  worktime = time(NULL) - starttime;
-	
-	fprintf(stderr, "* Processed %d lines in %d seconds\n", 
-		lines, (int)time(NULL)-(int)starttime);
-	
-	fprintf(stderr, "* Done processing file. %d records inserted in database.\n", lines);
-	
-	// Make sure everything is returned nicely after allocation by
-        // us or by some procedure that we are calling
-	
+	for(n = 0; n < i; n++)
+		pthread_join(tid[n], NULL);
+
+	fprintf(stderr, "* Processed %ld lines in %d seconds\n",
+		job.lines, (int)(time(NULL) - job.start));
+
+	for(i = 0; i < count; i++)
+		if(file[i].error)
+			failed++;
+	if(count > 1 || failed) {
+		fprintf(stderr, "\nFile                                          Lines    Packets   Rejected  Status\n");
+		fprintf(stderr, "---------------------------------------- ---------- ---------- ---------- ----------\n");
+		for(i = 0; i < count; i++)
+			fprintf(stderr, "%-40.40s %10ld %10ld %10lu  %s\n", file[i].name, file[i].lines,
+				file[i].packets, file[i].rejected, file[i].error ? file[i].error : "ok");
+		fprintf(stderr, "\n");
+	}
+
+	if(job.failed) {
+		fprintf(stderr, "! Error, the rows left at the end could not be written.\n");
+		retval = RETVAL_ERROR;
+	}
+	if(failed) {
+		fprintf(stderr, "! %d of %d files failed.\n", failed, count);
+		retval = RETVAL_ERROR;
+	}
+	fprintf(stderr, "* Done processing %s. %lu records inserted in %s.\n",
+		count > 1 ? "files" : "file", job.inserted,
+		flags->archive ? "the archive" : "database");
+	if(job.rejected)
+		fprintf(stderr, "- %lu rows were rejected by the database%s.\n", job.rejected,
+			flags->reject ? " and written to the reject file" : "");
+
 clean_exit:
-	
-	free(line);
-	free(query_string);
-	mysql_close(con);
-	if(logfile)
-		fclose(logfile);
+	for(i = 0; i < count; i++)
+		free(file[i].name);
+	free(file);
+	free(job.part);
+	pthread_mutex_destroy(&job.lock);
 	return retval;
 }
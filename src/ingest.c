@@ -0,0 +1,717 @@
+/**********************************************************************
+ * ingest.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Continuous ingest
+ *
+ * Follows the logs like follow() does but writes the packets to the
+ * logs table instead of the screen. Rows are collected in a batch
+ * that is written when it is full or when the oldest row has waited
+ * for the latency limit, so the table is only seconds behind the
+ * log. The file position is saved once a batch is on disk, so a
+ * restart continues where the last run stopped without losing or
+ * repeating lines. With --flow-timeout the packets of a flow are held
+ * until it ends, then the position saved is one from before the first
+ * packet of the oldest flow still held. A restart may then read some
+ * lines again, but it never skips one that was not written.
+ *
+ * The reader never waits for the database. Every batch is appended to
+ * the journal first, see journal.c, and the position is saved once it
+ * is on disk. While the database keeps up the batch is also handed to
+ * a writer thread through a queue of INGEST_QUEUE_BATCHES batches, and
+ * the writer marks its record in the journal done when it is written.
+ * When the queue is full, because the database is slow or gone, the
+ * batch is left in the journal only, and so is everything after it
+ * until the writer has caught up, so the rows reach the table in the
+ * order they were read. The writer takes the queue first, it is older
+ * than the rest of the journal, then replays the journal
+ * INGEST_REPLAY_ROWS rows per transaction. When the database fails the
+ * writer connects again, waiting longer each time up to
+ * INGEST_RETRY_MAX seconds, and tries the same rows again.
+ ***********************************************************************/
+
+struct ingest_writer {
+	struct ipta_db_info *db;
+	struct ipta_journal journal;
+	struct ipta_row *queue[INGEST_QUEUE_BATCHES];   /* Ring of batches */
+	int count[INGEST_QUEUE_BATCHES];
+	off_t end[INGEST_QUEUE_BATCHES];   /* Journal offset after the batch */
+	int head;
+	int used;
+	struct ipta_row *free[INGEST_QUEUE_BATCHES + 1];  /* Spare row buffers */
+	int nfree;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;      /* Rows for the writer or the reader is done */
+	int behind;               /* Journal has rows that are not queued */
+	int stop;                 /* Set by the reader when it is done */
+	struct ipta_batch batch;  /* Of the writer, rows are swapped in */
+	unsigned long spilled;    /* Rows only put in the journal */
+	unsigned long lost;       /* Rows dropped from a damaged journal */
+};
+
+/* Where the logs were after a batch, see ingest_checkpoint() */
+struct ingest_checkpoint {
+	long lines;               /* Lines read up to here */
+	time_t taken;
+	ino_t *inode;
+	off_t *offset;
+};
+
+struct ingest_checkpoints {
+	struct ingest_checkpoint cp[INGEST_CHECKPOINTS];
+	int first;
+	int count;
+	unsigned long seen;       /* Lines and flow rows at the last save */
+};
+
+static volatile sig_atomic_t ingest_stop = 0;
+
+static void ingest_signal(int sig)
+{
+	ingest_stop = 1;
+}
+
+/***********************************************************************
+ * ingest_queue
+ *
+ * The queue function of the reader's batch, called by batch_flush().
+ * Appends the rows to the journal and, unless the writer is behind,
+ * swaps them for a spare buffer and queues them for the writer.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success, the rows are on disk and the batch empty
+ *
+ * 	RETVAL_ERROR - the journal could not be written
+ ***********************************************************************/
+static int ingest_queue(struct ipta_batch *batch)
+{
+	struct ingest_writer *w = batch->queue_arg;
+	struct ipta_row *rows;
+	int slot;
+	int retval = RETVAL_OK;
+
+	pthread_mutex_lock(&w->lock);
+	if(journal_append(&w->journal, batch->rows, batch->count)) {
+		retval = RETVAL_ERROR;
+		goto unlock;
+	}
+
+	// No room, the writer takes these and what follows from the
+	// journal once it has written the queue
+	if(w->behind || w->used == INGEST_QUEUE_BATCHES) {
+		w->behind = FLAG_SET;
+		w->spilled += batch->count;
+		batch->count = 0;
+		pthread_cond_signal(&w->wake);
+		goto unlock;
+	}
+
+	slot = (w->head + w->used) % INGEST_QUEUE_BATCHES;
+	rows = w->free[--w->nfree];
+	w->queue[slot] = batch->rows;
+	w->count[slot] = batch->count;
+	w->end[slot] = w->journal.end;
+	w->used++;
+	batch->rows = rows;
+	batch->count = 0;
+	pthread_cond_signal(&w->wake);
+
+unlock:
+	pthread_mutex_unlock(&w->lock);
+	return retval;
+}
+
+/* Sleeps for the seconds, or until the reader is done. The reader
+ * signals wake for every batch, so one wait is not enough. */
+static void ingest_sleep(struct ingest_writer *w, int seconds)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += seconds;
+	pthread_mutex_lock(&w->lock);
+	while(!w->stop && pthread_cond_timedwait(&w->wake, &w->lock, &ts) != ETIMEDOUT)
+		;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/***********************************************************************
+ * ingest_retry
+ *
+ * Called when the database failed. Drops the connection, waits a
+ * little longer than the last time and connects again.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - connected, try again
+ *
+ * 	RETVAL_ERROR - the reader is done, give up
+ ***********************************************************************/
+static int ingest_retry(struct ingest_writer *w, int *wait)
+{
+	if(w->batch.con) {
+		db_close(w->batch.con);
+		w->batch.con = NULL;
+		fprintf(stderr, "- The database failed, the rows are kept until it is back.\n");
+	}
+	while(1) {
+		pthread_mutex_lock(&w->lock);
+		if(w->stop) {
+			pthread_mutex_unlock(&w->lock);
+			return RETVAL_ERROR;
+		}
+		pthread_mutex_unlock(&w->lock);
+
+		if(*wait)
+			ingest_sleep(w, *wait);
+		*wait = *wait ? 2 * *wait : 1;
+		if(*wait > INGEST_RETRY_MAX)
+			*wait = INGEST_RETRY_MAX;
+
+		w->batch.con = open_db(w->db);
+		if(w->batch.con) {
+			fprintf(stderr, "- Connected to the database again.\n");
+			return RETVAL_OK;
+		}
+	}
+}
+
+/***********************************************************************
+ * ingest_write_queued
+ *
+ * Writes a batch from the queue and marks its record in the journal
+ * done. If the reader stops while the database is away the record is
+ * left for the next run.
+ ***********************************************************************/
+static void ingest_write_queued(struct ingest_writer *w, struct ipta_row *rows, int count,
+				off_t end)
+{
+	struct ipta_row *own = w->batch.rows;
+	int wait = 0;
+	int written = FLAG_SET;
+
+	w->batch.rows = rows;
+	w->batch.count = count;
+	while(!w->batch.con || batch_flush(&w->batch)) {
+		if(ingest_retry(w, &wait)) {
+			w->batch.count = 0;
+			written = FLAG_CLEAR;
+			break;
+		}
+	}
+	w->batch.rows = own;
+
+	pthread_mutex_lock(&w->lock);
+	if(written)
+		journal_done(&w->journal, end, count);
+	w->free[w->nfree++] = rows;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/***********************************************************************
+ * ingest_replay
+ *
+ * Writes the journal from offset to end, or INGEST_REPLAY_ROWS rows
+ * of it, in one transaction and marks them done.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the reader is done and the database still failing
+ ***********************************************************************/
+static int ingest_replay(struct ingest_writer *w, off_t offset, off_t end)
+{
+	struct ipta_row *own = w->batch.rows;
+	unsigned long inserted = w->batch.inserted;
+	unsigned long rows = 0;
+	off_t next = offset;
+	int count, failed, wait = 0;
+
+	while(1) {
+		failed = !w->batch.con || db_begin(w->batch.con);
+		for(next = offset, rows = 0; !failed && next < end && rows < INGEST_REPLAY_ROWS;
+		    rows += count) {
+			if(journal_read(&w->journal, &next, &w->batch.rows, &count)) {
+				// Nothing after a damaged record can be trusted,
+				// what is left of the journal is dropped
+				pthread_mutex_lock(&w->lock);
+				w->lost += w->journal.rows - rows;
+				journal_done(&w->journal, w->journal.end, w->journal.rows);
+				w->behind = FLAG_CLEAR;
+				pthread_mutex_unlock(&w->lock);
+				w->batch.rows = own;
+				return db_commit(w->batch.con);
+			}
+			w->batch.count = count;
+			failed = batch_flush(&w->batch);
+		}
+		w->batch.count = 0;
+		if(!failed && !db_commit(w->batch.con))
+			break;
+		// What was not committed is written again
+		w->batch.inserted = inserted;
+		w->batch.count = 0;
+		if(ingest_retry(w, &wait)) {
+			w->batch.rows = own;
+			return RETVAL_ERROR;
+		}
+	}
+	w->batch.rows = own;
+
+	pthread_mutex_lock(&w->lock);
+	journal_done(&w->journal, next, rows);
+	if(!w->journal.rows) {
+		w->behind = FLAG_CLEAR;
+		fprintf(stderr, "- The journal is written, the database has caught up.\n");
+	}
+	pthread_mutex_unlock(&w->lock);
+	return RETVAL_OK;
+}
+
+static void *ingest_writer(void *arg)
+{
+	struct ingest_writer *w = arg;
+	struct ipta_row *rows;
+	off_t offset, end;
+	int count;
+
+	w->batch.con = open_db(w->db);
+	while(1) {
+		pthread_mutex_lock(&w->lock);
+		while(!w->used && !w->behind && !w->stop)
+			pthread_cond_wait(&w->wake, &w->lock);
+		if(!w->used && (!w->behind || w->stop)) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		if(w->used) {
+			rows = w->queue[w->head];
+			count = w->count[w->head];
+			end = w->end[w->head];
+			w->head = (w->head + 1) % INGEST_QUEUE_BATCHES;
+			w->used--;
+			pthread_mutex_unlock(&w->lock);
+			ingest_write_queued(w, rows, count, end);
+			continue;
+		}
+		offset = w->journal.done;
+		end = w->journal.end;
+		pthread_mutex_unlock(&w->lock);
+		ingest_replay(w, offset, end);
+	}
+
+	return NULL;
+}
+
+/***********************************************************************
+ * ingest_position_load
+ *
+ * Reads the saved position for filename. The file holds one line per
+ * log with the inode, the offset and the name of the log.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - a position for this log was found
+ *
+ * 	RETVAL_WARN - no saved position
+ ***********************************************************************/
+static int ingest_position_load(char *position_file, char *filename,
+				ino_t *inode, off_t *offset)
+{
+	FILE *f;
+	char path[PATH_MAX];
+	unsigned long long ino, off;
+	int retval = RETVAL_WARN;
+
+	f = fopen(position_file, "r");
+	if(!f)
+		return RETVAL_WARN;
+
+	while(fscanf(f, "%llu %llu %4095s", &ino, &off, path) == 3) {
+		if(!strcmp(path, filename)) {
+			*inode = ino;
+			*offset = off;
+			retval = RETVAL_OK;
+			break;
+		}
+	}
+
+	fclose(f);
+	return retval;
+}
+
+/* Write the positions, where the logs are now or at cp, to a new file
+ * and rename it in place */
+static int ingest_position_save(char *position_file, struct ipta_multitail *mt,
+				struct ingest_checkpoint *cp)
+{
+	char tmp[PATH_MAX + 8];
+	FILE *f;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", position_file);
+	f = fopen(tmp, "w");
+	if(!f) {
+		fprintf(stderr, "! Error, unable to write the position file %s.\n", tmp);
+		return RETVAL_ERROR;
+	}
+	for(i = 0; i < mt->count; i++)
+		fprintf(f, "%llu %llu %s\n",
+			(unsigned long long)(cp ? cp->inode[i] : mt->tail[i].inode),
+			(unsigned long long)(cp ? cp->offset[i] : mt->tail[i].offset),
+			mt->tail[i].path);
+	if(fclose(f) || rename(tmp, position_file)) {
+		fprintf(stderr, "! Error, unable to write the position file %s.\n", position_file);
+		return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * ingest_checkpoint
+ *
+ * Called after every batch is written when flows are held. Keeps
+ * where the logs are now, at most INGEST_CHECKPOINTS of them spread
+ * over FLOW_ACTIVE_TIMEOUT, and saves the newest one taken before the
+ * first line of the oldest flow. If there is none the position file
+ * is left as it is, what it holds is older still.
+ ***********************************************************************/
+static void ingest_checkpoint(struct ingest_checkpoints *cps, struct ipta_multitail *mt,
+			      long lines, long oldest, char *position_file)
+{
+	struct ingest_checkpoint *cp;
+	time_t now = time(NULL);
+	int i, found = -1;
+
+	cp = &cps->cp[(cps->first + cps->count - 1) % INGEST_CHECKPOINTS];
+	if(!cps->count || now - cp->taken >= FLOW_ACTIVE_TIMEOUT / INGEST_CHECKPOINTS) {
+		if(cps->count == INGEST_CHECKPOINTS) {
+			cps->first = (cps->first + 1) % INGEST_CHECKPOINTS;
+			cps->count--;
+		}
+		cp = &cps->cp[(cps->first + cps->count) % INGEST_CHECKPOINTS];
+		cps->count++;
+		cp->lines = lines;
+		cp->taken = now;
+		for(i = 0; i < mt->count; i++) {
+			cp->inode[i] = mt->tail[i].inode;
+			cp->offset[i] = mt->tail[i].offset;
+		}
+	}
+
+	for(i = 0; i < cps->count; i++)
+		if(cps->cp[(cps->first + i) % INGEST_CHECKPOINTS].lines < oldest)
+			found = i;
+	if(found < 0)
+		return;
+	ingest_position_save(position_file, mt,
+			     &cps->cp[(cps->first + found) % INGEST_CHECKPOINTS]);
+	// The older ones will not be needed again
+	cps->first = (cps->first + found) % INGEST_CHECKPOINTS;
+	cps->count -= found;
+}
+
+/* The batch is empty, all rows are in the journal or the archive, or
+ * in a flow. Saves where the logs are if anything was read since. */
+static void ingest_saved(struct ingest_checkpoints *cps, struct ipta_multitail *mt,
+			 struct ipta_flows *flows, long lines, char *position_file)
+{
+	unsigned long seen = lines + (flows ? flows->rows : 0);
+
+	if(seen == cps->seen)
+		return;
+	cps->seen = seen;
+	if(flows && flows->count) {
+		ingest_checkpoint(cps, mt, lines, flow_oldest(flows), position_file);
+		return;
+	}
+	cps->count = 0;
+	ingest_position_save(position_file, mt, NULL);
+}
+
+/***********************************************************************
+ * ingest_follow
+ *
+ * The --ingest-follow mode. Runs until interrupted, then writes what
+ * is left in the batch before returning.
+ *
+ * PARAMETERS
+ *
+ * 	char **files - the log files to follow, globs are expanded
+ *
+ * 	int nfiles - the number of names in files
+ *
+ * 	char **listen - syslog sockets to receive from
+ *
+ * 	int nlisten - the number of sockets in listen
+ *
+ * 	struct ipta_db_info *db - where to write the packets
+ *
+ * 	struct ipta_flags *flags - only packets passing the filter are
+ * 		written
+ *
+ * 	int batch_rows - rows per INSERT at most
+ *
+ * 	int latency_ms - longest time a row may wait to be written
+ *
+ * 	char *position_file - where the file position is kept
+ *
+ * 	char *journal_file - where rows wait when the database is behind
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int ingest_follow(char **files, int nfiles, char **listen, int nlisten,
+		  struct ipta_db_info *db, struct ipta_flags *flags, int batch_rows,
+		  int latency_ms, char *position_file, char *journal_file)
+{
+	struct ipta_multitail mt;
+	struct ipta_tail *tail;
+	struct ipta_batch batch;
+	struct ipta_record rec;
+	struct ingest_writer w;
+	struct ingest_checkpoints cps;
+	pthread_t writer;
+	int writer_running = FLAG_CLEAR;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	ino_t inode = 0;
+	off_t offset = 0;
+	long lines = 0;
+	int source;
+	int wait;
+	int i;
+	int retval = RETVAL_OK;
+
+	memset(&batch, 0, sizeof(batch));
+	memset(&mt, 0, sizeof(mt));
+	memset(&w, 0, sizeof(w));
+	memset(&cps, 0, sizeof(cps));
+	mt.inotify_fd = mt.epoll_fd = -1;
+	w.journal.fd = -1;
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.wake, NULL);
+
+	if(batch_init(&batch, NULL, db->table, batch_rows)) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	batch.archive = flags->archive;
+	batch.reject = flags->reject;
+
+	// The archive is written right away, the database by the writer
+	if(!flags->archive) {
+		if(journal_open(&w.journal, journal_file) ||
+		   batch_init(&w.batch, NULL, db->table, batch_rows)) {
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		w.db = db;
+		w.behind = w.journal.rows ? FLAG_SET : FLAG_CLEAR;
+		w.batch.reject = flags->reject;
+		for(w.nfree = 0; w.nfree < INGEST_QUEUE_BATCHES + 1; w.nfree++) {
+			w.free[w.nfree] = calloc(batch.size, sizeof(struct ipta_row));
+			if(!w.free[w.nfree]) {
+				fprintf(stderr, "! Error, memory allocation failed.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+		}
+		if(pthread_create(&writer, NULL, ingest_writer, &w)) {
+			fprintf(stderr, "! Error, unable to start the writer thread.\n");
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		writer_running = FLAG_SET;
+		batch.queue = ingest_queue;
+		batch.queue_arg = &w;
+	}
+
+	if(multitail_open(&mt, files, nfiles, FLAG_CLEAR)) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	for(i = 0; i < nlisten; i++) {
+		if(multitail_listen(&mt, listen[i])) {
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+	}
+
+	if(!mt.count && !mt.receivers) {
+		fprintf(stderr, "! Error, no log files or syslog sockets given.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	for(i = 0; flags->flows && i < INGEST_CHECKPOINTS; i++) {
+		cps.cp[i].inode = calloc(mt.count + 1, sizeof(ino_t));
+		cps.cp[i].offset = calloc(mt.count + 1, sizeof(off_t));
+		if(!cps.cp[i].inode || !cps.cp[i].offset) {
+			fprintf(stderr, "! Error, memory allocation failed.\n");
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+	}
+
+	// Continue where we stopped last time. The first time there is
+	// nothing to continue from and we take what comes from now on, if
+	// the log has been replaced since we take the whole new file.
+	for(i = 0; i < mt.count; i++) {
+		tail = &mt.tail[i];
+		if(ingest_position_load(position_file, tail->path, &inode, &offset) != RETVAL_OK) {
+			fprintf(stderr, "* No saved position, ingesting new lines in %s.\n",
+				tail->path);
+		} else if(tail->inode == inode) {
+			tail_seek(tail, offset);
+			fprintf(stderr, "* Continuing %s from offset %llu.\n",
+				tail->path, (unsigned long long)tail->offset);
+		} else {
+			tail_seek(tail, 0);
+			fprintf(stderr, "* Log %s was replaced, reading it from the start.\n",
+				tail->path);
+		}
+	}
+
+	// Nothing is read yet, a restart before the first write that
+	// takes a position starts from here
+	ingest_position_save(position_file, &mt, NULL);
+
+	signal(SIGINT, ingest_signal);
+	signal(SIGTERM, ingest_signal);
+
+	while(!ingest_stop) {
+		read = multitail_getline(&mt, &line, &len, &source);
+
+		if(read == -1) {
+			// Flows that have been quiet are written by the wall
+			// clock, the log does not move it now
+			if(flags->flows && flow_tick(flags->flows, time(NULL), &batch)) {
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+
+			// Nothing more for now, sleep until a log is written
+			// to or the oldest row in the batch is due. Flows may
+			// have filled batches that were written on their own.
+			if(!batch.count) {
+				ingest_saved(&cps, &mt, flags->flows, lines, position_file);
+				multitail_wait(&mt, flags->flows && flags->flows->count ? 1000 : -1);
+				continue;
+			}
+			wait = latency_ms - batch_age(&batch);
+			if(wait > 0) {
+				multitail_wait(&mt, wait);
+				continue;
+			}
+		} else {
+			lines++;
+			if(parse_line(line, &rec) == RETVAL_OK && filter_packet(flags, &rec)) {
+				if(!flags->flows)
+					batch_add(&batch, &rec, lines);
+				else if(flow_add(flags->flows, &rec, lines, &batch)) {
+					retval = RETVAL_ERROR;
+					goto clean_exit;
+				}
+			}
+			if(batch.count < batch.size &&
+			   (!batch.count || batch_age(&batch) < latency_ms))
+				continue;
+		}
+
+		// Only saved when the rows are in the journal or the archive
+		if(batch_flush(&batch)) {
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		ingest_saved(&cps, &mt, flags->flows, lines, position_file);
+	}
+
+	// Interrupted, write what we have before leaving
+	if((flags->flows && flow_flush(flags->flows, &batch)) || batch_flush(&batch)) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	ingest_saved(&cps, &mt, flags->flows, lines, position_file);
+
+clean_exit:
+	// The writer empties the queue before it leaves
+	if(writer_running) {
+		pthread_mutex_lock(&w.lock);
+		w.stop = FLAG_SET;
+		pthread_cond_broadcast(&w.wake);
+		pthread_mutex_unlock(&w.lock);
+		pthread_join(writer, NULL);
+		batch.inserted = w.batch.inserted;
+	}
+	if(!retval || writer_running)
+		fprintf(stderr, "\n* Ingest stopped, %ld lines read and %lu rows inserted.\n",
+			lines, batch.inserted);
+	if(w.spilled)
+		fprintf(stderr, "- %lu rows waited for the database in the journal %s.\n",
+			w.spilled, journal_file);
+	if(w.journal.rows)
+		fprintf(stderr, "- %lu rows are left in the journal for the next run.\n",
+			w.journal.rows);
+	if(w.lost) {
+		fprintf(stderr, "! Error, %lu rows could not be written anywhere.\n", w.lost);
+		retval = RETVAL_ERROR;
+	}
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	multitail_close(&mt);
+	for(i = 0; i < INGEST_CHECKPOINTS; i++) {
+		free(cps.cp[i].inode);
+		free(cps.cp[i].offset);
+	}
+	batch_free(&batch);
+	batch_free(&w.batch);
+	for(i = 0; i < w.nfree; i++)
+		free(w.free[i]);
+	if(w.batch.con)
+		db_close(w.batch.con);
+	journal_close(&w.journal);
+	pthread_mutex_destroy(&w.lock);
+	pthread_cond_destroy(&w.wake);
+	free(line);
+	return retval;
+}
@@ -22,7 +22,9 @@
  * long as you do not violate any terms and condition in the LICENCE.
  **********************************************************************/
 
-#include <mysql.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdint.h>
 
 /* Overall generic defines */
 #define IPTA_VERSION "ipta version Release-V0.3.3\n"
@@ -58,6 +60,74 @@
 #define HOSTNAME_MAX_LEN 256
 #define ANALYZE_LIMIT_MAX 1000
 #define CONFIG_FILE_PATH "~/.ipta/config"
+#define DNS_RESOLVER_THREADS 4
+#define DNS_RESOLVER_MAX_THREADS 32
+#define DNS_PREWARM_RATE 50
+#define DNS_FILE_SLOTS 65536
+#define DNS_FILE_PROBE 8
+#define DNS_FILE_NAME_LEN 96
+#define TOP_REFRESH 2
+#define OUTPUT_BUFFER_SIZE 65536
+#define OUTPUT_REFRESH_MS 100
+#define OUTPUT_FLOW_LEN 160
+#define FOLLOW_FILES_MAX 256
+#define LISTEN_MAX 8
+#define RECV_BATCH 64
+#define RECV_MSG_LEN 2048
+#define FOLLOW_REORDER_MS 1000
+#define FOLLOW_REORDER_MAX 65536
+#define INGEST_BATCH_ROWS 1000
+#define INGEST_LATENCY_MS 2000
+#define INGEST_POSITION_FILE ".ipta-position"
+#define INGEST_JOURNAL_FILE ".ipta-journal"
+#define INGEST_QUEUE_BATCHES 8    /* Batches held for the writer */
+#define INGEST_REPLAY_ROWS 10000  /* Journal rows per transaction */
+#define INGEST_RETRY_MAX 30       /* Seconds between reconnects at most */
+#define INGEST_CHECKPOINTS 64     /* Positions kept while flows are held */
+#define JOURNAL_MAGIC "IPJ1"
+#define JOURNAL_RECORD_MAGIC "IPJR"
+#define FILTER_SQL_SIZE 8192
+#define CIDR_TAGS_MAX 32
+#define CIDR_TAG_LEN 32
+#define ARCHIVE_BLOCK_ROWS 65536
+#define DETECT_SOURCES 16384      /* Power of two */
+#define DETECT_HLL 64             /* Sketch registers, power of two */
+#define DETECT_WINDOW 30
+#define DETECT_PORT_LIMIT 100
+#define DETECT_HOST_LIMIT 50
+#define DETECT_RATE_LIMIT 1000
+#define SAVE_THREADS 4
+#define SAVE_CHUNK_IDS 65536
+#define SAVE_BATCH_ROWS 1000
+#define SAVE_MAGIC "IPD3"
+#define COMPACT_BATCH_IDS 50000
+#define COMPACT_SUFFIX "_hourly"
+#define FLOW_MAX 65536            /* Flows merged at once */
+#define FLOW_WHEEL 512            /* Seconds, power of two */
+#define FLOW_ACTIVE_TIMEOUT 300   /* Longest a flow is held */
+#define IMPORT_THREADS 4
+#define IMPORT_THREADS_MAX 64
+#define IMPORT_CHUNK_SIZE (16 * 1024 * 1024)   /* Bytes of a log per part */
+#define IMPORT_BUFFER_SIZE 131072
+#define IMPORT_LINE_LEN 1024
+#define IMPORT_BATCH_ROWS 1000
+#define IMPORT_COMMIT_ROWS 10000
+
+/* DNS statistics counters and latency histograms */
+#define DNS_STAT_CACHE_HIT 0
+#define DNS_STAT_CACHE_NEGATIVE 1
+#define DNS_STAT_CACHE_MISS 2
+#define DNS_STAT_RESOLVE_OK 3
+#define DNS_STAT_RESOLVE_FAIL 4
+#define DNS_STAT_RESOLVE_TIMEOUT 5
+#define DNS_STAT_CACHE_WRITE 6
+#define DNS_STAT_CACHE_WRITE_FAIL 7
+#define DNS_STAT_COUNT 8
+
+#define DNS_TIME_CACHE_GET 0
+#define DNS_TIME_RESOLVE 1
+#define DNS_TIME_CACHE_ADD 2
+#define DNS_TIME_COUNT 3
 
 struct ipta_flags {
 	int no_lo;
@@ -66,6 +136,20 @@ struct ipta_flags {
 	int rdns;
 	int no_accept;
 	int scan;
+	int dns_threads;
+	int collapse;
+	int sample_rate;          /* Lines per second shown, 0 for all */
+	int reorder_ms;           /* Reorder window for merged logs */
+	struct ipta_filter *filter;  /* --filter, NULL for all packets */
+	struct ipta_cidr_set *ignore;   /* --ignore-list sources */
+	struct ipta_cidr_set *tags;     /* --tag-list networks */
+	int geoip;                /* Country and AS columns in follow */
+	struct ipta_detect *detect;  /* --detect, NULL when off */
+	struct ipta_archive *archive;   /* --archive instead of the database */
+	struct ipta_flows *flows;       /* --flow-timeout, NULL when off */
+	int import_threads;       /* Files or parts imported at once */
+	int commit_rows;          /* Rows per import transaction, 0 for each INSERT */
+	FILE *reject;             /* --reject-file, NULL when not given */
 };
 
 #define IPTA_DB_INFO_STRLEN 256
@@ -73,8 +157,408 @@ struct ipta_db_info {
 	char host[IPTA_DB_INFO_STRLEN];
 	char user[IPTA_DB_INFO_STRLEN];
 	char pass[IPTA_DB_INFO_STRLEN];
-	char name[IPTA_DB_INFO_STRLEN];
+	char name[IPTA_DB_INFO_STRLEN];   /* The file with SQLite */
 	char table[IPTA_DB_INFO_STRLEN];
+	struct ipta_db_backend *backend;  /* NULL for MySQL */
+};
+
+/* A log file being followed, see tail.c */
+struct ipta_tail {
+	FILE *file;
+	char *path;
+	off_t offset;             /* Start of the first unread line */
+	ino_t inode;              /* Identity of the open file */
+	dev_t dev;
+	int rotated;              /* Path now names another file */
+	int partial_ok;           /* Return a last line without newline */
+	int inotify_fd;
+	int shared;               /* inotify_fd belongs to the caller */
+	int watch;
+	int dir_watch;
+};
+
+/* A syslog socket, see syslog_recv.c */
+struct ipta_receiver {
+	int fd;
+	char *spec;               /* udp:port or unix:path as given */
+	char *path;               /* Socket file to remove when done */
+	char *buffer;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	int count;                /* Messages in the last batch */
+	int next;
+	unsigned long received;
+	unsigned long truncated;
+};
+
+/* Many log files followed at once, see multitail.c */
+struct ipta_multitail {
+	struct ipta_tail *tail;
+	char **path;
+	char **label;             /* Directory name, used when no host is logged */
+	struct ipta_receiver *receiver;
+	int receivers;
+	int *ready;               /* Changed since last read to the end */
+	int count;
+	int current;              /* Read from this one next */
+	int burst;
+	int inotify_fd;
+	int epoll_fd;
+};
+
+/* One parsed log line, the fields point into the line, see parse.c */
+struct ipta_record {
+	time_t timestamp;         /* From the syslog header, 0 if unknown */
+	char *host;
+	char *action;
+	char *if_in;
+	char *if_out;
+	char *mac;
+	char *src;
+	char *dst;
+	char *proto;
+	char *src_port;
+	char *dst_port;
+	char *tag;                /* Address list the packet is in */
+};
+
+/* The fields of a decoded NFLOG packet, see nflog.c */
+struct ipta_nflog {
+	time_t timestamp;
+	char prefix[128];
+	char action[16];
+	char if_in[16];
+	char if_out[16];
+	char mac[48];
+	char src[48];
+	char dst[48];
+	char proto[16];
+	char src_port[8];
+	char dst_port[8];
+};
+
+/* What import_nflog() read, for the summary of --import */
+struct ipta_nflog_count {
+	long records;             /* In the capture */
+	long packets;             /* IP packets that passed --filter */
+	unsigned long inserted;
+	unsigned long rejected;
+};
+
+/* A compiled --filter expression, see filter.c */
+struct ipta_filter_value {
+	char *text;
+	int low;                  /* Port range */
+	int high;
+	int family;               /* Address and prefix length */
+	int bits;
+	unsigned char addr[16];
+};
+
+struct ipta_filter_node {
+	int op;                   /* and, or, not or a comparison */
+	int cmp;
+	int field;
+	int left;
+	int right;
+	int first;                /* Values of the comparison */
+	int count;
+};
+
+struct ipta_filter {
+	struct ipta_filter_node *node;
+	int nodes;
+	struct ipta_filter_value *value;
+	int values;
+	int root;
+};
+
+/* Networks loaded from address lists, see cidr.c */
+struct ipta_cidr_set {
+	unsigned int *start4;     /* Sorted ranges that do not overlap */
+	unsigned int *end4;
+	unsigned char *tag4;
+	int count4;
+	unsigned __int128 *start6;
+	unsigned __int128 *end6;
+	unsigned char *tag6;
+	int count6;
+	char tag[CIDR_TAGS_MAX][CIDR_TAG_LEN];
+	int ntags;
+	void *prefix;             /* As loaded, until the set is built */
+	int prefixes;
+	int prefix_size;
+};
+
+/* Columns of an archive block, see archive.c */
+#define ARCHIVE_TIME 0
+#define ARCHIVE_SRC 1
+#define ARCHIVE_DST 2
+#define ARCHIVE_SPT 3
+#define ARCHIVE_DPT 4
+#define ARCHIVE_ACTION 5          /* The string columns come in this order */
+#define ARCHIVE_PROTO 6
+#define ARCHIVE_IF_IN 7
+#define ARCHIVE_IF_OUT 8
+#define ARCHIVE_MAC 9
+#define ARCHIVE_TAG 10
+#define ARCHIVE_DICTIONARY 11
+#define ARCHIVE_COLUMNS 12
+#define ARCHIVE_STRINGS 6
+
+struct ipta_archive_header {
+	char magic[4];
+	unsigned int rows;
+	unsigned int size;        /* Bytes of column data after the header */
+	unsigned int pad;
+	long long time_min;
+	long long time_max;
+	unsigned int src_min;
+	unsigned int src_max;
+	unsigned int dst_min;
+	unsigned int dst_max;
+	unsigned short spt_min;
+	unsigned short spt_max;
+	unsigned short dpt_min;
+	unsigned short dpt_max;
+	unsigned int packed[ARCHIVE_COLUMNS];   /* Compressed sizes */
+	unsigned int raw[ARCHIVE_COLUMNS];
+	unsigned int crc[ARCHIVE_COLUMNS];      /* Of the compressed data */
+};
+
+/* Writing to an --archive directory */
+struct ipta_archive {
+	char *dir;
+	int fd;                   /* Segment of day, -1 if none open */
+	long day;
+	unsigned long blocks;
+	unsigned long long bytes;
+};
+
+/* Reading the blocks of an archive one at a time */
+struct ipta_archive_reader {
+	char *dir;
+	struct dirent **names;
+	int count;
+	int current;
+	unsigned char *map;
+	size_t size;
+	size_t offset;
+	struct ipta_archive_header header;
+	const unsigned char *data;
+	int loaded;               /* Masks of the columns of this block */
+	int decoded;
+	int checked;
+	unsigned char *raw[ARCHIVE_COLUMNS];
+	time_t *time;
+	unsigned int *src;
+	unsigned int *dst;
+	unsigned short *spt;
+	unsigned short *dpt;
+	unsigned short *code[ARCHIVE_STRINGS];
+	char **dict[ARCHIVE_STRINGS];
+	int dict_count[ARCHIVE_STRINGS];
+	unsigned long blocks;
+	unsigned long damaged;
+};
+
+/* One source address of the scan detector, see detect.c */
+struct ipta_detect_source {
+	unsigned char addr[16];   /* IPv4 as ::ffff:a.b.c.d */
+	int used;
+	long epoch;               /* Half window the current counts are for */
+	time_t last;
+	unsigned int second;      /* Packets in the second of last */
+	unsigned int packets[2];  /* This half window and the one before */
+	int top_port;
+	unsigned int top_count;
+	long reported[3];         /* Half window of the last event of each kind */
+	unsigned char ports[2][DETECT_HLL];
+	unsigned char hosts[2][DETECT_HLL];
+};
+
+struct ipta_detect {
+	struct ipta_detect_source *table;
+	int window;               /* Seconds */
+	int half;
+	int ports;                /* Thresholds, 0 is off */
+	int hosts;
+	int rate;
+	FILE *log;                /* --detect-log, NULL for the follow output */
+	unsigned long events;
+	unsigned long evicted;
+};
+
+/* Country and AS of an address, see geoip.c */
+struct ipta_geo {
+	char country[3];          /* Empty if not known */
+	unsigned int asn;         /* 0 if not known */
+	char *name;               /* AS name, points into the index */
+};
+
+/* A record that owns its data, sized after the columns of the logs table */
+struct ipta_row {
+	long line;                /* Line number in the source file */
+	time_t timestamp;
+	char if_in[16];
+	char if_out[16];
+	char src[48];
+	char dst[48];
+	char proto[16];
+	char action[16];
+	char mac[48];
+	int src_port;             /* -1 for NULL */
+	int dst_port;
+	char tag[CIDR_TAG_LEN];
+	int packets;              /* Merged into this row, see flow.c */
+	time_t last_seen;
+};
+
+/* Repeated packets merged into one row, see flow.c */
+struct ipta_flow {
+	struct ipta_row row;
+	time_t expires;
+	unsigned int hash;
+	int next;                 /* Hash chain or free list, -1 ends it */
+	int timer_prev;           /* List of the wheel slot */
+	int timer_next;
+	int age_prev;             /* List of all flows, oldest first */
+	int age_next;
+};
+
+struct ipta_flows {
+	struct ipta_flow *flow;
+	int *bucket;              /* FLOW_MAX chain heads */
+	int wheel[FLOW_WHEEL];    /* Flows expiring in each second */
+	int oldest;               /* Flow started first, -1 when none */
+	int newest;
+	int free;
+	int count;
+	int timeout;              /* Idle seconds */
+	time_t now;               /* Latest packet time seen */
+	unsigned long packets;
+	unsigned long rows;
+	unsigned long evicted;
+};
+
+/***********************************************************************
+ * Storage backends, see db.c
+ *
+ * Everything that talks to the database goes through a struct ipta_db
+ * connection and the db_ functions, which call the backend it was
+ * opened with. The SQL is the same for all backends except for the
+ * few fragments kept here.
+ ***********************************************************************/
+struct ipta_db;
+struct ipta_db_result;
+
+struct ipta_db_backend {
+	char *name;               /* As given to --db-backend */
+	char *serial_column;      /* Type of the id column of the logs table */
+	char *unsigned_column;    /* Type of addresses and ports */
+	char *tables_query;       /* Lists the tables, one per row */
+	int (*open)(struct ipta_db *con, struct ipta_db_info *db);
+	void (*close)(struct ipta_db *con);
+	int (*query)(struct ipta_db *con, char *query);
+	int (*result)(struct ipta_db *con, struct ipta_db_result *result, int stream);
+	char **(*fetch_row)(struct ipta_db_result *result);
+	void (*free_result)(struct ipta_db_result *result);
+	const char *(*error)(struct ipta_db *con);
+	unsigned long (*escape)(struct ipta_db *con, char *to, char *from, unsigned long len);
+	int (*insert)(struct ipta_db *con, char *table, struct ipta_row *rows, int count);
+	int (*has_column)(struct ipta_db *con, char *table, char *column);
+	int (*begin)(struct ipta_db *con);
+	int (*commit)(struct ipta_db *con);
+	int (*row_error)(struct ipta_db *con);
+	int (*bulk)(struct ipta_db *con, char *table, int on);
+	int (*library_init)(void);
+	void (*thread_init)(void);
+	void (*thread_end)(void);
+};
+
+/* An open connection */
+struct ipta_db {
+	struct ipta_db_backend *backend;
+	void *state;              /* Owned by the backend */
+};
+
+/* The rows a query gave */
+struct ipta_db_result {
+	struct ipta_db *con;
+	void *state;              /* Owned by the backend */
+	int fields;
+};
+
+/* Rows waiting to be inserted, see batch.c */
+struct ipta_batch {
+	struct ipta_db *con;
+	char *table;
+	struct ipta_row *rows;
+	int count;
+	int size;
+	long long started;        /* When the first row was added, in ms */
+	unsigned long inserted;
+	unsigned long rejected;   /* Rows the database turned down */
+	struct ipta_archive *archive;   /* Written here instead when set */
+	FILE *reject;             /* --reject-file, NULL for stderr */
+	char *source;             /* File the rows are read from, or NULL */
+	off_t source_start;       /* Where the line numbers start counting */
+	long line_base;           /* Lines before source_start, -1 unknown */
+	int (*queue)(struct ipta_batch *batch);   /* Hands the rows on instead */
+	void *queue_arg;
+};
+
+/* Rows waiting for the database on local disk, see journal.c */
+struct ipta_journal {
+	int fd;
+	char *path;
+	off_t done;               /* Start of the first record not written */
+	off_t end;                /* End of the last whole record */
+	unsigned long rows;       /* Rows from done to end */
+	struct ipta_row *buffer;  /* Rows of journal_read() */
+	int buffer_rows;
+};
+
+struct ipta_journal_header {
+	char magic[4];
+	uint32_t row_size;        /* sizeof(struct ipta_row) */
+	uint64_t done;
+};
+
+struct ipta_journal_record {
+	char magic[4];
+	uint32_t rows;
+	uint32_t crc;             /* Of the rows that follow */
+};
+
+/* One chunk of a --save-db file, followed by size bytes of zlib data */
+#define SAVE_LOGS 1
+#define SAVE_DNS 2
+struct ipta_save_chunk {
+	char magic[4];
+	uint32_t table;
+	uint32_t rows;
+	uint32_t size;
+	uint32_t raw;             /* Size when uncompressed */
+	uint32_t crc;             /* Of the compressed data */
+};
+
+/* Buffered output of follow mode, see output.c */
+struct ipta_output {
+	int fd;
+	struct ipta_flags *flags;
+	char *buffer;
+	size_t used;
+	size_t size;
+	long long last_write;     /* ms */
+	time_t time;              /* Second of time_string */
+	char time_string[16];
+	int lines;                /* Lines since the header */
+	char flow[OUTPUT_FLOW_LEN];
+	unsigned long repeats;    /* Collapsed packets not yet shown */
+	double tokens;            /* Sampling token bucket */
+	long long last_refill;
+	unsigned long dropped;    /* Sampled away, not yet reported */
 };
 
 struct ipta_config {
@@ -89,18 +573,28 @@ struct ipta_config {
 /* Function declarations */
 int analyze(struct ipta_db_info *db, struct ipta_flags *flags, int analyze_limit, 
 	    struct ipta_db_info *dns);
-MYSQL *open_db(struct ipta_db_info *db);
+struct ipta_db *open_db(struct ipta_db_info *db);
 int create_config(void);
-int restore_db(struct ipta_db_info *db);
-int save_db(struct ipta_db_info *db);
+int restore_db(struct ipta_db_info *db, struct ipta_db_info *dns, char *filename);
+int save_db(struct ipta_db_info *db, struct ipta_db_info *dns, char *filename);
 int create_db(struct ipta_db_info *db);
 int create_table(struct ipta_db_info *db);
+int upgrade_table(struct ipta_db_info *db);
 int delete_table(struct ipta_db_info *db);
 int list_tables(struct ipta_db_info *db);
 int clear_database(struct ipta_db_info *db);
-int follow(char *filename, struct ipta_flags *flags, struct ipta_db_info *dns);
+int compact_table(struct ipta_db_info *db, int hours);
+int follow(char **files, int nfiles, char **listen, int nlisten,
+	   struct ipta_flags *flags, struct ipta_db_info *dns);
+int top(char *filename, struct ipta_flags *flags, struct ipta_db_info *dns,
+	int limit, int refresh);
 int get_host_by_addr(char *ip_address, char *hostname, int maxlen, struct ipta_db_info *db);
-int import_syslog(struct ipta_db_info *db, char *filename);
+char *dns_host_trim(char *s, int maxlen);
+int import_syslog(struct ipta_db_info *db, char **files, int nfiles,
+		  struct ipta_flags *flags);
+int ingest_follow(char **files, int nfiles, char **listen, int nlisten,
+		  struct ipta_db_info *db, struct ipta_flags *flags, int batch_rows,
+		  int latency_ms, char *position_file, char *journal_file);
 void print_license(void);
 void print_usage(void);
 
@@ -112,3 +606,151 @@ int dns_cache_get(struct ipta_db_info *db, char *ip_address, char *hostname, cha
 int dns_cache_delete_table(struct ipta_db_info *db);
 int dns_cache_clear_table(struct ipta_db_info *db);
 int dns_cache_prune(struct ipta_db_info *db, int ttl); /* This should change to include ttl */
+int dns_cache_prewarm(struct ipta_db_info *db, struct ipta_db_info *dns,
+		      char *filename, int ttl, int threads, int rate);
+
+/* dns cache file prototypes */
+int dns_file_cache_open(char *filename, int ttl);
+int dns_file_cache_active(void);
+void dns_file_cache_close(void);
+int dns_file_cache_get(char *ip_address, char *hostname, int maxlen);
+int dns_file_cache_add(char *ip_address, char *hostname);
+int dns_file_cache_import(struct ipta_db_info *db);
+int dns_file_cache_export(struct ipta_db_info *db);
+
+/* dns statistics prototypes */
+long long dns_stats_now(void);
+void dns_stats_count(int counter);
+void dns_stats_time(int histogram, long long start);
+void dns_stats_print(FILE *out);
+int dns_stats_report(struct ipta_db_info *db);
+
+/* background resolver prototypes */
+int dns_resolver_start(struct ipta_db_info *db, int threads);
+int dns_resolver_lookup(char *ip_address, char *hostname, int maxlen);
+void dns_resolver_stop(void);
+
+/* log file tailing prototypes */
+int tail_open(struct ipta_tail *tail, char *path, int from_start);
+int tail_open_shared(struct ipta_tail *tail, char *path, int from_start, int inotify_fd);
+ssize_t tail_getline(struct ipta_tail *tail, char **line, size_t *len);
+void tail_wait(struct ipta_tail *tail, int timeout_ms);
+void tail_close(struct ipta_tail *tail);
+int tail_seek(struct ipta_tail *tail, off_t offset);
+
+/* follow output prototypes */
+int output_init(struct ipta_output *out, int fd, struct ipta_flags *flags);
+void output_packet(struct ipta_output *out, struct ipta_record *rec, char *host,
+		   char *src_name, char *dst_name, unsigned long packet_count);
+void output_event(struct ipta_output *out, char *event);
+int output_due(struct ipta_output *out);
+int output_flush(struct ipta_output *out);
+void output_free(struct ipta_output *out);
+
+/* multiple file tailing prototypes */
+int multitail_open(struct ipta_multitail *mt, char **patterns, int npatterns, int from_start);
+ssize_t multitail_getline(struct ipta_multitail *mt, char **line, size_t *len, int *source);
+int multitail_listen(struct ipta_multitail *mt, char *spec);
+void multitail_wait(struct ipta_multitail *mt, int timeout_ms);
+void multitail_close(struct ipta_multitail *mt);
+
+/* syslog receiver prototypes */
+int receiver_open(struct ipta_receiver *r, char *spec);
+ssize_t receiver_getline(struct ipta_receiver *r, char **line, size_t *len);
+void receiver_close(struct ipta_receiver *r);
+
+/* log line parser prototypes */
+int parse_line(char *line, struct ipta_record *rec);
+void parse_to_row(struct ipta_record *rec, struct ipta_row *row, long line);
+
+/* NFLOG capture prototypes */
+int nflog_is_pcap(char *filename);
+int nflog_decode(const unsigned char *data, size_t len, int swapped, time_t timestamp,
+		 struct ipta_nflog *pkt, struct ipta_record *rec);
+int import_nflog(struct ipta_db_info *db, char *filename, struct ipta_flags *flags,
+		 struct ipta_nflog_count *count, int quiet);
+
+/* filter expression prototypes */
+int filter_compile(struct ipta_filter *f, char *expr);
+int filter_match(struct ipta_filter *f, struct ipta_record *rec);
+int filter_sql(struct ipta_filter *f, char *sql, size_t len);
+int filter_packet(struct ipta_flags *flags, struct ipta_record *rec);
+void filter_bounds(struct ipta_filter *f, char *name, unsigned long *low, unsigned long *high);
+int filter_uses(struct ipta_filter *f, char *name);
+void filter_free(struct ipta_filter *f);
+
+/* address list prototypes */
+int cidr_add_file(struct ipta_cidr_set *set, char *path, char *tag);
+int cidr_build(struct ipta_cidr_set *set);
+char *cidr_lookup(struct ipta_cidr_set *set, char *address);
+void cidr_free(struct ipta_cidr_set *set);
+int cidr_parse_v4(const char *s, unsigned int *addr);
+
+/* column archive prototypes */
+int archive_open(struct ipta_archive *a, char *dir);
+int archive_write(struct ipta_archive *a, struct ipta_row *rows, int count);
+void archive_close(struct ipta_archive *a);
+int archive_reader_open(struct ipta_archive_reader *r, char *dir);
+int archive_reader_next(struct ipta_archive_reader *r);
+int archive_reader_load(struct ipta_archive_reader *r, int mask);
+void archive_reader_close(struct ipta_archive_reader *r);
+
+/* scan detector prototypes */
+int detect_init(struct ipta_detect *detect, char *logfile);
+int detect_packet(struct ipta_detect *detect, struct ipta_record *rec, char *event, size_t len);
+void detect_log(struct ipta_detect *detect, char *event);
+void detect_free(struct ipta_detect *detect);
+
+/* flow merging prototypes */
+int flow_init(struct ipta_flows *flows);
+int flow_add(struct ipta_flows *flows, struct ipta_record *rec, long line, struct ipta_batch *batch);
+int flow_tick(struct ipta_flows *flows, time_t now, struct ipta_batch *batch);
+int flow_flush(struct ipta_flows *flows, struct ipta_batch *batch);
+long flow_oldest(struct ipta_flows *flows);
+void flow_free(struct ipta_flows *flows);
+
+/* Rows waiting for the database, journal.c */
+int journal_open(struct ipta_journal *j, char *path);
+int journal_append(struct ipta_journal *j, struct ipta_row *rows, int count);
+int journal_read(struct ipta_journal *j, off_t *offset, struct ipta_row **rows, int *count);
+int journal_done(struct ipta_journal *j, off_t offset, unsigned long rows);
+void journal_close(struct ipta_journal *j);
+
+/* GeoIP prototypes */
+int geoip_compile(char *filename, char **csv, int ncsv);
+int geoip_open(char *filename);
+int geoip_active(void);
+void geoip_close(void);
+int geoip_lookup4(unsigned int address, struct ipta_geo *geo);
+int geoip_lookup(char *address, struct ipta_geo *geo);
+
+/* batched insert prototypes */
+int batch_init(struct ipta_batch *batch, struct ipta_db *con, char *table, int size);
+int batch_add(struct ipta_batch *batch, struct ipta_record *rec, long line);
+int batch_add_row(struct ipta_batch *batch, struct ipta_row *row);
+int batch_age(struct ipta_batch *batch);
+int batch_flush(struct ipta_batch *batch);
+void batch_free(struct ipta_batch *batch);
+
+/* storage backend prototypes */
+extern struct ipta_db_backend db_mysql_backend;
+extern struct ipta_db_backend db_sqlite_backend;
+struct ipta_db_backend *db_backend(char *name);
+int db_library_init(void);
+void db_thread_init(void);
+void db_thread_end(void);
+int db_query(struct ipta_db *con, char *query);
+struct ipta_db_result *db_store_result(struct ipta_db *con);
+struct ipta_db_result *db_use_result(struct ipta_db *con);
+char **db_fetch_row(struct ipta_db_result *result);
+int db_num_fields(struct ipta_db_result *result);
+void db_free_result(struct ipta_db_result *result);
+const char *db_error(struct ipta_db *con);
+unsigned long db_escape(struct ipta_db *con, char *to, char *from, unsigned long len);
+int db_insert(struct ipta_db *con, char *table, struct ipta_row *rows, int count);
+int db_has_column(struct ipta_db *con, char *table, char *column);
+int db_begin(struct ipta_db *con);
+int db_commit(struct ipta_db *con);
+int db_row_error(struct ipta_db *con);
+int db_bulk(struct ipta_db *con, char *table, int on);
+void db_close(struct ipta_db *con);
@@ -0,0 +1,173 @@
+/**********************************************************************
+ * journal-test.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ipta.h"
+
+#define TEST_RECORDS 3
+#define TEST_ROWS 100
+
+static void test_rows(struct ipta_row *rows, int record)
+{
+	int i;
+
+	memset(rows, 0, TEST_ROWS * sizeof(struct ipta_row));
+	for(i = 0; i < TEST_ROWS; i++) {
+		rows[i].line = record * TEST_ROWS + i + 1;
+		rows[i].timestamp = 1700000000 + record * TEST_ROWS + i;
+		snprintf(rows[i].src, sizeof(rows[i].src), "10.0.%d.%d", record, i);
+		strcpy(rows[i].dst, "192.168.1.1");
+		strcpy(rows[i].action, "DROP");
+		rows[i].dst_port = 22;
+		rows[i].packets = 1;
+	}
+}
+
+static int test_check(char *what, long value, long expected)
+{
+	if(value == expected)
+		return 0;
+	fprintf(stderr, "! Error, %s is %ld, expected %ld.\n", what, value, expected);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ipta_journal j;
+	struct ipta_row rows[TEST_ROWS];
+	struct ipta_row *read;
+	char *path = argc > 1 ? argv[1] : "/tmp/ipta-journal-test";
+	off_t offset, second = 0;
+	struct stat st;
+	int count, i, fd;
+	int errors = 0, e;
+
+	printf("* Unit tests for the ingest journal of ipta.\n\n");
+	unlink(path);
+
+	fprintf(stderr, "* Test I: Append and read back %d records.\n", TEST_RECORDS);
+	e = 0;
+	if(journal_open(&j, path)) {
+		fprintf(stderr, "! Test error, unable to create the journal %s.\n", path);
+		return RETVAL_ERROR;
+	}
+	for(i = 0; i < TEST_RECORDS; i++) {
+		test_rows(rows, i);
+		e += test_check("append", journal_append(&j, rows, TEST_ROWS), RETVAL_OK);
+	}
+	journal_close(&j);
+	e += test_check("open", journal_open(&j, path), RETVAL_OK);
+	e += test_check("rows after open", j.rows, TEST_RECORDS * TEST_ROWS);
+	offset = j.done;
+	for(i = 0; i < TEST_RECORDS && !e; i++) {
+		e += test_check("read", journal_read(&j, &offset, &read, &count), RETVAL_OK);
+		test_rows(rows, i);
+		e += test_check("rows read", count, TEST_ROWS);
+		e += test_check("same rows", !e && !memcmp(read, rows, sizeof(rows)), 1);
+		if(i == 0)
+			second = offset;
+	}
+	e += test_check("end", offset, j.end);
+	if(!e)
+		fprintf(stderr, "  Success.\n");
+	errors += e;
+
+	fprintf(stderr, "* Test II: Replay marked done survives a restart.\n");
+	e = 0;
+	e += test_check("done", journal_done(&j, second, TEST_ROWS), RETVAL_OK);
+	journal_close(&j);
+	e += test_check("open", journal_open(&j, path), RETVAL_OK);
+	e += test_check("rows left", j.rows, (TEST_RECORDS - 1) * TEST_ROWS);
+	e += test_check("replay offset", j.done, second);
+	e += test_check("done", journal_done(&j, j.end, j.rows), RETVAL_OK);
+	e += test_check("rows left", j.rows, 0);
+	stat(path, &st);
+	e += test_check("size when empty", st.st_size, sizeof(struct ipta_journal_header));
+	if(!e)
+		fprintf(stderr, "  Success.\n");
+	errors += e;
+
+	fprintf(stderr, "* Test III: A torn record at the end is cut away.\n");
+	e = 0;
+	for(i = 0; i < 2; i++) {
+		test_rows(rows, i);
+		journal_append(&j, rows, TEST_ROWS);
+	}
+	journal_close(&j);
+	stat(path, &st);
+	e += test_check("truncate", truncate(path, st.st_size - 10), 0);
+	e += test_check("open", journal_open(&j, path), RETVAL_OK);
+	e += test_check("rows after open", j.rows, TEST_ROWS);
+	stat(path, &st);
+	e += test_check("size", st.st_size, j.end);
+	if(!e)
+		fprintf(stderr, "  Success.\n");
+	errors += e;
+
+	fprintf(stderr, "* Test IV: A damaged record is found by its CRC.\n");
+	e = 0;
+	fd = open(path, O_RDWR);
+	e += test_check("damage", fd >= 0 && pwrite(fd, "X", 1, j.end - 5) == 1, 1);
+	if(fd >= 0)
+		close(fd);
+	offset = j.done;
+	e += test_check("read", journal_read(&j, &offset, &read, &count), RETVAL_ERROR);
+	if(!e)
+		fprintf(stderr, "  Success.\n");
+	errors += e;
+
+	fprintf(stderr, "* Test V: Emptied but stopped before the header was written.\n");
+	e = 0;
+	journal_close(&j);
+	unlink(path);
+	journal_open(&j, path);
+	test_rows(rows, 0);
+	journal_append(&j, rows, TEST_ROWS);
+	journal_append(&j, rows, TEST_ROWS);
+	offset = j.done;
+	journal_read(&j, &offset, &read, &count);
+	journal_done(&j, offset, TEST_ROWS);
+	journal_close(&j);
+	e += test_check("truncate", truncate(path, sizeof(struct ipta_journal_header)), 0);
+	e += test_check("open", journal_open(&j, path), RETVAL_OK);
+	e += test_check("rows after open", j.rows, 0);
+	e += test_check("append", journal_append(&j, rows, TEST_ROWS), RETVAL_OK);
+	journal_close(&j);
+	e += test_check("open", journal_open(&j, path), RETVAL_OK);
+	e += test_check("rows after reopen", j.rows, TEST_ROWS);
+	if(!e)
+		fprintf(stderr, "  Success.\n");
+	errors += e;
+
+	journal_close(&j);
+	unlink(path);
+	fprintf(stderr, "* %d errors.\n", errors);
+	return errors ? RETVAL_ERROR : RETVAL_OK;
+}
@@ -0,0 +1,267 @@
+/**********************************************************************
+ * journal.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Journal of rows waiting for the database
+ *
+ * Ingest appends every batch to this file before it saves its position
+ * in the log, and marks the batch done when it is in the database.
+ * When the database can not keep up the rows wait here instead of in
+ * memory, and are written to the database from the file once it is
+ * reachable again. The file starts with a struct ipta_journal_header
+ * that says how far it has been replayed, followed by records of a
+ * struct ipta_journal_record and the rows as they are in memory. A
+ * record carries a CRC of its rows. A record that was cut short when
+ * ipta stopped is cut away when the journal is opened. The rows are
+ * only meant for the same build of ipta, the header has the size of a
+ * row to tell.
+ ***********************************************************************/
+
+static int journal_header(struct ipta_journal *j)
+{
+	struct ipta_journal_header h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JOURNAL_MAGIC, 4);
+	h.row_size = sizeof(struct ipta_row);
+	h.done = j->done;
+	if(pwrite(j->fd, &h, sizeof(h), 0) != sizeof(h)) {
+		fprintf(stderr, "! Error, unable to write the journal %s.\n", j->path);
+		return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * journal_open
+ *
+ * Opens the journal in path, or creates it. The records that are not
+ * replayed yet are counted, a torn record at the end is cut away.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int journal_open(struct ipta_journal *j, char *path)
+{
+	struct ipta_journal_header h;
+	struct ipta_journal_record r;
+	struct stat st;
+	off_t offset;
+
+	memset(j, 0, sizeof(struct ipta_journal));
+	j->path = path;
+	j->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(j->fd < 0 || fstat(j->fd, &st)) {
+		fprintf(stderr, "! Error, unable to open the journal %s.\n", path);
+		journal_close(j);
+		return RETVAL_ERROR;
+	}
+
+	j->done = j->end = sizeof(h);
+	if(st.st_size < (off_t)sizeof(h)) {
+		if(ftruncate(j->fd, 0) || journal_header(j)) {
+			journal_close(j);
+			return RETVAL_ERROR;
+		}
+		return RETVAL_OK;
+	}
+
+	if(pread(j->fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, JOURNAL_MAGIC, 4) ||
+	   h.row_size != sizeof(struct ipta_row) || h.done < sizeof(h)) {
+		fprintf(stderr, "! Error, %s is not a journal of this version of ipta.\n", path);
+		journal_close(j);
+		return RETVAL_ERROR;
+	}
+
+	// Emptied by journal_done() but stopped before the header was
+	// written again, all of it had been replayed
+	if(h.done > (uint64_t)st.st_size) {
+		if(ftruncate(j->fd, sizeof(h)) || journal_header(j)) {
+			journal_close(j);
+			return RETVAL_ERROR;
+		}
+		return RETVAL_OK;
+	}
+
+	// Walk the records to find the end of the last whole one
+	for(offset = h.done; offset + (off_t)sizeof(r) <= st.st_size;
+	    offset += sizeof(r) + (off_t)r.rows * sizeof(struct ipta_row)) {
+		if(pread(j->fd, &r, sizeof(r), offset) != sizeof(r) ||
+		   memcmp(r.magic, JOURNAL_RECORD_MAGIC, 4) ||
+		   offset + (off_t)sizeof(r) + (off_t)r.rows * (off_t)sizeof(struct ipta_row) > st.st_size)
+			break;
+		j->rows += r.rows;
+		j->end = offset + sizeof(r) + (off_t)r.rows * sizeof(struct ipta_row);
+	}
+	j->done = h.done;
+	if(j->end < j->done)
+		j->end = j->done;
+	if(j->end < st.st_size) {
+		fprintf(stderr, "- The journal %s ended in a broken record, it was cut away.\n", path);
+		if(ftruncate(j->fd, j->end)) {
+			journal_close(j);
+			return RETVAL_ERROR;
+		}
+	}
+	if(j->rows)
+		fprintf(stderr, "* The journal %s has %lu rows to write.\n", path, j->rows);
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * journal_append
+ *
+ * Adds the rows as a record at the end of the journal and waits until
+ * they are on the disk.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error, the journal is as before
+ ***********************************************************************/
+int journal_append(struct ipta_journal *j, struct ipta_row *rows, int count)
+{
+	struct ipta_journal_record r;
+	struct iovec iov[2];
+	size_t size = (size_t)count * sizeof(struct ipta_row);
+
+	memset(&r, 0, sizeof(r));
+	memcpy(r.magic, JOURNAL_RECORD_MAGIC, 4);
+	r.rows = count;
+	r.crc = crc32(0L, (unsigned char *)rows, size);
+
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = rows;
+	iov[1].iov_len = size;
+	if(pwritev(j->fd, iov, 2, j->end) != (ssize_t)(sizeof(r) + size) ||
+	   fdatasync(j->fd)) {
+		fprintf(stderr, "! Error, unable to write the journal %s.\n", j->path);
+		// Leave nothing of the record behind
+		if(ftruncate(j->fd, j->end))
+			fprintf(stderr, "! Error, unable to repair the journal %s.\n", j->path);
+		return RETVAL_ERROR;
+	}
+	j->end += sizeof(r) + size;
+	j->rows += count;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * journal_read
+ *
+ * Reads the record at *offset, which must be before the end, and
+ * moves *offset past it. The rows are valid until the next call.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the record could not be read or is damaged
+ ***********************************************************************/
+int journal_read(struct ipta_journal *j, off_t *offset, struct ipta_row **rows, int *count)
+{
+	struct ipta_journal_record r;
+	struct ipta_row *p;
+	size_t size;
+
+	if(pread(j->fd, &r, sizeof(r), *offset) != sizeof(r) ||
+	   memcmp(r.magic, JOURNAL_RECORD_MAGIC, 4))
+		goto damaged;
+	if((int)r.rows > j->buffer_rows) {
+		p = realloc(j->buffer, r.rows * sizeof(struct ipta_row));
+		if(!p) {
+			fprintf(stderr, "! Error, memory allocation failed.\n");
+			return RETVAL_ERROR;
+		}
+		j->buffer = p;
+		j->buffer_rows = r.rows;
+	}
+	size = (size_t)r.rows * sizeof(struct ipta_row);
+	if(pread(j->fd, j->buffer, size, *offset + sizeof(r)) != (ssize_t)size ||
+	   crc32(0L, (unsigned char *)j->buffer, size) != r.crc)
+		goto damaged;
+
+	*offset += sizeof(r) + size;
+	*rows = j->buffer;
+	*count = r.rows;
+	return RETVAL_OK;
+
+damaged:
+	fprintf(stderr, "! Error, the journal %s is damaged at offset %llu.\n",
+		j->path, (unsigned long long)*offset);
+	return RETVAL_ERROR;
+}
+
+/***********************************************************************
+ * journal_done
+ *
+ * Marks the records before offset, holding rows rows, as written to
+ * the database. When all are written the journal is emptied.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int journal_done(struct ipta_journal *j, off_t offset, unsigned long rows)
+{
+	j->done = offset;
+	j->rows = rows < j->rows ? j->rows - rows : 0;
+	if(j->done >= j->end) {
+		j->done = j->end = sizeof(struct ipta_journal_header);
+		j->rows = 0;
+		if(ftruncate(j->fd, j->end)) {
+			fprintf(stderr, "! Error, unable to empty the journal %s.\n", j->path);
+			return RETVAL_ERROR;
+		}
+	}
+	return journal_header(j);
+}
+
+void journal_close(struct ipta_journal *j)
+{
+	if(j->fd >= 0)
+		close(j->fd);
+	free(j->buffer);
+	j->fd = -1;
+	j->buffer = NULL;
+	j->buffer_rows = 0;
+}
@@ -29,7 +29,6 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
-#include <mysql.h>
 #include <linux/limits.h>
 #include "ipta.h"
 #include "cfg2.h"
@@ -41,11 +40,26 @@
 int main(int argc, char *argv[]) 
 {
 	struct ipta_flags *flags = NULL;
+	struct ipta_filter filter;
+	struct ipta_cidr_set ignore_set;
+	struct ipta_cidr_set tag_set;
+	struct ipta_detect detect;
+	struct ipta_flows flows;
+	char *detect_file = NULL;
+	int detect_flag = 0;
+	int *detect_value;
+	char tag_name[CIDR_TAG_LEN];
+	char *tag_file;
 	struct ipta_db_info *db_info = NULL;
 	struct ipta_db_info *dns_info = NULL;
 	int i = 0;
 	int retval = 0;
-	char *import_fname = NULL;
+	char *import_files[FOLLOW_FILES_MAX];
+	int import_count = 0;
+	char *save_fname = NULL;
+	char *restore_fname = NULL;
+	int compact_hours = 0;
+	char *end;
 	int clear_db = 0;
 	int analyze_limit = 10;
 	int known_flag, action_flag = 0;
@@ -53,7 +67,9 @@ int main(int argc, char *argv[])
 	FILE *config_file = NULL;
 	int print_usage_flag = 0;
 	int create_table_flag = 0;
-	char *follow_file = NULL;
+	int upgrade_table_flag = 0;
+	char *follow_files[FOLLOW_FILES_MAX];
+	int follow_count = 0;
 	int follow_flag = 0;
 	//int scan_flag = 0;
 	int create_db_flag = 0;
@@ -65,6 +81,29 @@ int main(int argc, char *argv[])
 	int list_tables_flg = 0;
 	int dns_create_table_flag = 0;
 	int dns_ttl = 24*14;
+	int dns_prewarm_flag = 0;
+	char *dns_prewarm_file = NULL;
+	char dns_file[PATH_MAX] = "";
+	int dns_file_import_flag = 0;
+	int dns_file_export_flag = 0;
+	int dns_stats_flag = 0;
+	int dns_rate = DNS_PREWARM_RATE;
+	char *top_file = NULL;
+	int top_refresh = TOP_REFRESH;
+	char *ingest_files[FOLLOW_FILES_MAX];
+	int ingest_count = 0;
+	int ingest_flag = 0;
+	char *listen[LISTEN_MAX];
+	int listen_count = 0;
+	int ingest_batch = INGEST_BATCH_ROWS;
+	int ingest_latency = INGEST_LATENCY_MS;
+	char ingest_position[PATH_MAX] = "";
+	char ingest_journal[PATH_MAX] = "";
+	char geoip_file[PATH_MAX] = "";
+	char *geoip_csv[FOLLOW_FILES_MAX];
+	int geoip_csv_count = 0;
+	char archive_dir[PATH_MAX] = "";
+	struct ipta_archive archive;
         //  int print_license_flag = 0;
 	cfg_t *st;                        // Configuration store
 	struct passwd *pw = NULL;
@@ -77,7 +116,20 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "! Error, memory allocation failed.\n");
 		exit(RETVAL_ERROR);
 	}
+	memset(&ignore_set, 0, sizeof(ignore_set));
+	memset(&tag_set, 0, sizeof(tag_set));
+	memset(&detect, 0, sizeof(detect));
+	memset(&flows, 0, sizeof(flows));
+	detect.window = DETECT_WINDOW;
+	detect.ports = DETECT_PORT_LIMIT;
+	detect.hosts = DETECT_HOST_LIMIT;
+	detect.rate = DETECT_RATE_LIMIT;
 	
+	flags->dns_threads = DNS_RESOLVER_THREADS;
+	flags->reorder_ms = FOLLOW_REORDER_MS;
+	flags->import_threads = IMPORT_THREADS;
+	flags->commit_rows = IMPORT_COMMIT_ROWS;
+
 	db_info = calloc(sizeof(struct ipta_db_info), 1);
 	if(NULL == db_info) {
 		fprintf(stderr, "! Error, memory allocation failed.\n");
@@ -116,6 +168,8 @@ int main(int argc, char *argv[])
 	
 	// Get user home dir and construct home path string
 	pw = getpwuid(getuid());
+	snprintf(ingest_position, PATH_MAX, "%s/%s", pw->pw_dir, INGEST_POSITION_FILE);
+	snprintf(ingest_journal, PATH_MAX, "%s/%s", pw->pw_dir, INGEST_JOURNAL_FILE);
 	retval = sprintf(home, "%s/.ipta", pw->pw_dir);
 	retval = cfg_parse_file(st, home);
 	if(!retval) {
@@ -151,6 +205,16 @@ int main(int argc, char *argv[])
 				strncpy(db_info->name,   value, IPTA_DB_INFO_STRLEN);
 				break;
 			}
+			if(!strcmp("db_backend", key)) {
+				db_info->backend = db_backend(value);
+				if(!db_info->backend) {
+					fprintf(stderr, "! Error in configuration file, no database backend %s.\n",
+						value);
+					retval = RETVAL_ERROR;
+					goto clean_exit;
+				}
+				break;
+			}
 			if(!strcmp("db_table", key)) {
 				strncpy(db_info->table,  value, IPTA_DB_INFO_STRLEN);
 				break;
@@ -159,6 +223,26 @@ int main(int argc, char *argv[])
 				strncpy(dns_info->table, value, IPTA_DB_INFO_STRLEN);
 				break;
 			}
+			if(!strcmp("dns_file", key)) {
+				strncpy(dns_file, value, PATH_MAX - 1);
+				break;
+			}
+			if(!strcmp("geoip_file", key)) {
+				strncpy(geoip_file, value, PATH_MAX - 1);
+				break;
+			}
+			if(!strcmp("archive_dir", key)) {
+				strncpy(archive_dir, value, PATH_MAX - 1);
+				break;
+			}
+			if(!strcmp("ingest_position", key)) {
+				strncpy(ingest_position, value, PATH_MAX - 1);
+				break;
+			}
+			if(!strcmp("ingest_journal", key)) {
+				strncpy(ingest_journal, value, PATH_MAX - 1);
+				break;
+			}
 
 			// Below this point key and value are lowercase
 			key = strlwr(key);
@@ -253,6 +337,143 @@ int main(int argc, char *argv[])
 			known_flag = FLAG_SET;
 		}
 		
+		if(!strcmp(argv[i], "--collapse")) {
+			flags->collapse = FLAG_SET;
+			known_flag = FLAG_SET;
+		}
+
+		if(!strcmp(argv[i], "--sample")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			flags->sample_rate = atoi(argv[i+1]);
+			if(flags->sample_rate < 1) {
+				fprintf(stderr, "! Error, sample rate must be at least 1 line per second.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--filter")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			if(flags->filter)
+				filter_free(flags->filter);
+			flags->filter = NULL;
+			if(filter_compile(&filter, argv[i+1])) {
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			flags->filter = &filter;
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--ignore-list")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			if(cidr_add_file(&ignore_set, argv[i+1], "ignore") == RETVAL_ERROR) {
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			flags->ignore = &ignore_set;
+			i++;
+			continue;
+		}
+
+		// The tag is name=file, or the file name without extension
+		if(!strcmp(argv[i], "--tag-list")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			tag_file = strchr(argv[i+1], '=');
+			if(tag_file) {
+				snprintf(tag_name, sizeof(tag_name), "%.*s",
+					 (int)(tag_file - argv[i+1]), argv[i+1]);
+				tag_file++;
+			} else {
+				tag_file = argv[i+1];
+				snprintf(tag_name, sizeof(tag_name), "%s",
+					 strrchr(tag_file, '/') ? strrchr(tag_file, '/') + 1 : tag_file);
+				tag_name[strcspn(tag_name, ".")] = '\0';
+			}
+			if(cidr_add_file(&tag_set, tag_file, tag_name) == RETVAL_ERROR) {
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			flags->tags = &tag_set;
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--detect")) {
+			detect_flag = FLAG_SET;
+			known_flag = FLAG_SET;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--detect-log")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			detect_file = argv[i+1];
+			detect_flag = FLAG_SET;
+			i++;
+			continue;
+		}
+
+		// The window and the thresholds of the detector, 0 turns a
+		// check off
+		if(!strcmp(argv[i], "--detect-window") || !strcmp(argv[i], "--detect-ports") ||
+		   !strcmp(argv[i], "--detect-hosts") || !strcmp(argv[i], "--detect-rate")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			detect_value = !strcmp(argv[i], "--detect-window") ? &detect.window :
+				!strcmp(argv[i], "--detect-ports") ? &detect.ports :
+				!strcmp(argv[i], "--detect-hosts") ? &detect.hosts : &detect.rate;
+			*detect_value = atoi(argv[i+1]);
+			if(*detect_value < 0) {
+				fprintf(stderr, "! Error, %s can not be negative.\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--reorder")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			flags->reorder_ms = atoi(argv[i+1]);
+			if(flags->reorder_ms < 0) {
+				fprintf(stderr, "! Error, the reorder window can not be negative.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
 		if(!strcmp(argv[i], "--rdns") || 
 		   !strcmp(argv[i], "-r")) {
 			flags->rdns = FLAG_SET;
@@ -296,8 +517,11 @@ int main(int argc, char *argv[])
 				goto clean_exit;
 			}
 			
-			follow_file = argv[i+1];
-			i++;
+			// More names may follow, for example from a glob the
+			// shell expanded
+			while(i + 1 < argc && argv[i+1][0] != '-' &&
+			      follow_count < FOLLOW_FILES_MAX)
+				follow_files[follow_count++] = argv[++i];
 			continue;
 		}
 
@@ -313,11 +537,127 @@ int main(int argc, char *argv[])
 				goto clean_exit;
 			}
 			
-			follow_file = argv[i+1];
-			i++;
+			// More names may follow, for example from a glob the
+			// shell expanded
+			while(i + 1 < argc && argv[i+1][0] != '-' &&
+			      follow_count < FOLLOW_FILES_MAX)
+				follow_files[follow_count++] = argv[++i];
 			continue;
 		}
 		
+		if(!strcmp(argv[i], "--top")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			if(argc < (i+2)) {
+				fprintf(stderr, "! Error: Top mode needs a file name!\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			top_file = argv[i+1];
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--top-refresh")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			top_refresh = atoi(argv[i+1]);
+			if(top_refresh < 1) {
+				fprintf(stderr, "! Error, top refresh must be at least 1 second.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--listen")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			if(argc < (i+2)) {
+				fprintf(stderr, "! Error, must have udp:[host:]port or unix:path following %s.\n",
+					argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			if(listen_count == LISTEN_MAX) {
+				fprintf(stderr, "! Error, at most %d syslog sockets.\n", LISTEN_MAX);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			listen[listen_count++] = argv[i+1];
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--ingest-follow")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			ingest_flag = FLAG_SET;
+			// The lines may also come from --listen sockets only
+			while(i + 1 < argc && argv[i+1][0] != '-' &&
+			      ingest_count < FOLLOW_FILES_MAX)
+				ingest_files[ingest_count++] = argv[++i];
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--ingest-batch")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			ingest_batch = atoi(argv[i+1]);
+			if(ingest_batch < 1) {
+				fprintf(stderr, "! Error, ingest batch must be at least 1 row.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--ingest-latency")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			ingest_latency = atoi(argv[i+1]);
+			if(ingest_latency < 1) {
+				fprintf(stderr, "! Error, ingest latency must be at least 1 ms.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--ingest-position")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "! Error, must have a file name following %s.\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			strncpy(ingest_position, argv[i+1], PATH_MAX - 1);
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--ingest-journal")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "! Error, must have a file name following %s.\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			strncpy(ingest_journal, argv[i+1], PATH_MAX - 1);
+			i++;
+			continue;
+		}
+
 		if(!strcmp(argv[i], "-l") || 
 		   !strcmp(argv[i], "--limit") ||
 		   !strcmp(argv[i], "--lines")) {
@@ -354,6 +694,24 @@ int main(int argc, char *argv[])
 			continue;
 		}
 		
+		if(!strcmp(argv[i], "--db-backend")) {
+			known_flag = FLAG_SET;
+			if(argc < (i+2)) {
+				fprintf(stderr, "! You must supply mysql or sqlite with argument %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			db_info->backend = db_backend(argv[i]);
+			if(!db_info->backend) {
+				fprintf(stderr, "! Error, no database backend %s, use mysql or sqlite.\n",
+					argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			continue;
+		}
+
 		if(!strcmp(argv[i], "--db-user") || !strcmp(argv[i], "-u")) {
 			known_flag = FLAG_SET;
 			if(argc < (i+2)) {
@@ -463,7 +821,202 @@ int main(int argc, char *argv[])
 				retval = RETVAL_ERROR;
 				goto clean_exit;
 			}
-			strncpy(dns_info->table, argv[i+2], IPTA_DB_INFO_STRLEN);
+			strncpy(dns_info->table, argv[i+1], IPTA_DB_INFO_STRLEN - 1);
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--dns-prewarm")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			dns_prewarm_flag = FLAG_SET;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--dns-prewarm-file")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "! Error, must have a log file following %s.\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			action_flag = FLAG_SET;
+			dns_prewarm_flag = FLAG_SET;
+			dns_prewarm_file = argv[i+1];
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--dns-file")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "! Error, must have a file name following %s.\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			strncpy(dns_file, argv[i+1], PATH_MAX - 1);
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--geoip")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "! Error, must have a file name following %s.\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			strncpy(geoip_file, argv[i+1], PATH_MAX - 1);
+			i++;
+			continue;
+		}
+
+		// Repeated packets are merged into one row, 0 is off
+		if(!strcmp(argv[i], "--flow-timeout")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			flows.timeout = atoi(argv[i+1]);
+			if(flows.timeout < 0) {
+				fprintf(stderr, "! Error, the flow timeout can not be negative.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--archive")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "! Error, must have a directory following %s.\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			strncpy(archive_dir, argv[i+1], PATH_MAX - 1);
+			i++;
+			continue;
+		}
+
+		// One or more range files, written to the --geoip index
+		if(!strcmp(argv[i], "--geoip-compile")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			while(i + 1 < argc && argv[i+1][0] != '-' &&
+			      geoip_csv_count < FOLLOW_FILES_MAX)
+				geoip_csv[geoip_csv_count++] = argv[++i];
+			if(!geoip_csv_count) {
+				fprintf(stderr, "! Error, %s needs one or more CSV files.\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--dns-file-import")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			dns_file_import_flag = FLAG_SET;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--dns-file-export")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			dns_file_export_flag = FLAG_SET;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--dns-stats")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			dns_stats_flag = FLAG_SET;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--dns-threads")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			flags->dns_threads = atoi(argv[i+1]);
+			if(flags->dns_threads < 1 ||
+			   flags->dns_threads > DNS_RESOLVER_MAX_THREADS) {
+				fprintf(stderr, "! Error, dns threads must be 1 to %d.\n",
+					DNS_RESOLVER_MAX_THREADS);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--import-threads")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			flags->import_threads = atoi(argv[i+1]);
+			if(flags->import_threads < 1 ||
+			   flags->import_threads > IMPORT_THREADS_MAX) {
+				fprintf(stderr, "! Error, import threads must be 1 to %d.\n",
+					IMPORT_THREADS_MAX);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--commit-rows")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			flags->commit_rows = atoi(argv[i+1]);
+			if(flags->commit_rows < 0) {
+				fprintf(stderr, "! Error, commit rows can not be negative.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		// Rows the database did not take are added to the file
+		if(!strcmp(argv[i], "--reject-file")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			if(flags->reject)
+				fclose(flags->reject);
+			flags->reject = fopen(argv[i+1], "a");
+			if(!flags->reject) {
+				fprintf(stderr, "! Error, unable to open the reject file %s.\n", argv[i+1]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--dns-rate")) {
+			if(argc < (i+2)) {
+				fprintf(stderr, "? Missing argument for %s\n", argv[i]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			dns_rate = atoi(argv[i+1]);
+			if(dns_rate < 0) {
+				fprintf(stderr, "! Error, dns rate can not be negative.\n");
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
 		}
 		
 		// Table operations defined here as flags are processed
@@ -498,6 +1051,55 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
+		if(!strcmp(argv[i], "--upgrade-table")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			upgrade_table_flag = FLAG_SET;
+			continue;
+		}
+
+		// Age as hours, days or weeks, days if no unit is given
+		if(!strcmp(argv[i], "--compact")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			if(argc < (i+2)) {
+				fprintf(stderr, "? You need to specify an age such as 7d after '%s'.\n", argv[i]);
+				retval = RETVAL_WARN;
+				goto clean_exit;
+			}
+			compact_hours = strtol(argv[i+1], &end, 10);
+			if(!strcmp(end, "w"))
+				compact_hours *= 7 * 24;
+			else if(!*end || !strcmp(end, "d"))
+				compact_hours *= 24;
+			else if(strcmp(end, "h"))
+				compact_hours = 0;
+			if(compact_hours <= 0) {
+				fprintf(stderr, "! Error, '%s' is not an age such as 12h, 7d or 2w.\n", argv[i+1]);
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			i++;
+			continue;
+		}
+
+		if(!strcmp(argv[i], "--save-db") ||
+		   !strcmp(argv[i], "--restore-db")) {
+			known_flag = FLAG_SET;
+			action_flag = FLAG_SET;
+			if(argc < (i+2)) {
+				fprintf(stderr, "? You need to specify a file name after '%s'.\n", argv[i]);
+				retval = RETVAL_WARN;
+				goto clean_exit;
+			}
+			if(!strcmp(argv[i], "--save-db"))
+				save_fname = argv[i+1];
+			else
+				restore_fname = argv[i+1];
+			i++;
+			continue;
+		}
+
 		if(!strcmp(argv[i], "--dns-dump")) {
 			known_flag = FLAG_SET;
 			action_flag = FLAG_SET;
@@ -522,7 +1124,11 @@ int main(int argc, char *argv[])
 				retval = RETVAL_WARN;
 				goto clean_exit;
 			}
-			import_fname = argv[i+1]; i++;
+			// Any number of files and directories, such as the
+			// rotated logs the shell expanded from a glob
+			while(i + 1 < argc && argv[i+1][0] != '-' &&
+			      import_count < FOLLOW_FILES_MAX)
+				import_files[import_count++] = argv[++i];
 			import_flag = FLAG_SET;
 			continue;
 		}
@@ -548,6 +1154,11 @@ int main(int argc, char *argv[])
 	 * how they were inserted on the command line.
 	 ***********************************************************************/
 	
+	// The dns table is kept in the same SQLite file as the logs
+	dns_info->backend = db_info->backend;
+	if(db_info->backend == &db_sqlite_backend)
+		strcpy(dns_info->name, db_info->name);
+
 	// Process the actual modes to do something here
 	if(!action_flag) {
 		fprintf(stderr, "- No action, exiting.\n");
@@ -555,6 +1166,59 @@ int main(int argc, char *argv[])
 		goto clean_exit;
 	}
 	
+	// Imports go to the archive and analyze reads it, not the database
+	if(archive_dir[0]) {
+		retval = archive_open(&archive, archive_dir);
+		if(retval)
+			goto clean_exit;
+		flags->archive = &archive;
+	}
+
+	if(flows.timeout) {
+		if(flags->archive) {
+			fprintf(stderr, "! Error, the archive has no flow counts, --flow-timeout needs the database.\n");
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		retval = flow_init(&flows);
+		if(retval)
+			goto clean_exit;
+		flags->flows = &flows;
+	}
+
+	// The address lists are sorted once all files are loaded
+	if((flags->ignore && cidr_build(flags->ignore)) ||
+	   (flags->tags && cidr_build(flags->tags))) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	if(detect_flag) {
+		retval = detect_init(&detect, detect_file);
+		if(retval)
+			goto clean_exit;
+		flags->detect = &detect;
+	}
+
+	// A new GeoIP index is written before it is opened
+	if(geoip_csv_count) {
+		if(!geoip_file[0]) {
+			fprintf(stderr, "! Error, --geoip names the index --geoip-compile writes.\n");
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		retval = geoip_compile(geoip_file, geoip_csv, geoip_csv_count);
+		if(retval)
+			goto clean_exit;
+	}
+
+	if(geoip_file[0]) {
+		retval = geoip_open(geoip_file);
+		if(retval)
+			goto clean_exit;
+		flags->geoip = FLAG_SET;
+	}
+
 	// This must be the first action as it may break all the
 	// others except for the dns settings 
 
@@ -570,8 +1234,62 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// The DNS cache file replaces the dns table for name lookups
+	if(dns_file[0]) {
+		retval = dns_file_cache_open(dns_file, dns_ttl);
+		if(retval)
+			goto clean_exit;
+	}
+
+	if((dns_file_import_flag || dns_file_export_flag) && !dns_file[0]) {
+		fprintf(stderr, "! Error, --dns-file is needed to sync the DNS cache file.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	// Sync between the dns table and the cache file
+	if(dns_file_import_flag) {
+		retval = dns_file_cache_import(dns_info);
+		if(retval)
+			goto clean_exit;
+	}
+
+	if(dns_file_export_flag) {
+		retval = dns_file_cache_export(dns_info);
+		if(retval)
+			goto clean_exit;
+	}
+
+	// Fill the DNS cache ahead of a big --rdns analysis
+	if(dns_prewarm_flag) {
+		retval = dns_cache_prewarm(db_info, dns_info, dns_prewarm_file,
+					   dns_ttl, flags->dns_threads, dns_rate);
+		if(retval) {
+			fprintf(stderr, "! Error prewarming the DNS cache.\n");
+			goto clean_exit;
+		}
+	}
+
+	// Syslog sockets on their own are followed
+	if(listen_count && !ingest_flag && !top_file)
+		follow_flag = FLAG_SET;
+
 	if(follow_flag) {
-		retval = follow(follow_file, flags, dns_info);
+		retval = follow(follow_files, follow_count, listen, listen_count,
+				flags, dns_info);
+		goto clean_exit;
+	}
+
+	if(top_file) {
+		retval = top(top_file, flags, dns_info, analyze_limit, top_refresh);
+		goto clean_exit;
+	}
+
+	// Runs until interrupted, like follow
+	if(ingest_flag) {
+		retval = ingest_follow(ingest_files, ingest_count, listen, listen_count,
+				       db_info, flags, ingest_batch, ingest_latency,
+				       ingest_position, ingest_journal);
 		goto clean_exit;
 	}
 	
@@ -583,7 +1301,7 @@ int main(int argc, char *argv[])
 	// Setup the default db setting and stor in .ipta
 	if(create_db_flag) {
 		retval = create_db(db_info);
-		if(!retval) {
+		if(retval) {
 			fprintf(stderr, 
 				"! Error, create db failed, exiting. You need to give MySQL root privileges\n"
 				"  for this to work as the database must be created and a grand given to ipta.\n");
@@ -616,6 +1334,13 @@ int main(int argc, char *argv[])
 			goto clean_exit;
 	}
 
+	// Add new columns to a table from an older version
+	if(upgrade_table_flag) {
+		retval = upgrade_table(db_info);
+		if(retval)
+			goto clean_exit;
+	}
+
 	// Clear all database entries
 	if(clear_db) {
 		retval = clear_database(db_info);
@@ -625,15 +1350,41 @@ int main(int argc, char *argv[])
 		} 
 	}
 	
+	// Load a dump from --save-db into the tables
+	if(restore_fname) {
+		retval = restore_db(db_info, dns_info, restore_fname);
+		if(retval)
+			goto clean_exit;
+	}
+
 	// import from syslog
 	if(import_flag) {
-		retval = import_syslog(db_info, import_fname);
+		retval = import_syslog(db_info, import_files, import_count, flags);
 		if(retval != 0) {
 			fprintf(stderr, "! Error importing. Sorry.\n");
 			goto clean_exit;
 		} 
 	}
 	
+	// Roll the old packets into hourly counts
+	if(compact_hours) {
+		if(flags->archive) {
+			fprintf(stderr, "! Error, --compact works on the database and not the archive.\n");
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		retval = compact_table(db_info, compact_hours);
+		if(retval)
+			goto clean_exit;
+	}
+
+	// After the import so a dump can be taken in the same run
+	if(save_fname) {
+		retval = save_db(db_info, dns_info, save_fname);
+		if(retval)
+			goto clean_exit;
+	}
+
 	// Run the automatic analyzer module
 	if(analyze_flag) {
 		retval = analyze(db_info, flags, analyze_limit, dns_info);
@@ -644,14 +1395,33 @@ int main(int argc, char *argv[])
 		}
 	}
 	
+	// Last so the counters include the work done above
+	if(dns_stats_flag) {
+		retval = dns_stats_report(dns_info);
+		if(retval)
+			goto clean_exit;
+	}
+
 clean_exit:
 	
 	if(config_file)
 		fclose(config_file);
+	if(flags && flags->filter)
+		filter_free(flags->filter);
+	cidr_free(&ignore_set);
+	cidr_free(&tag_set);
+	detect_free(&detect);
+	flow_free(&flows);
+	if(flags && flags->reject)
+		fclose(flags->reject);
+	if(flags && flags->archive)
+		archive_close(flags->archive);
 	free(flags);
 	free(db_info);
 	free(dns_info);
 	cfg_free(st);
+	dns_file_cache_close();
+	geoip_close();
 	
 	return retval;
 }
@@ -0,0 +1,307 @@
+/**********************************************************************
+ * multitail.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glob.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Following many log files
+ *
+ * A collector often writes one file per firewall. Instead of one
+ * process per file, all files are opened here with one inotify
+ * instance between them, and one epoll loop waits for all of them.
+ * The inotify events tell which files have changed so only those are
+ * read, a quiet file costs nothing. Lines are taken from the files in
+ * turn, a burst at a time, so a flood in one file does not starve
+ * the others.
+ *
+ * Syslog sockets, see syslog_recv.c, are sources in the same loop so
+ * follow and ingest can take lines from the network and from files
+ * at the same time.
+ ***********************************************************************/
+
+#define MULTITAIL_BURST 64
+
+/* The name shown for a file, the directory it is in, fw1/kern.log -> fw1 */
+static char *multitail_label(char *path)
+{
+	char *copy = strdup(path);
+	char *label;
+
+	if(!copy)
+		return NULL;
+	label = strdup(basename(dirname(copy)));
+	free(copy);
+	return label;
+}
+
+/***********************************************************************
+ * multitail_open
+ *
+ * Opens every file matching the patterns, which may be plain file
+ * names or shell globs like /var/log/fw?/kern.log.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - no files or a file could not be opened
+ ***********************************************************************/
+int multitail_open(struct ipta_multitail *mt, char **patterns, int npatterns, int from_start)
+{
+	struct epoll_event ev;
+	glob_t files;
+	int flags = GLOB_TILDE | GLOB_BRACE | GLOB_NOCHECK;
+	int i;
+
+	memset(mt, 0, sizeof(struct ipta_multitail));
+	mt->inotify_fd = mt->epoll_fd = -1;
+
+	memset(&files, 0, sizeof(files));
+	for(i = 0; i < npatterns; i++) {
+		if(glob(patterns[i], flags, NULL, &files)) {
+			fprintf(stderr, "! Error, no files match %s.\n", patterns[i]);
+			globfree(&files);
+			return RETVAL_ERROR;
+		}
+		flags |= GLOB_APPEND;
+	}
+
+	// Files may be left out if there are syslog sockets instead
+	mt->count = files.gl_pathc;
+	mt->tail = calloc(mt->count + 1, sizeof(struct ipta_tail));
+	mt->path = calloc(mt->count + 1, sizeof(char *));
+	mt->label = calloc(mt->count + 1, sizeof(char *));
+	mt->ready = calloc(mt->count + LISTEN_MAX, sizeof(int));
+	mt->receiver = calloc(LISTEN_MAX, sizeof(struct ipta_receiver));
+	if(!mt->tail || !mt->path || !mt->label || !mt->ready || !mt->receiver) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		globfree(&files);
+		multitail_close(mt);
+		return RETVAL_ERROR;
+	}
+	for(i = 0; i < mt->count; i++) {
+		mt->tail[i].file = NULL;
+		mt->tail[i].inotify_fd = -1;
+		mt->path[i] = strdup(files.gl_pathv[i]);
+		mt->label[i] = multitail_label(files.gl_pathv[i]);
+	}
+	globfree(&files);
+
+	// Without inotify every file is checked once a second
+	mt->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	mt->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(mt->epoll_fd < 0) {
+		fprintf(stderr, "! Error, unable to create the epoll instance.\n");
+		multitail_close(mt);
+		return RETVAL_ERROR;
+	}
+	if(mt->inotify_fd >= 0) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = mt->inotify_fd;
+		epoll_ctl(mt->epoll_fd, EPOLL_CTL_ADD, mt->inotify_fd, &ev);
+	}
+
+	for(i = 0; i < mt->count; i++) {
+		if(!mt->path[i] || !mt->label[i] ||
+		   tail_open_shared(&mt->tail[i], mt->path[i], from_start, mt->inotify_fd)) {
+			multitail_close(mt);
+			return RETVAL_ERROR;
+		}
+		mt->tail[i].partial_ok = from_start;
+		mt->ready[i] = FLAG_SET;
+	}
+
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * multitail_listen
+ *
+ * Adds a syslog socket as a source, spec is udp:[host:]port or
+ * unix:path.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int multitail_listen(struct ipta_multitail *mt, char *spec)
+{
+	struct ipta_receiver *r;
+	struct epoll_event ev;
+
+	if(mt->receivers == LISTEN_MAX) {
+		fprintf(stderr, "! Error, at most %d syslog sockets.\n", LISTEN_MAX);
+		return RETVAL_ERROR;
+	}
+	r = &mt->receiver[mt->receivers];
+	if(receiver_open(r, spec))
+		return RETVAL_ERROR;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = r->fd;
+	if(epoll_ctl(mt->epoll_fd, EPOLL_CTL_ADD, r->fd, &ev)) {
+		receiver_close(r);
+		return RETVAL_ERROR;
+	}
+
+	mt->ready[mt->count + mt->receivers] = FLAG_SET;
+	mt->receivers++;
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * multitail_getline
+ *
+ * Reads the next complete line from any of the files, *source is set
+ * to the index of the file it came from.
+ *
+ * RETURNS
+ *
+ * 	The length of the line, or -1 if no file has a complete line
+ ***********************************************************************/
+ssize_t multitail_getline(struct ipta_multitail *mt, char **line, size_t *len, int *source)
+{
+	int sources = mt->count + mt->receivers;
+	ssize_t read;
+	int n, i;
+
+	for(n = 0; n <= sources; n++) {
+		i = mt->current;
+		if(i < sources && mt->ready[i]) {
+			if(i < mt->count)
+				read = tail_getline(&mt->tail[i], line, len);
+			else
+				read = receiver_getline(&mt->receiver[i - mt->count], line, len);
+			if(read != -1) {
+				*source = i;
+				if(++mt->burst >= MULTITAIL_BURST) {
+					mt->burst = 0;
+					mt->current = (i + 1) % sources;
+				}
+				return read;
+			}
+			mt->ready[i] = FLAG_CLEAR;
+		}
+		mt->burst = 0;
+		mt->current = sources ? (i + 1) % sources : 0;
+	}
+
+	return -1;
+}
+
+/* Mark the files an inotify event is about as ready */
+static void multitail_event(struct ipta_multitail *mt, struct inotify_event *event)
+{
+	int i;
+
+	for(i = 0; i < mt->count; i++) {
+		if(event->mask & IN_Q_OVERFLOW || event->wd == mt->tail[i].watch ||
+		   event->wd == mt->tail[i].dir_watch)
+			mt->ready[i] = FLAG_SET;
+	}
+}
+
+/***********************************************************************
+ * multitail_wait
+ *
+ * Waits until any of the files has changed, for at most timeout_ms
+ * milliseconds, -1 waits forever. Files that could not be watched
+ * are polled once a second.
+ ***********************************************************************/
+void multitail_wait(struct ipta_multitail *mt, int timeout_ms)
+{
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct epoll_event ev[LISTEN_MAX + 1];
+	struct inotify_event *event;
+	ssize_t len;
+	char *p;
+	int polled = FLAG_CLEAR;
+	int i, e, n;
+
+	for(i = 0; i < mt->count; i++)
+		if(mt->tail[i].watch < 0)
+			polled = FLAG_SET;
+	if(polled && (timeout_ms < 0 || timeout_ms > 1000))
+		timeout_ms = 1000;
+
+	n = epoll_wait(mt->epoll_fd, ev, LISTEN_MAX + 1, timeout_ms);
+	for(e = 0; e < n; e++) {
+		if(ev[e].data.fd != mt->inotify_fd) {
+			for(i = 0; i < mt->receivers; i++)
+				if(ev[e].data.fd == mt->receiver[i].fd)
+					mt->ready[mt->count + i] = FLAG_SET;
+			continue;
+		}
+		while((len = read(mt->inotify_fd, events, sizeof(events))) > 0) {
+			for(p = events; p < events + len; p += sizeof(struct inotify_event) + event->len) {
+				event = (struct inotify_event *)p;
+				multitail_event(mt, event);
+			}
+		}
+	}
+
+	for(i = 0; i < mt->count; i++)
+		if(mt->tail[i].watch < 0)
+			mt->ready[i] = FLAG_SET;
+}
+
+void multitail_close(struct ipta_multitail *mt)
+{
+	int i;
+
+	for(i = 0; i < mt->count; i++) {
+		if(mt->tail)
+			tail_close(&mt->tail[i]);
+		if(mt->path)
+			free(mt->path[i]);
+		if(mt->label)
+			free(mt->label[i]);
+	}
+	for(i = 0; i < mt->receivers; i++)
+		receiver_close(&mt->receiver[i]);
+	free(mt->receiver);
+	free(mt->tail);
+	free(mt->path);
+	free(mt->label);
+	free(mt->ready);
+	if(mt->inotify_fd >= 0)
+		close(mt->inotify_fd);
+	if(mt->epoll_fd >= 0)
+		close(mt->epoll_fd);
+	memset(mt, 0, sizeof(struct ipta_multitail));
+	mt->inotify_fd = mt->epoll_fd = -1;
+}
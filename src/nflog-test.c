@@ -0,0 +1,213 @@
+/***********************************************************************
+ * nflog-test.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * Tests for the NFLOG packet decoder, not needed to compile the tools.
+ * The packets are built in memory. Needs no database.
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "ipta.h"
+
+/* Builds NFLOG packets the way the capturing host would, in its byte order */
+struct test_packet {
+	unsigned char data[512];
+	size_t len;
+	int swapped;
+};
+
+static void test_start(struct test_packet *t, int swapped)
+{
+	memset(t, 0, sizeof(struct test_packet));
+	t->swapped = swapped;
+	t->data[0] = 2;                   // AF_INET
+	t->len = 4;
+}
+
+static void test_tlv(struct test_packet *t, int type, const void *value, size_t len)
+{
+	uint16_t l = len + 4, ty = type;
+
+	if(t->swapped) {
+		l = __builtin_bswap16(l);
+		ty = __builtin_bswap16(ty);
+	}
+	memcpy(t->data + t->len, &l, 2);
+	memcpy(t->data + t->len + 2, &ty, 2);
+	memcpy(t->data + t->len + 4, value, len);
+	t->len += (len + 4 + 3) & ~3;
+}
+
+static void test_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* An IPv4 TCP packet from 192.0.2.1:40000 to 198.51.100.7:22 */
+static void test_ipv4(struct test_packet *t)
+{
+	unsigned char ip[40] = {
+		0x45, 0, 0, 40, 0, 0, 0x40, 0, 64, 6, 0, 0,
+		192, 0, 2, 1, 198, 51, 100, 7,
+		0x9c, 0x40, 0, 22 };
+	unsigned char ifindex[4];
+	unsigned char ts[16] = { 0 };
+	unsigned char hw[14] = { 0, 0x11, 0x22, 0x33, 0x44, 0x55,
+				 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0x08, 0x00 };
+
+	test_tlv(t, 10, "IPT: DROP ", 11);
+	test_be32(ifindex, 9999);
+	test_tlv(t, 4, ifindex, 4);
+	test_be32(ts + 4, 1700000000);
+	test_tlv(t, 3, ts, sizeof(ts));
+	test_tlv(t, 16, hw, sizeof(hw));
+	test_tlv(t, 9, ip, sizeof(ip));
+}
+
+static int test_check(char *name, char *got, char *want)
+{
+	if(!strcmp(got, want))
+		return 0;
+	fprintf(stderr, "! Error, %s is \"%s\", expected \"%s\".\n", name, got, want);
+	return 1;
+}
+
+static int test_ipv4_fields(struct test_packet *t)
+{
+	struct ipta_nflog pkt;
+	struct ipta_record rec;
+	int errors = 0;
+
+	if(nflog_decode(t->data, t->len, t->swapped, 0, &pkt, &rec) != RETVAL_OK) {
+		fprintf(stderr, "! Error, packet not decoded.\n");
+		return 1;
+	}
+	errors += test_check("action", rec.action, "DROP");
+	errors += test_check("if_in", rec.if_in, "if9999");
+	errors += test_check("if_out", rec.if_out, "");
+	errors += test_check("src", rec.src, "192.0.2.1");
+	errors += test_check("dst", rec.dst, "198.51.100.7");
+	errors += test_check("proto", rec.proto, "TCP");
+	errors += test_check("src_port", rec.src_port, "40000");
+	errors += test_check("dst_port", rec.dst_port, "22");
+	errors += test_check("mac", rec.mac, "00:11:22:33:44:55:66:77:88:99:aa:bb:08:00");
+	if(rec.timestamp != 1700000000) {
+		fprintf(stderr, "! Error, time stamp is %ld.\n", (long)rec.timestamp);
+		errors++;
+	}
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	struct test_packet t;
+	struct ipta_nflog pkt;
+	struct ipta_record rec;
+	int errors = 0;
+	int n;
+
+	printf("* Unit tests for the NFLOG decoder of ipta.\n\n");
+
+	// Test I: An IPv4 TCP packet with prefix, interface and time stamp
+	fprintf(stderr, "* Test I: Decode an IPv4 TCP packet.\n");
+	test_start(&t, FLAG_CLEAR);
+	test_ipv4(&t);
+	n = test_ipv4_fields(&t);
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test II: The same packet captured on a host of the other byte order
+	fprintf(stderr, "* Test II: Decode a packet in the other byte order.\n");
+	test_start(&t, FLAG_SET);
+	test_ipv4(&t);
+	n = test_ipv4_fields(&t);
+	if(!n)
+		fprintf(stderr, "  Success.\n");
+	errors += n;
+
+	// Test III: IPv6 UDP behind a fragment header, no time stamp TLV
+	fprintf(stderr, "* Test III: Decode an IPv6 UDP packet with a fragment header.\n");
+	{
+		unsigned char ip6[56] = { 0x60, 0, 0, 0, 0, 16, 44, 64 };
+
+		ip6[8] = 0x20; ip6[9] = 0x01; ip6[10] = 0x0d; ip6[11] = 0xb8; ip6[23] = 1;
+		ip6[24] = 0x20; ip6[25] = 0x01; ip6[26] = 0x0d; ip6[27] = 0xb8; ip6[39] = 2;
+		ip6[40] = 17;                     // fragment header, offset 0
+		ip6[48] = 0; ip6[49] = 53; ip6[50] = 0x14; ip6[51] = 0xe9;
+		test_start(&t, FLAG_CLEAR);
+		t.data[0] = 10;
+		test_tlv(&t, 10, "ACCEPT", 7);
+		test_tlv(&t, 9, ip6, sizeof(ip6));
+		n = 0;
+		if(nflog_decode(t.data, t.len, t.swapped, 1234, &pkt, &rec) != RETVAL_OK) {
+			fprintf(stderr, "! Error, packet not decoded.\n");
+			n++;
+		} else {
+			n += test_check("action", rec.action, "ACCEPT");
+			n += test_check("src", rec.src, "2001:db8::1");
+			n += test_check("dst", rec.dst, "2001:db8::2");
+			n += test_check("proto", rec.proto, "UDP");
+			n += test_check("src_port", rec.src_port, "53");
+			n += test_check("dst_port", rec.dst_port, "5353");
+			if(rec.timestamp != 1234) {
+				fprintf(stderr, "! Error, the pcap time stamp was not used.\n");
+				n++;
+			}
+		}
+		if(!n)
+			fprintf(stderr, "  Success.\n");
+		errors += n;
+	}
+
+	// Test IV: A TLV running past the end is refused
+	fprintf(stderr, "* Test IV: Refuse a damaged packet.\n");
+	test_start(&t, FLAG_CLEAR);
+	test_ipv4(&t);
+	if(nflog_decode(t.data, t.len - 8, t.swapped, 0, &pkt, &rec) == RETVAL_WARN) {
+		fprintf(stderr, "  Success.\n");
+	} else {
+		fprintf(stderr, "! Error, a cut packet was decoded.\n");
+		errors++;
+	}
+
+	// Test V: A packet without an IP payload is skipped
+	fprintf(stderr, "* Test V: Skip a packet without IP payload.\n");
+	test_start(&t, FLAG_CLEAR);
+	test_tlv(&t, 10, "IPT: DROP ", 11);
+	test_tlv(&t, 9, "\x00\x01\x08\x00", 4);
+	if(nflog_decode(t.data, t.len, t.swapped, 0, &pkt, &rec) == RETVAL_WARN) {
+		fprintf(stderr, "  Success.\n");
+	} else {
+		fprintf(stderr, "! Error, a packet without IP was decoded.\n");
+		errors++;
+	}
+
+	fprintf(stderr, "* %d errors.\n", errors);
+	return errors ? RETVAL_ERROR : RETVAL_OK;
+}
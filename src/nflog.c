@@ -0,0 +1,515 @@
+/**********************************************************************
+ * nflog.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * NFLOG packet captures
+ *
+ * With the NFLOG target instead of LOG the kernel hands the packets
+ * to user space without formatting a text line for each of them, and
+ * tcpdump -i nflog:N or ulogd can write them to a pcap file. Each
+ * packet is a small header followed by TLVs: the log prefix, the
+ * interfaces, the hardware header, a time stamp and the packet
+ * itself. The TLV lengths and types are in the byte order of the
+ * host that captured, like the pcap headers; the values are in
+ * network order.
+ *
+ * The packets are decoded into the same fields the text parser finds
+ * in a log line, so the batching and the table are shared with
+ * --import. There is no text to tokenize, it is a few loads per
+ * field.
+ ***********************************************************************/
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HEADER_LEN 24
+#define PCAP_RECORD_LEN 16
+#define LINKTYPE_NFLOG 239
+
+#define NFULA_PACKET_HDR 1
+#define NFULA_TIMESTAMP 3
+#define NFULA_IFINDEX_INDEV 4
+#define NFULA_IFINDEX_OUTDEV 5
+#define NFULA_HWADDR 8
+#define NFULA_PAYLOAD 9
+#define NFULA_PREFIX 10
+#define NFULA_HWHEADER 16
+
+#define NFLOG_IFNAME_CACHE 64
+
+static uint16_t nflog_get16(const unsigned char *p, int swapped)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swapped ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t nflog_get32(const unsigned char *p, int swapped)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+/* Network order values */
+static uint16_t nflog_be16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t nflog_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/***********************************************************************
+ * nflog_ifname
+ *
+ * The capture only has interface indexes. They are named the way the
+ * host running ipta names them, which is right when the capture was
+ * made here. Unknown indexes are shown as ifN. The low indexes are
+ * cached so the lookup is done once per interface, the cache is
+ * locked as the parallel import reads captures in several threads.
+ ***********************************************************************/
+static void nflog_ifname(uint32_t index, char *name, size_t len)
+{
+	static char cache[NFLOG_IFNAME_CACHE][IF_NAMESIZE];
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	char ifname[IF_NAMESIZE];
+
+	if(index < NFLOG_IFNAME_CACHE) {
+		pthread_mutex_lock(&lock);
+		memcpy(ifname, cache[index], IF_NAMESIZE);
+		pthread_mutex_unlock(&lock);
+		if(ifname[0]) {
+			snprintf(name, len, "%s", ifname);
+			return;
+		}
+	}
+	if(!if_indextoname(index, ifname))
+		snprintf(ifname, sizeof(ifname), "if%u", index);
+	if(index < NFLOG_IFNAME_CACHE) {
+		pthread_mutex_lock(&lock);
+		memcpy(cache[index], ifname, IF_NAMESIZE);
+		pthread_mutex_unlock(&lock);
+	}
+	snprintf(name, len, "%s", ifname);
+}
+
+/* The protocol the way the kernel writes PROTO= in a log line */
+static void nflog_proto(int proto, char *name, size_t len)
+{
+	switch(proto) {
+	case 1:
+		snprintf(name, len, "ICMP");
+		break;
+	case 6:
+		snprintf(name, len, "TCP");
+		break;
+	case 17:
+		snprintf(name, len, "UDP");
+		break;
+	case 50:
+		snprintf(name, len, "ESP");
+		break;
+	case 51:
+		snprintf(name, len, "AH");
+		break;
+	case 58:
+		snprintf(name, len, "ICMPv6");
+		break;
+	case 136:
+		snprintf(name, len, "UDPLITE");
+		break;
+	default:
+		snprintf(name, len, "%d", proto);
+		break;
+	}
+}
+
+/* Decodes the IPv4 or IPv6 packet, the payload may be cut short */
+static void nflog_payload(const unsigned char *p, size_t len, struct ipta_nflog *pkt)
+{
+	size_t hlen;
+	int proto;
+	int ports = FLAG_SET;
+
+	if(len < 1)
+		return;
+
+	if((p[0] >> 4) == 4) {
+		hlen = (p[0] & 0x0f) * 4;
+		if(len < 20 || hlen < 20)
+			return;
+		inet_ntop(AF_INET, p + 12, pkt->src, sizeof(pkt->src));
+		inet_ntop(AF_INET, p + 16, pkt->dst, sizeof(pkt->dst));
+		proto = p[9];
+		// Only the first fragment has the ports
+		if(nflog_be16(p + 6) & 0x1fff)
+			ports = FLAG_CLEAR;
+	} else if((p[0] >> 4) == 6) {
+		if(len < 40)
+			return;
+		inet_ntop(AF_INET6, p + 8, pkt->src, sizeof(pkt->src));
+		inet_ntop(AF_INET6, p + 24, pkt->dst, sizeof(pkt->dst));
+		proto = p[6];
+		hlen = 40;
+		// Step over the extension headers to the transport header
+		while(hlen + 8 <= len) {
+			if(proto == 0 || proto == 43 || proto == 60) {
+				proto = p[hlen];
+				hlen += (p[hlen + 1] + 1) * 8;
+			} else if(proto == 44) {
+				if(nflog_be16(p + hlen + 2) & 0xfff8)
+					ports = FLAG_CLEAR;
+				proto = p[hlen];
+				hlen += 8;
+			} else {
+				break;
+			}
+		}
+	} else {
+		return;
+	}
+
+	nflog_proto(proto, pkt->proto, sizeof(pkt->proto));
+	if(ports && (proto == 6 || proto == 17 || proto == 136) && hlen + 4 <= len) {
+		snprintf(pkt->src_port, sizeof(pkt->src_port), "%u", nflog_be16(p + hlen));
+		snprintf(pkt->dst_port, sizeof(pkt->dst_port), "%u", nflog_be16(p + hlen + 2));
+	}
+}
+
+/* The action is the first word after the ipta prefix, as in a log line */
+static void nflog_prefix(const unsigned char *p, size_t len, struct ipta_nflog *pkt)
+{
+	char *s;
+	size_t n;
+
+	if(len >= sizeof(pkt->prefix))
+		len = sizeof(pkt->prefix) - 1;
+	memcpy(pkt->prefix, p, len);
+	pkt->prefix[len] = '\0';
+
+	s = pkt->prefix;
+	if(!strncmp(s, IPTA_LINE_PREFIX, strlen(IPTA_LINE_PREFIX)))
+		s += strlen(IPTA_LINE_PREFIX);
+	s += strspn(s, " ");
+	n = strcspn(s, " :");
+	if(n >= sizeof(pkt->action))
+		n = sizeof(pkt->action) - 1;
+	memcpy(pkt->action, s, n);
+	pkt->action[n] = '\0';
+}
+
+/***********************************************************************
+ * nflog_decode
+ *
+ * Decodes one NFLOG packet as found in a pcap record.
+ *
+ * PARAMETERS
+ *
+ * 	const unsigned char *data, size_t len - the packet
+ *
+ * 	int swapped - the capture was made on a host with the other
+ * 		byte order
+ *
+ * 	time_t timestamp - the pcap time, used when the packet has no
+ * 		time stamp of its own
+ *
+ * 	struct ipta_nflog *pkt - holds the decoded fields
+ *
+ * 	struct ipta_record *rec - set to point into pkt, the same way
+ * 		parse_line() points into the line
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - a packet was decoded
+ *
+ * 	RETVAL_WARN - not an IP packet, or a damaged record
+ ***********************************************************************/
+int nflog_decode(const unsigned char *data, size_t len, int swapped, time_t timestamp,
+		 struct ipta_nflog *pkt, struct ipta_record *rec)
+{
+	const unsigned char *v;
+	uint64_t sec;
+	size_t off, tlv_len, vlen, i;
+	int type;
+
+	memset(pkt, 0, sizeof(struct ipta_nflog));
+	pkt->timestamp = timestamp;
+
+	// family, version, resource id
+	if(len < 4 || data[1] != 0)
+		return RETVAL_WARN;
+
+	for(off = 4; off + 4 <= len; off += (tlv_len + 3) & ~(size_t)3) {
+		tlv_len = nflog_get16(data + off, swapped);
+		type = nflog_get16(data + off + 2, swapped) & 0x3fff;
+		if(tlv_len < 4 || off + tlv_len > len)
+			return RETVAL_WARN;
+		v = data + off + 4;
+		vlen = tlv_len - 4;
+
+		switch(type) {
+		case NFULA_PREFIX:
+			nflog_prefix(v, strnlen((const char *)v, vlen), pkt);
+			break;
+		case NFULA_TIMESTAMP:
+			if(vlen >= 16) {
+				memcpy(&sec, v, sizeof(sec));
+				pkt->timestamp = (time_t)be64toh(sec);
+			}
+			break;
+		case NFULA_IFINDEX_INDEV:
+			if(vlen >= 4)
+				nflog_ifname(nflog_be32(v), pkt->if_in, sizeof(pkt->if_in));
+			break;
+		case NFULA_IFINDEX_OUTDEV:
+			if(vlen >= 4)
+				nflog_ifname(nflog_be32(v), pkt->if_out, sizeof(pkt->if_out));
+			break;
+		case NFULA_HWHEADER:
+			// MAC= in a log line is the link header, dst:src:type
+			for(i = 0; i < vlen && i < 16; i++)
+				sprintf(pkt->mac + (i ? i * 3 - 1 : 0), i ? ":%02x" : "%02x", v[i]);
+			break;
+		case NFULA_PAYLOAD:
+			nflog_payload(v, vlen, pkt);
+			break;
+		}
+	}
+
+	if(!pkt->src[0])
+		return RETVAL_WARN;
+
+	rec->timestamp = pkt->timestamp;
+	rec->host = "";
+	rec->action = pkt->action;
+	rec->if_in = pkt->if_in;
+	rec->if_out = pkt->if_out;
+	rec->mac = pkt->mac;
+	rec->src = pkt->src;
+	rec->dst = pkt->dst;
+	rec->proto = pkt->proto;
+	rec->src_port = pkt->src_port;
+	rec->dst_port = pkt->dst_port;
+	rec->tag = "";
+	return RETVAL_OK;
+}
+
+/* The byte order of a pcap file, -1 if it is not one */
+static int nflog_magic(const unsigned char *p)
+{
+	uint32_t magic = nflog_get32(p, 0);
+
+	if(magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS)
+		return FLAG_CLEAR;
+	if(magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS))
+		return FLAG_SET;
+	return -1;
+}
+
+/* Used by --import to tell a capture from a text log */
+int nflog_is_pcap(char *filename)
+{
+	unsigned char magic[4];
+	FILE *file;
+	int found = FLAG_CLEAR;
+
+	file = fopen(filename, "r");
+	if(!file)
+		return FLAG_CLEAR;
+	if(fread(magic, 1, sizeof(magic), file) == sizeof(magic) && nflog_magic(magic) >= 0)
+		found = FLAG_SET;
+	fclose(file);
+	return found;
+}
+
+/***********************************************************************
+ * import_nflog
+ *
+ * Reads a whole pcap file of NFLOG packets and inserts them into the
+ * logs table, QUERY_ROW_COUNT rows per INSERT. The file is mapped
+ * rather than read, a record is decoded where it lies. What was read
+ * and written is left in count for the summary of the caller, also
+ * when it fails. quiet leaves out the progress line, for a caller that
+ * reads several files at once.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int import_nflog(struct ipta_db_info *db_info, char *filename, struct ipta_flags *flags,
+		 struct ipta_nflog_count *count, int quiet)
+{
+	struct ipta_nflog pkt;
+	struct ipta_record rec;
+	struct ipta_batch batch;
+	struct stat st;
+	struct ipta_db *con = NULL;
+	unsigned char *map = MAP_FAILED;
+	size_t off, caplen;
+	time_t starttime = time(NULL);
+	long packets = 0;
+	long used = 0;
+	long skipped = 0;
+	int swapped;
+	int fd = -1;
+	int retval = RETVAL_OK;
+
+	memset(&batch, 0, sizeof(batch));
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "! Error, unable to open capture file %s.\n", filename);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	if(st.st_size < PCAP_HEADER_LEN) {
+		fprintf(stderr, "! Error, %s is not a pcap file.\n", filename);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "! Error, unable to map capture file %s.\n", filename);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	swapped = nflog_magic(map);
+	if(swapped < 0) {
+		fprintf(stderr, "! Error, %s is not a pcap file.\n", filename);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	if(nflog_get32(map + 20, swapped) != LINKTYPE_NFLOG) {
+		fprintf(stderr, "! Error, %s has link type %u, only NFLOG (%d) captures can be imported.\n",
+			filename, nflog_get32(map + 20, swapped), LINKTYPE_NFLOG);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	// With --archive the rows go to the column files instead
+	if(!flags->archive) {
+		con = open_db(db_info);
+		if(!con) {
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+	}
+	if(batch_init(&batch, con, db_info->table,
+		      flags->archive ? ARCHIVE_BLOCK_ROWS : QUERY_ROW_COUNT)) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	batch.archive = flags->archive;
+	batch.reject = flags->reject;
+
+	for(off = PCAP_HEADER_LEN; off + PCAP_RECORD_LEN <= (size_t)st.st_size;
+	    off += PCAP_RECORD_LEN + caplen) {
+		caplen = nflog_get32(map + off + 8, swapped);
+		if(off + PCAP_RECORD_LEN + caplen > (size_t)st.st_size) {
+			fprintf(stderr, "- The last packet in %s is cut short, skipped.\n", filename);
+			break;
+		}
+		packets++;
+		if(nflog_decode(map + off + PCAP_RECORD_LEN, caplen, swapped,
+				nflog_get32(map + off, swapped), &pkt, &rec) != RETVAL_OK) {
+			skipped++;
+			continue;
+		}
+		if(!filter_packet(flags, &rec))
+			continue;
+		used++;
+
+		if(flags->flows) {
+			if(flow_add(flags->flows, &rec, packets, &batch)) {
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			continue;
+		}
+
+		if(batch_add(&batch, &rec, packets)) {
+			if(batch_flush(&batch)) {
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			if(!quiet)
+				fprintf(stderr, "- Processed %ld packets in %d seconds  \r",
+					packets, (int)time(NULL) - (int)starttime);
+		}
+	}
+
+	if((flags->flows && flow_flush(flags->flows, &batch)) || batch_flush(&batch)) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	if(con && db_commit(con)) {
+		fprintf(stderr, "%s\n", db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	if(skipped)
+		fprintf(stderr, "- %ld packets in %s were not IP packets.\n", skipped, filename);
+
+clean_exit:
+	if(count) {
+		count->records = packets;
+		count->packets = used;
+		count->inserted = batch.inserted;
+		count->rejected = batch.rejected;
+	}
+	batch_free(&batch);
+	if(con)
+		db_close(con);
+	if(map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if(fd >= 0)
+		close(fd);
+	return retval;
+}
@@ -0,0 +1,287 @@
+/**********************************************************************
+ * output.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Follow output
+ *
+ * The lines shown in follow mode are formatted into a large buffer
+ * and written with one write() per refresh instead of going through
+ * stdio line by line, so the screen keeps up with the log during a
+ * flood. The time string is only formatted when the second changes.
+ *
+ * Two options make a flood readable. With collapse, packets of the
+ * same flow as the line before are counted instead of printed, and
+ * shown as one "x N" line. With sampling, at most a given number of
+ * lines per second are shown and the others are counted and reported
+ * as dropped.
+ ***********************************************************************/
+
+#define OUTPUT_LINE_MAX 512
+
+static char output_header[] =
+	"IF       Source                          Port Destination                     Port Proto      Action    ";
+
+static char output_rule[] =
+	"-------- ------------------------------ ----- ------------------------------ ----- ---------- ----------";
+
+static long long output_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/***********************************************************************
+ * output_init
+ *
+ * Sets up output to fd, the options are taken from flags.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on memory allocation failure
+ ***********************************************************************/
+int output_init(struct ipta_output *out, int fd, struct ipta_flags *flags)
+{
+	memset(out, 0, sizeof(struct ipta_output));
+	out->fd = fd;
+	out->flags = flags;
+	out->size = OUTPUT_BUFFER_SIZE;
+	out->buffer = malloc(out->size);
+	if(!out->buffer) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+	out->last_write = out->last_refill = output_now_ms();
+	out->tokens = flags->sample_rate;
+	return RETVAL_OK;
+}
+
+/* Make sure there is room for one more line */
+static int output_room(struct ipta_output *out)
+{
+	if(out->size - out->used < OUTPUT_LINE_MAX)
+		return output_flush(out);
+	return RETVAL_OK;
+}
+
+/* The time of day, only formatted again when the second changes */
+static char *output_time(struct ipta_output *out)
+{
+	time_t t = time(NULL);
+	struct tm tm;
+
+	if(t != out->time) {
+		localtime_r(&t, &tm);
+		snprintf(out->time_string, sizeof(out->time_string), "%02d:%02d:%02d",
+			 tm.tm_hour, tm.tm_min, tm.tm_sec);
+		out->time = t;
+	}
+	return out->time_string;
+}
+
+/* Report collapsed and dropped packets not shown yet */
+static void output_pending(struct ipta_output *out)
+{
+	if(out->repeats) {
+		output_room(out);
+		out->used += snprintf(out->buffer + out->used, out->size - out->used,
+				      out->flags->no_counter ? "%s \" x %lu\n" : "%s        \" x %lu\n",
+				      output_time(out), out->repeats);
+		out->repeats = 0;
+	}
+	if(out->dropped) {
+		output_room(out);
+		out->used += snprintf(out->buffer + out->used, out->size - out->used,
+				      "%s -- %lu packets not shown, sampling %d lines/s --\n",
+				      output_time(out), out->dropped, out->flags->sample_rate);
+		out->dropped = 0;
+	}
+}
+
+/* Token bucket, FLAG_SET if the line may be shown */
+static int output_sample(struct ipta_output *out)
+{
+	long long now;
+
+	if(!out->flags->sample_rate)
+		return FLAG_SET;
+
+	if(out->tokens < 1) {
+		now = output_now_ms();
+		out->tokens += (now - out->last_refill) * out->flags->sample_rate / 1000.0;
+		if(out->tokens > out->flags->sample_rate)
+			out->tokens = out->flags->sample_rate;
+		out->last_refill = now;
+		if(out->tokens < 1)
+			return FLAG_CLEAR;
+	}
+	out->tokens--;
+	return FLAG_SET;
+}
+
+/***********************************************************************
+ * output_packet
+ *
+ * Adds one packet to the output. src_name and dst_name are shown
+ * instead of the addresses if they are given, host is the name of
+ * the firewall when several logs are followed, or NULL.
+ ***********************************************************************/
+void output_packet(struct ipta_output *out, struct ipta_record *rec, char *host, char *src_name, char *dst_name, unsigned long packet_count)
+{
+	char flow[OUTPUT_FLOW_LEN];
+	char *interface = rec->if_in[0] ? rec->if_in : rec->if_out;
+	struct ipta_geo geo;
+	char *p;
+
+	if(out->flags->collapse) {
+		snprintf(flow, sizeof(flow), "%s %s %s %s %s %s %s %s", host ? host : "", interface, rec->src, rec->src_port, rec->dst, rec->dst_port,
+			 rec->proto, rec->action);
+		if(!strcmp(flow, out->flow)) {
+			out->repeats++;
+			return;
+		}
+		output_pending(out);
+		strcpy(out->flow, flow);
+	}
+
+	if(!output_sample(out)) {
+		out->dropped++;
+		return;
+	}
+	output_pending(out);
+	output_room(out);
+
+	if(out->lines == 0 && !out->flags->no_follow_header) {
+		out->used += snprintf(out->buffer + out->used, out->size - out->used,
+				      "\n%s%s%s%s%s%s\n%s%s%s",
+				      "Time     ", out->flags->no_counter ? "" : "Count    ",
+				      host ? "Host         " : "", output_header,
+				      out->flags->geoip ? " CC AS        " : "",
+				      out->flags->tags ? " Tag" : "",
+				      "-------- ", out->flags->no_counter ? "" : "-------- ",
+				      host ? "------------ " : "");
+		out->used += snprintf(out->buffer + out->used, out->size - out->used,
+				      "%s%s%s\n", output_rule,
+				      out->flags->geoip ? " -- ----------" : "",
+				      out->flags->tags ? " ----------------" : "");
+	}
+	if(++out->lines >= 20)
+		out->lines = 0;
+
+	p = out->buffer + out->used;
+	p += sprintf(p, "%s ", output_time(out));
+	if(!out->flags->no_counter)
+		p += sprintf(p, "%8lu ", packet_count);
+	if(host)
+		p += sprintf(p, "%-12.12s ", host);
+	p += sprintf(p, "%-8.8s %-30.30s %5d %-30.30s %5d %-10.10s %-10.10s",
+		     interface, src_name ? src_name : rec->src, atoi(rec->src_port),
+		     dst_name ? dst_name : rec->dst, atoi(rec->dst_port),
+		     rec->proto, rec->action);
+	if(out->flags->geoip) {
+		// Where the packet came from, looked up in the mapped index
+		if(geoip_lookup(rec->src, &geo) != RETVAL_OK)
+			memset(&geo, 0, sizeof(geo));
+		p += sprintf(p, " %-2s", geo.country[0] ? geo.country : "--");
+		if(geo.asn)
+			p += sprintf(p, " AS%-8u", geo.asn);
+		else
+			p += sprintf(p, " %-10s", "");
+	}
+	if(out->flags->tags)
+		p += sprintf(p, " %.16s", rec->tag);
+	*p++ = '\n';
+	out->used = p - out->buffer;
+}
+
+/* A line from the scan detector, shown even when sampling */
+void output_event(struct ipta_output *out, char *event)
+{
+	output_pending(out);
+	output_room(out);
+	out->used += snprintf(out->buffer + out->used, out->size - out->used,
+			      "%s !! %.400s\n", output_time(out), event);
+}
+
+/* FLAG_SET when it is time to write what has been collected */
+int output_due(struct ipta_output *out)
+{
+	return out->used && output_now_ms() - out->last_write >= OUTPUT_REFRESH_MS;
+}
+
+/***********************************************************************
+ * output_flush
+ *
+ * Writes the buffer with as few write() calls as possible. Collapsed
+ * and dropped packets are reported first so nothing is left hanging
+ * when the log goes quiet.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - the output is gone, for example a closed pipe
+ ***********************************************************************/
+int output_flush(struct ipta_output *out)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	// Called from output_pending() through output_room() with a full
+	// buffer, so only report the pending lines when there is room
+	if(out->size - out->used >= 2 * OUTPUT_LINE_MAX)
+		output_pending(out);
+
+	while(done < out->used) {
+		n = write(out->fd, out->buffer + done, out->used - done);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			out->used = 0;
+			return RETVAL_ERROR;
+		}
+		done += n;
+	}
+
+	out->used = 0;
+	out->last_write = output_now_ms();
+	return RETVAL_OK;
+}
+
+void output_free(struct ipta_output *out)
+{
+	free(out->buffer);
+	out->buffer = NULL;
+}
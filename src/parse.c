@@ -0,0 +1,253 @@
+/**********************************************************************
+ * parse.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Log line parser
+ *
+ * One parser for every place that reads iptables log lines, follow,
+ * import and ingest. The line is split in place, the record only
+ * holds pointers into it, so nothing is allocated or copied. It does
+ * not use strtok() so it can be used from several threads.
+ ***********************************************************************/
+
+static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+			  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/* Skip spaces and cut out the next word, NULL at end of line */
+static char *parse_token(char **p)
+{
+	char *start = *p;
+	char *end;
+
+	while(*start == ' ')
+		start++;
+	if(!*start || *start == '\n')
+		return NULL;
+
+	end = start;
+	while(*end && *end != ' ' && *end != '\n')
+		end++;
+	if(*end)
+		*end++ = '\0';
+	*p = end;
+	return start;
+}
+
+/***********************************************************************
+ * parse_time
+ *
+ * Converts the syslog time stamp "Mmm dd hh:mm:ss", which has no year,
+ * or an ISO 8601 "yyyy-mm-ddThh:mm:ss" one to a time_t. The year is
+ * taken to be the current one unless that puts the time in the
+ * future, then it is last year. mktime() is slow, so the start of the
+ * hour is cached since consecutive lines are nearly always in the
+ * same hour.
+ ***********************************************************************/
+static time_t parse_time(char *s, char **end)
+{
+	static __thread time_t cache_time = 0;
+	static __thread int cache_key = -1;
+	struct tm tm;
+	time_t now;
+	int year = 0, mon, mday, hour, min, sec, key, n = 0;
+
+	if(sscanf(s, "%4d-%2d-%2dT%2d:%2d:%2d%n", &year, &mon, &mday, &hour, &min, &sec, &n) == 6) {
+		mon--;
+		// Fractions and the zone, as sent by RFC 5424 senders, are
+		// skipped, the time is taken as local
+		while(s[n] && s[n] != ' ')
+			n++;
+	} else {
+		for(mon = 0; mon < 12; mon++)
+			if(!strncmp(s, months[mon], 3))
+				break;
+		if(mon == 12 || sscanf(s + 3, "%d %d:%d:%d%n", &mday, &hour, &min, &sec, &n) != 4)
+			return 0;
+		n += 3;
+	}
+	*end = s + n;
+
+	key = ((year * 12 + mon) * 32 + mday) * 24 + hour;
+	if(key != cache_key) {
+		now = time(NULL);
+		localtime_r(&now, &tm);
+		tm.tm_mon = mon;
+		tm.tm_mday = mday;
+		tm.tm_hour = hour;
+		tm.tm_min = tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		if(year) {
+			tm.tm_year = year - 1900;
+			cache_time = mktime(&tm);
+		} else {
+			cache_time = mktime(&tm);
+			if(cache_time > now + 86400) {
+				tm.tm_year--;
+				tm.tm_isdst = -1;
+				cache_time = mktime(&tm);
+			}
+		}
+		cache_key = key;
+	}
+
+	return cache_time + min * 60 + sec;
+}
+
+/***********************************************************************
+ * parse_line
+ *
+ * Splits an iptables log line into its fields. Fields that are not
+ * in the line point to an empty string. The syslog time stamp and
+ * host name are picked up if there is a header before the prefix.
+ *
+ * PARAMETERS
+ *
+ * 	char *line - the log line, it is modified
+ *
+ * 	struct ipta_record *rec - the record to fill in
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - a packet was found
+ *
+ * 	RETVAL_WARN - not an iptables log line
+ ***********************************************************************/
+int parse_line(char *line, struct ipta_record *rec)
+{
+	static char nullstring[] = "";
+	char *header_end;
+	char *p;
+	char *token;
+	int first;
+
+	p = strstr(line, IPTA_LINE_PREFIX);
+	if(!p)
+		return RETVAL_WARN;
+	header_end = p;
+	p += strlen(IPTA_LINE_PREFIX);
+
+	rec->timestamp = 0;
+	rec->host = rec->action = rec->if_in = rec->if_out = rec->mac =
+		rec->src = rec->dst = rec->proto = rec->src_port = rec->dst_port =
+		rec->tag = nullstring;
+
+	// The header is "time host kernel: [uptime]", only time and host are used
+	*header_end = '\0';
+	rec->timestamp = parse_time(line, &line);
+	if(rec->timestamp && (token = parse_token(&line)))
+		rec->host = token;
+
+	// The first word after the prefix is the action unless ACTION=
+	// is given. Fields that are not known are just ignored silently.
+	// Anything that is changed or added here needs to reflect the
+	// database.
+	first = FLAG_SET;
+	while((token = parse_token(&p))) {
+		if(first) {
+			first = FLAG_CLEAR;
+			if(!strchr(token, '=')) {
+				rec->action = token;
+				continue;
+			}
+		}
+		switch(token[0]) {
+		case 'A':
+			if(!strncmp("ACTION=", token, 7))
+				rec->action = token + 7;
+			break;
+		case 'I':
+			if(!strncmp("IN=", token, 3))
+				rec->if_in = token + 3;
+			break;
+		case 'O':
+			if(!strncmp("OUT=", token, 4))
+				rec->if_out = token + 4;
+			break;
+		case 'M':
+			if(!strncmp("MAC=", token, 4))
+				rec->mac = token + 4;
+			break;
+		case 'S':
+			if(!strncmp("SRC=", token, 4))
+				rec->src = token + 4;
+			else if(!strncmp("SPT=", token, 4))
+				rec->src_port = token + 4;
+			break;
+		case 'D':
+			if(!strncmp("DST=", token, 4))
+				rec->dst = token + 4;
+			else if(!strncmp("DPT=", token, 4))
+				rec->dst_port = token + 4;
+			break;
+		case 'P':
+			if(!strncmp("PROTO=", token, 6))
+				rec->proto = token + 6;
+			break;
+		}
+	}
+
+	return RETVAL_OK;
+}
+
+/* Copy at most size - 1 characters and always terminate */
+static void parse_copy(char *dst, char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if(len >= size)
+		len = size - 1;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+/***********************************************************************
+ * parse_to_row
+ *
+ * Copies a parsed record into a row that owns its data, so it can be
+ * kept after the line buffer is reused. Fields longer than the
+ * database columns are cut.
+ ***********************************************************************/
+void parse_to_row(struct ipta_record *rec, struct ipta_row *row, long line)
+{
+	row->line = line;
+	row->timestamp = rec->timestamp;
+	parse_copy(row->if_in, rec->if_in, sizeof(row->if_in));
+	parse_copy(row->if_out, rec->if_out, sizeof(row->if_out));
+	parse_copy(row->src, rec->src, sizeof(row->src));
+	parse_copy(row->dst, rec->dst, sizeof(row->dst));
+	parse_copy(row->proto, rec->proto, sizeof(row->proto));
+	parse_copy(row->action, rec->action, sizeof(row->action));
+	parse_copy(row->mac, rec->mac, sizeof(row->mac));
+	parse_copy(row->tag, rec->tag, sizeof(row->tag));
+	row->src_port = atoi(rec->src_port);
+	row->dst_port = atoi(rec->dst_port);
+	row->packets = 1;
+	row->last_seen = rec->timestamp;
+}
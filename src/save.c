@@ -0,0 +1,705 @@
+/**********************************************************************
+ * save.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Saving and restoring the tables
+ *
+ * --save-db writes the logs and dns tables to a file that --restore-db
+ * loads into another database, of the same or the other backend. The
+ * file is a row of chunks, each a struct ipta_save_chunk followed by
+ * the rows of up to SAVE_CHUNK_IDS ids of one table, packed with
+ * varints and compressed with zlib on their own. The logs table is
+ * read by SAVE_THREADS threads over connections of their own, each
+ * taking the next range of ids, so the server reads and the
+ * compression happen in parallel. Chunks are written in the order they
+ * are done, the ids are not kept.
+ ***********************************************************************/
+
+struct save_buffer {
+	unsigned char *data;
+	size_t used;
+	size_t size;
+};
+
+struct save_job {
+	struct ipta_db_info *db;
+	int tagged;               /* The logs table has the tag column */
+	int flows;                /* And the columns of --flow-timeout */
+	long next;                /* First id not taken by a thread */
+	long last;
+	int fd;
+	pthread_mutex_t lock;
+	unsigned long rows;
+	unsigned long chunks;
+	unsigned long long bytes;
+	int failed;
+};
+
+static int save_reserve(struct save_buffer *b, size_t n)
+{
+	unsigned char *p;
+	size_t size;
+
+	if(b->used + n <= b->size)
+		return RETVAL_OK;
+	size = b->size ? 2 * b->size : 65536;
+	while(size < b->used + n)
+		size *= 2;
+	p = realloc(b->data, size);
+	if(!p)
+		return RETVAL_ERROR;
+	b->data = p;
+	b->size = size;
+	return RETVAL_OK;
+}
+
+/* Room for the varint is reserved by the caller */
+static void save_varint(struct save_buffer *b, unsigned long long v)
+{
+	while(v >= 0x80) {
+		b->data[b->used++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	b->data[b->used++] = v;
+}
+
+/* A string of at most 255 characters, NULL is saved as empty */
+static int save_string(struct save_buffer *b, char *s)
+{
+	size_t len = s ? strlen(s) : 0;
+
+	if(len > 255)
+		len = 255;
+	if(save_reserve(b, len + 1))
+		return RETVAL_ERROR;
+	b->data[b->used++] = len;
+	memcpy(b->data + b->used, s, len);
+	b->used += len;
+	return RETVAL_OK;
+}
+
+static int save_number_value(struct save_buffer *b, unsigned long long v)
+{
+	if(save_reserve(b, 10))
+		return RETVAL_ERROR;
+	save_varint(b, v);
+	return RETVAL_OK;
+}
+
+/* Numbers of the table, NULL is saved as 0 and the rest as n + 1 */
+static int save_number(struct save_buffer *b, char *s, int nullable)
+{
+	return save_number_value(b, s ? strtoull(s, NULL, 10) + (nullable ? 1 : 0) : 0);
+}
+
+/* Times as the difference to the one before, zigzag coded */
+static int save_time(struct save_buffer *b, char *s, long long *previous)
+{
+	long long t = s ? strtoll(s, NULL, 10) : 0;
+	long long d = t - *previous;
+
+	*previous = t;
+	if(save_reserve(b, 10))
+		return RETVAL_ERROR;
+	save_varint(b, ((unsigned long long)d << 1) ^ (unsigned long long)(d >> 63));
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * save_chunk
+ *
+ * Compresses the rows in raw and appends them as one chunk. Called
+ * with the job locked.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+static int save_chunk(struct save_job *job, int table, unsigned int rows,
+		      struct save_buffer *raw, struct save_buffer *packed)
+{
+	struct ipta_save_chunk chunk;
+	uLongf size;
+	struct iovec iov[2];
+
+	packed->used = 0;
+	if(save_reserve(packed, compressBound(raw->used)))
+		return RETVAL_ERROR;
+	size = packed->size;
+	if(compress2(packed->data, &size, raw->data, raw->used, Z_DEFAULT_COMPRESSION) != Z_OK)
+		return RETVAL_ERROR;
+
+	memset(&chunk, 0, sizeof(chunk));
+	memcpy(chunk.magic, SAVE_MAGIC, 4);
+	chunk.table = table;
+	chunk.rows = rows;
+	chunk.size = size;
+	chunk.raw = raw->used;
+	chunk.crc = crc32(0, packed->data, size);
+
+	iov[0].iov_base = &chunk;
+	iov[0].iov_len = sizeof(chunk);
+	iov[1].iov_base = packed->data;
+	iov[1].iov_len = size;
+	pthread_mutex_lock(&job->lock);
+	if(writev(job->fd, iov, 2) != (ssize_t)(sizeof(chunk) + size)) {
+		pthread_mutex_unlock(&job->lock);
+		fprintf(stderr, "! Error writing the save file: %s\n", strerror(errno));
+		return RETVAL_ERROR;
+	}
+	job->rows += rows;
+	job->chunks++;
+	job->bytes += sizeof(chunk) + size;
+	pthread_mutex_unlock(&job->lock);
+	return RETVAL_OK;
+}
+
+/* Reads ranges of ids of the logs table until there are none left */
+static void *save_thread(void *arg)
+{
+	struct save_job *job = arg;
+	struct save_buffer raw = { NULL, 0, 0 }, packed = { NULL, 0, 0 };
+	struct ipta_db *con = NULL;
+	struct ipta_db_result *result = NULL;
+	char query[QUERY_STRING_SIZE];
+	char **row;
+	long long previous, duration;
+	long first;
+	unsigned int rows;
+	int i, failed = FLAG_CLEAR;
+
+	db_thread_init();
+	con = open_db(job->db);
+	if(!con)
+		failed = FLAG_SET;
+
+	while(!failed) {
+		pthread_mutex_lock(&job->lock);
+		first = job->next;
+		job->next += SAVE_CHUNK_IDS;
+		failed = job->failed;
+		pthread_mutex_unlock(&job->lock);
+		if(failed || first > job->last)
+			break;
+
+		snprintf(query, sizeof(query),
+			 "SELECT UNIX_TIMESTAMP(timestamp), if_in, if_out, src_ip, src_prt, dst_ip, "
+			 "dst_prt, proto, action, mac%s%s FROM %s WHERE id >= %ld AND id < %ld ORDER BY id;",
+			 job->tagged ? ", tag" : "",
+			 job->flows ? ", packet_count, UNIX_TIMESTAMP(last_seen)" : "",
+			 job->db->table, first, first + SAVE_CHUNK_IDS);
+		if(db_query(con, query) || !(result = db_use_result(con))) {
+			fprintf(stderr, "! Error reading table %s: %s\n", job->db->table, db_error(con));
+			failed = FLAG_SET;
+			break;
+		}
+
+		raw.used = 0;
+		rows = 0;
+		previous = 0;
+		while((row = db_fetch_row(result))) {
+			if(save_time(&raw, row[0], &previous))
+				failed = FLAG_SET;
+			for(i = 1; i < 10; i++) {
+				switch(i) {
+				case 3:
+				case 4:
+				case 5:
+				case 6:
+					// Addresses and ports can be NULL, IPv6 is not kept
+					failed |= save_number(&raw, row[i], FLAG_SET);
+					break;
+				default:
+					failed |= save_string(&raw, row[i]);
+				}
+			}
+			failed |= save_string(&raw, job->tagged ? row[10] : NULL);
+
+			// The packets of a flow and for how long after the
+			// first it was seen
+			i = 10 + job->tagged;
+			failed |= save_number(&raw, job->flows ? row[i] : "1", FLAG_CLEAR);
+			duration = job->flows && row[i + 1] && row[0] ?
+				strtoll(row[i + 1], NULL, 10) - strtoll(row[0], NULL, 10) : 0;
+			failed |= save_number_value(&raw, duration > 0 ? duration : 0);
+			rows++;
+		}
+		db_free_result(result);
+		result = NULL;
+
+		if(failed)
+			fprintf(stderr, "! Error, memory allocation failed.\n");
+		else if(rows && save_chunk(job, SAVE_LOGS, rows, &raw, &packed))
+			failed = FLAG_SET;
+	}
+
+	if(failed) {
+		pthread_mutex_lock(&job->lock);
+		job->failed = FLAG_SET;
+		pthread_mutex_unlock(&job->lock);
+	}
+	db_close(con);
+	db_thread_end();
+	free(raw.data);
+	free(packed.data);
+	return NULL;
+}
+
+/* The dns table is small, it is saved by the main thread */
+static int save_dns(struct save_job *job, struct ipta_db_info *dns)
+{
+	struct save_buffer raw = { NULL, 0, 0 }, packed = { NULL, 0, 0 };
+	struct ipta_db *con = NULL;
+	struct ipta_db_result *result = NULL;
+	char query[QUERY_STRING_SIZE];
+	char **row;
+	long long previous = 0;
+	unsigned int rows = 0;
+	int failed = FLAG_CLEAR;
+
+	con = open_db(dns);
+	if(!con)
+		return RETVAL_ERROR;
+
+	snprintf(query, sizeof(query), "SELECT ip, host, UNIX_TIMESTAMP(ttl) FROM %s;", dns->table);
+	if(db_query(con, query) || !(result = db_use_result(con))) {
+		// Not every database has a dns table
+		fprintf(stderr, "- Table %s not saved: %s\n", dns->table, db_error(con));
+		db_close(con);
+		return RETVAL_OK;
+	}
+
+	while(!failed && (row = db_fetch_row(result))) {
+		failed |= save_number(&raw, row[0], FLAG_CLEAR);
+		failed |= save_string(&raw, row[1]);
+		failed |= save_time(&raw, row[2], &previous);
+		if(++rows == SAVE_CHUNK_IDS) {
+			failed |= save_chunk(job, SAVE_DNS, rows, &raw, &packed);
+			raw.used = 0;
+			rows = 0;
+			previous = 0;
+		}
+	}
+	if(!failed && rows)
+		failed = save_chunk(job, SAVE_DNS, rows, &raw, &packed);
+	if(failed)
+		fprintf(stderr, "! Error saving table %s.\n", dns->table);
+
+	db_free_result(result);
+	db_close(con);
+	free(raw.data);
+	free(packed.data);
+	return failed ? RETVAL_ERROR : RETVAL_OK;
+}
+
+/***********************************************************************
+ * save_db
+ *
+ * Writes the logs table of db and the dns table of dns to filename.
+ * The file is written next to it and renamed when complete.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int save_db(struct ipta_db_info *db, struct ipta_db_info *dns, char *filename)
+{
+	struct save_job job;
+	struct ipta_db *con = NULL;
+	struct ipta_db_result *result = NULL;
+	char query[QUERY_STRING_SIZE];
+	char tmpname[PATH_MAX];
+	pthread_t tid[SAVE_THREADS];
+	char **row;
+	unsigned long rows;
+	int started = 0, i;
+	int retval = RETVAL_OK;
+
+	memset(&job, 0, sizeof(job));
+	job.db = db;
+	job.fd = -1;
+	pthread_mutex_init(&job.lock, NULL);
+
+	if(db_library_init()) {
+		fprintf(stderr, "! Error, unable to initialize the database library.\n");
+		return RETVAL_ERROR;
+	}
+
+	// The ids to split between the threads
+	con = open_db(db);
+	if(!con) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	job.tagged = db_has_column(con, db->table, "tag");
+	job.flows = db_has_column(con, db->table, "packet_count");
+	sprintf(query, "SELECT MIN(id), MAX(id) FROM %s;", db->table);
+	if(job.tagged < 0 || job.flows < 0 || db_query(con, query) || !(result = db_store_result(con))) {
+		fprintf(stderr, "! Error reading table %s: %s\n", db->table, db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	row = db_fetch_row(result);
+	job.next = row && row[0] ? atol(row[0]) : 1;
+	job.last = row && row[1] ? atol(row[1]) : 0;
+	db_free_result(result);
+	db_close(con);
+	con = NULL;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.new", filename);
+	job.fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(job.fd < 0) {
+		fprintf(stderr, "! Error, unable to create %s: %s\n", tmpname, strerror(errno));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	fprintf(stderr, "* Saving table %s with ids %ld to %ld.\n", db->table, job.next, job.last);
+	for(i = 0; i < SAVE_THREADS; i++) {
+		if(pthread_create(&tid[i], NULL, save_thread, &job))
+			break;
+		started++;
+	}
+	if(!started) {
+		fprintf(stderr, "! Error, unable to start the save threads.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	for(i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+	if(job.failed) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	fprintf(stderr, "* %lu rows saved from table %s.\n", job.rows, db->table);
+
+	rows = job.rows;
+	if(save_dns(&job, dns)) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	fprintf(stderr, "* %lu rows saved from table %s.\n", job.rows - rows, dns->table);
+
+	if(fsync(job.fd) || close(job.fd)) {
+		job.fd = -1;
+		fprintf(stderr, "! Error writing %s: %s\n", tmpname, strerror(errno));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	job.fd = -1;
+	if(rename(tmpname, filename)) {
+		fprintf(stderr, "! Error, unable to rename %s: %s\n", tmpname, strerror(errno));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	fprintf(stderr, "* Saved to %s, %lu chunks and %llu bytes.\n",
+		filename, job.chunks, job.bytes);
+
+clean_exit:
+	if(job.fd >= 0) {
+		close(job.fd);
+		unlink(tmpname);
+	}
+	db_close(con);
+	pthread_mutex_destroy(&job.lock);
+	return retval;
+}
+
+/* Reading back what save_varint() and save_string() wrote */
+static int restore_varint(unsigned char **p, unsigned char *end, unsigned long long *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while(*p < end && shift < 64) {
+		*v |= (unsigned long long)(**p & 0x7f) << shift;
+		if(!(*(*p)++ & 0x80))
+			return RETVAL_OK;
+		shift += 7;
+	}
+	return RETVAL_ERROR;
+}
+
+static int restore_string(unsigned char **p, unsigned char *end, char *s, size_t size)
+{
+	size_t len;
+
+	if(*p >= end || *p + 1 + **p > end)
+		return RETVAL_ERROR;
+	len = *(*p)++;
+	memcpy(s, *p, len < size ? len : size - 1);
+	s[len < size ? len : size - 1] = '\0';
+	*p += len;
+	return RETVAL_OK;
+}
+
+static int restore_time(unsigned char **p, unsigned char *end, long long *previous)
+{
+	unsigned long long v;
+
+	if(restore_varint(p, end, &v))
+		return RETVAL_ERROR;
+	*previous += (long long)(v >> 1) ^ -(long long)(v & 1);
+	return RETVAL_OK;
+}
+
+static void restore_address(unsigned long long v, char *s, size_t size)
+{
+	struct in_addr addr;
+
+	// 0 is NULL, saved with room for it
+	if(!v) {
+		s[0] = '\0';
+		return;
+	}
+	addr.s_addr = htonl((unsigned int)(v - 1));
+	inet_ntop(AF_INET, &addr, s, size);
+}
+
+/* Rows of one logs chunk into the batch */
+static int restore_logs(struct ipta_batch *batch, unsigned char *p, unsigned char *end,
+			unsigned int rows)
+{
+	struct ipta_row *row;
+	unsigned long long v[6];
+	long long previous = 0;
+	unsigned int n;
+
+	for(n = 0; n < rows; n++) {
+		row = &batch->rows[batch->count];
+		if(restore_time(&p, end, &previous) ||
+		   restore_string(&p, end, row->if_in, sizeof(row->if_in)) ||
+		   restore_string(&p, end, row->if_out, sizeof(row->if_out)) ||
+		   restore_varint(&p, end, &v[0]) || restore_varint(&p, end, &v[1]) ||
+		   restore_varint(&p, end, &v[2]) || restore_varint(&p, end, &v[3]) ||
+		   restore_string(&p, end, row->proto, sizeof(row->proto)) ||
+		   restore_string(&p, end, row->action, sizeof(row->action)) ||
+		   restore_string(&p, end, row->mac, sizeof(row->mac)) ||
+		   restore_string(&p, end, row->tag, sizeof(row->tag)) ||
+		   restore_varint(&p, end, &v[4]) || restore_varint(&p, end, &v[5]))
+			return RETVAL_ERROR;
+		row->timestamp = previous;
+		restore_address(v[0], row->src, sizeof(row->src));
+		row->src_port = v[1] ? (int)(v[1] - 1) : -1;
+		restore_address(v[2], row->dst, sizeof(row->dst));
+		row->dst_port = v[3] ? (int)(v[3] - 1) : -1;
+		row->packets = v[4] ? v[4] : 1;
+		row->last_seen = previous + v[5];
+		row->line = batch->inserted + batch->count + 1;
+		if(++batch->count == batch->size && batch_flush(batch))
+			return RETVAL_ERROR;
+	}
+	return RETVAL_OK;
+}
+
+/* Rows of one dns chunk, REPLACE so a restore can be run again */
+static int restore_dns(struct ipta_db *con, char *table, unsigned char *p, unsigned char *end,
+		       unsigned int rows, char *query)
+{
+	char host[HOSTNAME_MAX_LEN];
+	char escaped[2 * HOSTNAME_MAX_LEN + 1];
+	unsigned long long ip;
+	long long previous = 0;
+	size_t qlen = 0;
+	unsigned int n, count = 0;
+
+	for(n = 0; n < rows; n++) {
+		if(restore_varint(&p, end, &ip) ||
+		   restore_string(&p, end, host, sizeof(host)) ||
+		   restore_time(&p, end, &previous))
+			return RETVAL_ERROR;
+		db_escape(con, escaped, host, strlen(host));
+		if(!count)
+			qlen = sprintf(query, "REPLACE INTO %s (ip, host, ttl) VALUES ", table);
+		qlen += sprintf(query + qlen, "%s(%llu, '%s', FROM_UNIXTIME(%lld))",
+				count ? "," : "", ip, escaped, previous);
+		count++;
+		if(n + 1 == rows || qlen > QUERY_STRING_SIZE - 2 * sizeof(escaped)) {
+			strcpy(query + qlen, ";");
+			if(db_query(con, query)) {
+				fprintf(stderr, "! Unable to insert into %s.\n"
+					"  Error: %s\n", table, db_error(con));
+				return RETVAL_ERROR;
+			}
+			count = 0;
+		}
+	}
+	return RETVAL_OK;
+}
+
+static int restore_same(struct ipta_db_info *a, struct ipta_db_info *b)
+{
+	return a->backend == b->backend && !strcmp(a->host, b->host) &&
+		!strcmp(a->user, b->user) && !strcmp(a->name, b->name);
+}
+
+/***********************************************************************
+ * restore_db
+ *
+ * Loads a file written by save_db() into the logs table of db and the
+ * dns table of dns, which must exist. The rows are added to what is
+ * there already.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int restore_db(struct ipta_db_info *db, struct ipta_db_info *dns, char *filename)
+{
+	struct ipta_save_chunk chunk;
+	struct ipta_batch batch;
+	struct ipta_db *con = NULL, *dnscon = NULL;
+	unsigned char *packed = NULL, *raw = NULL;
+	size_t packed_size = 0, raw_size = 0;
+	char *query = NULL;
+	unsigned long dns_rows = 0;
+	uLongf size;
+	int bulk = FLAG_CLEAR;
+	FILE *file;
+	int retval = RETVAL_OK;
+
+	memset(&batch, 0, sizeof(batch));
+	file = fopen(filename, "r");
+	if(!file) {
+		fprintf(stderr, "! Error, unable to open %s: %s\n", filename, strerror(errno));
+		return RETVAL_ERROR;
+	}
+
+	con = open_db(db);
+	query = malloc(QUERY_STRING_SIZE);
+	if(!con || !query || batch_init(&batch, con, db->table, SAVE_BATCH_ROWS)) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	if(db_bulk(con, db->table, FLAG_SET)) {
+		fprintf(stderr, "! Error preparing table %s: %s\n", db->table, db_error(con));
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	bulk = FLAG_SET;
+
+	while(fread(&chunk, sizeof(chunk), 1, file) == 1) {
+		if(memcmp(chunk.magic, SAVE_MAGIC, 4) ||
+		   (chunk.table != SAVE_LOGS && chunk.table != SAVE_DNS)) {
+			fprintf(stderr, "! Error, %s is not a file from --save-db.\n", filename);
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		if(chunk.size > packed_size) {
+			free(packed);
+			packed_size = chunk.size;
+			packed = malloc(packed_size);
+		}
+		if(chunk.raw > raw_size) {
+			free(raw);
+			raw_size = chunk.raw;
+			raw = malloc(raw_size);
+		}
+		if(!packed || !raw) {
+			fprintf(stderr, "! Error, memory allocation failed.\n");
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		size = chunk.raw;
+		if(fread(packed, 1, chunk.size, file) != chunk.size ||
+		   crc32(0, packed, chunk.size) != chunk.crc ||
+		   uncompress(raw, &size, packed, chunk.size) != Z_OK || size != chunk.raw) {
+			fprintf(stderr, "! Error, %s is broken after %lu rows.\n",
+				filename, batch.inserted + batch.count + dns_rows);
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+
+		if(chunk.table == SAVE_LOGS) {
+			if(restore_logs(&batch, raw, raw + size, chunk.rows)) {
+				retval = RETVAL_ERROR;
+				goto clean_exit;
+			}
+			continue;
+		}
+
+		// The same database is written through the one connection,
+		// SQLite would find it locked by the bulk load otherwise
+		if(!dnscon && restore_same(db, dns))
+			dnscon = con;
+		else if(!dnscon && !(dnscon = open_db(dns))) {
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		if(restore_dns(dnscon, dns->table, raw, raw + size, chunk.rows, query)) {
+			retval = RETVAL_ERROR;
+			goto clean_exit;
+		}
+		dns_rows += chunk.rows;
+	}
+	if(!feof(file)) {
+		fprintf(stderr, "! Error reading %s.\n", filename);
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	if(batch_flush(&batch)) {
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+	fprintf(stderr, "* %lu rows restored to table %s, %lu to table %s.\n",
+		batch.inserted, db->table, dns_rows, dns->table);
+
+clean_exit:
+	// The indexes are built here, that can take a while
+	if(bulk && db_bulk(con, db->table, FLAG_CLEAR)) {
+		fprintf(stderr, "! Error finishing table %s: %s\n", db->table, db_error(con));
+		retval = RETVAL_ERROR;
+	}
+	batch_free(&batch);
+	if(dnscon != con)
+		db_close(dnscon);
+	db_close(con);
+	fclose(file);
+	free(query);
+	free(packed);
+	free(raw);
+	return retval;
+}
@@ -0,0 +1,265 @@
+/**********************************************************************
+ * syslog_recv.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Syslog receiver
+ *
+ * Lets ipta be the syslog server itself instead of reading back what
+ * rsyslog wrote to disk. A UDP port or a UNIX datagram socket is
+ * bound and the messages are read RECV_BATCH at a time with
+ * recvmmsg(), one system call for many log lines. The priority and
+ * the RFC 5424 version in front of each message are removed so the
+ * rest looks like a line in a log file and goes to the same parser.
+ *
+ * Addresses are given as udp:port, udp:host:port, udp:[v6addr]:port
+ * or unix:/path/to/socket.
+ ***********************************************************************/
+
+#define RECV_RCVBUF (4 * 1024 * 1024)
+
+/* Bind a UNIX datagram socket, replacing a stale socket left behind */
+static int receiver_unix(char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd, probe;
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "! Error, socket path %s is too long.\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// A socket nobody reads from any more is left from an earlier run
+	if(!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+		probe = socket(AF_UNIX, SOCK_DGRAM, 0);
+		if(probe >= 0) {
+			if(connect(probe, (struct sockaddr *)&addr, sizeof(addr)) &&
+			   errno == ECONNREFUSED)
+				unlink(path);
+			close(probe);
+		}
+	}
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "! Error, unable to bind %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Bind a UDP socket to [host:]port */
+static int receiver_udp(char *spec)
+{
+	struct addrinfo hints, *res = NULL;
+	char host[256] = "";
+	char *port;
+	int fd = -1;
+	int one = 1;
+
+	port = strrchr(spec, ':');
+	if(port) {
+		snprintf(host, sizeof(host), "%.*s", (int)(port - spec), spec);
+		port++;
+		// [::1] style addresses
+		if(host[0] == '[' && host[strlen(host) - 1] == ']') {
+			memmove(host, host + 1, strlen(host));
+			host[strlen(host) - 1] = '\0';
+		}
+	} else {
+		port = spec;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	if(getaddrinfo(host[0] ? host : NULL, port, &hints, &res)) {
+		fprintf(stderr, "! Error, unable to use the address udp:%s.\n", spec);
+		return -1;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if(bind(fd, res->ai_addr, res->ai_addrlen)) {
+			fprintf(stderr, "! Error, unable to bind udp:%s: %s\n", spec, strerror(errno));
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+/***********************************************************************
+ * receiver_open
+ *
+ * Binds the socket given by spec and sets up the receive buffers.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int receiver_open(struct ipta_receiver *r, char *spec)
+{
+	int size = RECV_RCVBUF;
+	int i;
+
+	memset(r, 0, sizeof(struct ipta_receiver));
+	r->fd = -1;
+	r->spec = spec;
+
+	if(!strncmp(spec, "unix:", 5)) {
+		r->fd = receiver_unix(spec + 5);
+		r->path = spec + 5;
+	} else if(!strncmp(spec, "udp:", 4)) {
+		r->fd = receiver_udp(spec + 4);
+	} else {
+		fprintf(stderr, "! Error, %s should be udp:[host:]port or unix:path.\n", spec);
+		return RETVAL_ERROR;
+	}
+	if(r->fd < 0)
+		return RETVAL_ERROR;
+
+	// A big socket buffer rides out bursts while we are busy
+	setsockopt(r->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	r->buffer = malloc(RECV_BATCH * (RECV_MSG_LEN + 1));
+	r->msgs = calloc(RECV_BATCH, sizeof(struct mmsghdr));
+	r->iov = calloc(RECV_BATCH, sizeof(struct iovec));
+	if(!r->buffer || !r->msgs || !r->iov) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		receiver_close(r);
+		return RETVAL_ERROR;
+	}
+	for(i = 0; i < RECV_BATCH; i++) {
+		r->iov[i].iov_base = r->buffer + i * (RECV_MSG_LEN + 1);
+		r->iov[i].iov_len = RECV_MSG_LEN;
+	}
+
+	fprintf(stderr, "* Receiving syslog messages on %s.\n", spec);
+	return RETVAL_OK;
+}
+
+/***********************************************************************
+ * receiver_getline
+ *
+ * Gives the next message the same way getline() gives the next line,
+ * with the syslog priority removed and a newline added. A new batch
+ * is read from the socket when the last one is used up.
+ *
+ * RETURNS
+ *
+ * 	The length of the line, or -1 if there are no messages waiting
+ ***********************************************************************/
+ssize_t receiver_getline(struct ipta_receiver *r, char **line, size_t *len)
+{
+	char *msg, *end, *p;
+	size_t n;
+	int i, got;
+
+	if(r->next >= r->count) {
+		for(i = 0; i < RECV_BATCH; i++) {
+			memset(&r->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+			r->msgs[i].msg_hdr.msg_iov = &r->iov[i];
+			r->msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		got = recvmmsg(r->fd, r->msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+		if(got <= 0)
+			return -1;
+		r->count = got;
+		r->next = 0;
+		r->received += got;
+	}
+
+	i = r->next++;
+	msg = r->iov[i].iov_base;
+	end = msg + r->msgs[i].msg_len;
+	if(r->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+		r->truncated++;
+
+	// <PRI> and for RFC 5424 the version number after it
+	if(*msg == '<' && (p = memchr(msg, '>', end - msg))) {
+		msg = p + 1;
+		if(end - msg > 2 && isdigit((unsigned char)msg[0]) && msg[1] == ' ')
+			msg += 2;
+	}
+	while(end > msg && (end[-1] == '\n' || end[-1] == '\0'))
+		end--;
+
+	n = end - msg;
+	if(!*line || *len < n + 2) {
+		p = realloc(*line, n + 2);
+		if(!p)
+			return -1;
+		*line = p;
+		*len = n + 2;
+	}
+	memcpy(*line, msg, n);
+	(*line)[n] = '\n';
+	(*line)[n + 1] = '\0';
+	return n + 1;
+}
+
+void receiver_close(struct ipta_receiver *r)
+{
+	if(r->fd >= 0) {
+		close(r->fd);
+		if(r->path)
+			unlink(r->path);
+		if(r->truncated)
+			fprintf(stderr, "- %lu of %lu syslog messages on %s were truncated.\n",
+				r->truncated, r->received, r->spec);
+	}
+	free(r->buffer);
+	free(r->msgs);
+	free(r->iov);
+	r->buffer = NULL;
+	r->msgs = NULL;
+	r->iov = NULL;
+	r->fd = -1;
+}
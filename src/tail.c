@@ -0,0 +1,305 @@
+/**********************************************************************
+ * tail.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Log file tailing
+ *
+ * Reads complete lines from a log file that is still being written
+ * to. When there is nothing more to read, tail_wait() blocks on an
+ * inotify watch for the file so new lines are seen as soon as they
+ * are written and an idle follower does not wake up at all. If
+ * inotify can not be used the old one second polling is used.
+ *
+ * Log rotation is handled as well. When the end of the file is
+ * reached the path is checked again. If it now names another file
+ * (logrotate moved ours away and created a new one) the rest of the
+ * old file is read and then the new file is opened from the start.
+ * If the file has become shorter than what we have read it was
+ * truncated (copytruncate) and we start over from the beginning.
+ ***********************************************************************/
+
+#define TAIL_FILE_EVENTS (IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB)
+#define TAIL_DIR_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+/* Watch the file itself, replacing any watch on an older file */
+static void tail_watch_file(struct ipta_tail *tail)
+{
+	if(tail->inotify_fd < 0)
+		return;
+	if(tail->watch >= 0)
+		inotify_rm_watch(tail->inotify_fd, tail->watch);
+	tail->watch = inotify_add_watch(tail->inotify_fd, tail->path, TAIL_FILE_EVENTS);
+}
+
+/***********************************************************************
+ * tail_check
+ *
+ * Called when there is nothing more to read. Detects rotation and
+ * truncation and acts on it.
+ *
+ * RETURNS
+ *
+ * 	FLAG_SET - something changed and reading should be tried again
+ *
+ * 	FLAG_CLEAR - nothing changed, wait for more data
+ ***********************************************************************/
+static int tail_check(struct ipta_tail *tail)
+{
+	struct stat st;
+	FILE *file = NULL;
+
+	if(tail->rotated) {
+		// The old file has been read to the end, switch to the
+		// new one as soon as it exists.
+		file = fopen(tail->path, "r");
+		if(!file)
+			return FLAG_CLEAR;
+		if(fstat(fileno(file), &st)) {
+			fclose(file);
+			return FLAG_CLEAR;
+		}
+		fclose(tail->file);
+		tail->file = file;
+		tail->offset = 0;
+		tail->inode = st.st_ino;
+		tail->dev = st.st_dev;
+		tail->rotated = FLAG_CLEAR;
+		tail_watch_file(tail);
+		fprintf(stderr, "- Log file %s was rotated, following the new file.\n", tail->path);
+		return FLAG_SET;
+	}
+
+	if(stat(tail->path, &st) || st.st_ino != tail->inode || st.st_dev != tail->dev) {
+		// Moved away or replaced, drain what is left first
+		tail->rotated = FLAG_SET;
+		return FLAG_SET;
+	}
+
+	if(st.st_size < tail->offset) {
+		fprintf(stderr, "- Log file %s was truncated, reading from the start.\n", tail->path);
+		fseeko(tail->file, 0, SEEK_SET);
+		tail->offset = 0;
+		return FLAG_SET;
+	}
+
+	return FLAG_CLEAR;
+}
+
+/***********************************************************************
+ * tail_open
+ *
+ * Opens the file and positions at the end, or at the start if
+ * from_start is set. tail_open_shared() adds the watches to an
+ * inotify instance owned by the caller, so many files can be waited
+ * for at once, see multitail.c.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int tail_open_shared(struct ipta_tail *tail, char *path, int from_start, int inotify_fd)
+{
+	struct stat st;
+	char dir[PATH_MAX];
+
+	memset(tail, 0, sizeof(struct ipta_tail));
+	tail->inotify_fd = -1;
+	tail->watch = -1;
+	tail->dir_watch = -1;
+	tail->path = path;
+
+	tail->file = fopen(path, "r");
+	if(!tail->file) {
+		fprintf(stderr, "! ERROR: Unable to open the file %s.\n", path);
+		return RETVAL_ERROR;
+	}
+
+	if(!from_start && fseeko(tail->file, 0, SEEK_END)) {
+		fprintf(stderr, "! Error seeking to end of log file %s.\n", path);
+		fclose(tail->file);
+		tail->file = NULL;
+		return RETVAL_ERROR;
+	}
+	tail->offset = ftello(tail->file);
+
+	if(fstat(fileno(tail->file), &st)) {
+		fprintf(stderr, "! Error, unable to stat log file %s.\n", path);
+		fclose(tail->file);
+		tail->file = NULL;
+		return RETVAL_ERROR;
+	}
+	tail->inode = st.st_ino;
+	tail->dev = st.st_dev;
+
+	// No inotify is not an error, we fall back to polling. The
+	// directory is watched too so we see a rotated file come back.
+	if(inotify_fd >= 0) {
+		tail->inotify_fd = inotify_fd;
+		tail->shared = FLAG_SET;
+	} else {
+		tail->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	}
+	if(tail->inotify_fd >= 0) {
+		tail_watch_file(tail);
+		if(tail->watch < 0) {
+			if(!tail->shared)
+				close(tail->inotify_fd);
+			tail->inotify_fd = -1;
+		} else {
+			strncpy(dir, path, PATH_MAX - 1);
+			dir[PATH_MAX - 1] = '\0';
+			tail->dir_watch = inotify_add_watch(tail->inotify_fd, dirname(dir),
+							    TAIL_DIR_EVENTS);
+		}
+	}
+
+	return RETVAL_OK;
+}
+
+int tail_open(struct ipta_tail *tail, char *path, int from_start)
+{
+	return tail_open_shared(tail, path, from_start, -1);
+}
+
+/***********************************************************************
+ * tail_getline
+ *
+ * Reads the next complete line into *line the same way getline()
+ * does. A line that is still being written, without its newline, is
+ * left in the file until it is complete, unless partial_ok is set
+ * because the whole file is just read once.
+ *
+ * RETURNS
+ *
+ * 	The length of the line, or -1 if there is no complete line yet
+ ***********************************************************************/
+ssize_t tail_getline(struct ipta_tail *tail, char **line, size_t *len)
+{
+	ssize_t read;
+
+	while(1) {
+		read = getline(line, len, tail->file);
+		if(read > 0) {
+			// A partial line is only taken if no more will come
+			if((*line)[read - 1] == '\n' || tail->partial_ok || tail->rotated) {
+				tail->offset += read;
+				return read;
+			}
+			fseeko(tail->file, tail->offset, SEEK_SET);
+		}
+
+		// EOF is sticky, clear it so we can read more later
+		clearerr(tail->file);
+
+		// At the end of what we have, maybe the file was rotated
+		if(!tail_check(tail))
+			return -1;
+	}
+}
+
+/***********************************************************************
+ * tail_wait
+ *
+ * Waits until the file has changed, for at most timeout_ms
+ * milliseconds, -1 waits forever. A signal also ends the wait so the
+ * caller can act on it.
+ ***********************************************************************/
+void tail_wait(struct ipta_tail *tail, int timeout_ms)
+{
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd;
+
+	if(tail->inotify_fd < 0) {
+		// Fallback, the way follow has always done it
+		if(timeout_ms < 0 || timeout_ms > 1000)
+			timeout_ms = 1000;
+		poll(NULL, 0, timeout_ms);
+		return;
+	}
+
+	pfd.fd = tail->inotify_fd;
+	pfd.events = POLLIN;
+	if(poll(&pfd, 1, timeout_ms) > 0) {
+		// We only need to know that something happened, drain
+		while(read(tail->inotify_fd, events, sizeof(events)) > 0)
+			;
+	}
+}
+
+/***********************************************************************
+ * tail_seek
+ *
+ * Continues reading from offset, used to pick up where an earlier run
+ * stopped. An offset beyond the end of the file means it was
+ * truncated since, then reading starts from the beginning.
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int tail_seek(struct ipta_tail *tail, off_t offset)
+{
+	struct stat st;
+
+	if(fstat(fileno(tail->file), &st))
+		return RETVAL_ERROR;
+	if(offset > st.st_size)
+		offset = 0;
+	if(fseeko(tail->file, offset, SEEK_SET))
+		return RETVAL_ERROR;
+	tail->offset = offset;
+	return RETVAL_OK;
+}
+
+void tail_close(struct ipta_tail *tail)
+{
+	// A shared descriptor belongs to the caller, only drop the file
+	// watch, the directory watch may be shared with other files
+	if(tail->shared) {
+		if(tail->inotify_fd >= 0 && tail->watch >= 0)
+			inotify_rm_watch(tail->inotify_fd, tail->watch);
+	} else if(tail->inotify_fd >= 0)
+		close(tail->inotify_fd);
+	if(tail->file)
+		fclose(tail->file);
+	tail->inotify_fd = -1;
+	tail->file = NULL;
+}
@@ -0,0 +1,354 @@
+/**********************************************************************
+ * top.c
+ *
+ * Anders "Ichimusai" Sikvall
+ * anders@sikvall.se
+ *
+ * This source file is part of the ipta package and is maintained by
+ * the package owner, see http://ichimusai.org/ipta/ for more info
+ * about this. Any changes, patches, diffs etc that you would like to
+ * offer should be sent by email to ichi@ichimusai.org for review
+ * before they will be applied to the main code base.
+ *
+ * As usual this software is offered "as is" and placed in the public
+ * domain. You are free to copy, modify, spread and make use of this
+ * software. For the terms and conditions for this software you should
+ * refer to the "LICENCE" file in the source directory or run a
+ * compiled binary with the "--licence" option which will display the
+ * licence.
+ *
+ * Any modifications to this source MUST retain this header. You are
+ * however allowed to add below your own changes and redistribute, as
+ * long as you do not violate any terms and condition in the LICENCE.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "ipta.h"
+
+/***********************************************************************
+ * Live top list
+ *
+ * The --top mode follows the log like follow() but instead of
+ * printing every packet it counts them and redraws a top list every
+ * few seconds, so it stays readable during a flood. The counts are
+ * kept for the last 1, 5 and 15 minutes for the same groupings as the
+ * analyzer uses: denied sources, denied ports and interface, action
+ * and protocol.
+ *
+ * Time is cut in buckets of TOP_BUCKET_SECONDS in a ring covering 15
+ * minutes. Each bucket holds a Space-Saving summary of TOP_KEYS
+ * counters per grouping: a new key takes over the smallest counter
+ * when the bucket is full. The heavy hitters are always kept, the
+ * counts are exact as long as there are fewer distinct keys than
+ * counters, and memory use is fixed no matter how many sources show
+ * up.
+ ***********************************************************************/
+
+#define TOP_KEYS 64
+#define TOP_KEY_LEN 48
+#define TOP_BUCKET_SECONDS 10
+#define TOP_BUCKETS (15 * 60 / TOP_BUCKET_SECONDS)
+#define TOP_WINDOWS 3
+#define TOP_GROUPS 3
+#define TOP_MERGE_SLOTS 8192     /* > TOP_BUCKETS * TOP_KEYS */
+
+struct top_counter {
+	unsigned int hash;
+	unsigned long count;
+	char key[TOP_KEY_LEN];
+};
+
+struct top_bucket {
+	time_t start;
+	int used;
+	struct top_counter counter[TOP_KEYS];
+};
+
+struct top_group {
+	struct top_bucket bucket[TOP_BUCKETS];
+};
+
+/* A key with its counts per window when the list is drawn */
+struct top_merged {
+	struct top_counter *counter;
+	unsigned long count[TOP_WINDOWS];
+};
+
+struct top_state {
+	struct top_group group[TOP_GROUPS];
+	time_t start[TOP_BUCKETS];            /* Packets per bucket */
+	unsigned long packets[TOP_BUCKETS];
+	struct top_merged merged[TOP_MERGE_SLOTS];
+	struct top_merged *sorted[TOP_MERGE_SLOTS];
+};
+
+static const int top_window[TOP_WINDOWS] = { 60, 5 * 60, 15 * 60 };
+
+static const char *top_title[TOP_GROUPS] = {
+	"Denied sources",
+	"Denied ports",
+	"Interface statistics"
+};
+
+static const char *top_heading[TOP_GROUPS] = {
+	"Source IP                     ",
+	"DPort Proto  Action           ",
+	"IF In      Action     Proto   "
+};
+
+static volatile sig_atomic_t top_stop = 0;
+
+static void top_signal(int sig)
+{
+	top_stop = 1;
+}
+
+/* FNV-1a, never 0 so 0 can mean an empty merge slot */
+static unsigned int top_hash(char *key)
+{
+	unsigned int h = 2166136261U;
+
+	while(*key)
+		h = (h ^ (unsigned char)*key++) * 16777619U;
+	return h ? h : 1;
+}
+
+/***********************************************************************
+ * top_count
+ *
+ * Counts one packet for key in the bucket of time now.
+ ***********************************************************************/
+static void top_count(struct top_group *group, time_t now, char *key)
+{
+	struct top_bucket *bucket;
+	struct top_counter *counter, *min;
+	time_t start = now - now % TOP_BUCKET_SECONDS;
+	unsigned int hash = top_hash(key);
+	int i;
+
+	bucket = &group->bucket[(now / TOP_BUCKET_SECONDS) % TOP_BUCKETS];
+	if(bucket->start != start) {
+		bucket->start = start;
+		bucket->used = 0;
+	}
+
+	min = bucket->counter;
+	for(i = 0; i < bucket->used; i++) {
+		counter = &bucket->counter[i];
+		if(counter->hash == hash && !strcmp(counter->key, key)) {
+			counter->count++;
+			return;
+		}
+		if(counter->count < min->count)
+			min = counter;
+	}
+
+	// A new key, take a free counter or the smallest one
+	if(bucket->used < TOP_KEYS) {
+		min = &bucket->counter[bucket->used++];
+		min->count = 0;
+	}
+	min->hash = hash;
+	min->count++;
+	strncpy(min->key, key, TOP_KEY_LEN - 1);
+	min->key[TOP_KEY_LEN - 1] = '\0';
+}
+
+static int top_compare(const void *a, const void *b)
+{
+	const struct top_merged *x = *(const struct top_merged **)a;
+	const struct top_merged *y = *(const struct top_merged **)b;
+	int i;
+
+	for(i = 0; i < TOP_WINDOWS; i++) {
+		if(x->count[i] != y->count[i])
+			return x->count[i] < y->count[i] ? 1 : -1;
+	}
+	return 0;
+}
+
+/***********************************************************************
+ * top_print_group
+ *
+ * Adds up the buckets of each window and prints the keys with the
+ * most packets in the last minute, then in the longer windows.
+ ***********************************************************************/
+static void top_print_group(struct top_state *state, int g, time_t now,
+			    int limit, int rdns)
+{
+	struct top_bucket *bucket;
+	struct top_counter *counter;
+	struct top_merged *m;
+	char hostname[HOSTNAME_MAX_LEN];
+	int b, i, w, slot, count = 0;
+
+	memset(state->merged, 0, sizeof(state->merged));
+
+	for(b = 0; b < TOP_BUCKETS; b++) {
+		bucket = &state->group[g].bucket[b];
+		if(!bucket->used || now - bucket->start >= top_window[TOP_WINDOWS - 1])
+			continue;
+		for(i = 0; i < bucket->used; i++) {
+			counter = &bucket->counter[i];
+			slot = counter->hash & (TOP_MERGE_SLOTS - 1);
+			while((m = &state->merged[slot])->counter &&
+			      (m->counter->hash != counter->hash ||
+			       strcmp(m->counter->key, counter->key)))
+				slot = (slot + 1) & (TOP_MERGE_SLOTS - 1);
+			if(!m->counter) {
+				m->counter = counter;
+				state->sorted[count++] = m;
+			}
+			for(w = 0; w < TOP_WINDOWS; w++)
+				if(now - bucket->start < top_window[w])
+					m->count[w] += counter->count;
+		}
+	}
+
+	qsort(state->sorted, count, sizeof(struct top_merged *), top_compare);
+
+	printf("\n%s\n", top_title[g]);
+	printf("%s    1 min    5 min   15 min\n", top_heading[g]);
+	printf("------------------------------ -------- -------- --------\n");
+	for(i = 0; i < count && i < limit; i++) {
+		m = state->sorted[i];
+		if(g == 0 && rdns) {
+			dns_resolver_lookup(m->counter->key, hostname, 30);
+			printf("%-30s", hostname);
+		} else {
+			printf("%-30s", m->counter->key);
+		}
+		printf(" %8lu %8lu %8lu\n", m->count[0], m->count[1], m->count[2]);
+	}
+}
+
+/* Redraw the whole screen */
+static void top_draw(struct top_state *state, char *filename, time_t now,
+		     int limit, int rdns)
+{
+	unsigned long packets[TOP_WINDOWS] = { 0, 0, 0 };
+	int b, w, g;
+
+	for(b = 0; b < TOP_BUCKETS; b++)
+		for(w = 0; w < TOP_WINDOWS; w++)
+			if(state->packets[b] && now - state->start[b] < top_window[w])
+				packets[w] += state->packets[b];
+
+	printf("\033[H\033[2J");
+	printf("ipta top - %s\n", filename);
+	printf("Packets/s, last 1 min: %.1f  5 min: %.1f  15 min: %.1f\n",
+	       packets[0] / 60.0, packets[1] / 300.0, packets[2] / 900.0);
+
+	for(g = 0; g < TOP_GROUPS; g++)
+		top_print_group(state, g, now, limit, rdns);
+	fflush(stdout);
+}
+
+/***********************************************************************
+ * top
+ *
+ * The --top mode, runs until interrupted.
+ *
+ * PARAMETERS
+ *
+ * 	char *filename - the log file to follow
+ *
+ * 	struct ipta_flags *flags - --no-lo, --filter and --rdns are used
+ *
+ * 	struct ipta_db_info *dnsdb - the dns cache for --rdns
+ *
+ * 	int limit - lines shown per list
+ *
+ * 	int refresh - seconds between redraws
+ *
+ * RETURNS
+ *
+ * 	RETVAL_OK - on success
+ *
+ * 	RETVAL_ERROR - on error
+ ***********************************************************************/
+int top(char *filename, struct ipta_flags *flags, struct ipta_db_info *dnsdb,
+	int limit, int refresh)
+{
+	struct top_state *state = NULL;
+	struct ipta_tail tail;
+	struct ipta_record rec;
+	char key[TOP_KEY_LEN];
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	time_t now, start, next_draw = 0;
+	int b;
+	int retval = RETVAL_OK;
+
+	state = calloc(1, sizeof(struct top_state));
+	if(!state) {
+		fprintf(stderr, "! Error, memory allocation failed.\n");
+		return RETVAL_ERROR;
+	}
+
+	if(tail_open(&tail, filename, FLAG_CLEAR)) {
+		free(state);
+		return RETVAL_ERROR;
+	}
+
+	if(flags->rdns && dns_resolver_start(dnsdb, flags->dns_threads)) {
+		fprintf(stderr, "! Error, unable to start the DNS resolver.\n");
+		retval = RETVAL_ERROR;
+		goto clean_exit;
+	}
+
+	signal(SIGINT, top_signal);
+	signal(SIGTERM, top_signal);
+
+	while(!top_stop) {
+		read = tail_getline(&tail, &line, &len);
+		now = time(NULL);
+
+		if(now >= next_draw) {
+			top_draw(state, filename, now, limit, flags->rdns);
+			next_draw = now + refresh;
+		}
+
+		if(read == -1) {
+			tail_wait(&tail, (next_draw - now) * 1000);
+			continue;
+		}
+
+		if(parse_line(line, &rec) != RETVAL_OK || !filter_packet(flags, &rec))
+			continue;
+		if(flags->no_lo && (!strcmp(rec.if_in, "lo") || !strcmp(rec.if_out, "lo")))
+			continue;
+
+		start = now - now % TOP_BUCKET_SECONDS;
+		b = (now / TOP_BUCKET_SECONDS) % TOP_BUCKETS;
+		if(state->start[b] != start) {
+			state->start[b] = start;
+			state->packets[b] = 0;
+		}
+		state->packets[b]++;
+
+		if(!strcmp(rec.action, "ACCEPT"))
+			continue;
+
+		top_count(&state->group[0], now, rec.src);
+		snprintf(key, sizeof(key), "%5d %-6s %s", atoi(rec.dst_port),
+			 rec.proto, rec.action);
+		top_count(&state->group[1], now, key);
+		snprintf(key, sizeof(key), "%-10s %-10s %s", rec.if_in, rec.action, rec.proto);
+		top_count(&state->group[2], now, key);
+	}
+
+clean_exit:
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	dns_resolver_stop();
+	tail_close(&tail);
+	free(line);
+	free(state);
+	return retval;
+}